@@ -58,6 +58,7 @@ void android_chiaki_audio_decoder_get_sink(AndroidChiakiAudioDecoder *decoder, C
 	sink->user = decoder;
 	sink->header_cb = android_chiaki_audio_decoder_header;
 	sink->frame_cb = android_chiaki_audio_decoder_frame;
+	sink->frame_lost_cb = NULL;
 }
 
 static void *android_chiaki_audio_decoder_output_thread_func(void *user)
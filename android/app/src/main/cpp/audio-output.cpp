@@ -2,17 +2,13 @@
 
 #include "audio-output.h"
 
-#include "circular-buf.hpp"
-
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/audioring.h>
 
 #include <oboe/Oboe.h>
 
-#define BUFFER_CHUNK_SIZE 1024
-#define BUFFER_CHUNKS_COUNT 32
-
-using AudioBuffer = CircularBuffer<BUFFER_CHUNKS_COUNT, BUFFER_CHUNK_SIZE>;
+#define AUDIO_RING_TARGET_LATENCY_MS 40
 
 class AudioOutput;
 
@@ -33,11 +29,24 @@ struct AudioOutput
 	ChiakiLog *log;
 	oboe::ManagedStream stream;
 	AudioOutputCallback stream_callback;
-	AudioBuffer buf;
+	ChiakiAudioRing ring;
+	bool ring_initialized;
 
-	AudioOutput() : stream_callback(this) {}
+	AudioOutput() : stream_callback(this), ring_initialized(false) {}
 };
 
+static void audio_output_ring_fini(AudioOutput *ao)
+{
+	if(!ao->ring_initialized)
+		return;
+	ChiakiAudioRingStats stats;
+	chiaki_audio_ring_get_stats(&ao->ring, &stats);
+	CHIAKI_LOGI(ao->log, "Audio Output: %llu underruns, %llu overruns, drift %d ppm",
+			(unsigned long long)stats.underruns, (unsigned long long)stats.overruns, (int)stats.drift_ppm);
+	chiaki_audio_ring_fini(&ao->ring);
+	ao->ring_initialized = false;
+}
+
 extern "C" void *android_chiaki_audio_output_new(ChiakiLog *log)
 {
 	auto r = new AudioOutput();
@@ -51,6 +60,7 @@ extern "C" void android_chiaki_audio_output_free(void *audio_output)
 		return;
 	auto ao = reinterpret_cast<AudioOutput *>(audio_output);
 	ao->stream = nullptr;
+	audio_output_ring_fini(ao);
 	delete ao;
 }
 
@@ -58,6 +68,16 @@ extern "C" void android_chiaki_audio_output_settings(uint32_t channels, uint32_t
 {
 	auto ao = reinterpret_cast<AudioOutput *>(audio_output);
 
+	// the callback of a previous stream must be gone before its ring is replaced
+	ao->stream = nullptr;
+	audio_output_ring_fini(ao);
+	if(chiaki_audio_ring_init(&ao->ring, channels, rate, AUDIO_RING_TARGET_LATENCY_MS) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(ao->log, "Audio Output failed to init audio ring");
+		return;
+	}
+	ao->ring_initialized = true;
+
 	oboe::AudioStreamBuilder builder;
 	builder.setPerformanceMode(oboe::PerformanceMode::LowLatency)
 		->setSharingMode(oboe::SharingMode::Exclusive)
@@ -82,10 +102,13 @@ extern "C" void android_chiaki_audio_output_settings(uint32_t channels, uint32_t
 extern "C" void android_chiaki_audio_output_frame(int16_t *buf, size_t samples_count, void *audio_output)
 {
 	auto ao = reinterpret_cast<AudioOutput *>(audio_output);
+	if(!ao->ring_initialized)
+		return;
 
-	size_t buf_size = samples_count * sizeof(int16_t);
-	size_t pushed = ao->buf.Push(reinterpret_cast<uint8_t *>(buf), buf_size);
-	if(pushed < buf_size)
+	// samples_count counts the samples of all channels
+	size_t frames_count = samples_count / ao->ring.channels;
+	size_t pushed = chiaki_audio_ring_write(&ao->ring, buf, frames_count);
+	if(pushed < frames_count)
 		CHIAKI_LOGW(ao->log, "Audio Output Buffer Overflow!");
 }
 
@@ -97,18 +120,8 @@ oboe::DataCallbackResult AudioOutputCallback::onAudioReady(oboe::AudioStream *st
 		return oboe::DataCallbackResult::Stop;
 	}
 
-	int32_t bytes_per_frame = stream->getBytesPerFrame();
-	size_t buf_size_requested = static_cast<size_t>(bytes_per_frame * num_frames);
-	auto buf = reinterpret_cast<uint8_t *>(audio_data);
-
-	size_t buf_size_delivered = audio_output->buf.Pop(buf, buf_size_requested);
-	//CHIAKI_LOGW(audio_output->log, "Delivered %llu", (unsigned long long)buf_size_delivered);
-
-	if(buf_size_delivered < buf_size_requested)
-	{
-		CHIAKI_LOGV(audio_output->log, "Audio Output Buffer Underflow!");
-		memset(buf + buf_size_delivered, 0, buf_size_requested - buf_size_delivered);
-	}
+	// always fills the whole buffer, with silence on underflow
+	chiaki_audio_ring_read(&audio_output->ring, reinterpret_cast<int16_t *>(audio_data), static_cast<size_t>(num_frames));
 
 	return oboe::DataCallbackResult::Continue;
 }
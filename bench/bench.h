@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BENCH_H
+#define CHIAKI_BENCH_H
+
+#include <chiaki/time.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// how long each benchmark loop runs
+#define BENCH_DURATION_US 500000
+
+typedef void (*BenchFunc)(void);
+
+typedef struct bench_t
+{
+	const char *name;
+	BenchFunc func;
+} Bench;
+
+typedef struct bench_timer_t
+{
+	uint64_t start_us;
+	uint64_t iterations;
+} BenchTimer;
+
+static inline void bench_timer_start(BenchTimer *timer)
+{
+	timer->start_us = chiaki_time_now_monotonic_us();
+	timer->iterations = 0;
+}
+
+/**
+ * Count one iteration and check whether the benchmark has run for long enough.
+ */
+static inline bool bench_timer_running(BenchTimer *timer)
+{
+	timer->iterations++;
+	// only check the time every few iterations to keep the overhead low
+	if(timer->iterations % 16)
+		return true;
+	return chiaki_time_now_monotonic_us() - timer->start_us < BENCH_DURATION_US;
+}
+
+static inline uint64_t bench_timer_elapsed_us(BenchTimer *timer)
+{
+	return chiaki_time_now_monotonic_us() - timer->start_us;
+}
+
+/**
+ * Print the throughput of bytes processed in elapsed_us.
+ */
+void bench_report_throughput(const char *name, const char *variant, uint64_t bytes, uint64_t elapsed_us);
+
+/**
+ * Print the average time per operation.
+ */
+void bench_report_ops(const char *name, const char *variant, uint64_t ops, uint64_t elapsed_us);
+
+extern Bench benches_gkcrypt[];
+extern Bench benches_frame_processor[];
+extern Bench benches_reorder_queue[];
+extern Bench benches_timer_wheel[];
+
+#endif // CHIAKI_BENCH_H
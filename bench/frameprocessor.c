@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/session.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// roughly a 1080p I-frame
+#define UNITS_SOURCE 200
+#define UNITS_FEC 20
+#define UNIT_SIZE 1400
+
+typedef enum {
+	ASSEMBLE_DECRYPT_IN_PLACE, // decrypt the packet first, then copy it into the frame, like the inline path used to
+	ASSEMBLE_DECRYPT_TO_SLOT,
+	ASSEMBLE_DECRYPT_TO_SLOT_IOV
+} AssembleMode;
+
+static ChiakiLog bench_log;
+
+static void bench_assemble(const char *variant, AssembleMode mode)
+{
+	static const uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+	chiaki_log_init(&bench_log, CHIAKI_LOG_ERROR, chiaki_log_cb_print, NULL);
+
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt, &bench_log, 0, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init GKCrypt\n");
+		return;
+	}
+
+	// the content does not matter, only the padding prefix of each unit has to be valid, so encrypt zeros
+	static uint8_t units[UNITS_SOURCE][UNIT_SIZE];
+	for(size_t i=0; i<UNITS_SOURCE; i++)
+	{
+		memset(units[i], 0, UNIT_SIZE);
+		chiaki_gkcrypt_encrypt(&gkcrypt, (uint64_t)i * UNIT_SIZE, units[i], UNIT_SIZE);
+	}
+
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, &bench_log);
+
+	static uint8_t packet_buf[UNIT_SIZE];
+	uint64_t bytes = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		for(size_t i=0; i<UNITS_SOURCE; i++)
+		{
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.unit_index = (ChiakiSeqNum16)i;
+			packet.units_in_frame_total = UNITS_SOURCE + UNITS_FEC;
+			packet.units_in_frame_fec = UNITS_FEC;
+			packet.data_size = UNIT_SIZE;
+			uint64_t key_pos = (uint64_t)i * UNIT_SIZE;
+			if(mode == ASSEMBLE_DECRYPT_IN_PLACE)
+			{
+				memcpy(packet_buf, units[i], UNIT_SIZE); // stands in for receiving the packet
+				packet.data = packet_buf;
+				chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, packet.data, packet.data_size);
+				if(i == 0)
+					chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+				chiaki_frame_processor_put_unit(&frame_processor, &packet);
+			}
+			else
+			{
+				packet.data = units[i];
+				if(i == 0)
+					chiaki_frame_processor_alloc_frame_encrypted(&frame_processor, &packet, &gkcrypt, key_pos);
+				chiaki_frame_processor_put_unit_encrypted(&frame_processor, &packet, &gkcrypt, key_pos);
+			}
+		}
+
+		size_t frame_size;
+		if(mode == ASSEMBLE_DECRYPT_TO_SLOT_IOV)
+		{
+			ChiakiFrameIOVec *iov;
+			size_t iov_count;
+			chiaki_frame_processor_flush_iov(&frame_processor, &iov, &iov_count, &frame_size);
+		}
+		else
+		{
+			uint8_t *frame;
+			chiaki_frame_processor_flush(&frame_processor, &frame, &frame_size);
+		}
+		bytes += UNITS_SOURCE * UNIT_SIZE;
+	} while(bench_timer_running(&timer));
+	bench_report_throughput("frame_processor/assemble", variant, bytes, bench_timer_elapsed_us(&timer));
+
+	chiaki_frame_processor_fini(&frame_processor);
+	chiaki_gkcrypt_fini(&gkcrypt);
+}
+
+static void bench_assemble_decrypt_in_place(void)
+{
+	bench_assemble("in_place", ASSEMBLE_DECRYPT_IN_PLACE);
+}
+
+static void bench_assemble_decrypt_to_slot(void)
+{
+	bench_assemble("to_slot", ASSEMBLE_DECRYPT_TO_SLOT);
+}
+
+static void bench_assemble_decrypt_to_slot_iov(void)
+{
+	bench_assemble("to_slot_iov", ASSEMBLE_DECRYPT_TO_SLOT_IOV);
+}
+
+Bench benches_frame_processor[] = {
+	{ "frame_processor/assemble/in_place", bench_assemble_decrypt_in_place },
+	{ "frame_processor/assemble/to_slot", bench_assemble_decrypt_to_slot },
+	{ "frame_processor/assemble/to_slot_iov", bench_assemble_decrypt_to_slot_iov },
+	{ NULL, NULL }
+};
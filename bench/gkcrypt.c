@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/gkcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/session.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#define BACKEND_NAME "mbedtls"
+#else
+#define BACKEND_NAME "openssl"
+#endif
+
+// typical payload of a Takion av packet
+#define PACKET_SIZE 1400
+
+#define KEY_STREAM_CHUNK_SIZE 0x1000
+
+static ChiakiLog bench_log;
+
+static bool gkcrypt_bench_init(ChiakiGKCrypt *gkcrypt, size_t key_buf_chunks)
+{
+	static const uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+	chiaki_log_init(&bench_log, CHIAKI_LOG_ERROR, chiaki_log_cb_print, NULL);
+	if(chiaki_gkcrypt_init(gkcrypt, &bench_log, key_buf_chunks, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init GKCrypt\n");
+		return false;
+	}
+	return true;
+}
+
+static void bench_key_stream(void)
+{
+	ChiakiGKCrypt gkcrypt;
+	if(!gkcrypt_bench_init(&gkcrypt, 0))
+		return;
+
+	static uint8_t buf[KEY_STREAM_CHUNK_SIZE];
+	uint64_t key_pos = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		chiaki_gkcrypt_gen_key_stream(&gkcrypt, key_pos, buf, sizeof(buf));
+		key_pos += sizeof(buf);
+	} while(bench_timer_running(&timer));
+	bench_report_throughput("gkcrypt/key_stream", BACKEND_NAME, key_pos, bench_timer_elapsed_us(&timer));
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+}
+
+static void bench_decrypt(const char *name, size_t key_buf_chunks)
+{
+	ChiakiGKCrypt gkcrypt;
+	if(!gkcrypt_bench_init(&gkcrypt, key_buf_chunks))
+		return;
+
+	static uint8_t buf[PACKET_SIZE];
+	memset(buf, 0x42, sizeof(buf));
+	uint64_t key_pos = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, buf, sizeof(buf));
+		key_pos += sizeof(buf);
+	} while(bench_timer_running(&timer));
+	bench_report_throughput(name, BACKEND_NAME, key_pos, bench_timer_elapsed_us(&timer));
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+}
+
+static void bench_decrypt_direct(void)
+{
+	bench_decrypt("gkcrypt/decrypt_direct", 0);
+}
+
+static void bench_decrypt_key_buf(void)
+{
+	bench_decrypt("gkcrypt/decrypt_key_buf", CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT);
+}
+
+static void bench_gmac(void)
+{
+	ChiakiGKCrypt gkcrypt;
+	if(!gkcrypt_bench_init(&gkcrypt, 0))
+		return;
+
+	static uint8_t buf[PACKET_SIZE];
+	memset(buf, 0x42, sizeof(buf));
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+	uint64_t key_pos = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		chiaki_gkcrypt_gmac(&gkcrypt, key_pos, buf, sizeof(buf), gmac);
+		key_pos += sizeof(buf);
+	} while(bench_timer_running(&timer));
+	uint64_t elapsed_us = bench_timer_elapsed_us(&timer);
+	bench_report_throughput("gkcrypt/gmac", BACKEND_NAME, key_pos, elapsed_us);
+	bench_report_ops("gkcrypt/gmac", BACKEND_NAME, timer.iterations, elapsed_us);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+}
+
+Bench benches_gkcrypt[] = {
+	{ "gkcrypt/key_stream", bench_key_stream },
+	{ "gkcrypt/decrypt_direct", bench_decrypt_direct },
+	{ "gkcrypt/decrypt_key_buf", bench_decrypt_key_buf },
+	{ "gkcrypt/gmac", bench_gmac },
+	{ NULL, NULL }
+};
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static Bench *bench_suites[] = {
+	benches_gkcrypt,
+	benches_frame_processor,
+	benches_reorder_queue,
+	benches_timer_wheel,
+	NULL
+};
+
+void bench_report_throughput(const char *name, const char *variant, uint64_t bytes, uint64_t elapsed_us)
+{
+	double gbps = elapsed_us ? (double)bytes / (double)elapsed_us / 1000.0 : 0.0;
+	printf("%-32s %-12s %10.3f GB/s %10.1f Mbit/s\n", name, variant, gbps, gbps * 8000.0);
+}
+
+void bench_report_ops(const char *name, const char *variant, uint64_t ops, uint64_t elapsed_us)
+{
+	double ns = ops ? (double)elapsed_us * 1000.0 / (double)ops : 0.0;
+	printf("%-32s %-12s %10.1f ns/op %10.3f Mops/s\n", name, variant, ns, ns > 0.0 ? 1000.0 / ns : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")))
+	{
+		printf("Usage: %s [name prefix...]\n", argv[0]);
+		return 0;
+	}
+
+	for(Bench **suite = bench_suites; *suite; suite++)
+	{
+		for(Bench *bench = *suite; bench->name; bench++)
+		{
+			bool run = argc <= 1;
+			for(int i=1; i<argc && !run; i++)
+				run = !strncmp(bench->name, argv[i], strlen(argv[i]));
+			if(run)
+				bench->func();
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/reorderqueue.h>
+
+// elements pushed per round, with every pair swapped to force some reordering
+#define ROUND_SIZE 16
+#define SIZE_EXP 6
+
+static uint64_t sink;
+
+static void bench_push_pull_generic(void)
+{
+	ChiakiReorderQueue queue;
+	if(chiaki_reorder_queue_init_32(&queue, SIZE_EXP, 0) != CHIAKI_ERR_SUCCESS)
+		return;
+
+	ChiakiSeqNum32 next = 0;
+	uint64_t ops = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		for(ChiakiSeqNum32 i=0; i<ROUND_SIZE; i++)
+			chiaki_reorder_queue_push(&queue, next + (i ^ 1), (void *)(size_t)i);
+		uint64_t seq_num;
+		void *user;
+		while(chiaki_reorder_queue_pull(&queue, &seq_num, &user))
+			sink += seq_num;
+		next += ROUND_SIZE;
+		ops += ROUND_SIZE;
+	} while(bench_timer_running(&timer));
+	bench_report_ops("reorder_queue/push_pull", "generic", ops, bench_timer_elapsed_us(&timer));
+
+	chiaki_reorder_queue_fini(&queue);
+}
+
+static void bench_push_pull_32(void)
+{
+	ChiakiReorderQueue32 queue;
+	if(chiaki_reorder_queue_32_init(&queue, SIZE_EXP, 0) != CHIAKI_ERR_SUCCESS)
+		return;
+
+	ChiakiSeqNum32 next = 0;
+	uint64_t ops = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		for(ChiakiSeqNum32 i=0; i<ROUND_SIZE; i++)
+			chiaki_reorder_queue_32_push(&queue, next + (i ^ 1), (void *)(size_t)i);
+		ChiakiSeqNum32 seq_num;
+		void *user;
+		while(chiaki_reorder_queue_32_pull(&queue, &seq_num, &user))
+			sink += seq_num;
+		next += ROUND_SIZE;
+		ops += ROUND_SIZE;
+	} while(bench_timer_running(&timer));
+	bench_report_ops("reorder_queue/push_pull", "32", ops, bench_timer_elapsed_us(&timer));
+
+	chiaki_reorder_queue_32_fini(&queue);
+}
+
+/**
+ * Fill the queue except for one element near its end and look for that gap.
+ */
+static void bench_next_missing(const char *variant, bool bitmap)
+{
+	ChiakiReorderQueue32 queue;
+	if(chiaki_reorder_queue_32_init(&queue, SIZE_EXP, 0) != CHIAKI_ERR_SUCCESS)
+		return;
+	size_t size = chiaki_reorder_queue_32_size(&queue);
+	for(ChiakiSeqNum32 i=0; i<size; i++)
+	{
+		if(i != size - 2)
+			chiaki_reorder_queue_32_push(&queue, i, NULL);
+	}
+
+	uint64_t ops = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		size_t missing = chiaki_reorder_queue_32_count(&queue);
+		if(bitmap)
+			missing = chiaki_reorder_queue_32_next_missing(&queue);
+		else
+		{
+			for(size_t i=0; i<chiaki_reorder_queue_32_count(&queue); i++)
+			{
+				if(!chiaki_reorder_queue_32_peek(&queue, i, NULL, NULL))
+				{
+					missing = i;
+					break;
+				}
+			}
+		}
+		sink += missing;
+		ops++;
+	} while(bench_timer_running(&timer));
+	bench_report_ops("reorder_queue/next_missing", variant, ops, bench_timer_elapsed_us(&timer));
+
+	chiaki_reorder_queue_32_fini(&queue);
+}
+
+static void bench_next_missing_peek(void)
+{
+	bench_next_missing("peek", false);
+}
+
+static void bench_next_missing_bitmap(void)
+{
+	bench_next_missing("bitmap", true);
+}
+
+Bench benches_reorder_queue[] = {
+	{ "reorder_queue/push_pull/generic", bench_push_pull_generic },
+	{ "reorder_queue/push_pull/32", bench_push_pull_32 },
+	{ "reorder_queue/next_missing/peek", bench_next_missing_peek },
+	{ "reorder_queue/next_missing/bitmap", bench_next_missing_bitmap },
+	{ NULL, NULL }
+};
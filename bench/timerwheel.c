@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/timerwheel.h>
+
+// timers kept armed all the time, due anywhere within about 16s
+#define TIMERS_COUNT 4096
+#define DUE_RANGE_MASK ((UINT64_C(1) << 24) - 1)
+
+static uint64_t sink;
+
+static void bench_cb(void *user)
+{
+	sink++;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+	*state = *state * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+	return *state >> 16;
+}
+
+/**
+ * Re-schedule and cancel timers of a wheel that is already full of them.
+ */
+static void bench_schedule_cancel(void)
+{
+	static ChiakiTimerWheel wheel;
+	static ChiakiTimerWheelTimer timers[TIMERS_COUNT];
+	chiaki_timer_wheel_init(&wheel, 0);
+	uint64_t random = 42;
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+	{
+		chiaki_timer_wheel_timer_init(&timers[i], bench_cb, NULL);
+		chiaki_timer_wheel_schedule(&wheel, &timers[i], 1 + (next_random(&random) & DUE_RANGE_MASK), 0, 0);
+	}
+
+	uint64_t ops = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		for(size_t i=0; i<TIMERS_COUNT; i++)
+		{
+			chiaki_timer_wheel_cancel(&wheel, &timers[i]);
+			chiaki_timer_wheel_schedule(&wheel, &timers[i], 1 + (next_random(&random) & DUE_RANGE_MASK), 0, 0);
+		}
+		ops += TIMERS_COUNT;
+	} while(bench_timer_running(&timer));
+	bench_report_ops("timer_wheel/schedule_cancel", "4096", ops, bench_timer_elapsed_us(&timer));
+	sink += chiaki_timer_wheel_next_expiry(&wheel);
+}
+
+/**
+ * Periodic timers with intervals from 1 to 256ms, advanced 1ms at a time like a busy loop would.
+ */
+static void bench_advance(void)
+{
+	static ChiakiTimerWheel wheel;
+	static ChiakiTimerWheelTimer timers[TIMERS_COUNT];
+	chiaki_timer_wheel_init(&wheel, 0);
+	uint64_t random = 42;
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+	{
+		uint64_t interval_us = 1000 << (next_random(&random) % 9);
+		chiaki_timer_wheel_timer_init(&timers[i], bench_cb, NULL);
+		chiaki_timer_wheel_schedule(&wheel, &timers[i], next_random(&random) % interval_us, interval_us, 0);
+	}
+
+	uint64_t now_us = 0;
+	uint64_t ops = 0;
+	BenchTimer timer;
+	bench_timer_start(&timer);
+	do
+	{
+		now_us += 1000;
+		ops += chiaki_timer_wheel_advance(&wheel, now_us);
+	} while(bench_timer_running(&timer));
+	bench_report_ops("timer_wheel/advance", "4096", ops, bench_timer_elapsed_us(&timer));
+
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+		chiaki_timer_wheel_cancel(&wheel, &timers[i]);
+}
+
+Bench benches_timer_wheel[] = {
+	{ "timer_wheel/schedule_cancel", bench_schedule_cancel },
+	{ "timer_wheel/advance", bench_advance },
+	{ NULL, NULL }
+};
@@ -44,6 +44,8 @@ struct AVOpenGLFrame
 	unsigned int width;
 	unsigned int height;
 	ConversionConfig *conversion_config;
+	int32_t frame_index; // for chiaki_trace_stamp()
+	bool presented;
 
 	bool Update(AVFrame *frame, ChiakiLog *log);
 };
@@ -4,6 +4,7 @@
 #define CHIAKI_SETTINGS_H
 
 #include <chiaki/session.h>
+#include <chiaki/ffmpegdecoder.h>
 
 #include "host.h"
 
@@ -90,6 +91,9 @@ class Settings : public QObject
 		QString GetHardwareDecoder() const;
 		void SetHardwareDecoder(const QString &hw_decoder);
 
+		ChiakiFfmpegDecoderProfile GetDecoderProfile() const;
+		void SetDecoderProfile(ChiakiFfmpegDecoderProfile profile);
+
 		unsigned int GetAudioBufferSizeDefault() const;
 
 		/**
@@ -31,6 +31,7 @@ class SettingsDialog : public QDialog
 		QComboBox *audio_device_combo_box;
 		QCheckBox *pi_decoder_check_box;
 		QComboBox *hw_decoder_combo_box;
+		QComboBox *decoder_profile_combo_box;
 
 		QListWidget *registered_hosts_list_widget;
 		QPushButton *delete_registered_host_button;
@@ -50,6 +51,7 @@ class SettingsDialog : public QDialog
 		void AudioBufferSizeEdited();
 		void AudioOutputSelected();
 		void HardwareDecodeEngineSelected();
+		void DecoderProfileSelected();
 		void UpdateHardwareDecodeEngineComboBox();
 
 		void UpdateRegisteredHosts();
@@ -44,6 +44,7 @@ struct StreamSessionConnectInfo
 	QMap<Qt::Key, int> key_map;
 	Decoder decoder;
 	QString hw_decoder;
+	ChiakiFfmpegDecoderProfile decoder_profile;
 	QString audio_out_device;
 	uint32_t log_level_mask;
 	QString log_file;
@@ -57,6 +58,8 @@ struct StreamSessionConnectInfo
 	bool enable_keyboard;
 	bool enable_dualsense;
 	bool enable_emulated_rumble;
+	QString capture_file; // write the received stream to this file for chiaki-replay if not empty
+	QString trace_file; // record frame latency and write the trace to this file if not empty
 
 	StreamSessionConnectInfo(Settings *settings, ChiakiTarget target, QString host, QByteArray regist_key, QByteArray morning, bool fullscreen, bool enable_dualsense, bool enable_emulated_rumble);
 };
@@ -72,6 +75,7 @@ class StreamSession : public QObject
 		ChiakiSession session;
 		ChiakiOpusDecoder opus_decoder;
 		bool connected;
+		QString trace_file;
 
 		
 
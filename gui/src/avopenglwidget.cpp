@@ -4,6 +4,8 @@
 #include <avopenglframeuploader.h>
 #include <streamsession.h>
 
+#include <chiaki/trace.h>
+
 #include <QOffscreenSurface>
 #include <QOpenGLContext>
 #include <QOpenGLExtraFunctions>
@@ -264,6 +266,10 @@ bool AVOpenGLFrame::Update(AVFrame *frame, ChiakiLog *log)
 
 	f->glFinish();
 
+	frame_index = chiaki_ffmpeg_decoder_frame_index(frame);
+	presented = false;
+	chiaki_trace_stamp(CHIAKI_TRACE_STAGE_UPLOAD, frame_index);
+
 	return true;
 }
 
@@ -342,6 +348,8 @@ void AVOpenGLWidget::initializeGL()
 		}
 		frames[i].width = 0;
 		frames[i].height = 0;
+		frames[i].frame_index = -1;
+		frames[i].presented = true;
 	}
 
 	f->glUseProgram(program);
@@ -464,4 +472,11 @@ void AVOpenGLWidget::paintGL()
 	f->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
 	f->glFinish();
+
+	// the same frame is drawn again on resize etc., only its first appearance counts
+	if(!frame->presented)
+	{
+		chiaki_trace_stamp(CHIAKI_TRACE_STAGE_PRESENT, frame->frame_index);
+		frame->presented = true;
+	}
 }
\ No newline at end of file
@@ -112,6 +112,12 @@ int real_main(int argc, char *argv[])
 	QCommandLineOption enable_emulated_rumble_option("enable_emulated_rumble_option", "Enable emulated rumble).");
 	parser.addOption(enable_emulated_rumble_option);
 
+	QCommandLineOption capture_option("capture", "Write the received stream to a file that can be played back with chiaki-replay (only for use with stream command)", "file");
+	parser.addOption(capture_option);
+
+	QCommandLineOption trace_option("trace", "Record per-frame latency, log a summary and write a Chrome trace to file at the end of the session (only for use with stream command)", "file");
+	parser.addOption(trace_option);
+
 	parser.process(app);
 	QStringList args = parser.positionalArguments();
 
@@ -181,6 +187,8 @@ int real_main(int argc, char *argv[])
 			}
 		}
 		StreamSessionConnectInfo connect_info(&settings, target, host, regist_key, morning, parser.isSet(fullscreen_option), parser.isSet(dualsense_option), parser.isSet(enable_emulated_rumble_option));
+		connect_info.capture_file = parser.value(capture_option);
+		connect_info.trace_file = parser.value(trace_option);
 		return RunStream(app, connect_info);
 	}
 #ifdef CHIAKI_ENABLE_CLI
@@ -195,6 +195,26 @@ void Settings::SetHardwareDecoder(const QString &hw_decoder)
 	settings.setValue("settings/hw_decoder", hw_decoder);
 }
 
+static const QMap<ChiakiFfmpegDecoderProfile, QString> decoder_profile_values = {
+	{ CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT, "default" },
+	{ CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY, "latency" },
+	{ CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT, "throughput" },
+	{ CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER, "power_saver" }
+};
+
+static const ChiakiFfmpegDecoderProfile decoder_profile_default = CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT;
+
+ChiakiFfmpegDecoderProfile Settings::GetDecoderProfile() const
+{
+	auto v = settings.value("settings/decoder_profile", decoder_profile_values[decoder_profile_default]).toString();
+	return decoder_profile_values.key(v, decoder_profile_default);
+}
+
+void Settings::SetDecoderProfile(ChiakiFfmpegDecoderProfile profile)
+{
+	settings.setValue("settings/decoder_profile", decoder_profile_values[profile]);
+}
+
 unsigned int Settings::GetAudioBufferSize() const
 {
 	unsigned int v = GetAudioBufferSizeRaw();
@@ -245,6 +245,23 @@ SettingsDialog::SettingsDialog(Settings *settings, QWidget *parent) : QDialog(pa
 	}
 	connect(hw_decoder_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(HardwareDecodeEngineSelected()));
 	decode_settings_layout->addRow(tr("Hardware decode method:"), hw_decoder_combo_box);
+
+	decoder_profile_combo_box = new QComboBox(this);
+	static const QList<QPair<ChiakiFfmpegDecoderProfile, const char *>> decoder_profile_strings = {
+		{ CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT, "Default" },
+		{ CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY, "Lowest latency" },
+		{ CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT, "Highest throughput" },
+		{ CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER, "Power saver" }
+	};
+	auto current_decoder_profile = settings->GetDecoderProfile();
+	for(const auto &p : decoder_profile_strings)
+	{
+		decoder_profile_combo_box->addItem(tr(p.second), (int)p.first);
+		if(current_decoder_profile == p.first)
+			decoder_profile_combo_box->setCurrentIndex(decoder_profile_combo_box->count() - 1);
+	}
+	connect(decoder_profile_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(DecoderProfileSelected()));
+	decode_settings_layout->addRow(tr("Decoder profile:"), decoder_profile_combo_box);
 	UpdateHardwareDecodeEngineComboBox();
 
 	// Registered Consoles
@@ -374,9 +391,15 @@ void SettingsDialog::HardwareDecodeEngineSelected()
 	settings->SetHardwareDecoder(hw_decoder_combo_box->currentData().toString());
 }
 
+void SettingsDialog::DecoderProfileSelected()
+{
+	settings->SetDecoderProfile((ChiakiFfmpegDecoderProfile)decoder_profile_combo_box->currentData().toInt());
+}
+
 void SettingsDialog::UpdateHardwareDecodeEngineComboBox()
 {
 	hw_decoder_combo_box->setEnabled(settings->GetDecoder() == Decoder::Ffmpeg);
+	decoder_profile_combo_box->setEnabled(settings->GetDecoder() == Decoder::Ffmpeg);
 }
 
 void SettingsDialog::UpdateBitratePlaceholder()
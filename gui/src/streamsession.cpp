@@ -5,6 +5,7 @@
 #include <controllermanager.h>
 
 #include <chiaki/base64.h>
+#include <chiaki/trace.h>
 
 #include <QKeyEvent>
 #include <QAudioOutput>
@@ -29,6 +30,7 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(Settings *settings, ChiakiTar
 	key_map = settings->GetControllerMappingForDecoding();
 	decoder = settings->GetDecoder();
 	hw_decoder = settings->GetHardwareDecoder();
+	decoder_profile = settings->GetDecoderProfile();
 	audio_out_device = settings->GetAudioOutDevice();
 	log_level_mask = settings->GetLogLevelMask();
 	log_file = CreateLogFilename();
@@ -69,6 +71,15 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	connected = false;
 	ChiakiErrorCode err;
 
+	trace_file = connect_info.trace_file;
+	if(!trace_file.isEmpty())
+	{
+		chiaki_trace_clear();
+		err = chiaki_trace_enable();
+		if(err != CHIAKI_ERR_SUCCESS)
+			throw ChiakiException("Failed to enable tracing");
+	}
+
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	if(connect_info.decoder == Decoder::Pi)
 	{
@@ -86,6 +97,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 				chiaki_log_sniffer_get_log(&sniffer),
 				chiaki_target_is_ps5(connect_info.target) ? connect_info.video_profile.codec : CHIAKI_CODEC_H264,
 				connect_info.hw_decoder.isEmpty() ? NULL : connect_info.hw_decoder.toUtf8().constData(),
+				connect_info.decoder_profile,
 				FfmpegFrameCb, this);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
@@ -120,6 +132,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	audio_buffer_size = connect_info.audio_buffer_size;
 
 	QByteArray host_str = connect_info.host.toUtf8();
+	QByteArray capture_file_str = connect_info.capture_file.toLocal8Bit();
 
 	ChiakiConnectInfo chiaki_connect_info = {};
 	chiaki_connect_info.ps5 = chiaki_target_is_ps5(connect_info.target);
@@ -130,6 +143,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_connect_info.enable_dualsense = connect_info.enable_dualsense;
 	chiaki_connect_info.enable_emulated_rumble = connect_info.enable_emulated_rumble;
 	enable_emulated_rumble = connect_info.enable_emulated_rumble;
+	chiaki_connect_info.capture_filename = capture_file_str.isEmpty() ? nullptr : capture_file_str.constData();
 
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	if(connect_info.decoder == Decoder::Pi && chiaki_connect_info.video_profile.codec != CHIAKI_CODEC_H264)
@@ -159,7 +173,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_session_set_audio_sink(&session, &audio_sink);
 
 	if (connect_info.enable_dualsense) {
-		ChiakiAudioSink haptics_sink;
+		ChiakiAudioSink haptics_sink = {};
 		haptics_sink.user = this;
 		haptics_sink.frame_cb = HapticsFrameCb;
 		chiaki_session_set_haptics_sink(&session, &haptics_sink);
@@ -171,7 +185,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	else
 	{
 #endif
-		chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
+		chiaki_session_set_video_frame_cb(&session, chiaki_ffmpeg_decoder_video_frame_cb, ffmpeg_decoder);
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	}
 #endif
@@ -232,6 +246,11 @@ StreamSession::~StreamSession()
 		chiaki_ffmpeg_decoder_fini(ffmpeg_decoder);
 		delete ffmpeg_decoder;
 	}
+	if(!trace_file.isEmpty())
+	{
+		chiaki_trace_disable();
+		chiaki_trace_report(trace_file.toLocal8Bit().constData(), log.GetChiakiLog());
+	}
 	if (haptics_output > 0)
 	{
 		SDL_CloseAudioDevice(haptics_output);
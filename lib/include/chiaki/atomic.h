@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ATOMIC_H
+#define CHIAKI_ATOMIC_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define CHIAKI_ATOMIC_MSVC
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Minimal atomics for lock-free single-producer/single-consumer structures.
+ * Uses the GCC/Clang __atomic builtins or the Interlocked intrinsics on MSVC,
+ * which does not provide <stdatomic.h> for C in all supported versions.
+ *
+ * seq_cst variants are needed where a store must be ordered before a following load of another variable.
+ */
+
+typedef struct chiaki_atomic_u64_t
+{
+	volatile uint64_t value;
+} ChiakiAtomicU64;
+
+typedef struct chiaki_atomic_u32_t
+{
+	volatile uint32_t value;
+} ChiakiAtomicU32;
+
+#ifdef CHIAKI_ATOMIC_MSVC
+
+static inline uint64_t chiaki_atomic_u64_load(ChiakiAtomicU64 *a) { return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)&a->value, 0, 0); }
+static inline uint64_t chiaki_atomic_u64_load_acquire(ChiakiAtomicU64 *a) { return chiaki_atomic_u64_load(a); }
+static inline uint64_t chiaki_atomic_u64_load_relaxed(ChiakiAtomicU64 *a) { return a->value; }
+static inline void chiaki_atomic_u64_store(ChiakiAtomicU64 *a, uint64_t v) { _InterlockedExchange64((volatile __int64 *)&a->value, (__int64)v); }
+static inline void chiaki_atomic_u64_store_release(ChiakiAtomicU64 *a, uint64_t v) { chiaki_atomic_u64_store(a, v); }
+static inline void chiaki_atomic_u64_store_relaxed(ChiakiAtomicU64 *a, uint64_t v) { a->value = v; }
+static inline uint64_t chiaki_atomic_u64_fetch_add(ChiakiAtomicU64 *a, uint64_t v) { return (uint64_t)_InterlockedExchangeAdd64((volatile __int64 *)&a->value, (__int64)v); }
+
+static inline uint32_t chiaki_atomic_u32_load(ChiakiAtomicU32 *a) { return (uint32_t)_InterlockedCompareExchange((volatile long *)&a->value, 0, 0); }
+static inline uint32_t chiaki_atomic_u32_load_acquire(ChiakiAtomicU32 *a) { return chiaki_atomic_u32_load(a); }
+static inline uint32_t chiaki_atomic_u32_load_relaxed(ChiakiAtomicU32 *a) { return a->value; }
+static inline void chiaki_atomic_u32_store(ChiakiAtomicU32 *a, uint32_t v) { _InterlockedExchange((volatile long *)&a->value, (long)v); }
+static inline void chiaki_atomic_u32_store_release(ChiakiAtomicU32 *a, uint32_t v) { chiaki_atomic_u32_store(a, v); }
+static inline void chiaki_atomic_u32_store_relaxed(ChiakiAtomicU32 *a, uint32_t v) { a->value = v; }
+static inline uint32_t chiaki_atomic_u32_fetch_add(ChiakiAtomicU32 *a, uint32_t v) { return (uint32_t)_InterlockedExchangeAdd((volatile long *)&a->value, (long)v); }
+static inline bool chiaki_atomic_u32_compare_exchange(ChiakiAtomicU32 *a, uint32_t expected, uint32_t desired) { return (uint32_t)_InterlockedCompareExchange((volatile long *)&a->value, (long)desired, (long)expected) == expected; }
+
+#else
+
+static inline uint64_t chiaki_atomic_u64_load(ChiakiAtomicU64 *a) { return __atomic_load_n(&a->value, __ATOMIC_SEQ_CST); }
+static inline uint64_t chiaki_atomic_u64_load_acquire(ChiakiAtomicU64 *a) { return __atomic_load_n(&a->value, __ATOMIC_ACQUIRE); }
+static inline uint64_t chiaki_atomic_u64_load_relaxed(ChiakiAtomicU64 *a) { return __atomic_load_n(&a->value, __ATOMIC_RELAXED); }
+static inline void chiaki_atomic_u64_store(ChiakiAtomicU64 *a, uint64_t v) { __atomic_store_n(&a->value, v, __ATOMIC_SEQ_CST); }
+static inline void chiaki_atomic_u64_store_release(ChiakiAtomicU64 *a, uint64_t v) { __atomic_store_n(&a->value, v, __ATOMIC_RELEASE); }
+static inline void chiaki_atomic_u64_store_relaxed(ChiakiAtomicU64 *a, uint64_t v) { __atomic_store_n(&a->value, v, __ATOMIC_RELAXED); }
+static inline uint64_t chiaki_atomic_u64_fetch_add(ChiakiAtomicU64 *a, uint64_t v) { return __atomic_fetch_add(&a->value, v, __ATOMIC_SEQ_CST); }
+
+static inline uint32_t chiaki_atomic_u32_load(ChiakiAtomicU32 *a) { return __atomic_load_n(&a->value, __ATOMIC_SEQ_CST); }
+static inline uint32_t chiaki_atomic_u32_load_acquire(ChiakiAtomicU32 *a) { return __atomic_load_n(&a->value, __ATOMIC_ACQUIRE); }
+static inline uint32_t chiaki_atomic_u32_load_relaxed(ChiakiAtomicU32 *a) { return __atomic_load_n(&a->value, __ATOMIC_RELAXED); }
+static inline void chiaki_atomic_u32_store(ChiakiAtomicU32 *a, uint32_t v) { __atomic_store_n(&a->value, v, __ATOMIC_SEQ_CST); }
+static inline void chiaki_atomic_u32_store_release(ChiakiAtomicU32 *a, uint32_t v) { __atomic_store_n(&a->value, v, __ATOMIC_RELEASE); }
+static inline void chiaki_atomic_u32_store_relaxed(ChiakiAtomicU32 *a, uint32_t v) { __atomic_store_n(&a->value, v, __ATOMIC_RELAXED); }
+static inline uint32_t chiaki_atomic_u32_fetch_add(ChiakiAtomicU32 *a, uint32_t v) { return __atomic_fetch_add(&a->value, v, __ATOMIC_SEQ_CST); }
+static inline bool chiaki_atomic_u32_compare_exchange(ChiakiAtomicU32 *a, uint32_t expected, uint32_t desired) { return __atomic_compare_exchange_n(&a->value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+#endif
+
+static inline void chiaki_atomic_u64_init(ChiakiAtomicU64 *a, uint64_t v) { a->value = v; }
+static inline void chiaki_atomic_u32_init(ChiakiAtomicU32 *a, uint32_t v) { a->value = v; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ATOMIC_H
@@ -17,6 +17,14 @@ extern "C" {
 typedef void (*ChiakiAudioSinkHeader)(ChiakiAudioHeader *header, void *user);
 typedef void (*ChiakiAudioSinkFrame)(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * Called right before the frame_cb of the first frame after a gap.
+ *
+ * @param frames_count number of consecutive frames that have been lost, at most CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX
+ * @param next_buf the frame that will be passed to frame_cb next, e.g. for recovering the last lost frame from Opus in-band FEC
+ */
+typedef void (*ChiakiAudioSinkFrameLost)(size_t frames_count, uint8_t *next_buf, size_t next_buf_size, void *user);
+
 /**
  * Sink that receives Audio encoded as Opus
  */
@@ -25,15 +33,24 @@ typedef struct chiaki_audio_sink_t
 	void *user;
 	ChiakiAudioSinkHeader header_cb;
 	ChiakiAudioSinkFrame frame_cb;
+	ChiakiAudioSinkFrameLost frame_lost_cb; // optional
 } ChiakiAudioSink;
 
+/**
+ * Longer gaps are reported as this many lost frames, they are most likely a stall rather than loss
+ * and concealing all of them would only add latency.
+ */
+#define CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX 8
+
 typedef struct chiaki_audio_receiver_t
 {
 	struct chiaki_session_t *session;
 	ChiakiLog *log;
 	ChiakiMutex mutex;
 	ChiakiSeqNum16 frame_index_prev;
+	bool frame_index_prev_valid; // whether any frame has been passed on yet
 	bool frame_index_startup; // whether frame_index_prev has definitely not wrapped yet
+	uint64_t frames_lost;
 	ChiakiPacketStats *packet_stats;
 } ChiakiAudioReceiver;
 
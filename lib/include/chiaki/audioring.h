@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIORING_H
+#define CHIAKI_AUDIORING_H
+
+#include "common.h"
+#include "atomic.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AUDIO_RING_CHANNELS_MAX 8
+
+/**
+ * Maximum deviation of the resampling ratio from 1. At 0.5%, the pitch change is not audible.
+ */
+#define CHIAKI_AUDIO_RING_RATIO_MAX_PPM 5000
+
+typedef struct chiaki_audio_ring_stats_t
+{
+	uint64_t fill_frames; // currently buffered
+	uint64_t target_frames;
+	uint64_t frames_written;
+	uint64_t frames_read; // output frames, including silence
+	uint64_t underruns; // reads that ran out of data and had to be padded with silence
+	uint64_t overruns; // writes that did not fit completely and were partially dropped
+	int32_t ratio_ppm; // current deviation of the consumption speed from 1, positive when draining
+	int32_t drift_ppm; // long-term part of ratio_ppm, i.e. how much faster the source clock runs than the sink's
+} ChiakiAudioRingStats;
+
+/**
+ * Lock-free single-producer/single-consumer ring of interleaved 16-bit PCM,
+ * meant to sit between the audio decoder and a pull-based audio device callback.
+ *
+ * The consumer always gets exactly the number of frames it asks for. It resamples slightly
+ * (linear interpolation, within CHIAKI_AUDIO_RING_RATIO_MAX_PPM) so the fill level is held at
+ * the target latency, compensating for the source and sink clocks drifting apart.
+ * After running empty, it outputs silence until the ring has been filled up to the target again.
+ */
+typedef struct chiaki_audio_ring_t
+{
+	int16_t *buf;
+	size_t capacity; // in frames, power of 2
+	unsigned int channels;
+	uint32_t rate;
+	size_t target_frames;
+
+	ChiakiAtomicU64 head; // next frame to read, written by the consumer only
+	ChiakiAtomicU64 tail; // next frame to write, written by the producer only
+
+	// consumer only
+	bool playing;
+	double frac; // position between cur and the frame at head
+	int16_t cur[CHIAKI_AUDIO_RING_CHANNELS_MAX];
+	double fill_avg;
+	double integral;
+
+	// statistics, each written by one side only
+	ChiakiAtomicU64 frames_written;
+	ChiakiAtomicU64 overruns;
+	ChiakiAtomicU64 frames_read;
+	ChiakiAtomicU64 underruns;
+	ChiakiAtomicU32 ratio_ppm;
+	ChiakiAtomicU32 drift_ppm;
+} ChiakiAudioRing;
+
+/**
+ * @param target_latency_ms fill level to hold, the capacity is 4 times as much
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_ring_init(ChiakiAudioRing *ring, unsigned int channels, uint32_t rate, uint32_t target_latency_ms);
+CHIAKI_EXPORT void chiaki_audio_ring_fini(ChiakiAudioRing *ring);
+
+/**
+ * Producer only. Never blocks.
+ *
+ * @param frames_count number of frames, i.e. samples per channel
+ * @return number of frames that were actually written, the rest is dropped
+ */
+CHIAKI_EXPORT size_t chiaki_audio_ring_write(ChiakiAudioRing *ring, const int16_t *pcm, size_t frames_count);
+
+/**
+ * Consumer only. Never blocks, always fills all of pcm, with silence if necessary.
+ */
+CHIAKI_EXPORT void chiaki_audio_ring_read(ChiakiAudioRing *ring, int16_t *pcm, size_t frames_count);
+
+/**
+ * May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_audio_ring_get_stats(ChiakiAudioRing *ring, ChiakiAudioRingStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIORING_H
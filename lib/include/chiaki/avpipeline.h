@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AVPIPELINE_H
+#define CHIAKI_AVPIPELINE_H
+
+#include "common.h"
+#include "log.h"
+#include "takion.h"
+#include "framepool.h"
+#include "spscqueue.h"
+#include "atomic.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AV_PIPELINE_PACKET_QUEUE_SIZE 1024
+#define CHIAKI_AV_PIPELINE_FRAME_QUEUE_SIZE 8
+
+/**
+ * Staged processing of received AV packets, so the Takion receive thread only has to verify and enqueue them:
+ *
+ *   Takion thread --packets--> crypt stage (decrypt, reassembly, FEC) --frames--> decode stage (video_sample_cb)
+ *
+ * Full packet queue: packets are dropped and counted, the receive thread never blocks.
+ * Full frame queue: the crypt stage blocks, which eventually makes the packet queue drop.
+ */
+typedef enum chiaki_av_pipeline_stage_t
+{
+	CHIAKI_AV_PIPELINE_STAGE_CRYPT,
+	CHIAKI_AV_PIPELINE_STAGE_DECODE,
+	CHIAKI_AV_PIPELINE_STAGE_COUNT
+} ChiakiAVPipelineStage;
+
+CHIAKI_EXPORT const char *chiaki_av_pipeline_stage_name(ChiakiAVPipelineStage stage);
+
+typedef struct chiaki_av_pipeline_stage_stats_t
+{
+	uint64_t items; // processed by the stage
+	uint64_t dropped; // not accepted because the queue was full or closed
+	uint64_t queue_depth;
+	uint64_t queue_depth_max;
+	uint64_t latency_us_sum; // from being queued until processing has finished
+	uint64_t latency_us_max;
+} ChiakiAVPipelineStageStats;
+
+/**
+ * Called on the crypt stage thread. packet->data is only valid during the call.
+ * packet is NULL if the deadline set with chiaki_av_pipeline_set_packet_deadline() has come.
+ */
+typedef void (*ChiakiAVPipelinePacketCallback)(ChiakiTakionAVPacket *packet, void *user);
+
+/**
+ * Called on the decode stage thread.
+ * frame is only borrowed for the duration of the call, use chiaki_video_frame_ref() to keep it.
+ */
+typedef void (*ChiakiAVPipelineFrameCallback)(ChiakiVideoFrame *frame, void *user);
+
+typedef struct chiaki_av_pipeline_stage_state_t
+{
+	ChiakiSPSCQueue queue;
+	ChiakiThread thread;
+	bool thread_running;
+	ChiakiAtomicU64 items;
+	ChiakiAtomicU64 dropped;
+	ChiakiAtomicU64 queue_depth_max;
+	ChiakiAtomicU64 latency_us_sum;
+	ChiakiAtomicU64 latency_us_max;
+} ChiakiAVPipelineStageState;
+
+typedef struct chiaki_av_pipeline_t
+{
+	ChiakiLog *log;
+	ChiakiAVPipelineStageState stages[CHIAKI_AV_PIPELINE_STAGE_COUNT];
+	ChiakiAVPipelinePacketCallback packet_cb;
+	void *packet_cb_user;
+	uint64_t packet_deadline_us; // only used from the crypt stage thread, UINT64_MAX if not set
+	ChiakiAVPipelineFrameCallback frame_cb;
+	void *frame_cb_user;
+} ChiakiAVPipeline;
+
+/**
+ * Allocate all queues and start the stage threads.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_av_pipeline_init(ChiakiAVPipeline *pipeline, ChiakiLog *log,
+		ChiakiAVPipelinePacketCallback packet_cb, void *packet_cb_user,
+		ChiakiAVPipelineFrameCallback frame_cb, void *frame_cb_user);
+
+/**
+ * Stop and join the stage threads, discarding everything still queued.
+ * Packets and frames pushed afterwards are dropped.
+ */
+CHIAKI_EXPORT void chiaki_av_pipeline_stop(ChiakiAVPipeline *pipeline);
+
+/**
+ * Stops the pipeline if that has not happened yet.
+ */
+CHIAKI_EXPORT void chiaki_av_pipeline_fini(ChiakiAVPipeline *pipeline);
+
+/**
+ * Copy packet including its data into the crypt stage. Never blocks.
+ * Must always be called from the same thread.
+ *
+ * @return false if the packet was dropped
+ */
+CHIAKI_EXPORT bool chiaki_av_pipeline_push_packet(ChiakiAVPipeline *pipeline, ChiakiTakionAVPacket *packet);
+
+/**
+ * Hand a frame to the decode stage, which takes its own reference. Blocks while the frame queue is full.
+ * Must be called from the crypt stage thread, i.e. from inside the packet callback.
+ *
+ * @return false if the frame was dropped
+ */
+CHIAKI_EXPORT bool chiaki_av_pipeline_push_frame(ChiakiAVPipeline *pipeline, ChiakiVideoFrame *frame);
+
+/**
+ * Call the packet callback with a NULL packet once deadline_us has passed, even if no packets arrive until then.
+ * Replaces any previous deadline, UINT64_MAX to cancel.
+ * Must be called from the crypt stage thread, i.e. from inside the packet callback.
+ *
+ * @param deadline_us see chiaki_time_now_monotonic_us()
+ */
+static inline void chiaki_av_pipeline_set_packet_deadline(ChiakiAVPipeline *pipeline, uint64_t deadline_us)
+{
+	pipeline->packet_deadline_us = deadline_us;
+}
+
+CHIAKI_EXPORT void chiaki_av_pipeline_get_stats(ChiakiAVPipeline *pipeline, ChiakiAVPipelineStage stage, ChiakiAVPipelineStageStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AVPIPELINE_H
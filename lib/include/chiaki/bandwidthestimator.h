@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BANDWIDTHESTIMATOR_H
+#define CHIAKI_BANDWIDTHESTIMATOR_H
+
+#include "common.h"
+#include "thread.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE 20
+#define CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS 10
+
+typedef enum
+{
+	CHIAKI_BANDWIDTH_USAGE_NORMAL,
+	CHIAKI_BANDWIDTH_USAGE_UNDERUSE, // queues are draining
+	CHIAKI_BANDWIDTH_USAGE_OVERUSE // queues are building up
+} ChiakiBandwidthUsage;
+
+typedef struct chiaki_bandwidth_estimate_t
+{
+	uint64_t bitrate; // estimated available bitrate in bit/s, 0 if not known yet
+	uint64_t receive_bitrate; // currently received video bitrate in bit/s
+	uint64_t bottleneck_bitrate; // max delivery rate seen recently within frames in bit/s, 0 if not known
+	uint64_t queue_delay_us; // one-way delay above the minimum seen recently
+	double loss_rate; // smoothed share of lost packets in [0, 1]
+	ChiakiBandwidthUsage usage;
+} ChiakiBandwidthEstimate;
+
+/**
+ * Delay-based bandwidth estimation from video packet arrivals, in the spirit of Google Congestion Control.
+ *
+ * The console's packets carry no send timestamps, but frames are sent at a fixed rate, so the arrival
+ * of each frame's first packet relative to frame_index * frame interval gives the one-way delay up to
+ * a constant. Its trend tells whether queues are building up along the path, before packets are lost.
+ *
+ * Packets are pushed from the receiving thread, chiaki_bandwidth_estimator_update() is called
+ * periodically from another one, so everything is guarded by mutex.
+ */
+typedef struct chiaki_bandwidth_estimator_t
+{
+	ChiakiMutex mutex;
+	uint64_t frame_interval_us;
+
+	// frame currently arriving
+	bool frame_valid;
+	ChiakiSeqNum16 frame_index;
+	int64_t frame_index_ext; // unwrapped
+	uint64_t frame_first_us;
+	uint64_t frame_last_us;
+	uint64_t frame_bytes;
+	uint64_t frame_first_bytes;
+	unsigned int frame_packets;
+
+	// delay
+	bool delay_base_valid;
+	uint64_t delay_base_us; // arrival of the first frame
+	int64_t delay_min_us[CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS]; // per second
+	uint64_t delay_min_second[CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS];
+	double delay_smoothed_us;
+	double trendline_x[CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE]; // ms
+	double trendline_y[CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE]; // ms
+	unsigned int trendline_count;
+	unsigned int trendline_next;
+	unsigned int delta_count;
+	double threshold;
+	uint64_t threshold_update_us;
+	double trend_prev;
+	uint64_t overuse_start_us;
+	ChiakiBandwidthUsage usage;
+	uint64_t queue_delay_us;
+
+	// rate
+	uint64_t bytes;
+	uint64_t bottleneck_max[CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS]; // per second, bit/s
+	uint64_t bottleneck_second[CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS];
+	uint64_t update_prev_us;
+	uint64_t bytes_prev;
+	double receive_bitrate;
+	double bitrate;
+	uint64_t decrease_prev_us;
+	double loss_rate;
+} ChiakiBandwidthEstimator;
+
+/**
+ * @param frame_interval_us interval at which the console sends frames, i.e. 1000000 / fps
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_bandwidth_estimator_init(ChiakiBandwidthEstimator *estimator, uint64_t frame_interval_us);
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_fini(ChiakiBandwidthEstimator *estimator);
+
+/**
+ * Forget everything, e.g. for a new stream.
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_reset(ChiakiBandwidthEstimator *estimator, uint64_t frame_interval_us);
+
+/**
+ * Call for every received video packet as close to its arrival as possible.
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_packet(ChiakiBandwidthEstimator *estimator, uint64_t now_us, ChiakiSeqNum16 frame_index, size_t size);
+
+/**
+ * Update the bitrate estimate with the packets counted since the last call.
+ *
+ * The console only understands received and lost counts, so while the estimate is below the received bitrate,
+ * the excess is reported as additional loss to make it back off before real loss happens.
+ *
+ * @param received packets received since the last call
+ * @param lost packets lost since the last call
+ * @param report_received set to the number of received packets to report, saturated to 16 bits
+ * @param report_lost set to the number of lost packets to report, saturated to 16 bits
+ */
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_update(ChiakiBandwidthEstimator *estimator, uint64_t now_us, uint64_t received, uint64_t lost,
+		uint16_t *report_received, uint16_t *report_lost);
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_get(ChiakiBandwidthEstimator *estimator, ChiakiBandwidthEstimate *estimate);
+
+CHIAKI_EXPORT const char *chiaki_bandwidth_usage_string(ChiakiBandwidthUsage usage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_BANDWIDTHESTIMATOR_H
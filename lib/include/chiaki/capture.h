@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CAPTURE_H
+#define CHIAKI_CAPTURE_H
+
+#include "common.h"
+#include "log.h"
+#include "ecdh.h"
+#include "packetpool.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_CAPTURE_VERSION 1
+
+#define CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE 0x10 // same as CHIAKI_HANDSHAKE_KEY_SIZE
+#define CHIAKI_CAPTURE_KEYS_SIZE (CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE + CHIAKI_ECDH_SECRET_SIZE)
+#define CHIAKI_CAPTURE_RECORD_SIZE_MAX CHIAKI_PACKET_BUF_SIZE
+
+typedef enum
+{
+	// values must not change
+	CHIAKI_CAPTURE_RECORD_DATAGRAM = 1, // a datagram exactly as it was received from the socket
+	CHIAKI_CAPTURE_RECORD_TAKION_TAG = 2, // 32 bit local Takion tag, which all received messages are addressed to
+	CHIAKI_CAPTURE_RECORD_KEYS = 3 // handshake key followed by the ECDH secret, everything needed to derive the stream keys
+} ChiakiCaptureRecordType;
+
+typedef struct chiaki_capture_info_t
+{
+	ChiakiTarget target;
+	ChiakiCodec codec;
+} ChiakiCaptureInfo;
+
+/**
+ * Writes everything that is needed to replay a stream connection offline to a file.
+ *
+ * File layout, all integers big endian:
+ *   header: "CHIAKICP", u8 version, u8 codec, u16 reserved, u32 target
+ *   records: u8 type, u16 payload size, u32 us since the previous record (or the start), payload
+ *
+ * Not thread-safe. Takion writes all records from its own thread.
+ */
+typedef struct chiaki_capture_writer_t
+{
+	ChiakiLog *log;
+	FILE *file;
+	uint64_t time_prev_us;
+	uint64_t records;
+	uint64_t bytes;
+	bool failed; // a write has failed, nothing more is written
+} ChiakiCaptureWriter;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_writer_init(ChiakiCaptureWriter *writer, ChiakiLog *log, const char *filename, const ChiakiCaptureInfo *info);
+CHIAKI_EXPORT void chiaki_capture_writer_fini(ChiakiCaptureWriter *writer);
+
+/**
+ * @param time_us monotonic time the record belongs to, e.g. when a datagram arrived
+ */
+CHIAKI_EXPORT void chiaki_capture_writer_record(ChiakiCaptureWriter *writer, ChiakiCaptureRecordType type, uint64_t time_us, const uint8_t *buf, size_t buf_size);
+
+CHIAKI_EXPORT void chiaki_capture_writer_keys(ChiakiCaptureWriter *writer, uint64_t time_us, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+
+typedef struct chiaki_capture_record_t
+{
+	ChiakiCaptureRecordType type;
+	uint64_t time_us; // since the start of the capture
+	size_t size;
+	uint8_t data[CHIAKI_CAPTURE_RECORD_SIZE_MAX];
+} ChiakiCaptureRecord;
+
+typedef struct chiaki_capture_reader_t
+{
+	ChiakiLog *log;
+	FILE *file;
+	long records_offset;
+	uint64_t time_us;
+	ChiakiCaptureInfo info;
+
+	// found by scanning the whole file on init
+	bool takion_tag_valid;
+	uint32_t takion_tag;
+	bool keys_valid;
+	uint8_t handshake_key[CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	uint64_t datagrams_count;
+	uint64_t datagrams_bytes;
+	uint64_t duration_us;
+} ChiakiCaptureReader;
+
+/**
+ * Open a capture and scan it once for its summary, the tag and the keys.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_init(ChiakiCaptureReader *reader, ChiakiLog *log, const char *filename);
+CHIAKI_EXPORT void chiaki_capture_reader_fini(ChiakiCaptureReader *reader);
+
+/**
+ * Start reading records from the beginning again.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_rewind(ChiakiCaptureReader *reader);
+
+/**
+ * @return CHIAKI_ERR_SUCCESS, CHIAKI_ERR_DISCONNECTED at the end of the capture or CHIAKI_ERR_INVALID_DATA if it is corrupt
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_next(ChiakiCaptureReader *reader, ChiakiCaptureRecord *record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CAPTURE_H
@@ -6,6 +6,8 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "bandwidthestimator.h"
+#include "eventloop.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,14 +17,24 @@ typedef struct chiaki_congestion_control_t
 {
 	ChiakiTakion *takion;
 	ChiakiPacketStats *stats;
+	ChiakiBandwidthEstimator *estimator;
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
+	ChiakiEventLoop *loop;
+	ChiakiEventLoopTimer timer;
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats);
+/**
+ * Periodically report received and lost packets from stats to the console,
+ * adjusted by estimator so the console backs off once queues start building up.
+ *
+ * @param loop if not NULL, reports are sent by a timer on loop instead of a separate thread
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats,
+		ChiakiBandwidthEstimator *estimator, ChiakiEventLoop *loop);
 
 /**
- * Stop control and join the thread
+ * Stop control and join the thread or stop the timer
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
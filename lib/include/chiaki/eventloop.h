@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_EVENTLOOP_H
+#define CHIAKI_EVENTLOOP_H
+
+#include "common.h"
+#include "log.h"
+#include "sock.h"
+#include "thread.h"
+#include "stoppipe.h"
+#include "timerwheel.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Dispatches socket readiness and timers for several components on a single thread.
+ *
+ * On Linux, the loop waits in epoll with a timerfd armed to the earliest timer at microsecond precision
+ * and an eventfd to be woken up. Elsewhere it falls back to select() with the stop pipe.
+ * Timers are kept in a ChiakiTimerWheel.
+ *
+ * Timers and sockets may be added, started and removed from any thread.
+ * Callbacks are called on the loop thread without any lock of the loop held,
+ * so they may start and stop timers themselves.
+ */
+
+typedef enum
+{
+	CHIAKI_EVENT_LOOP_IO_READ = 1,
+	CHIAKI_EVENT_LOOP_IO_WRITE = 2
+} ChiakiEventLoopIoFlags;
+
+typedef void (*ChiakiEventLoopTimerCallback)(void *user);
+typedef void (*ChiakiEventLoopIoCallback)(chiaki_socket_t fd, unsigned int events, void *user);
+
+typedef struct chiaki_event_loop_t ChiakiEventLoop;
+
+typedef struct chiaki_event_loop_timer_t
+{
+	ChiakiEventLoop *loop;
+	ChiakiTimerWheelTimer timer; // protected by the loop's mutex
+	uint64_t slack_us;
+} ChiakiEventLoopTimer;
+
+typedef struct chiaki_event_loop_io_t
+{
+	ChiakiEventLoop *loop;
+	ChiakiEventLoopIoCallback cb;
+	void *user;
+	chiaki_socket_t fd;
+	unsigned int events; // ChiakiEventLoopIoFlags
+	uint64_t id; // identifies the io in readiness reported after it might have been removed
+	struct chiaki_event_loop_io_t *next;
+} ChiakiEventLoopIo;
+
+typedef struct chiaki_event_loop_stats_t
+{
+	uint64_t wakeups;
+	uint64_t timers_fired;
+	uint64_t timers_late_us; // summed up delay of fired timers after their due time
+	uint64_t ios_dispatched;
+} ChiakiEventLoopStats;
+
+struct chiaki_event_loop_t
+{
+	ChiakiLog *log;
+#if defined(__linux__)
+	int epoll_fd;
+	int timer_fd;
+	int wake_fd;
+	uint64_t timer_fd_due_us; // what timer_fd is armed for, UINT64_MAX if disarmed
+#else
+	ChiakiStopPipe wake_pipe;
+#ifdef _WIN32
+	WSAEVENT io_event; // every registered socket signals this, the ready ones are found with select()
+#endif
+#endif
+	bool wake_pending;
+
+	ChiakiMutex mutex;
+	ChiakiCond dispatch_cond; // signaled after each callback returned
+	void *dispatching; // timer or io whose callback is running
+	bool should_stop;
+
+	ChiakiTimerWheel timers; // in chiaki_time_now_monotonic_us()
+	ChiakiEventLoopIo *ios;
+	uint64_t io_id_next;
+	ChiakiEventLoopStats stats;
+
+	ChiakiThread thread;
+};
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop, ChiakiLog *log);
+
+/**
+ * All timers and ios must have been removed and the loop must not be running anymore.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop);
+
+/**
+ * Dispatch on the calling thread until chiaki_event_loop_stop() is called.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_run(ChiakiEventLoop *loop);
+
+/**
+ * Make chiaki_event_loop_run() return after the current callback. Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop);
+
+/**
+ * Run the loop on a new thread, to be stopped with chiaki_event_loop_stop() and joined with chiaki_event_loop_join().
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_start(ChiakiEventLoop *loop, const char *thread_name);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_join(ChiakiEventLoop *loop);
+
+CHIAKI_EXPORT void chiaki_event_loop_get_stats(ChiakiEventLoop *loop, ChiakiEventLoopStats *stats);
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_init(ChiakiEventLoopTimer *timer, ChiakiEventLoop *loop, ChiakiEventLoopTimerCallback cb, void *user);
+
+/**
+ * Stop the timer and wait until a running callback of it returned.
+ * Must not be called from the timer's own callback.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_timer_fini(ChiakiEventLoopTimer *timer);
+
+/**
+ * (Re-)arm the timer, replacing any previous due time.
+ *
+ * @param due_us monotonic time to fire at, see chiaki_time_now_monotonic_us(), times in the past fire right away
+ * @param interval_us if not 0, the timer fires again every interval_us until stopped
+ */
+CHIAKI_EXPORT void chiaki_event_loop_timer_start(ChiakiEventLoopTimer *timer, uint64_t due_us, uint64_t interval_us);
+
+/**
+ * Allow the timer to fire up to slack_us late, so it can share wakeups with others.
+ * Applies from the next chiaki_event_loop_timer_start() on.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_timer_set_slack(ChiakiEventLoopTimer *timer, uint64_t slack_us);
+
+/**
+ * Disarm the timer. Its callback might still be running on the loop thread when this returns.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_timer_stop(ChiakiEventLoopTimer *timer);
+
+/**
+ * Call cb on the loop thread whenever fd is ready for any of events.
+ * Readiness is level-triggered, so cb must consume it or it is called again.
+ *
+ * @param events ChiakiEventLoopIoFlags
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_io_add(ChiakiEventLoop *loop, ChiakiEventLoopIo *io, chiaki_socket_t fd, unsigned int events,
+		ChiakiEventLoopIoCallback cb, void *user);
+
+/**
+ * Stop watching and wait until a running callback of io returned.
+ * Must not be called from io's own callback.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_io_remove(ChiakiEventLoopIo *io);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_EVENTLOOP_H
@@ -16,6 +16,63 @@ extern "C" {
 
 #define CHIAKI_FEC_WORDSIZE 8
 
+/**
+ * Maximum k + m supported for CHIAKI_FEC_WORDSIZE
+ */
+#define CHIAKI_FEC_UNITS_MAX 256
+
+#define CHIAKI_FEC_CACHE_BUCKETS 64
+#define CHIAKI_FEC_CACHE_MEM_BUDGET_DEFAULT (1024 * 1024)
+
+typedef struct chiaki_fec_cache_entry_t ChiakiFecCacheEntry;
+
+/**
+ * LRU cache of Cauchy coding matrices per (k, m) and inverted decoding matrices per (k, m, erasure pattern),
+ * so repeated FEC recovery only has to do the region multiplications.
+ *
+ * Not thread-safe.
+ */
+typedef struct chiaki_fec_cache_t
+{
+	size_t mem_budget;
+	size_t mem_used;
+	ChiakiFecCacheEntry *lru_first; // most recently used
+	ChiakiFecCacheEntry *lru_last; // least recently used
+	ChiakiFecCacheEntry *buckets[CHIAKI_FEC_CACHE_BUCKETS];
+	uint64_t hits;
+	uint64_t misses;
+} ChiakiFecCache;
+
+/**
+ * @param mem_budget approximate maximum number of bytes to keep cached
+ */
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache, size_t mem_budget);
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache);
+
+/**
+ * Compute the m fec units of frame_buf from its k source units, reusing the coding matrix from cache.
+ *
+ * @param frame_buf k source units followed by space for m fec units, each at a distance of stride.
+ * Source units must be zero-padded to unit_size.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode_cached(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
+
+/**
+ * Same as chiaki_fec_encode_cached(), but without keeping the matrix around.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
+
+/**
+ * Recover the erased source units of frame_buf in place, reusing matrices from cache.
+ * Erased FEC units are not restored.
+ *
+ * @param frame_buf k source units followed by m fec units, each at a distance of stride
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode_cached(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
+
+/**
+ * Same as chiaki_fec_decode_cached(), but without keeping any matrices around.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 
 #ifdef __cplusplus
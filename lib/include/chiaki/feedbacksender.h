@@ -6,12 +6,33 @@
 #include "controller.h"
 #include "takion.h"
 #include "thread.h"
+#include "eventloop.h"
 #include "common.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct chiaki_feedback_sender_stats_t
+{
+	uint64_t state_changes; // controller state updates relevant for feedback
+	uint64_t state_packets; // including the ones sent periodically without a change
+	uint64_t history_packets;
+} ChiakiFeedbackSenderStats;
+
+static inline double chiaki_feedback_sender_stats_history_packets_per_change(ChiakiFeedbackSenderStats *stats)
+{
+	return stats->state_changes ? (double)stats->history_packets / (double)stats->state_changes : 0.0;
+}
+
+/**
+ * Sends the controller state to the console on a separate thread or by a timer on an event loop.
+ *
+ * All history events of a controller state update are sent together in a single history packet.
+ * Once packets have been sent for a change, further changes within interval_min_us are gathered
+ * and sent together when it is over, or earlier if their history events would not fit into the history buffer.
+ * Nothing is sent from chiaki_feedback_sender_set_controller_state() itself.
+ */
 typedef struct chiaki_feedback_sender_t
 {
 	ChiakiLog *log;
@@ -22,6 +43,11 @@ typedef struct chiaki_feedback_sender_t
 
 	ChiakiSeqNum16 history_seq_num;
 	ChiakiFeedbackHistoryBuffer history_buf;
+	size_t history_events_pending; // pushed into history_buf, but not sent yet
+
+	uint64_t interval_min_us;
+	uint64_t change_sent_us; // when packets for a change were sent last
+	ChiakiFeedbackSenderStats stats;
 
 	bool should_stop;
 	ChiakiControllerState controller_state_prev;
@@ -29,9 +55,18 @@ typedef struct chiaki_feedback_sender_t
 	bool controller_state_changed;
 	ChiakiMutex state_mutex;
 	ChiakiCond state_cond;
+
+	ChiakiEventLoop *loop;
+	ChiakiEventLoopTimer timer;
+	uint64_t timer_due_us; // protected by state_mutex
 } ChiakiFeedbackSender;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion);
+/**
+ * @param interval_min_ms min time between packets for controller state changes, 0 to send every change right away
+ * @param loop if not NULL, packets are sent by a timer on loop instead of a separate thread
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, uint32_t interval_min_ms,
+		ChiakiEventLoop *loop);
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state);
 
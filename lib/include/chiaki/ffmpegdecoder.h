@@ -4,6 +4,8 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/framepool.h>
+#include <chiaki/spscqueue.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,31 +13,140 @@ extern "C" {
 
 #include <libavcodec/avcodec.h>
 
+#define CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE 16
+#define CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE 4
+
+// how many packets in the codec are remembered to attribute decoded frames to them
+#define CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT 16
+
 typedef struct chiaki_ffmpeg_decoder_t ChiakiFfmpegDecoder;
 
 typedef void (*ChiakiFfmpegFrameAvailable)(ChiakiFfmpegDecoder *decover, void *user);
 
+typedef enum
+{
+	/**
+	 * Keep up to CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE decoded frames until they are pulled,
+	 * so a consumer that is briefly slow still gets every frame.
+	 */
+	CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE,
+
+	/**
+	 * Keep only the newest decoded frame, replacing any that has not been pulled yet.
+	 */
+	CHIAKI_FFMPEG_DECODER_OUTPUT_LATEST
+} ChiakiFfmpegDecoderOutputPolicy;
+
+/**
+ * Threading and decoding flags to trade latency, throughput and power against each other.
+ */
+typedef enum
+{
+	CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT, // FFmpeg's own defaults
+	CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY, // slice threading only, low delay and fast decoding
+	CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT, // frame and slice threading, each extra frame thread adds a frame of latency
+	CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER // single thread, low delay, fast decoding and no loop filter on non-reference frames
+} ChiakiFfmpegDecoderProfile;
+
+#define CHIAKI_FFMPEG_DECODER_PROFILE_COUNT (CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER + 1)
+
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_profile_name(ChiakiFfmpegDecoderProfile profile);
+
+/**
+ * Apply profile to a codec context that has not been opened yet.
+ * Also meant for frontends that drive FFmpeg themselves.
+ *
+ * @param threads thread count, 0 to let the profile decide
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_profile_apply(ChiakiFfmpegDecoderProfile profile, unsigned int threads, AVCodecContext *codec_context);
+
+typedef struct chiaki_ffmpeg_decoder_stats_t
+{
+	uint64_t packets_decoded;
+	uint64_t packets_dropped; // packet queue was full or decoding failed
+	uint64_t frames_decoded;
+	uint64_t frames_replaced; // decoded, but never pulled because of the output policy
+	uint64_t frames_timed; // frames that decode_latency_us_* are based on
+	uint64_t decode_latency_us_sum; // from avcodec_send_packet() until avcodec_receive_frame() returned the frame
+	uint64_t decode_latency_us_max;
+} ChiakiFfmpegDecoderStats;
+
+/**
+ * Decodes on its own thread: packets are handed over through a bounded queue by the video callbacks,
+ * decoded frames are kept in a small output queue until they are pulled, so neither receiving nor
+ * presenting ever waits for FFmpeg.
+ */
 struct chiaki_ffmpeg_decoder_t
 {
 	ChiakiLog *log;
-	ChiakiMutex mutex;
+	ChiakiFfmpegDecoderProfile profile;
 	AVCodec *av_codec;
-	AVCodecContext *codec_context;
+	AVCodecContext *codec_context; // only touched by the decode thread after init
 	enum AVPixelFormat hw_pix_fmt;
 	AVBufferRef *hw_device_ctx;
-	ChiakiMutex cb_mutex;
 	ChiakiFfmpegFrameAvailable frame_available_cb;
 	void *frame_available_cb_user;
+
+	ChiakiSPSCQueue packet_queue; // of AVPacket *
+	uint64_t submit_timeout_ms; // only touched by the thread calling the video callbacks
+	ChiakiThread decode_thread;
+
+	// decode thread only: pts given to packets and the frame indices they came from
+	int64_t in_flight_pts[CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT];
+	int32_t in_flight_frame_index[CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT];
+	size_t in_flight_next;
+
+	ChiakiMutex mutex; // protects everything below
+	ChiakiFfmpegDecoderOutputPolicy output_policy;
+	AVFrame *output[CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE];
+	size_t output_first;
+	size_t output_count;
+	ChiakiFfmpegDecoderStats stats;
 };
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
-		ChiakiCodec codec, const char *hw_decoder_name,
+		ChiakiCodec codec, const char *hw_decoder_name, ChiakiFfmpegDecoderProfile profile,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
+
+/**
+ * Defaults to CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE. Can be changed at any time.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_output_policy(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderOutputPolicy policy);
+
+/**
+ * Set how long the video callbacks wait for room in the packet queue before dropping a packet.
+ * Must be called from the thread that calls the video callbacks, or before they are called.
+ *
+ * @param timeout_ms UINT64_MAX to never drop packets because decoding falls behind, but block instead
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_submit_timeout(ChiakiFfmpegDecoder *decoder, uint64_t timeout_ms);
+
+/**
+ * The video callbacks only queue the data for the decode thread.
+ * They must always be called from the same thread and return false if the packet had to be dropped.
+ */
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user);
+
+/**
+ * ChiakiVideoFrameCallback that hands frame to FFmpeg by reference instead of having it copied.
+ */
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiVideoFrame *frame, void *user);
+
+/**
+ * Never blocks on decoding.
+ * @return the next decoded frame, to be freed by the caller, or NULL if there is none
+ */
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder);
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
 
+/**
+ * @param frame as returned by chiaki_ffmpeg_decoder_pull_frame()
+ * @return index of the ChiakiVideoFrame that frame was decoded from, e.g. for chiaki_trace_stamp(), or -1 if unknown
+ */
+CHIAKI_EXPORT int32_t chiaki_ffmpeg_decoder_frame_index(AVFrame *frame);
+
 #ifdef __cplusplus
 }
 #endif
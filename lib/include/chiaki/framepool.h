@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_FRAMEPOOL_H
+#define CHIAKI_FRAMEPOOL_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "atomic.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_FRAME_POOL_FRAMES_MAX 32
+
+struct chiaki_frame_pool_t;
+
+/**
+ * Refcounted buffer holding one complete video sample, handed out by a ChiakiFramePool.
+ * As long as a reference is held, the buffer is not reused for another frame.
+ */
+typedef struct chiaki_video_frame_t
+{
+	struct chiaki_frame_pool_t *pool;
+	uint8_t *buf; // buf_size bytes, followed by CHIAKI_VIDEO_BUFFER_PADDING_SIZE zeroed bytes
+	size_t buf_size;
+	int32_t frame_index; // -1 for codec headers
+
+	// internal
+	size_t buf_capacity;
+	ChiakiAtomicU32 refcount;
+	struct chiaki_video_frame_t *next_free;
+} ChiakiVideoFrame;
+
+typedef struct chiaki_frame_pool_stats_t
+{
+	uint64_t frames_allocated; // in use or free
+	uint64_t frames_in_use;
+	uint64_t frames_in_use_max;
+	uint64_t bytes_allocated;
+	uint64_t bytes_allocated_max;
+	uint64_t frame_size_max;
+	uint64_t exhausted; // acquire failed because frames_max frames were in use
+} ChiakiFramePoolStats;
+
+/**
+ * Pool of ChiakiVideoFrames. Buffers are kept and reused once their frame has been released,
+ * growing as needed, so after a few frames no more allocations happen.
+ *
+ * Frames may be released from any thread. The pool itself stays alive until its owner has called
+ * chiaki_frame_pool_free() and all frames have been released, so sinks may hold on to frames
+ * for as long as they like, even after the session has ended.
+ */
+typedef struct chiaki_frame_pool_t
+{
+	ChiakiLog *log;
+	ChiakiMutex mutex;
+	size_t frames_max;
+	ChiakiVideoFrame *free_frames;
+	bool owner_released;
+	ChiakiFramePoolStats stats;
+} ChiakiFramePool;
+
+/**
+ * @param frames_max maximum number of frames in use at the same time
+ */
+CHIAKI_EXPORT ChiakiFramePool *chiaki_frame_pool_new(ChiakiLog *log, size_t frames_max);
+
+/**
+ * Release the owner's reference to pool. Its memory is freed once all frames have been released.
+ */
+CHIAKI_EXPORT void chiaki_frame_pool_free(ChiakiFramePool *pool);
+
+/**
+ * Get a frame with a buffer for size bytes and a refcount of 1.
+ * The padding after size is already zeroed, the contents of buf are undefined.
+ *
+ * @return the frame or NULL if the pool is exhausted or allocation failed
+ */
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_frame_pool_acquire(ChiakiFramePool *pool, size_t size);
+
+CHIAKI_EXPORT void chiaki_frame_pool_get_stats(ChiakiFramePool *pool, ChiakiFramePoolStats *stats);
+
+static inline void chiaki_video_frame_ref(ChiakiVideoFrame *frame)
+{
+	chiaki_atomic_u32_fetch_add(&frame->refcount, 1);
+}
+
+/**
+ * Release a reference. The last one gives the frame back to its pool.
+ */
+CHIAKI_EXPORT void chiaki_video_frame_unref(ChiakiVideoFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_FRAMEPOOL_H
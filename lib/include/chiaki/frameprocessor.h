@@ -6,6 +6,9 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "fec.h"
+#include "gkcrypt.h"
+#include "framepool.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -27,11 +30,27 @@ CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uin
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 
+/**
+ * One contiguous part of a frame, see chiaki_frame_processor_flush_iov()
+ */
+typedef struct chiaki_frame_iovec_t
+{
+	uint8_t *buf;
+	size_t size;
+} ChiakiFrameIOVec;
+
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
+	/**
+	 * The payloads of source units without their 2 byte header go back to back, buf_size_per_unit - 2 bytes each,
+	 * so a frame whose units are all complete is assembled without moving anything.
+	 * Fec units are at their slot of buf_stride_per_unit bytes.
+	 */
 	uint8_t *frame_buf;
 	size_t frame_buf_size;
+	ChiakiFramePool *frame_pool; // if not NULL, frame_buf belongs to frame, see chiaki_frame_processor_flush_frame()
+	ChiakiVideoFrame *frame;
 	size_t buf_size_per_unit;
 	size_t buf_stride_per_unit;
 	unsigned int units_source_expected;
@@ -40,8 +59,10 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_received;
 	ChiakiFrameUnit *unit_slots;
 	size_t unit_slots_size;
+	ChiakiFrameIOVec *iov; // unit_slots_size entries
 	bool flushed; // whether we have already flushed the current frame, i.e. are only interested in stats, not data.
 	ChiakiStreamStats stream_stats;
+	ChiakiFecCache fec_cache;
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -54,16 +75,54 @@ typedef enum chiaki_frame_flush_result_t {
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
+/**
+ * Assemble frames in buffers from pool instead of an internal one.
+ * Must be called before the first frame, pool must outlive frame_processor.
+ */
+static inline void chiaki_frame_processor_set_frame_pool(ChiakiFrameProcessor *frame_processor, ChiakiFramePool *pool)
+{
+	frame_processor->frame_pool = pool;
+}
+
 CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 
 /**
+ * Same as chiaki_frame_processor_alloc_frame() and chiaki_frame_processor_put_unit(), but packet->data is still encrypted.
+ * Units are decrypted with gkcrypt at key_pos straight into their slot in the frame buffer, packet->data is not modified.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame_encrypted(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit_encrypted(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos);
+
+/**
+ * Units are only moved if some are missing or shorter than others before the last one.
+ *
  * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer into the internal buffer of frame_processor.
+ * It is followed by CHIAKI_VIDEO_BUFFER_PADDING_SIZE zero bytes.
  * MUST NOT be used after the next call to this frame processor!
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
+/**
+ * Same as chiaki_frame_processor_flush(), but without compacting the units into one contiguous buffer.
+ * Concatenating all parts in order gives the same frame.
+ *
+ * @param iov unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer to an internal array of iov_count parts.
+ * Both the array and the parts MUST NOT be used after the next call to this frame processor!
+ * @param frame_size will receive the sum of all part sizes
+ */
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_iov(ChiakiFrameProcessor *frame_processor, ChiakiFrameIOVec **iov, size_t *iov_count, size_t *frame_size);
+
+/**
+ * Same as chiaki_frame_processor_flush(), but hand out the pooled frame that the units were assembled in.
+ * Only for frame processors with a frame pool, see chiaki_frame_processor_set_frame_pool().
+ * Further units of the same frame only count for the stats.
+ *
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive the frame, the reference is passed to the caller
+ */
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_frame(ChiakiFrameProcessor *frame_processor, ChiakiVideoFrame **frame);
+
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
 	return frame_processor->units_source_received + frame_processor->units_fec_received
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_GF8_H
+#define CHIAKI_GF8_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Arithmetic in GF(2^8) with the primitive polynomial 0x11d, which is the field used by jerasure for CHIAKI_FEC_WORDSIZE 8.
+ */
+
+typedef enum chiaki_gf8_impl_t
+{
+	CHIAKI_GF8_IMPL_SCALAR = 0,
+	CHIAKI_GF8_IMPL_SSSE3,
+	CHIAKI_GF8_IMPL_AVX2,
+	CHIAKI_GF8_IMPL_NEON,
+	CHIAKI_GF8_IMPL_COUNT
+} ChiakiGF8Impl;
+
+CHIAKI_EXPORT const char *chiaki_gf8_impl_name(ChiakiGF8Impl impl);
+
+/**
+ * @return whether impl has been compiled in and is supported by the cpu we are running on
+ */
+CHIAKI_EXPORT bool chiaki_gf8_impl_supported(ChiakiGF8Impl impl);
+
+/**
+ * @return the fastest implementation supported at runtime
+ */
+CHIAKI_EXPORT ChiakiGF8Impl chiaki_gf8_impl_best();
+
+CHIAKI_EXPORT uint8_t chiaki_gf8_mul(uint8_t a, uint8_t b);
+
+/**
+ * Multiply size bytes of src by c and store the result in dst (add == false)
+ * or xor it onto dst (add == true).
+ *
+ * @param impl must be supported
+ */
+CHIAKI_EXPORT void chiaki_gf8_region_mul_impl(ChiakiGF8Impl impl, uint8_t *dst, const uint8_t *src, uint8_t c, size_t size, bool add);
+
+static inline void chiaki_gf8_region_mul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size, bool add)
+{
+	chiaki_gf8_region_mul_impl(chiaki_gf8_impl_best(), dst, src, c, size, add);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_GF8_H
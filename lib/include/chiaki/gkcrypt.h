@@ -6,10 +6,16 @@
 #include "common.h"
 #include "log.h"
 #include "thread.h"
+#include "atomic.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,30 +26,97 @@ extern "C" {
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS 45000
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_IV_OFFSET 44910
 
+/**
+ * Number of keyed gmac cipher contexts kept per ChiakiGKCrypt.
+ * Gmac key index i always uses slot i % CHIAKI_GKCRYPT_GMAC_CTX_COUNT, so packets from the current
+ * and the previous key index can be interleaved without rekeying.
+ */
+#define CHIAKI_GKCRYPT_GMAC_CTX_COUNT 2
+
 typedef struct chiaki_key_state_t
 {
    uint64_t prev;
 } ChiakiKeyState;
 
+typedef struct chiaki_gkcrypt_gmac_ctx_t
+{
+	bool keyed;
+	uint64_t key_index;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context gcm;
+#else
+	struct evp_cipher_ctx_st *ctx;
+#endif
+} ChiakiGKCryptGmacCtx;
+
+/**
+ * AES-128 context keyed with key_base, used to encrypt batches of counter blocks into key stream.
+ * The Takion counter is iv + block index as a 128 bit little endian integer, which is why this is
+ * ECB over explicit counter blocks rather than the big endian increment of standard CTR mode.
+ */
+typedef struct chiaki_gkcrypt_key_stream_ctx_t
+{
+	bool keyed;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context aes;
+#else
+	struct evp_cipher_ctx_st *ctx;
+#endif
+} ChiakiGKCryptKeyStreamCtx;
+
+typedef struct chiaki_gkcrypt_gmac_request_t
+{
+	uint64_t key_pos;
+	const uint8_t *buf;
+	size_t buf_size;
+
+	/**
+	 * If not NULL, the calculated gmac is compared to this.
+	 */
+	const uint8_t *gmac_expected;
+
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE]; // out
+	bool valid; // out, whether gmac was calculated and matches gmac_expected if given
+} ChiakiGKCryptGmacRequest;
+
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
-	uint8_t *key_buf; // circular buffer of the ctr mode key stream
+	/**
+	 * Lock-free single-producer/single-consumer ring of the ctr mode key stream.
+	 * The key stream for key pos p is at key_buf[p % key_buf_size] while key_buf_key_pos_min <= p < key_buf_key_pos_end.
+	 * The producer is the GKCrypt thread, the consumer is whoever calls chiaki_gkcrypt_get_key_stream()
+	 * or chiaki_gkcrypt_decrypt(), which must not happen concurrently on the same ChiakiGKCrypt.
+	 */
+	uint8_t *key_buf;
 	size_t key_buf_size;
-	size_t key_buf_populated; // size of key_buf that is already populated (on startup)
-	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf
-	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
-	uint64_t last_key_pos;        // last key pos that has been requested
+	ChiakiAtomicU64 key_buf_key_pos_min; // written by producer, raised before a chunk is overwritten
+	ChiakiAtomicU64 key_buf_key_pos_end; // written by producer, raised after a chunk has been generated
+	ChiakiAtomicU64 key_buf_watermark; // written by producer, the consumer wakes it up once it requests beyond this
+	ChiakiAtomicU64 key_buf_reader_pos; // written by consumer, key pos it is currently reading from the ring or UINT64_MAX
+	ChiakiAtomicU64 last_key_pos; // written by consumer, end of the highest key pos that has been requested
+	uint64_t key_buf_rate; // producer only, estimated key stream consumption in bytes per second, 0 if unknown
+	uint64_t key_buf_rate_key_pos; // producer only, last_key_pos at the last rate sample
+	uint64_t key_buf_rate_time_ms; // producer only, time of the last rate sample
 	bool key_buf_thread_stop;
-	ChiakiMutex key_buf_mutex;
+	ChiakiMutex key_buf_mutex; // only protects key_buf_thread_stop and the producer's wait on key_buf_cond
 	ChiakiCond key_buf_cond;
 	ChiakiThread key_buf_thread;
+	ChiakiGKCryptKeyStreamCtx key_stream_ctx_producer; // only used by key_buf_thread
+	ChiakiGKCryptKeyStreamCtx key_stream_ctx; // used by the consumer and chiaki_gkcrypt_gen_key_stream()
 
 	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_gmac_index_current;
+
+	/**
+	 * Cipher contexts for gmac, only reinitialized with a new iv for each packet.
+	 * Not synchronized, so gmac calls on the same ChiakiGKCrypt must not happen concurrently.
+	 */
+	ChiakiGKCryptGmacCtx gmac_ctx[CHIAKI_GKCRYPT_GMAC_CTX_COUNT];
+
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
@@ -55,15 +128,35 @@ struct chiaki_session_t;
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
+/**
+ * Generate key stream without going through key_buf.
+ * Must not be called concurrently with chiaki_gkcrypt_get_key_stream() or chiaki_gkcrypt_decrypt() on the same ChiakiGKCrypt.
+ *
+ * @param key_pos and buf_size must be multiples of CHIAKI_GKCRYPT_BLOCK_SIZE
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * Same as chiaki_gkcrypt_decrypt(), but write the result to dst instead of decrypting in place.
+ * src and dst may be the same, but must not overlap otherwise.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt_to(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *dst, size_t size);
 static inline ChiakiErrorCode chiaki_gkcrypt_encrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size) { return chiaki_gkcrypt_decrypt(gkcrypt, key_pos, buf, buf_size); }
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *key_base, const uint8_t *iv, uint8_t *key_out);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
+/**
+ * Calculate (and optionally verify) the gmacs of multiple buffers at once.
+ * The key for the highest key pos in reqs is derived first, so older key indices are only ever handled as temporary keys.
+ *
+ * @return an error if any gmac could not be calculated, the valid member of each request tells which ones failed or did not match
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGmacRequest *reqs, size_t count);
+
 static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_NETIMPAIR_H
+#define CHIAKI_NETIMPAIR_H
+
+#include "common.h"
+#include "packetpool.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Environment variable that is read by the stream connection if the connect info has no impairment,
+ * holding a spec for chiaki_net_impair_config_parse().
+ */
+#define CHIAKI_NET_IMPAIR_ENV "CHIAKI_NET_IMPAIR"
+
+/**
+ * Max number of packets held back at once, more are dropped.
+ */
+#define CHIAKI_NET_IMPAIR_QUEUE_SIZE 4096
+
+/**
+ * Artificial network conditions applied to received datagrams. All probabilities are in [0, 1].
+ * A zeroed config passes everything through unchanged.
+ */
+typedef struct chiaki_net_impair_config_t
+{
+	uint64_t seed;
+
+	/**
+	 * Gilbert-Elliott loss: a two-state Markov chain that moves from good to bad with ge_p and back with ge_r
+	 * per packet, dropping with loss_good or loss_bad depending on the state.
+	 */
+	double ge_p;
+	double ge_r;
+	double loss_good;
+	double loss_bad;
+
+	double duplicate; // probability of delivering a packet twice
+	double reorder; // probability of holding a packet back by an extra reorder_delay_ms
+	uint32_t reorder_delay_ms;
+	uint32_t delay_ms; // constant one-way delay
+	uint32_t jitter_ms; // uniform random delay on top of delay_ms, also reorders
+
+	/**
+	 * Token bucket: tokens flow in at rate_kbps up to burst_bytes.
+	 * Packets that find too few tokens wait for them, unless that would take longer than queue_ms, then they are dropped.
+	 * rate_kbps = 0 disables the limit, burst_bytes = 0 means one max size packet and queue_ms = 0 an unlimited queue.
+	 */
+	uint32_t rate_kbps;
+	uint32_t burst_bytes;
+	uint32_t queue_ms;
+} ChiakiNetImpairConfig;
+
+/**
+ * Parse a comma-separated list of key=value pairs like "loss=2,burst=3,delay=20,jitter=5,rate=20000".
+ *
+ * Keys: seed, loss (mean loss in percent), burst (mean loss burst length in packets), ge_p, ge_r, loss_good, loss_bad,
+ * dup, reorder (both in percent), reorder_delay, delay, jitter (all in ms), rate (kbps), bucket (bytes), queue (ms).
+ * loss and burst are a shortcut for the Gilbert-Elliott parameters with loss_good = 0 and loss_bad = 1.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_config_parse(ChiakiNetImpairConfig *config, const char *spec);
+
+/**
+ * @return whether config would change anything at all
+ */
+CHIAKI_EXPORT bool chiaki_net_impair_config_active(const ChiakiNetImpairConfig *config);
+
+typedef struct chiaki_net_impair_stats_t
+{
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t dropped_loss;
+	uint64_t dropped_queue; // token bucket queue or CHIAKI_NET_IMPAIR_QUEUE_SIZE exceeded
+	uint64_t duplicated;
+	uint64_t reordered;
+} ChiakiNetImpairStats;
+
+typedef struct chiaki_net_impair_entry_t
+{
+	uint64_t due_us;
+	uint64_t order; // keeps packets that are due at the same time in arrival order
+	ChiakiPacketBuf *packet;
+} ChiakiNetImpairEntry;
+
+/**
+ * Sits between the socket and packet handling, deciding for each datagram whether,
+ * when and how often it is handed on.
+ *
+ * Deterministic for a given seed and sequence of push/pop times. Not thread-safe.
+ */
+typedef struct chiaki_net_impair_t
+{
+	ChiakiNetImpairConfig config;
+	ChiakiPacketPool *pool;
+	uint64_t rng_state;
+	bool ge_bad;
+	int64_t tokens_bits; // negative while packets wait for tokens
+	uint64_t tokens_us;
+	uint64_t order_next;
+	ChiakiNetImpairEntry *heap; // min-heap by due_us, then order
+	size_t heap_count;
+	ChiakiNetImpairStats stats;
+} ChiakiNetImpair;
+
+/**
+ * @param pool buffers of dropped packets are released to it and duplicates are acquired from it
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_init(ChiakiNetImpair *impair, const ChiakiNetImpairConfig *config, ChiakiPacketPool *pool);
+
+/**
+ * Release all packets that are still held back. stats remain valid.
+ */
+CHIAKI_EXPORT void chiaki_net_impair_fini(ChiakiNetImpair *impair);
+
+/**
+ * Take ownership of a received packet, which is either dropped or queued for chiaki_net_impair_pop().
+ */
+CHIAKI_EXPORT void chiaki_net_impair_push(ChiakiNetImpair *impair, ChiakiPacketBuf *packet, uint64_t now_us);
+
+/**
+ * @return the next packet that is due at now_us with ownership, or NULL if there is none
+ */
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_net_impair_pop(ChiakiNetImpair *impair, uint64_t now_us);
+
+/**
+ * @return when the next held back packet is due or UINT64_MAX if none is held
+ */
+static inline uint64_t chiaki_net_impair_next_due_us(ChiakiNetImpair *impair)
+{
+	return impair->heap_count ? impair->heap[0].due_us : UINT64_MAX;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_NETIMPAIR_H
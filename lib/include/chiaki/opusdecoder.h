@@ -22,6 +22,8 @@ typedef struct chiaki_opus_decoder_t
 	ChiakiAudioHeader audio_header;
 	int16_t *pcm_buf;
 	size_t pcm_buf_size;
+	uint64_t frames_recovered_fec; // lost frames restored from in-band FEC data of the next frame
+	uint64_t frames_concealed; // lost frames replaced by packet loss concealment
 
 	ChiakiOpusDecoderSettingsCallback settings_cb;
 	ChiakiOpusDecoderFrameCallback frame_cb;
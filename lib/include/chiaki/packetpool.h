@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PACKETPOOL_H
+#define CHIAKI_PACKETPOOL_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum size of a single received datagram
+ */
+#define CHIAKI_PACKET_BUF_SIZE 1500
+
+typedef struct chiaki_packet_buf_t
+{
+	struct chiaki_packet_buf_t *next; // free list, only valid while inside the pool
+	bool pooled; // false if this buf was allocated separately because the pool was exhausted
+	size_t size; // size of the data actually used
+	uint8_t data[CHIAKI_PACKET_BUF_SIZE];
+} ChiakiPacketBuf;
+
+/**
+ * Fixed-size pool of packet buffers that are recycled instead of being allocated per datagram.
+ *
+ * Not thread-safe, all acquires and releases must happen on the same thread.
+ */
+typedef struct chiaki_packet_pool_t
+{
+	ChiakiPacketBuf *bufs;
+	size_t bufs_count;
+	ChiakiPacketBuf *free_list;
+	size_t free_count;
+
+	/**
+	 * Number of times a buffer had to be allocated outside the pool
+	 */
+	uint64_t exhausted_count;
+} ChiakiPacketPool;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t count);
+
+/**
+ * All pooled buffers must have been released before.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool);
+
+/**
+ * Take a buffer out of the pool.
+ * If the pool is exhausted, a separate buffer is allocated and exhausted_count is incremented.
+ *
+ * @return the buffer with size set to CHIAKI_PACKET_BUF_SIZE or NULL if allocation failed
+ */
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_pool_acquire(ChiakiPacketPool *pool);
+
+/**
+ * Give a buffer acquired from pool back.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_release(ChiakiPacketPool *pool, ChiakiPacketBuf *buf);
+
+static inline size_t chiaki_packet_pool_available(ChiakiPacketPool *pool) { return pool->free_count; }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PACKETPOOL_H
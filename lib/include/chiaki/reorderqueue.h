@@ -123,6 +123,65 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
  */
 CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t index);
 
+/**
+ * Reorder queues specialized for ChiakiSeqNum16 and ChiakiSeqNum32, e.g. ChiakiReorderQueue32 with chiaki_reorder_queue_32_push().
+ *
+ * They behave like ChiakiReorderQueue, but compare sequence numbers inline instead of through function pointers
+ * and keep a bitmap of occupied slots, so chiaki_reorder_queue_X_next_missing() finds the first gap without visiting every entry.
+ * size_exp may be at most bits - 1, so the window never spans more than half of the sequence number space.
+ *
+ * The functions are the same as for ChiakiReorderQueue, except:
+ * - chiaki_reorder_queue_X_peek() accepts NULL for seq_num and user
+ * - chiaki_reorder_queue_X_drop() frees the slot, so the queue shrinks if it was the last one
+ * - chiaki_reorder_queue_X_next_missing() returns the index of the first empty slot, or count if there is none
+ */
+#define CHIAKI_REORDER_QUEUE_DECLARE(bits) \
+\
+typedef struct chiaki_reorder_queue_##bits##_t \
+{ \
+	size_t size_exp; \
+	void **elems; \
+	uint64_t *set; /* bitmap of occupied slots */ \
+	ChiakiSeqNum##bits begin; \
+	size_t count; \
+	ChiakiReorderQueueDropStrategy drop_strategy; \
+	ChiakiReorderQueueDropCb drop_cb; \
+	void *drop_cb_user; \
+} ChiakiReorderQueue##bits; \
+\
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_##bits##_init(ChiakiReorderQueue##bits *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start); \
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_fini(ChiakiReorderQueue##bits *queue); \
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_push(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits seq_num, void *user); \
+CHIAKI_EXPORT bool chiaki_reorder_queue_##bits##_pull(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits *seq_num, void **user); \
+CHIAKI_EXPORT bool chiaki_reorder_queue_##bits##_peek(ChiakiReorderQueue##bits *queue, size_t index, ChiakiSeqNum##bits *seq_num, void **user); \
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_drop(ChiakiReorderQueue##bits *queue, size_t index); \
+CHIAKI_EXPORT size_t chiaki_reorder_queue_##bits##_next_missing(ChiakiReorderQueue##bits *queue); \
+\
+static inline void chiaki_reorder_queue_##bits##_set_drop_strategy(ChiakiReorderQueue##bits *queue, ChiakiReorderQueueDropStrategy drop_strategy) \
+{ \
+	queue->drop_strategy = drop_strategy; \
+} \
+\
+static inline void chiaki_reorder_queue_##bits##_set_drop_cb(ChiakiReorderQueue##bits *queue, ChiakiReorderQueueDropCb cb, void *user) \
+{ \
+	queue->drop_cb = cb; \
+	queue->drop_cb_user = user; \
+} \
+\
+static inline size_t chiaki_reorder_queue_##bits##_size(ChiakiReorderQueue##bits *queue) \
+{ \
+	return ((size_t)1) << queue->size_exp; \
+} \
+\
+static inline size_t chiaki_reorder_queue_##bits##_count(ChiakiReorderQueue##bits *queue) \
+{ \
+	return queue->count; \
+}
+
+CHIAKI_REORDER_QUEUE_DECLARE(16)
+CHIAKI_REORDER_QUEUE_DECLARE(32)
+#undef CHIAKI_REORDER_QUEUE_DECLARE
+
 #ifdef __cplusplus
 }
 #endif
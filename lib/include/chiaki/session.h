@@ -14,6 +14,7 @@
 #include "audio.h"
 #include "controller.h"
 #include "stoppipe.h"
+#include "framepool.h"
 
 #include <stdint.h>
 
@@ -80,6 +81,12 @@ typedef struct chiaki_connect_info_t
 	bool enable_keyboard;
 	bool enable_dualsense;
 	bool enable_emulated_rumble;
+	bool disable_av_pipeline; // Process AV packets directly on the receive thread instead of in separate decrypt and decode threads.
+	uint32_t video_jitter_buffer_max_ms; // Max time to hold back an incomplete video frame for reordered packets, 0 to disable.
+	uint32_t feedback_interval_min_ms; // Min time between feedback packets for controller state changes, 0 to send every change right away.
+	bool event_loop; // Run Takion re-sends, Congestion Control and the Feedback Sender on one event loop thread instead of a thread each.
+	const char *capture_filename; // If non-null, received stream datagrams and keys are written to this file for chiaki-replay.
+	const ChiakiNetImpairConfig *net_impair; // If non-null, received stream datagrams are impaired like this for testing, otherwise CHIAKI_NET_IMPAIR_ENV is checked.
 } ChiakiConnectInfo;
 
 
@@ -166,6 +173,14 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * Alternative to ChiakiVideoSampleCallback, taking precedence if set.
+ * frame is only borrowed for the duration of the call. To keep it, e.g. for asynchronous decoding,
+ * take a reference with chiaki_video_frame_ref() and release it with chiaki_video_frame_unref() when done.
+ * @return same as for ChiakiVideoSampleCallback
+ */
+typedef bool (*ChiakiVideoFrameCallback)(ChiakiVideoFrame *frame, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -183,6 +198,13 @@ typedef struct chiaki_session_t
 		bool video_profile_auto_downgrade;
 		bool enable_keyboard;
 		bool enable_dualsense;
+		bool disable_av_pipeline;
+		uint32_t video_jitter_buffer_max_ms;
+		uint32_t feedback_interval_min_ms;
+		bool event_loop;
+		char *capture_filename;
+		bool net_impair_set;
+		ChiakiNetImpairConfig net_impair;
 	} connect_info;
 
 	ChiakiTarget target;
@@ -203,6 +225,8 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoFrameCallback video_frame_cb;
+	void *video_frame_cb_user;
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
 
@@ -240,6 +264,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_set_text(ChiakiSession *se
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
 
+/**
+ * Get the current estimate of the available bandwidth on the path from the console.
+ * May be called from any thread, also after the session has finished.
+ */
+CHIAKI_EXPORT void chiaki_session_get_bandwidth_estimate(ChiakiSession *session, ChiakiBandwidthEstimate *estimate);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -252,6 +282,12 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+static inline void chiaki_session_set_video_frame_cb(ChiakiSession *session, ChiakiVideoFrameCallback cb, void *user)
+{
+	session->video_frame_cb = cb;
+	session->video_frame_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
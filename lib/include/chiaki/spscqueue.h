@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_SPSCQUEUE_H
+#define CHIAKI_SPSCQUEUE_H
+
+#include "common.h"
+#include "atomic.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Bounded lock-free queue of fixed-size slots for exactly one producer and one consumer thread.
+ *
+ * Slots are written and read in place: the producer fills the slot returned by chiaki_spsc_queue_write_slot()
+ * and publishes it with chiaki_spsc_queue_push(), the consumer gets it with chiaki_spsc_queue_read_slot()
+ * and gives it back with chiaki_spsc_queue_pop(). Contents of a slot persist across uses,
+ * so slots may own buffers that are reused.
+ *
+ * Pushing and popping never lock. The mutex is only taken when the other side is actually waiting.
+ */
+typedef struct chiaki_spsc_queue_t
+{
+	uint8_t *slots;
+	size_t slot_size;
+	size_t count; // power of 2
+	ChiakiAtomicU64 head; // next slot to read, written by the consumer only
+	ChiakiAtomicU64 tail; // next slot to write, written by the producer only
+	ChiakiAtomicU32 consumer_waiting;
+	ChiakiAtomicU32 producer_waiting;
+	ChiakiAtomicU32 closed;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+} ChiakiSPSCQueue;
+
+/**
+ * @param count number of slots, will be rounded up to a power of 2
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_init(ChiakiSPSCQueue *queue, size_t slot_size, size_t count);
+CHIAKI_EXPORT void chiaki_spsc_queue_fini(ChiakiSPSCQueue *queue);
+
+/**
+ * Producer only.
+ * @return the next free slot or NULL if the queue is full
+ */
+CHIAKI_EXPORT void *chiaki_spsc_queue_write_slot(ChiakiSPSCQueue *queue);
+
+/**
+ * Producer only. Publish the slot returned by the last chiaki_spsc_queue_write_slot().
+ */
+CHIAKI_EXPORT void chiaki_spsc_queue_push(ChiakiSPSCQueue *queue);
+
+/**
+ * Consumer only.
+ * @return the oldest published slot or NULL if the queue is empty
+ */
+CHIAKI_EXPORT void *chiaki_spsc_queue_read_slot(ChiakiSPSCQueue *queue);
+
+/**
+ * Consumer only. Release the slot returned by the last chiaki_spsc_queue_read_slot().
+ */
+CHIAKI_EXPORT void chiaki_spsc_queue_pop(ChiakiSPSCQueue *queue);
+
+/**
+ * Consumer only. Block until a slot can be read.
+ * @param timeout_ms UINT64_MAX to wait until a slot can be read or the queue is closed
+ * @return CHIAKI_ERR_SUCCESS, CHIAKI_ERR_TIMEOUT or CHIAKI_ERR_CANCELED if the queue has been closed
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_wait_readable(ChiakiSPSCQueue *queue, uint64_t timeout_ms);
+
+/**
+ * Producer only. Block until a slot can be written.
+ * @param timeout_ms UINT64_MAX to wait until a slot can be written or the queue is closed
+ * @return CHIAKI_ERR_SUCCESS, CHIAKI_ERR_TIMEOUT or CHIAKI_ERR_CANCELED if the queue has been closed
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_wait_writable(ChiakiSPSCQueue *queue, uint64_t timeout_ms);
+
+/**
+ * Wake up and cancel all current and future waits. Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_spsc_queue_close(ChiakiSPSCQueue *queue);
+
+static inline bool chiaki_spsc_queue_is_closed(ChiakiSPSCQueue *queue)
+{
+	return chiaki_atomic_u32_load_acquire(&queue->closed) != 0;
+}
+
+/**
+ * Number of published slots that have not been popped yet. Exact only when called from the producer or consumer.
+ */
+static inline size_t chiaki_spsc_queue_depth(ChiakiSPSCQueue *queue)
+{
+	// head first, so the difference can never become negative
+	uint64_t head = chiaki_atomic_u64_load_acquire(&queue->head);
+	return (size_t)(chiaki_atomic_u64_load_acquire(&queue->tail) - head);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SPSCQUEUE_H
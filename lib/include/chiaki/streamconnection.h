@@ -10,7 +10,10 @@
 #include "gkcrypt.h"
 #include "audioreceiver.h"
 #include "videoreceiver.h"
+#include "avpipeline.h"
 #include "congestioncontrol.h"
+#include "capture.h"
+#include "eventloop.h"
 
 #include <stdbool.h>
 
@@ -30,10 +33,25 @@ typedef struct chiaki_stream_connection_t
 	ChiakiGKCrypt *gkcrypt_remote;
 
 	ChiakiPacketStats packet_stats;
+	ChiakiBandwidthEstimator bandwidth_estimator; // valid for the whole lifetime, reset on run
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
 	ChiakiAudioReceiver *haptics_receiver;
 
+	/**
+	 * Only initialized if av_pipeline_active is true, otherwise AV packets are processed inline on the Takion thread.
+	 * av_pipeline_active only changes while the Takion thread is not running.
+	 */
+	ChiakiAVPipeline av_pipeline;
+	bool av_pipeline_active;
+
+	/**
+	 * Only initialized if event_loop_active is true, which it is during run if the session's connect_info.event_loop is set.
+	 * Takion re-sends, Congestion Control and the Feedback Sender run on it.
+	 */
+	ChiakiEventLoop event_loop;
+	bool event_loop_active;
+
 	ChiakiFeedbackSender feedback_sender;
 	/**
 	 * whether feedback_sender is initialized
@@ -61,6 +79,21 @@ typedef struct chiaki_stream_connection_t
 	bool should_stop;
 	bool remote_disconnected;
 	char *remote_disconnect_reason;
+
+	/**
+	 * Initialized during run if the session's connect_info.capture_filename is set.
+	 */
+	ChiakiCaptureWriter capture;
+	bool capture_active;
+
+	ChiakiCaptureReader *replay;
+	bool replay_realtime;
+	bool replay_finished; // protected by state_mutex
+
+	/**
+	 * Stats of the last video receiver, saved when it is freed at the end of chiaki_stream_connection_run().
+	 */
+	ChiakiVideoReceiverStats video_receiver_stats;
 } ChiakiStreamConnection;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session);
@@ -71,6 +104,15 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection);
 
+/**
+ * Make the next chiaki_stream_connection_run() play back a capture instead of connecting.
+ * The session's handshake key is replaced by the captured one and nothing is sent.
+ * Run returns CHIAKI_ERR_SUCCESS once the end of the capture has been reached.
+ *
+ * @param realtime whether to deliver the datagrams with their captured timing or as fast as possible
+ */
+CHIAKI_EXPORT void chiaki_stream_connection_set_replay(ChiakiStreamConnection *stream_connection, ChiakiCaptureReader *replay, bool realtime);
+
 /**
  * To be called from a thread other than the one chiaki_stream_connection_run() is running on to stop stream_connection
  */
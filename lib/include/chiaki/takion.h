@@ -12,6 +12,10 @@
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "packetpool.h"
+#include "capture.h"
+#include "netimpair.h"
+#include "eventloop.h"
 
 #include <stdbool.h>
 
@@ -71,7 +75,8 @@ typedef enum {
 	CHIAKI_TAKION_EVENT_TYPE_DISCONNECT,
 	CHIAKI_TAKION_EVENT_TYPE_DATA,
 	CHIAKI_TAKION_EVENT_TYPE_DATA_ACK,
-	CHIAKI_TAKION_EVENT_TYPE_AV
+	CHIAKI_TAKION_EVENT_TYPE_AV,
+	CHIAKI_TAKION_EVENT_TYPE_AV_DEADLINE // the time set with chiaki_takion_set_av_deadline() has come
 } ChiakiTakionEventType;
 
 typedef struct chiaki_takion_event_t
@@ -108,8 +113,77 @@ typedef struct chiaki_takion_connect_info_t
 	bool enable_crypt;
 	bool enable_dualsense;
 	uint8_t protocol_version;
+
+	/**
+	 * If non-null, all received datagrams and the local tag are written to it.
+	 */
+	ChiakiCaptureWriter *capture;
+
+	/**
+	 * If non-null, no socket is created at all. Datagrams are read from this capture instead
+	 * and everything that would be sent is discarded. sa and sa_len are ignored.
+	 */
+	ChiakiCaptureReader *replay;
+
+	/**
+	 * Deliver replayed datagrams with their captured timing instead of as fast as possible.
+	 */
+	bool replay_realtime;
+
+	/**
+	 * If non-null and active, received datagrams are passed through a ChiakiNetImpair with this config
+	 * after the handshake, for testing.
+	 */
+	const ChiakiNetImpairConfig *net_impair;
+
+	/**
+	 * Round-trip time measured before, e.g. by Senkusha, to start re-sending unacked data with.
+	 * If 0, the time of the handshake is used.
+	 */
+	uint64_t rtt_us;
+
+	/**
+	 * Capacity of the reorder queue for received data as an exponent of 2, 0 for the default of 16 entries.
+	 * Queued packets hold buffers of the packet pool, which allocates more if a large queue exhausts it.
+	 */
+	size_t data_queue_size_exp;
+
+	/**
+	 * If non-null, unacked data is re-sent by a timer on this loop instead of a separate thread.
+	 * Must keep running until chiaki_takion_close() returned.
+	 */
+	ChiakiEventLoop *event_loop;
 } ChiakiTakionConnectInfo;
 
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t syscalls; // number of successful receive calls on the socket
+	uint64_t packets; // number of datagrams received and handed on in total
+	uint64_t pool_exhausted; // number of times a packet buffer had to be allocated outside of the pool
+} ChiakiTakionRecvStats;
+
+static inline double chiaki_takion_recv_stats_packets_per_syscall(ChiakiTakionRecvStats *stats)
+{
+	return stats->syscalls ? (double)stats->packets / (double)stats->syscalls : 0.0;
+}
+
+/**
+ * MAC still to be calculated for a packet in the send queue.
+ */
+typedef struct chiaki_takion_send_queue_mac_t
+{
+	bool pending;
+	uint64_t key_pos;
+	size_t mac_offset;
+	int key_pos_offset; // if >= 0, the key pos at this offset is zeroed while calculating the MAC
+} ChiakiTakionSendQueueMac;
+
+typedef struct chiaki_takion_send_stats_t
+{
+	uint64_t syscalls; // number of send calls on the socket
+	uint64_t packets; // number of datagrams sent in total, not counting re-sends from the send buffer
+} ChiakiTakionSendStats;
+
 
 typedef struct chiaki_takion_t
 {
@@ -137,12 +211,31 @@ typedef struct chiaki_takion_t
 
 	ChiakiGKCrypt *gkcrypt_local; // if NULL (default), no gmac is calculated and nothing is encrypted
 	uint64_t key_pos_local;
+
+	/**
+	 * Guards key_pos_local, seq_num_local and the send queue, so an outbound packet gets its key pos, seq num and MAC
+	 * under a single lock and packets leave in key pos order.
+	 */
 	ChiakiMutex gkcrypt_local_mutex;
 
+	/**
+	 * Outbound packets are formatted and MACed in place in these buffers and sent together once the queue is flushed,
+	 * which happens after every packet unless chiaki_takion_send_begin() is holding it.
+	 * Packets that are not kept for resending get their MACs only at the flush, all in one batch.
+	 */
+	ChiakiPacketBuf *send_queue;
+	ChiakiTakionSendQueueMac *send_queue_macs; // parallel to send_queue
+	size_t send_queue_count;
+	unsigned int send_queue_holds;
+	ChiakiTakionSendStats send_stats;
+
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
-	ChiakiReorderQueue data_queue;
+	ChiakiReorderQueue32 data_queue;
+	size_t data_queue_size_exp;
+	ChiakiEventLoop *event_loop;
 	ChiakiTakionSendBuffer send_buffer;
+	uint64_t rtt_us; // initial round-trip time for send_buffer
 
 	ChiakiTakionCallback cb;
 	void *cb_user;
@@ -152,8 +245,7 @@ typedef struct chiaki_takion_t
 	uint32_t tag_local;
 	uint32_t tag_remote;
 
-	ChiakiSeqNum32 seq_num_local;
-	ChiakiMutex seq_num_local_mutex;
+	ChiakiSeqNum32 seq_num_local; // guarded by gkcrypt_local_mutex
 
 	/**
 	 * Advertised Receiver Window Credit
@@ -165,6 +257,31 @@ typedef struct chiaki_takion_t
 	ChiakiKeyState key_state;
 
 	bool enable_dualsense;
+
+	/**
+	 * Buffers for received datagrams, only used from the Takion thread.
+	 */
+	ChiakiPacketPool packet_pool;
+
+	/**
+	 * Only written by the Takion thread.
+	 */
+	ChiakiTakionRecvStats recv_stats;
+
+	ChiakiCaptureWriter *capture;
+	ChiakiCaptureReader *replay;
+	bool replay_realtime;
+	uint64_t replay_start_us;
+
+	bool net_impair_enabled;
+	ChiakiNetImpairConfig net_impair_config;
+
+	uint64_t av_deadline_us; // only used from the Takion thread, UINT64_MAX if not set
+
+	/**
+	 * Only used from the Takion thread, stats can be read after the thread has finished.
+	 */
+	ChiakiNetImpair net_impair;
 } ChiakiTakion;
 
 
@@ -180,6 +297,29 @@ static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *
 	takion->gkcrypt_remote = gkcrypt_remote;
 }
 
+/**
+ * Deliver a CHIAKI_TAKION_EVENT_TYPE_AV_DEADLINE event once deadline_us has passed, even if no packets arrive until then.
+ * Replaces any previous deadline, UINT64_MAX to cancel.
+ * Must be called from within the Takion thread, i.e. inside the callback!
+ *
+ * @param deadline_us see chiaki_time_now_monotonic_us()
+ */
+static inline void chiaki_takion_set_av_deadline(ChiakiTakion *takion, uint64_t deadline_us)
+{
+	takion->av_deadline_us = deadline_us;
+}
+
+/**
+ * Get a snapshot of the receive statistics.
+ * Values may be slightly outdated while Takion is running.
+ */
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats);
+
+/**
+ * Thread-safe while Takion is running.
+ */
+CHIAKI_EXPORT void chiaki_takion_get_send_stats(ChiakiTakion *takion, ChiakiTakionSendStats *stats);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out);
 
 /**
@@ -205,6 +345,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos);
 
+/**
+ * Hold back all packets sent from now on, from any thread, until the matching chiaki_takion_send_end(),
+ * which sends them together with as few syscalls as possible.
+ * Use around the packets produced in one tick and keep the section short, calls may be nested.
+ *
+ * Thread-safe while Takion is running.
+ */
+CHIAKI_EXPORT void chiaki_takion_send_begin(ChiakiTakion *takion);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_end(ChiakiTakion *takion);
+
 /**
  * Thread-safe while Takion is running.
  *
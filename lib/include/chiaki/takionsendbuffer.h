@@ -7,8 +7,11 @@
 #include "log.h"
 #include "thread.h"
 #include "seqnum.h"
+#include "packetpool.h"
+#include "eventloop.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +21,28 @@ typedef struct chiaki_takion_t ChiakiTakion;
 
 typedef struct chiaki_takion_send_buffer_packet_t ChiakiTakionSendBufferPacket;
 
+typedef struct chiaki_takion_send_buffer_gap_ack_block_t
+{
+	uint16_t start; // offset of the first acked seq num from the cumulative one
+	uint16_t end; // offset of the last acked seq num, inclusive
+} ChiakiTakionSendBufferGapAckBlock;
+
+typedef struct chiaki_takion_send_buffer_stats_t
+{
+	uint64_t packets_resent; // after the retransmission timeout
+	uint64_t packets_fast_resent; // after being reported missing by gap ack blocks
+	uint64_t packets_gap_acked;
+	uint64_t srtt_us;
+	uint64_t rto_us;
+} ChiakiTakionSendBufferStats;
+
+/**
+ * Keeps sent data packets until they are acked and re-sends them if not, similar to SCTP (RFC 4960).
+ *
+ * Packets live in a ring indexed by their distance from the oldest seq num that is not cumulatively acked,
+ * so acks and gap ack blocks find them directly. The retransmission timeout follows the smoothed
+ * round-trip time as in RFC 6298.
+ */
 typedef struct chiaki_takion_send_buffer_t
 {
 	ChiakiLog *log;
@@ -25,12 +50,28 @@ typedef struct chiaki_takion_send_buffer_t
 
 	ChiakiTakionSendBufferPacket *packets;
 	size_t packets_size; // allocated size
-	size_t packets_count; // current count
+	uint8_t *bufs; // CHIAKI_PACKET_BUF_SIZE bytes of storage for each slot
+	size_t packets_count; // packets that are not acked yet
+	ChiakiSeqNum32 seq_num_first; // oldest seq num that is not cumulatively acked
+	size_t seq_num_first_index; // slot of seq_num_first in packets
+	size_t seq_nums_span; // number of seq nums from seq_num_first on that may have slots in use
+	uint64_t wakeup_us; // when the thread or timer will check for due packets next
+	bool wakeup_pending; // the thread should check earlier
+
+	bool rtt_sampled;
+	uint64_t srtt_us;
+	uint64_t rttvar_us;
+	uint64_t rto_us;
+
+	ChiakiTakionSendBufferStats stats;
 
 	ChiakiMutex mutex;
 	ChiakiCond cond;
 	bool should_stop;
 	ChiakiThread thread;
+
+	ChiakiEventLoop *loop; // if not NULL, re-sends are done by timer instead of thread
+	ChiakiEventLoopTimer timer;
 } ChiakiTakionSendBuffer;
 
 
@@ -38,21 +79,35 @@ typedef struct chiaki_takion_send_buffer_t
  * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
  *
  * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
- * @param size number of packet slots
+ * @param loop if not NULL, packets are re-sent by a timer on loop instead of a thread
+ * @param seq_num_initial seq num of the first packet that will be pushed
+ * @param size number of packet slots, i.e. how far seq nums of unacked packets may span
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, ChiakiEventLoop *loop,
+		ChiakiSeqNum32 seq_num_initial, size_t size);
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer);
 
 /**
- * @param buf ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
- * On error, buf is freed immediately.
+ * Seed the retransmission timeout with a round-trip time measured before, e.g. by Senkusha.
+ * Ignored once the first ack has been measured.
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size);
+CHIAKI_EXPORT void chiaki_takion_send_buffer_set_rtt(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us);
 
 /**
+ * @param buf copied into the storage of the packet's slot, only packets larger than CHIAKI_PACKET_BUF_SIZE are allocated separately
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, const uint8_t *buf, size_t buf_size);
+
+/**
+ * @param seq_num cumulative seq num, all packets up to and including it are acked
+ * @param gap_ack_blocks additionally acked ranges after seq_num
  * @param acked_seq_nums optional array of size of at least send_buffer->packets_size where acked seq nums will be stored
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num,
+		const ChiakiTakionSendBufferGapAckBlock *gap_ack_blocks, size_t gap_ack_blocks_count,
+		ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
+
+CHIAKI_EXPORT void chiaki_takion_send_buffer_get_stats(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferStats *stats);
 
 #ifdef __cplusplus
 }
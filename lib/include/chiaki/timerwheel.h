@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TIMERWHEEL_H
+#define CHIAKI_TIMERWHEEL_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_TIMER_WHEEL_LEVEL_BITS 6
+#define CHIAKI_TIMER_WHEEL_SLOTS (1 << CHIAKI_TIMER_WHEEL_LEVEL_BITS)
+#define CHIAKI_TIMER_WHEEL_LEVELS 6 // slots of the last level span about 18 minutes, later timers wait in its last slot
+
+typedef void (*ChiakiTimerWheelCallback)(void *user);
+
+typedef struct chiaki_timer_wheel_timer_t
+{
+	ChiakiTimerWheelCallback cb;
+	void *user;
+	uint64_t due_us; // as requested
+	uint64_t expires_us; // due_us moved up to coalesce with others within slack_us
+	uint64_t interval_us; // 0 for one-shot
+	uint64_t slack_us;
+	uint8_t level;
+	uint8_t slot;
+	struct chiaki_timer_wheel_timer_t *next;
+	struct chiaki_timer_wheel_timer_t **pprev; // NULL if not scheduled
+} ChiakiTimerWheelTimer;
+
+/**
+ * Hierarchical timer wheel with microsecond resolution, similar to the one of the Linux kernel.
+ *
+ * Level l has CHIAKI_TIMER_WHEEL_SLOTS slots of 64^l us each. A timer sits in the lowest level whose
+ * slots reach its expiry and moves down one level whenever the wheel reaches the start of its slot,
+ * so scheduling and canceling are O(1) and every timer fires at its exact expiry.
+ *
+ * The wheel itself is not thread-safe and never reads the clock. Whoever drives it, like ChiakiEventLoop,
+ * waits until chiaki_timer_wheel_next_expiry() and then calls chiaki_timer_wheel_advance()
+ * or chiaki_timer_wheel_pop_expired() with the current time.
+ */
+typedef struct chiaki_timer_wheel_t
+{
+	uint64_t now_us; // what the wheel has been advanced to
+	ChiakiTimerWheelTimer *slots[CHIAKI_TIMER_WHEEL_LEVELS][CHIAKI_TIMER_WHEEL_SLOTS];
+	uint64_t occupied[CHIAKI_TIMER_WHEEL_LEVELS]; // bit per non-empty slot
+	size_t count;
+} ChiakiTimerWheel;
+
+/**
+ * @param now_us current time of the clock used for all timers, e.g. chiaki_time_now_monotonic_us()
+ */
+CHIAKI_EXPORT void chiaki_timer_wheel_init(ChiakiTimerWheel *wheel, uint64_t now_us);
+
+CHIAKI_EXPORT void chiaki_timer_wheel_timer_init(ChiakiTimerWheelTimer *timer, ChiakiTimerWheelCallback cb, void *user);
+
+static inline bool chiaki_timer_wheel_timer_scheduled(ChiakiTimerWheelTimer *timer) { return timer->pprev != NULL; }
+
+/**
+ * (Re-)schedule timer, replacing any previous expiry.
+ *
+ * @param due_us when to fire, times before the wheel's now fire on the next advance
+ * @param interval_us if not 0, fire again every interval_us after due_us until canceled
+ * @param slack_us how much later than due_us the timer may fire. The expiry is moved up to the coarsest
+ * time within the slack, so timers with slack that are due around the same time fire together.
+ */
+CHIAKI_EXPORT void chiaki_timer_wheel_schedule(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer, uint64_t due_us, uint64_t interval_us, uint64_t slack_us);
+
+CHIAKI_EXPORT void chiaki_timer_wheel_cancel(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer);
+
+/**
+ * @return expiry of the first timer, UINT64_MAX if there are none
+ */
+CHIAKI_EXPORT uint64_t chiaki_timer_wheel_next_expiry(ChiakiTimerWheel *wheel);
+
+/**
+ * Advance the wheel up to now_us and take out one timer that has expired.
+ * Periodic timers are scheduled again before they are returned.
+ * Allows callers to call the callback themselves, e.g. without holding a lock.
+ *
+ * @param expires_us optional, set to when the returned timer was supposed to fire
+ * @return NULL if no more timers have expired
+ */
+CHIAKI_EXPORT ChiakiTimerWheelTimer *chiaki_timer_wheel_pop_expired(ChiakiTimerWheel *wheel, uint64_t now_us, uint64_t *expires_us);
+
+/**
+ * Advance the wheel up to now_us and call the callbacks of all timers that have expired in order.
+ * Callbacks may schedule and cancel timers.
+ *
+ * @return number of callbacks called
+ */
+CHIAKI_EXPORT size_t chiaki_timer_wheel_advance(ChiakiTimerWheel *wheel, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TIMERWHEEL_H
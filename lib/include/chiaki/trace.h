@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TRACE_H
+#define CHIAKI_TRACE_H
+
+#include "common.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Per-frame latency tracing through the whole client pipeline.
+ *
+ * Every stage stamps a video frame with chiaki_trace_stamp() as it passes. Stamps go into a lock-free ring
+ * owned by the calling thread, so recording never blocks and costs about one clock read while enabled
+ * and one relaxed load while disabled. Rings keep the last CHIAKI_TRACE_RING_SIZE stamps of each thread
+ * and are only read when a snapshot is taken.
+ *
+ * Tracing is process-wide, because the stages span the session, the decoder and the frontend.
+ */
+
+#define CHIAKI_TRACE_THREADS_MAX 16
+#define CHIAKI_TRACE_RING_SIZE 4096 // power of 2
+
+typedef enum
+{
+	CHIAKI_TRACE_STAGE_FIRST_UNIT, // first packet of the frame arrived
+	CHIAKI_TRACE_STAGE_LAST_UNIT, // last packet of the frame arrived before it was flushed
+	CHIAKI_TRACE_STAGE_FEC_START,
+	CHIAKI_TRACE_STAGE_FEC_END,
+	CHIAKI_TRACE_STAGE_FLUSH, // complete frame handed to the video callback
+	CHIAKI_TRACE_STAGE_DECODE_SUBMIT,
+	CHIAKI_TRACE_STAGE_DECODE_OUTPUT,
+	CHIAKI_TRACE_STAGE_UPLOAD, // decoded frame copied to the GPU
+	CHIAKI_TRACE_STAGE_PRESENT,
+	CHIAKI_TRACE_STAGE_COUNT
+} ChiakiTraceStage;
+
+CHIAKI_EXPORT const char *chiaki_trace_stage_string(ChiakiTraceStage stage);
+
+typedef struct chiaki_trace_event_t
+{
+	uint64_t time_us; // chiaki_time_now_monotonic_us()
+	int32_t frame_index;
+	uint16_t stage;
+	uint16_t thread; // index of the recording thread's ring
+} ChiakiTraceEvent;
+
+/**
+ * Start recording. The rings are allocated on the first call and kept for the lifetime of the process,
+ * because threads may still be recording into them at any time.
+ * Must not be called concurrently with itself.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_enable(void);
+CHIAKI_EXPORT void chiaki_trace_disable(void);
+CHIAKI_EXPORT bool chiaki_trace_enabled(void);
+
+/**
+ * Forget everything recorded so far and release all rings, so threads that have exited don't keep theirs.
+ * Call at the start of a stream, before chiaki_trace_enable().
+ * Only valid while no thread is stamping anymore, i.e. tracing is disabled and the streams that were traced are stopped.
+ *
+ * @return false if tracing is enabled, nothing is cleared then
+ */
+CHIAKI_EXPORT bool chiaki_trace_clear(void);
+
+/**
+ * @param frame_index frame the stamp belongs to, negative values are ignored
+ */
+CHIAKI_EXPORT void chiaki_trace_stamp_at(ChiakiTraceStage stage, int32_t frame_index, uint64_t time_us);
+CHIAKI_EXPORT void chiaki_trace_stamp(ChiakiTraceStage stage, int32_t frame_index);
+
+/**
+ * Copy all recorded stamps, ordered by time.
+ * @param events set to an array to be freed with free(), NULL if count is 0
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_snapshot(ChiakiTraceEvent **events, size_t *count);
+
+typedef struct chiaki_trace_stage_summary_t
+{
+	uint64_t count;
+	uint64_t p50_us;
+	uint64_t p90_us;
+	uint64_t p99_us;
+	uint64_t max_us;
+} ChiakiTraceStageSummary;
+
+typedef struct chiaki_trace_summary_t
+{
+	uint64_t frames;
+	/**
+	 * Time from the frame's previous stamped stage to each stage.
+	 * Nothing for CHIAKI_TRACE_STAGE_FIRST_UNIT.
+	 */
+	ChiakiTraceStageSummary stages[CHIAKI_TRACE_STAGE_COUNT];
+	ChiakiTraceStageSummary total; // from the first unit to the last stamped stage
+} ChiakiTraceSummary;
+
+/**
+ * @param events ordered by time as returned by chiaki_trace_snapshot()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_summarize(const ChiakiTraceEvent *events, size_t count, ChiakiTraceSummary *summary);
+CHIAKI_EXPORT void chiaki_trace_summary_log(const ChiakiTraceSummary *summary, ChiakiLog *log);
+
+/**
+ * Write events in the Chrome trace event format, to be opened in chrome://tracing or Perfetto.
+ * Each stamp is an instant event on its thread and each frame a span from its first to its last stamp.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_write_chrome_json(const ChiakiTraceEvent *events, size_t count, const char *filename);
+
+/**
+ * Snapshot, write to filename if not NULL and log the summary.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_report(const char *filename, ChiakiLog *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TRACE_H
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEOJITTER_H
+#define CHIAKI_VIDEOJITTER_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_VIDEO_JITTER_HOLD_MIN_US 1000
+
+/**
+ * Moving average of frames with late packets (scaled to 65536) above which frames are held.
+ * A single late packet keeps holding enabled for about 90 frames.
+ */
+#define CHIAKI_VIDEO_JITTER_REORDER_RATE_THRESHOLD (65536 / 256)
+
+typedef struct chiaki_video_jitter_stats_t
+{
+	uint64_t packets_late; // arrived after the next frame had already started
+	uint64_t packets_rescued; // late, but still in time for their held frame
+	uint64_t frames_held;
+	uint64_t frames_completed_while_held;
+	uint64_t hold_us_sum; // latency added by holding frames
+	uint64_t hold_us_max;
+} ChiakiVideoJitterStats;
+
+/**
+ * Decides how long a video frame that is still incomplete when the next one starts
+ * should be held back for its late packets, instead of flushing it right away.
+ *
+ * Nothing is held as long as no packets arrive late. Once they do, the hold time follows
+ * a decaying peak of how late they were plus twice the inter-arrival jitter of frames,
+ * bounded by hold_max_us.
+ */
+typedef struct chiaki_video_jitter_t
+{
+	uint64_t hold_max_us;
+	uint64_t frame_start_prev_us;
+	uint64_t frame_interval_prev_us;
+	uint64_t jitter_us_q4; // RFC 3550 style jitter of frame inter-arrival times, scaled by 16
+	uint64_t lateness_us; // decaying peak
+	uint32_t reorder_rate_q16;
+	bool frame_had_late_packets;
+	ChiakiVideoJitterStats stats;
+} ChiakiVideoJitter;
+
+/**
+ * @param hold_max_us upper bound for the hold time, 0 disables holding entirely
+ */
+CHIAKI_EXPORT void chiaki_video_jitter_init(ChiakiVideoJitter *jitter, uint64_t hold_max_us);
+
+/**
+ * Call when the first packet of a new frame has arrived.
+ */
+CHIAKI_EXPORT void chiaki_video_jitter_frame_start(ChiakiVideoJitter *jitter, uint64_t now_us);
+
+/**
+ * Call for each packet of a previous frame that arrived lateness_us after the next frame had started.
+ *
+ * @param rescued whether the packet could still be used because its frame was being held
+ */
+CHIAKI_EXPORT void chiaki_video_jitter_late_packet(ChiakiVideoJitter *jitter, uint64_t lateness_us, bool rescued);
+
+/**
+ * Call when a held frame has been flushed.
+ *
+ * @param completed whether all of its packets arrived in time
+ */
+CHIAKI_EXPORT void chiaki_video_jitter_frame_held(ChiakiVideoJitter *jitter, uint64_t held_us, bool completed);
+
+/**
+ * @return how long an incomplete frame should currently be held, 0 to flush it immediately
+ */
+CHIAKI_EXPORT uint64_t chiaki_video_jitter_hold_us(ChiakiVideoJitter *jitter);
+
+static inline uint64_t chiaki_video_jitter_us(ChiakiVideoJitter *jitter)
+{
+	return jitter->jitter_us_q4 >> 4;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEOJITTER_H
@@ -8,6 +8,9 @@
 #include "video.h"
 #include "takion.h"
 #include "frameprocessor.h"
+#include "avpipeline.h"
+#include "framepool.h"
+#include "videojitter.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +18,19 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+typedef struct chiaki_video_receiver_stats_t
+{
+	uint64_t frames; // flushed from the frame processor, complete or not
+	uint64_t frames_fec_recovered; // complete only thanks to fec
+	uint64_t frames_fec_failed; // handed on incomplete
+	uint64_t frames_failed; // not handed on at all
+} ChiakiVideoReceiverStats;
+
+/**
+ * Request a new keyframe because frames start to end have been lost or could not be completed.
+ */
+typedef void (*ChiakiVideoReceiverCorruptFrameCallback)(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user);
+
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -27,10 +43,41 @@ typedef struct chiaki_video_receiver_t
 	int32_t frame_index_prev; // last frame that has been at least partially decoded
 	int32_t frame_index_prev_complete; // last frame that has been completely decoded
 	ChiakiFrameProcessor frame_processor;
+	uint64_t frame_start_us; // arrival of the first packet of frame_index_cur
+	uint64_t frame_last_unit_us; // arrival of the latest packet of frame_index_cur
+
+	/**
+	 * Frame before frame_index_cur, held back for late packets as decided by jitter.
+	 * Always flushed before frame_index_cur.
+	 */
+	int32_t frame_index_held; // -1 if none
+	ChiakiFrameProcessor frame_processor_held;
+	uint64_t held_since_us;
+	uint64_t held_last_unit_us;
+	uint64_t held_deadline_us;
+	ChiakiVideoJitter jitter;
+
+	ChiakiFramePool *frame_pool; // complete frames handed to the video sink
 	ChiakiPacketStats *packet_stats;
+
+	/**
+	 * If set, samples are handed to the decode stage of this pipeline instead of calling video_sample_cb directly.
+	 */
+	ChiakiAVPipeline *av_pipeline;
+
+	/**
+	 * Reports corrupt frames to the host through the session's stream connection unless replaced after init.
+	 */
+	ChiakiVideoReceiverCorruptFrameCallback corrupt_frame_cb;
+	void *corrupt_frame_cb_user;
+
+	/**
+	 * Only written by the thread that feeds packets into the receiver.
+	 */
+	ChiakiVideoReceiverStats stats;
 } ChiakiVideoReceiver;
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver);
 
 /**
@@ -44,12 +91,42 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * Same as chiaki_video_receiver_av_packet(), but packet->data is still encrypted.
+ * It will be decrypted with gkcrypt at key_pos straight into the frame buffer, and only if it is needed at all.
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_av_packet_encrypted(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos);
+
+/**
+ * Time at which a frame held back for late packets has to be handed on even if no more packets arrive.
+ * Must be called from the thread that feeds packets into the receiver, like chiaki_video_receiver_expire().
+ *
+ * @return see chiaki_time_now_monotonic_us(), UINT64_MAX if no frame is held
+ */
+CHIAKI_EXPORT uint64_t chiaki_video_receiver_deadline_us(ChiakiVideoReceiver *video_receiver);
+
+/**
+ * Hand on a held frame if its deadline has passed.
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_expire(ChiakiVideoReceiver *video_receiver);
+
+/**
+ * Hand a complete frame to the session's video_frame_cb or video_sample_cb.
+ *
+ * @return false if the sink failed to process the frame
+ */
+CHIAKI_EXPORT bool chiaki_video_receiver_sink_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrame *frame);
+
 static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
 	if(!video_receiver)
 		return NULL;
-	chiaki_video_receiver_init(video_receiver, session, packet_stats);
+	if(chiaki_video_receiver_init(video_receiver, session, packet_stats) != CHIAKI_ERR_SUCCESS)
+	{
+		free(video_receiver);
+		return NULL;
+	}
 	return video_receiver;
 }
 
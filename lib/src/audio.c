@@ -23,8 +23,8 @@ void chiaki_audio_header_load(ChiakiAudioHeader *audio_header, const uint8_t *bu
 
 void chiaki_audio_header_save(ChiakiAudioHeader *audio_header, uint8_t *buf)
 {
-	buf[0] = audio_header->bits;
-	buf[1] = audio_header->channels;
+	buf[0] = audio_header->channels;
+	buf[1] = audio_header->bits;
 	*((chiaki_unaligned_uint32_t *)(buf + 2)) = htonl(audio_header->rate);
 	*((chiaki_unaligned_uint32_t *)(buf + 6)) = htonl(audio_header->frame_size);
 	*((chiaki_unaligned_uint32_t *)(buf + 0xa)) = htonl(audio_header->unknown);
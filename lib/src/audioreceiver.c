@@ -14,7 +14,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 	audio_receiver->packet_stats = packet_stats;
 
 	audio_receiver->frame_index_prev = 0;
+	audio_receiver->frame_index_prev_valid = false;
 	audio_receiver->frame_index_startup = true;
+	audio_receiver->frames_lost = 0;
 
 	ChiakiErrorCode err = chiaki_mutex_init(&audio_receiver->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -25,6 +27,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 
 CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receiver)
 {
+	if(audio_receiver->frames_lost)
+		CHIAKI_LOGI(audio_receiver->log, "Audio Receiver lost %llu frames in total", (unsigned long long)audio_receiver->frames_lost);
 #ifdef CHIAKI_LIB_ENABLE_OPUS
 	opus_decoder_destroy(audio_receiver->opus_decoder);
 #endif
@@ -85,23 +89,22 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 	if(packet->frame_index > (1 << 15))
 		audio_receiver->frame_index_startup = false;
 
-	for(size_t i = 0; i < source_units_count + fec_units_count; i++)
+	// fec units carry the frames before the source units, so pass them on first.
+	// Otherwise they would always be older than the source frames and be dropped, even if they fill a gap.
+	for(size_t fec_index = 0; fec_index < fec_units_count; fec_index++)
 	{
-		ChiakiSeqNum16 frame_index;
-		if(i < source_units_count)
-			frame_index = packet->frame_index + i;
-		else
-		{
-			// fec
-			size_t fec_index = i - source_units_count;
-
-			// first packets will contain the same frame multiple times, ignore those
-			if(audio_receiver->frame_index_startup && packet->frame_index + fec_index < fec_units_count + 1)
-				continue;
+		// first packets will contain the same frame multiple times, ignore those
+		if(audio_receiver->frame_index_startup && packet->frame_index + fec_index < fec_units_count + 1)
+			continue;
 
-			frame_index = packet->frame_index - fec_units_count + fec_index;
-		}
+		ChiakiSeqNum16 frame_index = packet->frame_index - fec_units_count + fec_index;
+		size_t i = source_units_count + fec_index;
+		chiaki_audio_receiver_frame(audio_receiver, frame_index, packet->is_haptics, packet->data + unit_size * i, unit_size);
+	}
 
+	for(size_t i = 0; i < source_units_count; i++)
+	{
+		ChiakiSeqNum16 frame_index = packet->frame_index + i;
 		chiaki_audio_receiver_frame(audio_receiver, frame_index, packet->is_haptics, packet->data + unit_size * i, unit_size);
 	}
 
@@ -113,14 +116,30 @@ static void chiaki_audio_receiver_frame(ChiakiAudioReceiver* audio_receiver, Chi
 {
 	chiaki_mutex_lock(&audio_receiver->mutex);
 
-	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
+	if(audio_receiver->frame_index_prev_valid && !chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
 		goto beach;
+
+	ChiakiAudioSink *sink = is_haptics ? &audio_receiver->session->haptics_sink : &audio_receiver->session->audio_sink;
+
+	if(audio_receiver->frame_index_prev_valid)
+	{
+		size_t lost = (ChiakiSeqNum16)(frame_index - audio_receiver->frame_index_prev - 1);
+		if(lost)
+		{
+			audio_receiver->frames_lost += lost;
+			CHIAKI_LOGV(audio_receiver->log, "Audio Receiver lost %llu frames before frame %u",
+					(unsigned long long)lost, (unsigned int)frame_index);
+			if(lost > CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX)
+				lost = CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX;
+			if(sink->frame_lost_cb)
+				sink->frame_lost_cb(lost, buf, buf_size, sink->user);
+		}
+	}
 	audio_receiver->frame_index_prev = frame_index;
+	audio_receiver->frame_index_prev_valid = true;
 
-	if (is_haptics && audio_receiver->session->haptics_sink.frame_cb)
-		audio_receiver->session->haptics_sink.frame_cb(buf, buf_size, audio_receiver->session->haptics_sink.user);
-	else if (!is_haptics && audio_receiver->session->audio_sink.frame_cb)
-		audio_receiver->session->audio_sink.frame_cb(buf, buf_size, audio_receiver->session->audio_sink.user);
+	if(sink->frame_cb)
+		sink->frame_cb(buf, buf_size, sink->user);
 
 beach:
 	chiaki_mutex_unlock(&audio_receiver->mutex);
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/audioring.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CAPACITY_FACTOR 4
+
+/**
+ * Time constant of the fill level average. Packets of 10ms arriving against device callbacks of a few ms
+ * make the instant fill level jump around, only its average is meaningful.
+ */
+#define FILL_AVG_TIME_S 0.5
+
+/**
+ * PI controller on the fill level error in seconds, critically damped (KI = KP^2 / 4),
+ * settling in about 2 / KP seconds. 1ms above the target makes the consumer run 200ppm faster.
+ */
+#define CONTROL_KP 0.2
+#define CONTROL_KI (CONTROL_KP * CONTROL_KP / 4.0)
+
+#define RATIO_MAX ((double)CHIAKI_AUDIO_RING_RATIO_MAX_PPM / 1000000.0)
+
+static size_t next_pow2(size_t v)
+{
+	size_t r = 1;
+	while(r < v)
+		r <<= 1;
+	return r;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_ring_init(ChiakiAudioRing *ring, unsigned int channels, uint32_t rate, uint32_t target_latency_ms)
+{
+	if(!channels || channels > CHIAKI_AUDIO_RING_CHANNELS_MAX || !rate)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	ring->channels = channels;
+	ring->rate = rate;
+	ring->target_frames = (size_t)rate * target_latency_ms / 1000;
+	if(!ring->target_frames)
+		ring->target_frames = 1;
+	ring->capacity = next_pow2(ring->target_frames * CAPACITY_FACTOR);
+	ring->buf = malloc(ring->capacity * channels * sizeof(int16_t));
+	if(!ring->buf)
+		return CHIAKI_ERR_MEMORY;
+
+	chiaki_atomic_u64_init(&ring->head, 0);
+	chiaki_atomic_u64_init(&ring->tail, 0);
+
+	ring->playing = false;
+	ring->frac = 0.0;
+	memset(ring->cur, 0, sizeof(ring->cur));
+	ring->fill_avg = 0.0;
+	ring->integral = 0.0;
+
+	chiaki_atomic_u64_init(&ring->frames_written, 0);
+	chiaki_atomic_u64_init(&ring->overruns, 0);
+	chiaki_atomic_u64_init(&ring->frames_read, 0);
+	chiaki_atomic_u64_init(&ring->underruns, 0);
+	chiaki_atomic_u32_init(&ring->ratio_ppm, 0);
+	chiaki_atomic_u32_init(&ring->drift_ppm, 0);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_fini(ChiakiAudioRing *ring)
+{
+	free(ring->buf);
+}
+
+CHIAKI_EXPORT size_t chiaki_audio_ring_write(ChiakiAudioRing *ring, const int16_t *pcm, size_t frames_count)
+{
+	uint64_t tail = chiaki_atomic_u64_load_relaxed(&ring->tail);
+	uint64_t head = chiaki_atomic_u64_load_acquire(&ring->head);
+	size_t space = ring->capacity - (size_t)(tail - head);
+	size_t count = frames_count < space ? frames_count : space;
+
+	size_t offset = (size_t)(tail & (ring->capacity - 1));
+	size_t first = ring->capacity - offset;
+	if(first > count)
+		first = count;
+	memcpy(ring->buf + offset * ring->channels, pcm, first * ring->channels * sizeof(int16_t));
+	memcpy(ring->buf, pcm + first * ring->channels, (count - first) * ring->channels * sizeof(int16_t));
+	chiaki_atomic_u64_store_release(&ring->tail, tail + count);
+
+	chiaki_atomic_u64_store_relaxed(&ring->frames_written, chiaki_atomic_u64_load_relaxed(&ring->frames_written) + count);
+	if(count < frames_count)
+		chiaki_atomic_u64_store_relaxed(&ring->overruns, chiaki_atomic_u64_load_relaxed(&ring->overruns) + 1);
+	return count;
+}
+
+/**
+ * @return the resampling ratio for the next frames_count output frames
+ */
+static double audio_ring_update_ratio(ChiakiAudioRing *ring, size_t fill, size_t frames_count)
+{
+	double dt = (double)frames_count / (double)ring->rate;
+	double alpha = dt / FILL_AVG_TIME_S;
+	if(alpha > 1.0)
+		alpha = 1.0;
+	ring->fill_avg += ((double)fill - ring->fill_avg) * alpha;
+
+	double error = (ring->fill_avg - (double)ring->target_frames) / (double)ring->rate;
+	ring->integral += CONTROL_KI * error * dt;
+	if(ring->integral > RATIO_MAX)
+		ring->integral = RATIO_MAX;
+	else if(ring->integral < -RATIO_MAX)
+		ring->integral = -RATIO_MAX;
+
+	double dev = CONTROL_KP * error + ring->integral;
+	if(dev > RATIO_MAX)
+		dev = RATIO_MAX;
+	else if(dev < -RATIO_MAX)
+		dev = -RATIO_MAX;
+
+	chiaki_atomic_u32_store_relaxed(&ring->ratio_ppm, (uint32_t)(int32_t)(dev * 1000000.0));
+	chiaki_atomic_u32_store_relaxed(&ring->drift_ppm, (uint32_t)(int32_t)(ring->integral * 1000000.0));
+	return 1.0 + dev;
+}
+
+static inline int16_t audio_ring_lerp(int16_t a, int16_t b, double t)
+{
+	double v = (double)a + ((double)b - (double)a) * t;
+	return (int16_t)(v >= 0.0 ? (int)(v + 0.5) : (int)(v - 0.5));
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_read(ChiakiAudioRing *ring, int16_t *pcm, size_t frames_count)
+{
+	uint64_t head = chiaki_atomic_u64_load_relaxed(&ring->head);
+	uint64_t tail = chiaki_atomic_u64_load_acquire(&ring->tail);
+	size_t mask = ring->capacity - 1;
+	unsigned int channels = ring->channels;
+	size_t i = 0;
+
+	if(!ring->playing)
+	{
+		if(tail - head < ring->target_frames)
+			goto silence;
+		ring->playing = true;
+		memcpy(ring->cur, ring->buf + (head & mask) * channels, channels * sizeof(int16_t));
+		head++;
+		ring->frac = 0.0;
+		ring->fill_avg = (double)(tail - head);
+	}
+
+	double ratio = audio_ring_update_ratio(ring, (size_t)(tail - head), frames_count);
+	for(; i<frames_count; i++)
+	{
+		while(ring->frac >= 1.0)
+		{
+			if(head == tail)
+				goto underrun;
+			memcpy(ring->cur, ring->buf + (head & mask) * channels, channels * sizeof(int16_t));
+			head++;
+			ring->frac -= 1.0;
+		}
+		if(head == tail)
+			goto underrun;
+		const int16_t *next = ring->buf + (head & mask) * channels;
+		for(unsigned int c=0; c<channels; c++)
+			pcm[i * channels + c] = audio_ring_lerp(ring->cur[c], next[c], ring->frac);
+		ring->frac += ratio;
+	}
+	chiaki_atomic_u64_store_release(&ring->head, head);
+	chiaki_atomic_u64_store_relaxed(&ring->frames_read, chiaki_atomic_u64_load_relaxed(&ring->frames_read) + frames_count);
+	return;
+
+underrun:
+	ring->playing = false;
+	chiaki_atomic_u64_store_release(&ring->head, head);
+	chiaki_atomic_u64_store_relaxed(&ring->underruns, chiaki_atomic_u64_load_relaxed(&ring->underruns) + 1);
+silence:
+	memset(pcm + i * channels, 0, (frames_count - i) * channels * sizeof(int16_t));
+	chiaki_atomic_u64_store_relaxed(&ring->frames_read, chiaki_atomic_u64_load_relaxed(&ring->frames_read) + frames_count);
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_get_stats(ChiakiAudioRing *ring, ChiakiAudioRingStats *stats)
+{
+	uint64_t head = chiaki_atomic_u64_load_acquire(&ring->head);
+	uint64_t tail = chiaki_atomic_u64_load_acquire(&ring->tail);
+	stats->fill_frames = tail > head ? tail - head : 0;
+	stats->target_frames = ring->target_frames;
+	stats->frames_written = chiaki_atomic_u64_load_relaxed(&ring->frames_written);
+	stats->frames_read = chiaki_atomic_u64_load_relaxed(&ring->frames_read);
+	stats->underruns = chiaki_atomic_u64_load_relaxed(&ring->underruns);
+	stats->overruns = chiaki_atomic_u64_load_relaxed(&ring->overruns);
+	stats->ratio_ppm = (int32_t)chiaki_atomic_u32_load_relaxed(&ring->ratio_ppm);
+	stats->drift_ppm = (int32_t)chiaki_atomic_u32_load_relaxed(&ring->drift_ppm);
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/avpipeline.h>
+#include <chiaki/packetpool.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STAGE_WAIT_TIMEOUT_MS 100
+
+typedef struct av_pipeline_packet_slot_t
+{
+	ChiakiTakionAVPacket packet;
+	uint64_t queued_us;
+	uint8_t data[CHIAKI_PACKET_BUF_SIZE];
+} AVPipelinePacketSlot;
+
+typedef struct av_pipeline_frame_slot_t
+{
+	ChiakiVideoFrame *frame; // reference held by the slot while queued
+	uint64_t queued_us;
+} AVPipelineFrameSlot;
+
+static void *av_pipeline_crypt_thread_func(void *user);
+static void *av_pipeline_decode_thread_func(void *user);
+
+CHIAKI_EXPORT const char *chiaki_av_pipeline_stage_name(ChiakiAVPipelineStage stage)
+{
+	switch(stage)
+	{
+		case CHIAKI_AV_PIPELINE_STAGE_CRYPT:
+			return "crypt";
+		case CHIAKI_AV_PIPELINE_STAGE_DECODE:
+			return "decode";
+		default:
+			return "unknown";
+	}
+}
+
+static void av_pipeline_stage_state_init(ChiakiAVPipelineStageState *stage)
+{
+	stage->thread_running = false;
+	chiaki_atomic_u64_init(&stage->items, 0);
+	chiaki_atomic_u64_init(&stage->dropped, 0);
+	chiaki_atomic_u64_init(&stage->queue_depth_max, 0);
+	chiaki_atomic_u64_init(&stage->latency_us_sum, 0);
+	chiaki_atomic_u64_init(&stage->latency_us_max, 0);
+}
+
+/**
+ * All counters have exactly one writing thread, so plain load/store is enough.
+ */
+static inline void av_pipeline_counter_add(ChiakiAtomicU64 *counter, uint64_t v)
+{
+	chiaki_atomic_u64_store_relaxed(counter, chiaki_atomic_u64_load_relaxed(counter) + v);
+}
+
+static inline void av_pipeline_counter_max(ChiakiAtomicU64 *counter, uint64_t v)
+{
+	if(v > chiaki_atomic_u64_load_relaxed(counter))
+		chiaki_atomic_u64_store_relaxed(counter, v);
+}
+
+/**
+ * Called by the producer of stage after pushing.
+ */
+static void av_pipeline_stage_pushed(ChiakiAVPipelineStageState *stage)
+{
+	av_pipeline_counter_max(&stage->queue_depth_max, chiaki_spsc_queue_depth(&stage->queue));
+}
+
+/**
+ * Called by stage itself after processing an item.
+ */
+static void av_pipeline_stage_processed(ChiakiAVPipelineStageState *stage, uint64_t queued_us)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t latency = now > queued_us ? now - queued_us : 0;
+	av_pipeline_counter_add(&stage->items, 1);
+	av_pipeline_counter_add(&stage->latency_us_sum, latency);
+	av_pipeline_counter_max(&stage->latency_us_max, latency);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_av_pipeline_init(ChiakiAVPipeline *pipeline, ChiakiLog *log,
+		ChiakiAVPipelinePacketCallback packet_cb, void *packet_cb_user,
+		ChiakiAVPipelineFrameCallback frame_cb, void *frame_cb_user)
+{
+	pipeline->log = log;
+	pipeline->packet_cb = packet_cb;
+	pipeline->packet_cb_user = packet_cb_user;
+	pipeline->packet_deadline_us = UINT64_MAX;
+	pipeline->frame_cb = frame_cb;
+	pipeline->frame_cb_user = frame_cb_user;
+
+	for(size_t i=0; i<CHIAKI_AV_PIPELINE_STAGE_COUNT; i++)
+		av_pipeline_stage_state_init(&pipeline->stages[i]);
+
+	ChiakiAVPipelineStageState *crypt = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_CRYPT];
+	ChiakiAVPipelineStageState *decode = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_DECODE];
+
+	ChiakiErrorCode err = chiaki_spsc_queue_init(&crypt->queue, sizeof(AVPipelinePacketSlot), CHIAKI_AV_PIPELINE_PACKET_QUEUE_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_spsc_queue_init(&decode->queue, sizeof(AVPipelineFrameSlot), CHIAKI_AV_PIPELINE_FRAME_QUEUE_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_crypt_queue;
+
+	err = chiaki_thread_create(&decode->thread, av_pipeline_decode_thread_func, pipeline);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_decode_queue;
+	decode->thread_running = true;
+	chiaki_thread_set_name(&decode->thread, "Chiaki AV Decode");
+
+	err = chiaki_thread_create(&crypt->thread, av_pipeline_crypt_thread_func, pipeline);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_decode_thread;
+	crypt->thread_running = true;
+	chiaki_thread_set_name(&crypt->thread, "Chiaki AV Crypt");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_decode_thread:
+	chiaki_spsc_queue_close(&decode->queue);
+	chiaki_thread_join(&decode->thread, NULL);
+error_decode_queue:
+	chiaki_spsc_queue_fini(&decode->queue);
+error_crypt_queue:
+	chiaki_spsc_queue_fini(&crypt->queue);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_av_pipeline_stop(ChiakiAVPipeline *pipeline)
+{
+	for(size_t i=0; i<CHIAKI_AV_PIPELINE_STAGE_COUNT; i++)
+		chiaki_spsc_queue_close(&pipeline->stages[i].queue);
+
+	bool was_running = false;
+	for(size_t i=0; i<CHIAKI_AV_PIPELINE_STAGE_COUNT; i++)
+	{
+		ChiakiAVPipelineStageState *stage = &pipeline->stages[i];
+		if(!stage->thread_running)
+			continue;
+		chiaki_thread_join(&stage->thread, NULL);
+		stage->thread_running = false;
+		was_running = true;
+	}
+
+	if(!was_running)
+		return;
+
+	for(size_t i=0; i<CHIAKI_AV_PIPELINE_STAGE_COUNT; i++)
+	{
+		ChiakiAVPipelineStageStats stats;
+		chiaki_av_pipeline_get_stats(pipeline, (ChiakiAVPipelineStage)i, &stats);
+		CHIAKI_LOGI(pipeline->log, "AV Pipeline %s stage: %llu processed, %llu dropped, queue depth max %llu, latency avg %llu us, max %llu us",
+				chiaki_av_pipeline_stage_name((ChiakiAVPipelineStage)i),
+				(unsigned long long)stats.items,
+				(unsigned long long)stats.dropped,
+				(unsigned long long)stats.queue_depth_max,
+				(unsigned long long)(stats.items ? stats.latency_us_sum / stats.items : 0),
+				(unsigned long long)stats.latency_us_max);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_av_pipeline_fini(ChiakiAVPipeline *pipeline)
+{
+	chiaki_av_pipeline_stop(pipeline);
+
+	// all threads are gone, so drain the frames that were never decoded from here
+	ChiakiSPSCQueue *frame_queue = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_DECODE].queue;
+	AVPipelineFrameSlot *slot;
+	while((slot = chiaki_spsc_queue_read_slot(frame_queue)))
+	{
+		chiaki_video_frame_unref(slot->frame);
+		chiaki_spsc_queue_pop(frame_queue);
+	}
+
+	for(size_t i=0; i<CHIAKI_AV_PIPELINE_STAGE_COUNT; i++)
+		chiaki_spsc_queue_fini(&pipeline->stages[i].queue);
+}
+
+CHIAKI_EXPORT bool chiaki_av_pipeline_push_packet(ChiakiAVPipeline *pipeline, ChiakiTakionAVPacket *packet)
+{
+	ChiakiAVPipelineStageState *stage = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_CRYPT];
+	if(chiaki_spsc_queue_is_closed(&stage->queue))
+		goto drop;
+
+	if(packet->data_size > CHIAKI_PACKET_BUF_SIZE)
+	{
+		CHIAKI_LOGE(pipeline->log, "AV Pipeline got packet of size %#llx that does not fit into a queue slot",
+				(unsigned long long)packet->data_size);
+		goto drop;
+	}
+
+	AVPipelinePacketSlot *slot = chiaki_spsc_queue_write_slot(&stage->queue);
+	if(!slot)
+		goto drop;
+
+	slot->packet = *packet;
+	slot->packet.data = slot->data;
+	memcpy(slot->data, packet->data, packet->data_size);
+	slot->queued_us = chiaki_time_now_monotonic_us();
+	chiaki_spsc_queue_push(&stage->queue);
+	av_pipeline_stage_pushed(stage);
+	return true;
+
+drop:
+	av_pipeline_counter_add(&stage->dropped, 1);
+	return false;
+}
+
+CHIAKI_EXPORT bool chiaki_av_pipeline_push_frame(ChiakiAVPipeline *pipeline, ChiakiVideoFrame *frame)
+{
+	ChiakiAVPipelineStageState *stage = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_DECODE];
+
+	AVPipelineFrameSlot *slot;
+	while(!(slot = chiaki_spsc_queue_write_slot(&stage->queue)))
+	{
+		ChiakiErrorCode err = chiaki_spsc_queue_wait_writable(&stage->queue, STAGE_WAIT_TIMEOUT_MS);
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+			goto drop;
+	}
+	if(chiaki_spsc_queue_is_closed(&stage->queue))
+		goto drop;
+
+	chiaki_video_frame_ref(frame);
+	slot->frame = frame;
+	slot->queued_us = chiaki_time_now_monotonic_us();
+	chiaki_spsc_queue_push(&stage->queue);
+	av_pipeline_stage_pushed(stage);
+	return true;
+
+drop:
+	av_pipeline_counter_add(&stage->dropped, 1);
+	return false;
+}
+
+CHIAKI_EXPORT void chiaki_av_pipeline_get_stats(ChiakiAVPipeline *pipeline, ChiakiAVPipelineStage stage, ChiakiAVPipelineStageStats *stats)
+{
+	ChiakiAVPipelineStageState *state = &pipeline->stages[stage];
+	stats->items = chiaki_atomic_u64_load_relaxed(&state->items);
+	stats->dropped = chiaki_atomic_u64_load_relaxed(&state->dropped);
+	stats->queue_depth = chiaki_spsc_queue_depth(&state->queue);
+	stats->queue_depth_max = chiaki_atomic_u64_load_relaxed(&state->queue_depth_max);
+	stats->latency_us_sum = chiaki_atomic_u64_load_relaxed(&state->latency_us_sum);
+	stats->latency_us_max = chiaki_atomic_u64_load_relaxed(&state->latency_us_max);
+}
+
+/**
+ * @param deadline_us if not NULL, return NULL with *deadline_passed set once *deadline_us has passed and reset it to UINT64_MAX
+ * @return the next slot of stage's queue or NULL if the pipeline is stopping
+ */
+static void *av_pipeline_stage_next(ChiakiAVPipelineStageState *stage, uint64_t *deadline_us, bool *deadline_passed)
+{
+	if(deadline_passed)
+		*deadline_passed = false;
+	while(true)
+	{
+		if(chiaki_spsc_queue_is_closed(&stage->queue))
+			return NULL;
+		void *slot = chiaki_spsc_queue_read_slot(&stage->queue);
+		if(slot)
+			return slot;
+		uint64_t timeout_ms = STAGE_WAIT_TIMEOUT_MS;
+		if(deadline_us && *deadline_us != UINT64_MAX)
+		{
+			uint64_t now = chiaki_time_now_monotonic_us();
+			if(now >= *deadline_us)
+			{
+				*deadline_us = UINT64_MAX;
+				*deadline_passed = true;
+				return NULL;
+			}
+			uint64_t deadline_ms = (*deadline_us - now + 999) / 1000;
+			if(deadline_ms < timeout_ms)
+				timeout_ms = deadline_ms;
+		}
+		ChiakiErrorCode err = chiaki_spsc_queue_wait_readable(&stage->queue, timeout_ms);
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+			return NULL;
+	}
+}
+
+static void *av_pipeline_crypt_thread_func(void *user)
+{
+	ChiakiAVPipeline *pipeline = user;
+	ChiakiAVPipelineStageState *stage = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_CRYPT];
+	while(true)
+	{
+		bool deadline_passed;
+		AVPipelinePacketSlot *slot = av_pipeline_stage_next(stage, &pipeline->packet_deadline_us, &deadline_passed);
+		if(deadline_passed)
+		{
+			pipeline->packet_cb(NULL, pipeline->packet_cb_user);
+			continue;
+		}
+		if(!slot)
+			break;
+		pipeline->packet_cb(&slot->packet, pipeline->packet_cb_user);
+		av_pipeline_stage_processed(stage, slot->queued_us);
+		chiaki_spsc_queue_pop(&stage->queue);
+	}
+	return NULL;
+}
+
+static void *av_pipeline_decode_thread_func(void *user)
+{
+	ChiakiAVPipeline *pipeline = user;
+	ChiakiAVPipelineStageState *stage = &pipeline->stages[CHIAKI_AV_PIPELINE_STAGE_DECODE];
+	AVPipelineFrameSlot *slot;
+	while((slot = av_pipeline_stage_next(stage, NULL, NULL)))
+	{
+		ChiakiVideoFrame *frame = slot->frame;
+		uint64_t queued_us = slot->queued_us;
+		chiaki_spsc_queue_pop(&stage->queue);
+		pipeline->frame_cb(frame, pipeline->frame_cb_user);
+		chiaki_video_frame_unref(frame);
+		av_pipeline_stage_processed(stage, queued_us);
+	}
+	return NULL;
+}
@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/bandwidthestimator.h>
+
+#include <math.h>
+#include <string.h>
+
+#define DELAY_SMOOTHING 0.9
+#define TREND_GAIN 4.0
+#define TREND_DELTAS_MAX 60
+#define OVERUSE_TIME_US 10000
+#define THRESHOLD_INITIAL 12.5
+#define THRESHOLD_MIN 6.0
+#define THRESHOLD_MAX 600.0
+#define THRESHOLD_K_UP 0.0087
+#define THRESHOLD_K_DOWN 0.039
+#define THRESHOLD_OUTLIER 15.0
+#define THRESHOLD_DT_MAX_MS 100.0
+
+#define BOTTLENECK_PACKETS_MIN 4
+#define RECEIVE_SMOOTHING 0.7
+#define DECREASE_FACTOR 0.85
+#define DECREASE_INTERVAL_US 300000
+#define INCREASE_PER_SECOND 0.08
+#define INCREASE_RECEIVE_MAX 1.5
+#define LOSS_SMOOTHING 0.8
+#define LOSS_DECREASE 0.1
+#define BITRATE_MIN 500000.0
+
+static void estimator_clear(ChiakiBandwidthEstimator *estimator, uint64_t frame_interval_us)
+{
+	ChiakiMutex mutex = estimator->mutex;
+	memset(estimator, 0, sizeof(*estimator));
+	estimator->mutex = mutex;
+	estimator->frame_interval_us = frame_interval_us;
+	estimator->threshold = THRESHOLD_INITIAL;
+	estimator->usage = CHIAKI_BANDWIDTH_USAGE_NORMAL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_bandwidth_estimator_init(ChiakiBandwidthEstimator *estimator, uint64_t frame_interval_us)
+{
+	ChiakiErrorCode err = chiaki_mutex_init(&estimator->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	estimator_clear(estimator, frame_interval_us);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_fini(ChiakiBandwidthEstimator *estimator)
+{
+	chiaki_mutex_fini(&estimator->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_reset(ChiakiBandwidthEstimator *estimator, uint64_t frame_interval_us)
+{
+	chiaki_mutex_lock(&estimator->mutex);
+	estimator_clear(estimator, frame_interval_us);
+	chiaki_mutex_unlock(&estimator->mutex);
+}
+
+/**
+ * Min of the relative delay over the last CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS seconds, kept per second.
+ * Slots store second + 1 so 0 means empty.
+ */
+static int64_t delay_min_update(ChiakiBandwidthEstimator *estimator, uint64_t now_us, int64_t delay_us)
+{
+	uint64_t second = now_us / 1000000 + 1;
+	size_t slot = (size_t)(second % CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS);
+	if(estimator->delay_min_second[slot] != second)
+	{
+		estimator->delay_min_second[slot] = second;
+		estimator->delay_min_us[slot] = delay_us;
+	}
+	else if(delay_us < estimator->delay_min_us[slot])
+		estimator->delay_min_us[slot] = delay_us;
+
+	int64_t min = delay_us;
+	for(size_t i=0; i<CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS; i++)
+	{
+		uint64_t s = estimator->delay_min_second[i];
+		if(s && second - s < CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS && estimator->delay_min_us[i] < min)
+			min = estimator->delay_min_us[i];
+	}
+	return min;
+}
+
+static double trendline_slope(ChiakiBandwidthEstimator *estimator)
+{
+	unsigned int n = estimator->trendline_count;
+	double x_avg = 0.0, y_avg = 0.0;
+	for(unsigned int i=0; i<n; i++)
+	{
+		x_avg += estimator->trendline_x[i];
+		y_avg += estimator->trendline_y[i];
+	}
+	x_avg /= n;
+	y_avg /= n;
+	double num = 0.0, den = 0.0;
+	for(unsigned int i=0; i<n; i++)
+	{
+		double dx = estimator->trendline_x[i] - x_avg;
+		num += dx * (estimator->trendline_y[i] - y_avg);
+		den += dx * dx;
+	}
+	return den > 0.0 ? num / den : 0.0;
+}
+
+/**
+ * Adapt the threshold to the trend, so it rises with noise and concurrent TCP flows don't starve us.
+ */
+static void threshold_update(ChiakiBandwidthEstimator *estimator, double trend, uint64_t now_us)
+{
+	if(!estimator->threshold_update_us)
+		estimator->threshold_update_us = now_us;
+	double trend_abs = fabs(trend);
+	if(trend_abs > estimator->threshold + THRESHOLD_OUTLIER)
+	{
+		estimator->threshold_update_us = now_us;
+		return;
+	}
+	double k = trend_abs < estimator->threshold ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+	double dt_ms = (double)(now_us - estimator->threshold_update_us) / 1000.0;
+	if(dt_ms > THRESHOLD_DT_MAX_MS)
+		dt_ms = THRESHOLD_DT_MAX_MS;
+	estimator->threshold += k * (trend_abs - estimator->threshold) * dt_ms;
+	if(estimator->threshold < THRESHOLD_MIN)
+		estimator->threshold = THRESHOLD_MIN;
+	else if(estimator->threshold > THRESHOLD_MAX)
+		estimator->threshold = THRESHOLD_MAX;
+	estimator->threshold_update_us = now_us;
+}
+
+/**
+ * Called with the first packet of each frame.
+ */
+static void frame_delay(ChiakiBandwidthEstimator *estimator, uint64_t now_us)
+{
+	if(!estimator->delay_base_valid)
+	{
+		estimator->delay_base_valid = true;
+		estimator->delay_base_us = now_us;
+		estimator->frame_index_ext = 0;
+	}
+
+	int64_t elapsed_us = (int64_t)(now_us - estimator->delay_base_us);
+	int64_t delay_us = elapsed_us - estimator->frame_index_ext * (int64_t)estimator->frame_interval_us;
+	int64_t min = delay_min_update(estimator, now_us, delay_us);
+	estimator->queue_delay_us = (uint64_t)(delay_us - min);
+	estimator->delay_smoothed_us = DELAY_SMOOTHING * estimator->delay_smoothed_us
+		+ (1.0 - DELAY_SMOOTHING) * (double)estimator->queue_delay_us;
+
+	estimator->trendline_x[estimator->trendline_next] = (double)elapsed_us / 1000.0;
+	estimator->trendline_y[estimator->trendline_next] = estimator->delay_smoothed_us / 1000.0;
+	estimator->trendline_next = (estimator->trendline_next + 1) % CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE;
+	if(estimator->trendline_count < CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE)
+		estimator->trendline_count++;
+	if(estimator->delta_count < TREND_DELTAS_MAX)
+		estimator->delta_count++;
+	if(estimator->trendline_count < CHIAKI_BANDWIDTH_ESTIMATOR_TRENDLINE_SIZE)
+		return;
+
+	double trend = trendline_slope(estimator) * estimator->delta_count * TREND_GAIN;
+	if(trend > estimator->threshold)
+	{
+		if(!estimator->overuse_start_us)
+			estimator->overuse_start_us = now_us;
+		else if(now_us - estimator->overuse_start_us >= OVERUSE_TIME_US && trend >= estimator->trend_prev)
+			estimator->usage = CHIAKI_BANDWIDTH_USAGE_OVERUSE;
+	}
+	else
+	{
+		estimator->overuse_start_us = 0;
+		estimator->usage = trend < -estimator->threshold ? CHIAKI_BANDWIDTH_USAGE_UNDERUSE : CHIAKI_BANDWIDTH_USAGE_NORMAL;
+	}
+	estimator->trend_prev = trend;
+	threshold_update(estimator, trend, now_us);
+}
+
+/**
+ * Called when the next frame starts. The packets of a frame leave the console back to back,
+ * so their spacing on arrival is a sample of the bottleneck's delivery rate.
+ */
+static void frame_finish(ChiakiBandwidthEstimator *estimator)
+{
+	if(estimator->frame_packets < BOTTLENECK_PACKETS_MIN || estimator->frame_last_us <= estimator->frame_first_us)
+		return;
+	uint64_t sample = (estimator->frame_bytes - estimator->frame_first_bytes) * 8 * 1000000
+		/ (estimator->frame_last_us - estimator->frame_first_us);
+
+	uint64_t second = estimator->frame_last_us / 1000000 + 1;
+	size_t slot = (size_t)(second % CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS);
+	if(estimator->bottleneck_second[slot] != second)
+	{
+		estimator->bottleneck_second[slot] = second;
+		estimator->bottleneck_max[slot] = sample;
+	}
+	else if(sample > estimator->bottleneck_max[slot])
+		estimator->bottleneck_max[slot] = sample;
+}
+
+static uint64_t bottleneck_get(ChiakiBandwidthEstimator *estimator)
+{
+	uint64_t second = estimator->frame_last_us / 1000000 + 1;
+	uint64_t max = 0;
+	for(size_t i=0; i<CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS; i++)
+	{
+		uint64_t s = estimator->bottleneck_second[i];
+		if(s && second - s < CHIAKI_BANDWIDTH_ESTIMATOR_WINDOWS && estimator->bottleneck_max[i] > max)
+			max = estimator->bottleneck_max[i];
+	}
+	return max;
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_packet(ChiakiBandwidthEstimator *estimator, uint64_t now_us, ChiakiSeqNum16 frame_index, size_t size)
+{
+	chiaki_mutex_lock(&estimator->mutex);
+	estimator->bytes += size;
+
+	if(estimator->frame_valid && frame_index == estimator->frame_index)
+	{
+		estimator->frame_last_us = now_us;
+		estimator->frame_bytes += size;
+		estimator->frame_packets++;
+		goto beach;
+	}
+
+	if(estimator->frame_valid)
+	{
+		if(!chiaki_seq_num_16_gt(frame_index, estimator->frame_index))
+			goto beach; // late packet of an old frame
+		frame_finish(estimator);
+		estimator->frame_index_ext += (int16_t)(frame_index - estimator->frame_index);
+	}
+
+	estimator->frame_valid = true;
+	estimator->frame_index = frame_index;
+	estimator->frame_first_us = estimator->frame_last_us = now_us;
+	estimator->frame_bytes = estimator->frame_first_bytes = size;
+	estimator->frame_packets = 1;
+	frame_delay(estimator, now_us);
+
+beach:
+	chiaki_mutex_unlock(&estimator->mutex);
+}
+
+static uint16_t report_scale(uint64_t v, uint64_t max)
+{
+	if(max <= UINT16_MAX)
+		return (uint16_t)v;
+	return (uint16_t)(v * UINT16_MAX / max);
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_update(ChiakiBandwidthEstimator *estimator, uint64_t now_us, uint64_t received, uint64_t lost,
+		uint16_t *report_received, uint16_t *report_lost)
+{
+	chiaki_mutex_lock(&estimator->mutex);
+
+	if(received + lost)
+	{
+		double loss = (double)lost / (double)(received + lost);
+		estimator->loss_rate = LOSS_SMOOTHING * estimator->loss_rate + (1.0 - LOSS_SMOOTHING) * loss;
+	}
+
+	if(estimator->update_prev_us && now_us > estimator->update_prev_us)
+	{
+		double dt = (double)(now_us - estimator->update_prev_us) / 1000000.0;
+		double sample = (double)(estimator->bytes - estimator->bytes_prev) * 8.0 / dt;
+		if(estimator->receive_bitrate == 0.0)
+			estimator->receive_bitrate = sample;
+		else
+			estimator->receive_bitrate = RECEIVE_SMOOTHING * estimator->receive_bitrate + (1.0 - RECEIVE_SMOOTHING) * sample;
+
+		if(estimator->bitrate == 0.0)
+			estimator->bitrate = estimator->receive_bitrate; // stays 0 until the first packets arrived
+		else if(estimator->usage == CHIAKI_BANDWIDTH_USAGE_OVERUSE || estimator->loss_rate > LOSS_DECREASE)
+		{
+			if(now_us - estimator->decrease_prev_us >= DECREASE_INTERVAL_US)
+			{
+				double target = estimator->usage == CHIAKI_BANDWIDTH_USAGE_OVERUSE
+					? DECREASE_FACTOR * estimator->receive_bitrate
+					: (1.0 - 0.5 * estimator->loss_rate) * estimator->bitrate;
+				if(target < estimator->bitrate)
+					estimator->bitrate = target;
+				estimator->decrease_prev_us = now_us;
+			}
+		}
+		else if(estimator->usage == CHIAKI_BANDWIDTH_USAGE_NORMAL)
+		{
+			// don't probe far beyond what actually arrives, nor beyond the bottleneck if it shows less headroom
+			// until the first decrease, whatever arrives is evidently available
+			if(!estimator->decrease_prev_us && estimator->bitrate < estimator->receive_bitrate)
+				estimator->bitrate = estimator->receive_bitrate;
+			double max = INCREASE_RECEIVE_MAX * estimator->receive_bitrate;
+			double bottleneck = (double)bottleneck_get(estimator);
+			if(bottleneck > estimator->receive_bitrate && bottleneck < max)
+				max = bottleneck;
+			if(estimator->bitrate < max)
+			{
+				estimator->bitrate *= 1.0 + INCREASE_PER_SECOND * dt;
+				if(estimator->bitrate > max)
+					estimator->bitrate = max;
+			}
+		}
+		if(estimator->bitrate != 0.0 && estimator->bitrate < BITRATE_MIN)
+			estimator->bitrate = BITRATE_MIN;
+	}
+	estimator->update_prev_us = now_us;
+	estimator->bytes_prev = estimator->bytes;
+
+	// only ask for less while the path actually signals congestion, not when the stream just got more complex
+	uint64_t report_lost_full = lost;
+	if((estimator->usage == CHIAKI_BANDWIDTH_USAGE_OVERUSE || estimator->loss_rate > LOSS_DECREASE)
+			&& estimator->bitrate < estimator->receive_bitrate)
+		report_lost_full += (uint64_t)((double)received * (1.0 - estimator->bitrate / estimator->receive_bitrate));
+
+	// scale both down together to keep the ratio instead of truncating
+	uint64_t max = received > report_lost_full ? received : report_lost_full;
+	*report_received = report_scale(received, max);
+	*report_lost = report_scale(report_lost_full, max);
+
+	chiaki_mutex_unlock(&estimator->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_bandwidth_estimator_get(ChiakiBandwidthEstimator *estimator, ChiakiBandwidthEstimate *estimate)
+{
+	chiaki_mutex_lock(&estimator->mutex);
+	estimate->bitrate = (uint64_t)estimator->bitrate;
+	estimate->receive_bitrate = (uint64_t)estimator->receive_bitrate;
+	estimate->bottleneck_bitrate = bottleneck_get(estimator);
+	estimate->queue_delay_us = (uint64_t)estimator->delay_smoothed_us;
+	estimate->loss_rate = estimator->loss_rate;
+	estimate->usage = estimator->usage;
+	chiaki_mutex_unlock(&estimator->mutex);
+}
+
+CHIAKI_EXPORT const char *chiaki_bandwidth_usage_string(ChiakiBandwidthUsage usage)
+{
+	switch(usage)
+	{
+		case CHIAKI_BANDWIDTH_USAGE_NORMAL:
+			return "normal";
+		case CHIAKI_BANDWIDTH_USAGE_UNDERUSE:
+			return "underuse";
+		case CHIAKI_BANDWIDTH_USAGE_OVERUSE:
+			return "overuse";
+		default:
+			return "unknown";
+	}
+}
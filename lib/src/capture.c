@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/capture.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+#include <errno.h>
+
+#define CAPTURE_MAGIC "CHIAKICP"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_HEADER_SIZE 0x10
+#define CAPTURE_RECORD_HEADER_SIZE 7
+
+static void write_u16(uint8_t *buf, uint16_t v)
+{
+	buf[0] = (uint8_t)(v >> 8);
+	buf[1] = (uint8_t)v;
+}
+
+static void write_u32(uint8_t *buf, uint32_t v)
+{
+	buf[0] = (uint8_t)(v >> 24);
+	buf[1] = (uint8_t)(v >> 16);
+	buf[2] = (uint8_t)(v >> 8);
+	buf[3] = (uint8_t)v;
+}
+
+static uint16_t read_u16(const uint8_t *buf)
+{
+	return (uint16_t)(((uint16_t)buf[0] << 8) | buf[1]);
+}
+
+static uint32_t read_u32(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_writer_init(ChiakiCaptureWriter *writer, ChiakiLog *log, const char *filename, const ChiakiCaptureInfo *info)
+{
+	writer->log = log;
+	writer->records = 0;
+	writer->bytes = 0;
+	writer->failed = false;
+	writer->file = fopen(filename, "wb");
+	if(!writer->file)
+	{
+		CHIAKI_LOGE(log, "Failed to open capture file \"%s\": %s", filename, strerror(errno));
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	uint8_t header[CAPTURE_HEADER_SIZE] = { 0 };
+	memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+	header[8] = CHIAKI_CAPTURE_VERSION;
+	header[9] = (uint8_t)info->codec;
+	write_u32(header + 0xc, (uint32_t)info->target);
+	if(fwrite(header, sizeof(header), 1, writer->file) != 1)
+	{
+		CHIAKI_LOGE(log, "Failed to write capture header");
+		fclose(writer->file);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	writer->bytes = sizeof(header);
+	writer->time_prev_us = chiaki_time_now_monotonic_us();
+
+	CHIAKI_LOGI(log, "Capturing stream to \"%s\"", filename);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_capture_writer_fini(ChiakiCaptureWriter *writer)
+{
+	CHIAKI_LOGI(writer->log, "Capture finished with %llu records, %llu bytes%s",
+			(unsigned long long)writer->records, (unsigned long long)writer->bytes,
+			writer->failed ? ", but is incomplete because writing failed" : "");
+	fclose(writer->file);
+}
+
+CHIAKI_EXPORT void chiaki_capture_writer_record(ChiakiCaptureWriter *writer, ChiakiCaptureRecordType type, uint64_t time_us, const uint8_t *buf, size_t buf_size)
+{
+	if(writer->failed)
+		return;
+	if(buf_size > CHIAKI_CAPTURE_RECORD_SIZE_MAX)
+	{
+		CHIAKI_LOGW(writer->log, "Capture record of %llu bytes is too large, skipping it", (unsigned long long)buf_size);
+		return;
+	}
+
+	uint64_t dt = time_us > writer->time_prev_us ? time_us - writer->time_prev_us : 0;
+	if(dt > UINT32_MAX)
+		dt = UINT32_MAX;
+	if(time_us > writer->time_prev_us)
+		writer->time_prev_us = time_us;
+
+	uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+	header[0] = (uint8_t)type;
+	write_u16(header + 1, (uint16_t)buf_size);
+	write_u32(header + 3, (uint32_t)dt);
+	if(fwrite(header, sizeof(header), 1, writer->file) != 1
+			|| (buf_size && fwrite(buf, buf_size, 1, writer->file) != 1))
+	{
+		CHIAKI_LOGE(writer->log, "Failed to write capture record, stopping capture");
+		writer->failed = true;
+		return;
+	}
+	writer->records++;
+	writer->bytes += sizeof(header) + buf_size;
+}
+
+CHIAKI_EXPORT void chiaki_capture_writer_keys(ChiakiCaptureWriter *writer, uint64_t time_us, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+{
+	uint8_t buf[CHIAKI_CAPTURE_KEYS_SIZE];
+	memcpy(buf, handshake_key, CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE);
+	memcpy(buf + CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE, ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+	chiaki_capture_writer_record(writer, CHIAKI_CAPTURE_RECORD_KEYS, time_us, buf, sizeof(buf));
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_init(ChiakiCaptureReader *reader, ChiakiLog *log, const char *filename)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->log = log;
+	reader->file = fopen(filename, "rb");
+	if(!reader->file)
+	{
+		CHIAKI_LOGE(log, "Failed to open capture file \"%s\": %s", filename, strerror(errno));
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	uint8_t header[CAPTURE_HEADER_SIZE];
+	if(fread(header, sizeof(header), 1, reader->file) != 1 || memcmp(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0)
+	{
+		CHIAKI_LOGE(log, "\"%s\" is not a capture file", filename);
+		goto error;
+	}
+	if(header[8] != CHIAKI_CAPTURE_VERSION)
+	{
+		CHIAKI_LOGE(log, "Capture file has version %u, expected %u", (unsigned int)header[8], (unsigned int)CHIAKI_CAPTURE_VERSION);
+		fclose(reader->file);
+		return CHIAKI_ERR_VERSION_MISMATCH;
+	}
+	reader->info.codec = (ChiakiCodec)header[9];
+	reader->info.target = (ChiakiTarget)read_u32(header + 0xc);
+	reader->records_offset = ftell(reader->file);
+
+	ChiakiCaptureRecord record;
+	ChiakiErrorCode err;
+	while((err = chiaki_capture_reader_next(reader, &record)) == CHIAKI_ERR_SUCCESS)
+	{
+		switch(record.type)
+		{
+			case CHIAKI_CAPTURE_RECORD_DATAGRAM:
+				reader->datagrams_count++;
+				reader->datagrams_bytes += record.size;
+				break;
+			case CHIAKI_CAPTURE_RECORD_TAKION_TAG:
+				if(record.size != 4 || reader->takion_tag_valid)
+					break;
+				reader->takion_tag = read_u32(record.data);
+				reader->takion_tag_valid = true;
+				break;
+			case CHIAKI_CAPTURE_RECORD_KEYS:
+				if(record.size != CHIAKI_CAPTURE_KEYS_SIZE || reader->keys_valid)
+					break;
+				memcpy(reader->handshake_key, record.data, CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE);
+				memcpy(reader->ecdh_secret, record.data + CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE, CHIAKI_ECDH_SECRET_SIZE);
+				reader->keys_valid = true;
+				break;
+			default:
+				break;
+		}
+	}
+	if(err != CHIAKI_ERR_DISCONNECTED)
+		goto error;
+	reader->duration_us = reader->time_us;
+
+	err = chiaki_capture_reader_rewind(reader);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	fclose(reader->file);
+	return CHIAKI_ERR_INVALID_DATA;
+}
+
+CHIAKI_EXPORT void chiaki_capture_reader_fini(ChiakiCaptureReader *reader)
+{
+	fclose(reader->file);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_rewind(ChiakiCaptureReader *reader)
+{
+	if(fseek(reader->file, reader->records_offset, SEEK_SET) != 0)
+		return CHIAKI_ERR_UNKNOWN;
+	reader->time_us = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_next(ChiakiCaptureReader *reader, ChiakiCaptureRecord *record)
+{
+	uint8_t header[CAPTURE_RECORD_HEADER_SIZE];
+	size_t r = fread(header, 1, sizeof(header), reader->file);
+	if(r == 0 && feof(reader->file))
+		return CHIAKI_ERR_DISCONNECTED;
+	if(r != sizeof(header))
+		goto truncated;
+
+	record->type = (ChiakiCaptureRecordType)header[0];
+	record->size = read_u16(header + 1);
+	reader->time_us += read_u32(header + 3);
+	record->time_us = reader->time_us;
+	if(record->size > sizeof(record->data))
+	{
+		CHIAKI_LOGE(reader->log, "Capture record of %llu bytes is too large", (unsigned long long)record->size);
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+	if(record->size && fread(record->data, record->size, 1, reader->file) != 1)
+		goto truncated;
+	return CHIAKI_ERR_SUCCESS;
+
+truncated:
+	CHIAKI_LOGE(reader->log, "Capture file is truncated");
+	return CHIAKI_ERR_INVALID_DATA;
+}
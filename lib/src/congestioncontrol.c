@@ -1,8 +1,26 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/congestioncontrol.h>
+#include <chiaki/time.h>
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
+#define CONGESTION_CONTROL_SLACK_MS 10
+
+static void congestion_control_send(ChiakiCongestionControl *control)
+{
+	uint64_t received;
+	uint64_t lost;
+	chiaki_packet_stats_get(control->stats, true, &received, &lost);
+	ChiakiTakionCongestionPacket packet = { 0 };
+	chiaki_bandwidth_estimator_update(control->estimator, chiaki_time_now_monotonic_us(), received, lost, &packet.received, &packet.lost);
+	ChiakiBandwidthEstimate estimate;
+	chiaki_bandwidth_estimator_get(control->estimator, &estimate);
+	CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u, estimate: %llu kbit/s, %s, queue delay: %llu us",
+		(unsigned int)packet.received, (unsigned int)packet.lost,
+		(unsigned long long)(estimate.bitrate / 1000), chiaki_bandwidth_usage_string(estimate.usage),
+		(unsigned long long)estimate.queue_delay_us);
+	chiaki_takion_send_congestion(control->takion, &packet);
+}
 
 static void *congestion_control_thread_func(void *user)
 {
@@ -17,26 +35,34 @@ static void *congestion_control_thread_func(void *user)
 		err = chiaki_bool_pred_cond_timedwait(&control->stop_cond, CONGESTION_CONTROL_INTERVAL_MS);
 		if(err != CHIAKI_ERR_TIMEOUT)
 			break;
-
-		uint64_t received;
-		uint64_t lost;
-		chiaki_packet_stats_get(control->stats, true, &received, &lost);
-		ChiakiTakionCongestionPacket packet = { 0 };
-		packet.received = (uint16_t)received;
-		packet.lost = (uint16_t)lost;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
-		chiaki_takion_send_congestion(control->takion, &packet);
+		congestion_control_send(control);
 	}
 
 	chiaki_bool_pred_cond_unlock(&control->stop_cond);
 	return NULL;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats)
+static void congestion_control_timer_cb(void *user)
+{
+	congestion_control_send(user);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats,
+		ChiakiBandwidthEstimator *estimator, ChiakiEventLoop *loop)
 {
 	control->takion = takion;
 	control->stats = stats;
+	control->estimator = estimator;
+	control->loop = loop;
+
+	if(loop)
+	{
+		uint64_t interval_us = CONGESTION_CONTROL_INTERVAL_MS * 1000;
+		chiaki_event_loop_timer_init(&control->timer, loop, congestion_control_timer_cb, control);
+		chiaki_event_loop_timer_set_slack(&control->timer, CONGESTION_CONTROL_SLACK_MS * 1000);
+		chiaki_event_loop_timer_start(&control->timer, chiaki_time_now_monotonic_us() + interval_us, interval_us);
+		return CHIAKI_ERR_SUCCESS;
+	}
 
 	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -56,6 +82,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionCo
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
+	if(control->loop)
+	{
+		chiaki_event_loop_timer_fini(&control->timer);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
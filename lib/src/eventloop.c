@@ -0,0 +1,556 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/eventloop.h>
+#include <chiaki/time.h>
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#define EVENT_LOOP_EPOLL
+#elif !defined(_WIN32)
+#include <sys/select.h>
+#endif
+
+// max readiness events handled per wakeup, more are reported again on the next one
+#define EVENT_LOOP_EVENTS_MAX 16
+
+#ifdef EVENT_LOOP_EPOLL
+#define EVENT_LOOP_ID_TIMER 0
+#define EVENT_LOOP_ID_WAKE 1
+#endif
+#define EVENT_LOOP_ID_IO_FIRST 2
+
+typedef struct event_loop_ready_t
+{
+	uint64_t id;
+	unsigned int events;
+} EventLoopReady;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop, ChiakiLog *log)
+{
+	loop->log = log;
+	loop->wake_pending = false;
+	loop->dispatching = NULL;
+	loop->should_stop = false;
+	chiaki_timer_wheel_init(&loop->timers, chiaki_time_now_monotonic_us());
+	loop->ios = NULL;
+	loop->io_id_next = EVENT_LOOP_ID_IO_FIRST;
+	memset(&loop->stats, 0, sizeof(loop->stats));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&loop->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&loop->dispatch_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+#ifdef EVENT_LOOP_EPOLL
+	loop->timer_fd_due_us = UINT64_MAX;
+	err = CHIAKI_ERR_UNKNOWN;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epoll_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to create epoll: %s", strerror(errno));
+		goto error_cond;
+	}
+
+	loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(loop->timer_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to create timerfd: %s", strerror(errno));
+		goto error_epoll;
+	}
+
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(loop->wake_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Event Loop failed to create eventfd: %s", strerror(errno));
+		goto error_timer_fd;
+	}
+
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN;
+	event.data.u64 = EVENT_LOOP_ID_TIMER;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) < 0)
+		goto error_wake_fd;
+	event.data.u64 = EVENT_LOOP_ID_WAKE;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) < 0)
+		goto error_wake_fd;
+#else
+	err = chiaki_stop_pipe_init(&loop->wake_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+#ifdef _WIN32
+	loop->io_event = WSACreateEvent();
+	if(loop->io_event == WSA_INVALID_EVENT)
+	{
+		err = CHIAKI_ERR_UNKNOWN;
+		chiaki_stop_pipe_fini(&loop->wake_pipe);
+		goto error_cond;
+	}
+#endif
+#endif
+
+	return CHIAKI_ERR_SUCCESS;
+
+#ifdef EVENT_LOOP_EPOLL
+error_wake_fd:
+	close(loop->wake_fd);
+error_timer_fd:
+	close(loop->timer_fd);
+error_epoll:
+	close(loop->epoll_fd);
+#endif
+error_cond:
+	chiaki_cond_fini(&loop->dispatch_cond);
+error_mutex:
+	chiaki_mutex_fini(&loop->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop)
+{
+	assert(!loop->timers.count && !loop->ios);
+#ifdef EVENT_LOOP_EPOLL
+	close(loop->wake_fd);
+	close(loop->timer_fd);
+	close(loop->epoll_fd);
+#else
+#ifdef _WIN32
+	WSACloseEvent(loop->io_event);
+#endif
+	chiaki_stop_pipe_fini(&loop->wake_pipe);
+#endif
+	chiaki_cond_fini(&loop->dispatch_cond);
+	chiaki_mutex_fini(&loop->mutex);
+}
+
+/**
+ * Interrupt the wait of the loop thread. mutex must be locked.
+ */
+static void event_loop_wake(ChiakiEventLoop *loop)
+{
+	if(loop->wake_pending)
+		return;
+	loop->wake_pending = true;
+#ifdef EVENT_LOOP_EPOLL
+	uint64_t v = 1;
+	if(write(loop->wake_fd, &v, sizeof(v)) < 0)
+		CHIAKI_LOGE(loop->log, "Event Loop failed to write eventfd: %s", strerror(errno));
+#else
+	chiaki_stop_pipe_stop(&loop->wake_pipe);
+#endif
+}
+
+static void event_loop_wake_reset(ChiakiEventLoop *loop)
+{
+	loop->wake_pending = false;
+#ifdef EVENT_LOOP_EPOLL
+	uint64_t v;
+	while(read(loop->wake_fd, &v, sizeof(v)) > 0);
+#else
+	chiaki_stop_pipe_reset(&loop->wake_pipe);
+#endif
+}
+
+#ifdef EVENT_LOOP_EPOLL
+/**
+ * Arm timer_fd for the first timer. mutex must be locked.
+ * timerfd_settime() is thread-safe, so other threads don't have to wake up the loop for new timers.
+ */
+static void event_loop_timer_fd_update(ChiakiEventLoop *loop)
+{
+	uint64_t due_us = chiaki_timer_wheel_next_expiry(&loop->timers);
+	if(due_us == loop->timer_fd_due_us)
+		return;
+	loop->timer_fd_due_us = due_us;
+
+	struct itimerspec spec = { 0 };
+	if(due_us != UINT64_MAX)
+	{
+		// an all-zero it_value would disarm, so due times at 0 are moved to 1ns
+		spec.it_value.tv_sec = (time_t)(due_us / 1000000);
+		spec.it_value.tv_nsec = (long)((due_us % 1000000) * 1000);
+		if(!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+			spec.it_value.tv_nsec = 1;
+	}
+	if(timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+		CHIAKI_LOGE(loop->log, "Event Loop failed to arm timerfd: %s", strerror(errno));
+}
+#endif
+
+/**
+ * Called after timer has been scheduled. mutex must be locked.
+ */
+static void event_loop_timer_scheduled(ChiakiEventLoop *loop, ChiakiEventLoopTimer *timer)
+{
+#ifdef EVENT_LOOP_EPOLL
+	(void)timer;
+	event_loop_timer_fd_update(loop);
+#else
+	// the loop computes its select timeout from the first timer
+	if(timer->timer.expires_us <= chiaki_timer_wheel_next_expiry(&loop->timers))
+		event_loop_wake(loop);
+#endif
+}
+
+/**
+ * Call the callback of dispatching with mutex unlocked.
+ */
+#define EVENT_LOOP_DISPATCH(loop, item, call) do { \
+		(loop)->dispatching = (item); \
+		chiaki_mutex_unlock(&(loop)->mutex); \
+		call; \
+		chiaki_mutex_lock(&(loop)->mutex); \
+		(loop)->dispatching = NULL; \
+		chiaki_cond_broadcast(&(loop)->dispatch_cond); \
+	} while(0)
+
+static void event_loop_dispatch_timers(ChiakiEventLoop *loop)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	ChiakiTimerWheelTimer *timer;
+	uint64_t expires_us;
+	while(!loop->should_stop && (timer = chiaki_timer_wheel_pop_expired(&loop->timers, now, &expires_us)))
+	{
+		loop->stats.timers_fired++;
+		if(expires_us && expires_us < now) // 0 is used for right away
+			loop->stats.timers_late_us += now - expires_us;
+		EVENT_LOOP_DISPATCH(loop, timer, timer->cb(timer->user));
+		now = chiaki_time_now_monotonic_us();
+	}
+}
+
+static void event_loop_dispatch_io(ChiakiEventLoop *loop, uint64_t id, unsigned int events)
+{
+	ChiakiEventLoopIo *io = loop->ios;
+	while(io && io->id != id)
+		io = io->next;
+	if(!io) // removed after its readiness was reported
+		return;
+	events &= io->events;
+	if(!events)
+		return;
+	loop->stats.ios_dispatched++;
+	EVENT_LOOP_DISPATCH(loop, io, io->cb(io->fd, events, io->user));
+}
+
+/**
+ * Wait until the first timer is due, an io is ready or the loop is woken up.
+ * mutex must be locked and is unlocked while waiting.
+ *
+ * @return number of ready ios written to ready
+ */
+static size_t event_loop_wait(ChiakiEventLoop *loop, EventLoopReady *ready)
+{
+	size_t ready_count = 0;
+#ifdef EVENT_LOOP_EPOLL
+	event_loop_timer_fd_update(loop);
+	chiaki_mutex_unlock(&loop->mutex);
+	struct epoll_event events[EVENT_LOOP_EVENTS_MAX];
+	int r = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_EVENTS_MAX, -1);
+	chiaki_mutex_lock(&loop->mutex);
+	if(r < 0)
+	{
+		if(errno != EINTR)
+			CHIAKI_LOGE(loop->log, "Event Loop epoll_wait failed: %s", strerror(errno));
+		return 0;
+	}
+	for(int i=0; i<r; i++)
+	{
+		uint64_t id = events[i].data.u64;
+		if(id == EVENT_LOOP_ID_TIMER)
+		{
+			uint64_t expirations;
+			while(read(loop->timer_fd, &expirations, sizeof(expirations)) > 0);
+			loop->timer_fd_due_us = UINT64_MAX;
+			continue;
+		}
+		if(id == EVENT_LOOP_ID_WAKE)
+		{
+			event_loop_wake_reset(loop);
+			continue;
+		}
+		unsigned int flags = 0;
+		// errors and hangups are reported as readiness, so the callback sees them from recv() or send()
+		if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			flags |= CHIAKI_EVENT_LOOP_IO_READ;
+		if(events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			flags |= CHIAKI_EVENT_LOOP_IO_WRITE;
+		ready[ready_count].id = id;
+		ready[ready_count].events = flags;
+		ready_count++;
+	}
+#else
+	uint64_t timeout_us = UINT64_MAX;
+	uint64_t due_us = chiaki_timer_wheel_next_expiry(&loop->timers);
+	if(due_us != UINT64_MAX)
+	{
+		uint64_t now = chiaki_time_now_monotonic_us();
+		timeout_us = due_us > now ? due_us - now : 0;
+	}
+
+	fd_set rfds;
+	fd_set wfds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	int nfds = 0;
+	size_t fds_count = 0;
+	for(ChiakiEventLoopIo *io = loop->ios; io && fds_count < FD_SETSIZE - 1; io = io->next, fds_count++)
+	{
+		if(io->events & CHIAKI_EVENT_LOOP_IO_READ)
+			FD_SET(io->fd, &rfds);
+		if(io->events & CHIAKI_EVENT_LOOP_IO_WRITE)
+			FD_SET(io->fd, &wfds);
+		if((int)io->fd + 1 > nfds)
+			nfds = (int)io->fd + 1;
+	}
+
+#ifdef _WIN32
+	chiaki_mutex_unlock(&loop->mutex);
+	WSAEVENT wait_events[2] = { loop->wake_pipe.event, loop->io_event };
+	DWORD r = WSAWaitForMultipleEvents(2, wait_events, FALSE,
+			timeout_us == UINT64_MAX ? WSA_INFINITE : (DWORD)((timeout_us + 999) / 1000), FALSE);
+	chiaki_mutex_lock(&loop->mutex);
+	if(r == WSA_WAIT_EVENT_0)
+		event_loop_wake_reset(loop);
+	if(!fds_count || (r != WSA_WAIT_EVENT_0 && r != WSA_WAIT_EVENT_0 + 1))
+		return 0;
+	// reset before asking, so readiness arriving in between signals the event again
+	WSAResetEvent(loop->io_event);
+	struct timeval zero = { 0 };
+	int sr = select(nfds, &rfds, &wfds, NULL, &zero);
+#else
+#if defined(__SWITCH__)
+	int wake_fd = loop->wake_pipe.fd;
+#else
+	int wake_fd = loop->wake_pipe.fds[0];
+#endif
+	FD_SET(wake_fd, &rfds);
+	if(wake_fd + 1 > nfds)
+		nfds = wake_fd + 1;
+
+	struct timeval timeout_s;
+	struct timeval *timeout = NULL;
+	if(timeout_us != UINT64_MAX)
+	{
+		timeout_s.tv_sec = timeout_us / 1000000;
+		timeout_s.tv_usec = timeout_us % 1000000;
+		timeout = &timeout_s;
+	}
+	chiaki_mutex_unlock(&loop->mutex);
+	int sr = select(nfds, &rfds, &wfds, NULL, timeout);
+	chiaki_mutex_lock(&loop->mutex);
+	if(sr > 0 && FD_ISSET(wake_fd, &rfds))
+		event_loop_wake_reset(loop);
+#endif
+	if(sr <= 0)
+		return 0;
+
+	// ios removed while waiting are skipped, the ones added are not in the sets
+	for(ChiakiEventLoopIo *io = loop->ios; io && ready_count < EVENT_LOOP_EVENTS_MAX; io = io->next)
+	{
+		unsigned int flags = 0;
+		if((io->events & CHIAKI_EVENT_LOOP_IO_READ) && FD_ISSET(io->fd, &rfds))
+			flags |= CHIAKI_EVENT_LOOP_IO_READ;
+		if((io->events & CHIAKI_EVENT_LOOP_IO_WRITE) && FD_ISSET(io->fd, &wfds))
+			flags |= CHIAKI_EVENT_LOOP_IO_WRITE;
+		if(!flags)
+			continue;
+		ready[ready_count].id = io->id;
+		ready[ready_count].events = flags;
+		ready_count++;
+	}
+#endif
+	return ready_count;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_run(ChiakiEventLoop *loop)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&loop->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	EventLoopReady ready[EVENT_LOOP_EVENTS_MAX];
+	while(!loop->should_stop)
+	{
+		event_loop_dispatch_timers(loop);
+		if(loop->should_stop)
+			break;
+		size_t ready_count = event_loop_wait(loop, ready);
+		loop->stats.wakeups++;
+		for(size_t i=0; i<ready_count && !loop->should_stop; i++)
+			event_loop_dispatch_io(loop, ready[i].id, ready[i].events);
+	}
+
+	// so the loop can be run again
+	loop->should_stop = false;
+	chiaki_mutex_unlock(&loop->mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop)
+{
+	chiaki_mutex_lock(&loop->mutex);
+	loop->should_stop = true;
+	event_loop_wake(loop);
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+static void *event_loop_thread_func(void *user)
+{
+	ChiakiEventLoop *loop = user;
+	chiaki_event_loop_run(loop);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_start(ChiakiEventLoop *loop, const char *thread_name)
+{
+	ChiakiErrorCode err = chiaki_thread_create(&loop->thread, event_loop_thread_func, loop);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_thread_set_name(&loop->thread, thread_name);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_join(ChiakiEventLoop *loop)
+{
+	ChiakiErrorCode err = chiaki_thread_join(&loop->thread, NULL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	ChiakiEventLoopStats *stats = &loop->stats;
+	CHIAKI_LOGI(loop->log, "Event Loop woke up %llu times, fired %llu timers (%.1f us late on average) and dispatched %llu ios",
+			(unsigned long long)stats->wakeups, (unsigned long long)stats->timers_fired,
+			stats->timers_fired ? (double)stats->timers_late_us / (double)stats->timers_fired : 0.0,
+			(unsigned long long)stats->ios_dispatched);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_get_stats(ChiakiEventLoop *loop, ChiakiEventLoopStats *stats)
+{
+	chiaki_mutex_lock(&loop->mutex);
+	*stats = loop->stats;
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_init(ChiakiEventLoopTimer *timer, ChiakiEventLoop *loop, ChiakiEventLoopTimerCallback cb, void *user)
+{
+	timer->loop = loop;
+	chiaki_timer_wheel_timer_init(&timer->timer, cb, user);
+	timer->slack_us = 0;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_fini(ChiakiEventLoopTimer *timer)
+{
+	ChiakiEventLoop *loop = timer->loop;
+	chiaki_mutex_lock(&loop->mutex);
+	chiaki_timer_wheel_cancel(&loop->timers, &timer->timer);
+	while(loop->dispatching == &timer->timer)
+		chiaki_cond_wait(&loop->dispatch_cond, &loop->mutex);
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_start(ChiakiEventLoopTimer *timer, uint64_t due_us, uint64_t interval_us)
+{
+	ChiakiEventLoop *loop = timer->loop;
+	chiaki_mutex_lock(&loop->mutex);
+	chiaki_timer_wheel_schedule(&loop->timers, &timer->timer, due_us, interval_us, timer->slack_us);
+	event_loop_timer_scheduled(loop, timer);
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_set_slack(ChiakiEventLoopTimer *timer, uint64_t slack_us)
+{
+	ChiakiEventLoop *loop = timer->loop;
+	chiaki_mutex_lock(&loop->mutex);
+	timer->slack_us = slack_us;
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_timer_stop(ChiakiEventLoopTimer *timer)
+{
+	ChiakiEventLoop *loop = timer->loop;
+	chiaki_mutex_lock(&loop->mutex);
+	// a later first timer only causes a spurious wakeup
+	chiaki_timer_wheel_cancel(&loop->timers, &timer->timer);
+	chiaki_mutex_unlock(&loop->mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_io_add(ChiakiEventLoop *loop, ChiakiEventLoopIo *io, chiaki_socket_t fd, unsigned int events,
+		ChiakiEventLoopIoCallback cb, void *user)
+{
+	io->loop = loop;
+	io->cb = cb;
+	io->user = user;
+	io->fd = fd;
+	io->events = events;
+
+	chiaki_mutex_lock(&loop->mutex);
+	io->id = loop->io_id_next++;
+#ifdef EVENT_LOOP_EPOLL
+	struct epoll_event event = { 0 };
+	if(events & CHIAKI_EVENT_LOOP_IO_READ)
+		event.events |= EPOLLIN;
+	if(events & CHIAKI_EVENT_LOOP_IO_WRITE)
+		event.events |= EPOLLOUT;
+	event.data.u64 = io->id;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		CHIAKI_LOGE(loop->log, "Event Loop failed to add fd to epoll: %s", strerror(errno));
+		chiaki_mutex_unlock(&loop->mutex);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#else
+#ifdef _WIN32
+	long network_events = FD_CLOSE;
+	if(events & CHIAKI_EVENT_LOOP_IO_READ)
+		network_events |= FD_READ | FD_ACCEPT;
+	if(events & CHIAKI_EVENT_LOOP_IO_WRITE)
+		network_events |= FD_WRITE | FD_CONNECT;
+	if(WSAEventSelect(fd, loop->io_event, network_events) != 0)
+	{
+		CHIAKI_LOGE(loop->log, "Event Loop failed to select events of socket: %d", WSAGetLastError());
+		chiaki_mutex_unlock(&loop->mutex);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#endif
+	// rebuild the fd sets
+	event_loop_wake(loop);
+#endif
+	io->next = loop->ios;
+	loop->ios = io;
+	chiaki_mutex_unlock(&loop->mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_io_remove(ChiakiEventLoopIo *io)
+{
+	ChiakiEventLoop *loop = io->loop;
+	chiaki_mutex_lock(&loop->mutex);
+	ChiakiEventLoopIo **prev = &loop->ios;
+	while(*prev && *prev != io)
+		prev = &(*prev)->next;
+	if(*prev)
+	{
+		*prev = io->next;
+#ifdef EVENT_LOOP_EPOLL
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL);
+#else
+#ifdef _WIN32
+		WSAEventSelect(io->fd, NULL, 0);
+#endif
+		event_loop_wake(loop);
+#endif
+	}
+	io->next = NULL;
+	while(loop->dispatching == io)
+		chiaki_cond_wait(&loop->dispatch_cond, &loop->mutex);
+	chiaki_mutex_unlock(&loop->mutex);
+}
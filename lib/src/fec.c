@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/fec.h>
+#include <chiaki/gf8.h>
 
 #include <jerasure.h>
 #include <cauchy.h>
@@ -8,67 +9,338 @@
 #include <string.h>
 #include <stdlib.h>
 
+#define ERASURES_WORDS (CHIAKI_FEC_UNITS_MAX / 64)
+
+struct chiaki_fec_cache_entry_t
+{
+	ChiakiFecCacheEntry *lru_prev;
+	ChiakiFecCacheEntry *lru_next;
+	ChiakiFecCacheEntry *bucket_next;
+	uint64_t hash;
+	unsigned int k;
+	unsigned int m;
+	uint64_t erasures[ERASURES_WORDS]; // bitmap of erased units, all zero for a coding matrix entry
+	size_t mem_size;
+
+	/**
+	 * Coding matrix entry: m rows of k elements.
+	 * Decoding matrix entry: rows_count rows of k elements, one for each erased source unit.
+	 */
+	int *matrix;
+	unsigned int rows_count;
+	int *rows_dest; // decoding only, unit index to restore with each row
+	int *src_ids; // decoding only, k indices of the units that the rows are applied to
+};
+
 int *create_matrix(unsigned int k, unsigned int m)
 {
 	return cauchy_original_coding_matrix(k, m, CHIAKI_FEC_WORDSIZE);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache, size_t mem_budget)
 {
-	if(stride < unit_size)
-		return CHIAKI_ERR_INVALID_DATA;
+	cache->mem_budget = mem_budget;
+	cache->mem_used = 0;
+	cache->lru_first = NULL;
+	cache->lru_last = NULL;
+	memset(cache->buckets, 0, sizeof(cache->buckets));
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache)
+{
+	ChiakiFecCacheEntry *entry = cache->lru_first;
+	while(entry)
+	{
+		ChiakiFecCacheEntry *next = entry->lru_next;
+		free(entry);
+		entry = next;
+	}
+}
+
+static uint64_t cache_hash(unsigned int k, unsigned int m, const uint64_t *erasures)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ull;
+#define HASH_WORD(v) do { h ^= (uint64_t)(v); h *= 0x100000001b3ull; } while(0)
+	HASH_WORD(k);
+	HASH_WORD(m);
+	for(size_t i=0; i<ERASURES_WORDS; i++)
+		HASH_WORD(erasures[i]);
+#undef HASH_WORD
+	return h;
+}
+
+static void cache_lru_unlink(ChiakiFecCache *cache, ChiakiFecCacheEntry *entry)
+{
+	if(entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_first = entry->lru_next;
+	if(entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_last = entry->lru_prev;
+}
+
+static void cache_lru_push_front(ChiakiFecCache *cache, ChiakiFecCacheEntry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_first;
+	if(cache->lru_first)
+		cache->lru_first->lru_prev = entry;
+	else
+		cache->lru_last = entry;
+	cache->lru_first = entry;
+}
+
+static ChiakiFecCacheEntry *cache_lookup(ChiakiFecCache *cache, unsigned int k, unsigned int m, const uint64_t *erasures, uint64_t hash)
+{
+	for(ChiakiFecCacheEntry *entry = cache->buckets[hash % CHIAKI_FEC_CACHE_BUCKETS]; entry; entry = entry->bucket_next)
+	{
+		if(entry->hash != hash || entry->k != k || entry->m != m
+				|| memcmp(entry->erasures, erasures, sizeof(entry->erasures)) != 0)
+			continue;
+		cache->hits++;
+		cache_lru_unlink(cache, entry);
+		cache_lru_push_front(cache, entry);
+		return entry;
+	}
+	cache->misses++;
+	return NULL;
+}
+
+static void cache_insert(ChiakiFecCache *cache, ChiakiFecCacheEntry *entry)
+{
+	ChiakiFecCacheEntry **bucket = &cache->buckets[entry->hash % CHIAKI_FEC_CACHE_BUCKETS];
+	entry->bucket_next = *bucket;
+	*bucket = entry;
+	cache_lru_push_front(cache, entry);
+	cache->mem_used += entry->mem_size;
+}
+
+static void cache_remove(ChiakiFecCache *cache, ChiakiFecCacheEntry *entry)
+{
+	ChiakiFecCacheEntry **cur = &cache->buckets[entry->hash % CHIAKI_FEC_CACHE_BUCKETS];
+	while(*cur != entry)
+		cur = &(*cur)->bucket_next;
+	*cur = entry->bucket_next;
+	cache_lru_unlink(cache, entry);
+	cache->mem_used -= entry->mem_size;
+	free(entry);
+}
+
+/**
+ * Evict least recently used entries until mem_budget is met, but never the most recently used one.
+ */
+static void cache_trim(ChiakiFecCache *cache)
+{
+	while(cache->mem_used > cache->mem_budget && cache->lru_last && cache->lru_last != cache->lru_first)
+		cache_remove(cache, cache->lru_last);
+}
+
+static ChiakiFecCacheEntry *cache_entry_alloc(unsigned int k, unsigned int m, const uint64_t *erasures, uint64_t hash, size_t matrix_elems, size_t ids_elems)
+{
+	size_t mem_size = sizeof(ChiakiFecCacheEntry) + (matrix_elems + ids_elems) * sizeof(int);
+	ChiakiFecCacheEntry *entry = malloc(mem_size);
+	if(!entry)
+		return NULL;
+	memset(entry, 0, sizeof(ChiakiFecCacheEntry));
+	entry->hash = hash;
+	entry->k = k;
+	entry->m = m;
+	memcpy(entry->erasures, erasures, sizeof(entry->erasures));
+	entry->mem_size = mem_size;
+	entry->matrix = (int *)(entry + 1);
+	return entry;
+}
+
+static ChiakiFecCacheEntry *cache_get_coding_matrix(ChiakiFecCache *cache, unsigned int k, unsigned int m)
+{
+	static const uint64_t no_erasures[ERASURES_WORDS] = { 0 };
+	uint64_t hash = cache_hash(k, m, no_erasures);
+	ChiakiFecCacheEntry *entry = cache_lookup(cache, k, m, no_erasures, hash);
+	if(entry)
+		return entry;
+
 	int *matrix = create_matrix(k, m);
 	if(!matrix)
-		return CHIAKI_ERR_MEMORY;
+		return NULL;
+	entry = cache_entry_alloc(k, m, no_erasures, hash, (size_t)k * m, 0);
+	if(!entry)
+	{
+		free(matrix);
+		return NULL;
+	}
+	memcpy(entry->matrix, matrix, (size_t)k * m * sizeof(int));
+	free(matrix);
+	entry->rows_count = m;
+	cache_insert(cache, entry);
+	return entry;
+}
 
-	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+static ChiakiFecCacheEntry *cache_get_decoding_matrix(ChiakiFecCache *cache, unsigned int k, unsigned int m, const uint64_t *erasures)
+{
+	uint64_t hash = cache_hash(k, m, erasures);
+	ChiakiFecCacheEntry *entry = cache_lookup(cache, k, m, erasures, hash);
+	if(entry)
+		return entry;
 
-	int *jerasures = calloc(erasures_count + 1, sizeof(int));
-	if(!jerasures)
+	ChiakiFecCacheEntry *coding = cache_get_coding_matrix(cache, k, m);
+	if(!coding)
+		return NULL;
+
+	int erased[CHIAKI_FEC_UNITS_MAX];
+	unsigned int rows_count = 0;
+	for(unsigned int i=0; i<k+m; i++)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_matrix;
+		erased[i] = (erasures[i / 64] >> (i % 64)) & 1;
+		if(i < k && erased[i])
+			rows_count++;
 	}
-	memcpy(jerasures, erasures, erasures_count * sizeof(int));
-	jerasures[erasures_count] = -1;
 
-	uint8_t **data_ptrs = calloc(k, sizeof(uint8_t *));
-	if(!data_ptrs)
+	int *decoding_matrix = malloc((size_t)k * k * sizeof(int));
+	if(!decoding_matrix)
+		return NULL;
+
+	entry = cache_entry_alloc(k, m, erasures, hash, (size_t)rows_count * k, rows_count + k);
+	if(!entry)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_jerasures;
+		free(decoding_matrix);
+		return NULL;
 	}
+	entry->rows_count = rows_count;
+	entry->rows_dest = entry->matrix + (size_t)rows_count * k;
+	entry->src_ids = entry->rows_dest + rows_count;
 
-	uint8_t **coding_ptrs = calloc(m, sizeof(uint8_t *));
-	if(!coding_ptrs)
+	if(jerasure_make_decoding_matrix(k, m, CHIAKI_FEC_WORDSIZE, coding->matrix, erased, decoding_matrix, entry->src_ids) < 0)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_data_ptrs;
+		free(decoding_matrix);
+		free(entry);
+		return NULL;
 	}
 
-	for(size_t i=0; i<k+m; i++)
+	unsigned int row = 0;
+	for(unsigned int i=0; i<k; i++)
 	{
-		uint8_t *buf_ptr = frame_buf + stride * i;
-		if(i < k)
-			data_ptrs[i] = buf_ptr;
-		else
-			coding_ptrs[i - k] = buf_ptr;
+		if(!erased[i])
+			continue;
+		memcpy(entry->matrix + (size_t)row * k, decoding_matrix + (size_t)i * k, k * sizeof(int));
+		entry->rows_dest[row] = (int)i;
+		row++;
 	}
+	free(decoding_matrix);
 
-	int res = jerasure_matrix_decode(k, m, CHIAKI_FEC_WORDSIZE, matrix, 0, jerasures,
-									 (char **)data_ptrs, (char **)coding_ptrs, unit_size);
+	cache_insert(cache, entry);
+	return entry;
+}
 
-	if(res < 0)
-		err = CHIAKI_ERR_FEC_FAILED;
-	else
-		err = CHIAKI_ERR_SUCCESS;
-
-	free(coding_ptrs);
-error_data_ptrs:
-	free(data_ptrs);
-error_jerasures:
-	free(jerasures);
-error_matrix:
-	free(matrix);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode_cached(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m)
+{
+	if(stride < unit_size)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(!k || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(!m)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiFecCacheEntry *entry = cache_get_coding_matrix(cache, k, m);
+	if(!entry)
+		return CHIAKI_ERR_MEMORY;
+
+	// equivalent to jerasure_matrix_encode(), but with our own region kernels
+	ChiakiGF8Impl impl = chiaki_gf8_impl_best();
+	for(unsigned int row=0; row<m; row++)
+	{
+		const int *coeffs = entry->matrix + (size_t)row * k;
+		uint8_t *dst = frame_buf + stride * (k + row);
+		bool init = false;
+		for(unsigned int i=0; i<k; i++)
+		{
+			if(!coeffs[i])
+				continue;
+			chiaki_gf8_region_mul_impl(impl, dst, frame_buf + stride * i, (uint8_t)coeffs[i], unit_size, init);
+			init = true;
+		}
+		if(!init)
+			memset(dst, 0, unit_size);
+	}
+
+	cache_trim(cache);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache, SIZE_MAX);
+	ChiakiErrorCode err = chiaki_fec_encode_cached(&cache, frame_buf, unit_size, stride, k, m);
+	chiaki_fec_cache_fini(&cache);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode_cached(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	if(stride < unit_size)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(!k || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	uint64_t erasures_bitmap[ERASURES_WORDS] = { 0 };
+	size_t erased_count = 0;
+	bool source_erased = false;
+	for(size_t i=0; i<erasures_count; i++)
+	{
+		unsigned int e = erasures[i];
+		if(e >= k + m)
+			return CHIAKI_ERR_INVALID_DATA;
+		uint64_t bit = 1ull << (e % 64);
+		if(erasures_bitmap[e / 64] & bit)
+			continue;
+		erasures_bitmap[e / 64] |= bit;
+		erased_count++;
+		if(e < k)
+			source_erased = true;
+	}
+
+	if(erased_count > m)
+		return CHIAKI_ERR_FEC_FAILED;
+	if(!source_erased)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiFecCacheEntry *entry = cache_get_decoding_matrix(cache, k, m, erasures_bitmap);
+	if(!entry)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	// equivalent to jerasure_matrix_dotprod(), but with our own region kernels
+	ChiakiGF8Impl impl = chiaki_gf8_impl_best();
+	for(unsigned int row=0; row<entry->rows_count; row++)
+	{
+		const int *coeffs = entry->matrix + (size_t)row * k;
+		uint8_t *dst = frame_buf + stride * entry->rows_dest[row];
+		bool init = false;
+		for(unsigned int i=0; i<k; i++)
+		{
+			if(!coeffs[i])
+				continue;
+			const uint8_t *src = frame_buf + stride * entry->src_ids[i];
+			chiaki_gf8_region_mul_impl(impl, dst, src, (uint8_t)coeffs[i], unit_size, init);
+			init = true;
+		}
+		if(!init)
+			memset(dst, 0, unit_size);
+	}
+
+	cache_trim(cache);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache, SIZE_MAX);
+	ChiakiErrorCode err = chiaki_fec_decode_cached(&cache, frame_buf, unit_size, stride, k, m, erasures, erasures_count);
+	chiaki_fec_cache_fini(&cache);
 	return err;
 }
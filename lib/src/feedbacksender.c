@@ -1,18 +1,32 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/feedbacksender.h>
+#include <chiaki/time.h>
+
+#include <string.h>
 
-#define FEEDBACK_STATE_TIMEOUT_MIN_MS 8 // minimum time to wait between sending 2 packets
 #define FEEDBACK_STATE_TIMEOUT_MAX_MS 200 // maximum time to wait between sending 2 packets
 
 #define FEEDBACK_HISTORY_BUFFER_SIZE 0x10
+// pending history events at which they are sent without waiting for interval_min_us, before they drop out of the buffer
+#define FEEDBACK_HISTORY_EVENTS_FLUSH (FEEDBACK_HISTORY_BUFFER_SIZE / 2)
 
 static void *feedback_sender_thread_func(void *user);
+static void feedback_sender_timer_cb(void *user);
+static void feedback_sender_push_history(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state_prev, ChiakiControllerState *state_now);
+static uint64_t feedback_sender_change_due_us(ChiakiFeedbackSender *feedback_sender, uint64_t now_us);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, uint32_t interval_min_ms,
+		ChiakiEventLoop *loop)
 {
 	feedback_sender->log = takion->log;
 	feedback_sender->takion = takion;
+	feedback_sender->loop = loop;
+	feedback_sender->should_stop = false;
+	feedback_sender->controller_state_changed = false;
+	feedback_sender->interval_min_us = (uint64_t)interval_min_ms * 1000;
+	feedback_sender->change_sent_us = 0;
+	memset(&feedback_sender->stats, 0, sizeof(feedback_sender->stats));
 
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state_prev);
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state);
@@ -20,6 +34,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	feedback_sender->state_seq_num = 0;
 
 	feedback_sender->history_seq_num = 0;
+	feedback_sender->history_events_pending = 0;
 	ChiakiErrorCode err = chiaki_feedback_history_buffer_init(&feedback_sender->history_buf, FEEDBACK_HISTORY_BUFFER_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -32,6 +47,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
+	if(loop)
+	{
+		feedback_sender->timer_due_us = chiaki_time_now_monotonic_us() + FEEDBACK_STATE_TIMEOUT_MAX_MS * 1000;
+		chiaki_event_loop_timer_init(&feedback_sender->timer, loop, feedback_sender_timer_cb, feedback_sender);
+		chiaki_event_loop_timer_start(&feedback_sender->timer, feedback_sender->timer_due_us, 0);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	err = chiaki_thread_create(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
@@ -50,11 +73,20 @@ error_history_buffer:
 
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender)
 {
-	chiaki_mutex_lock(&feedback_sender->state_mutex);
-	feedback_sender->should_stop = true;
-	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
-	chiaki_thread_join(&feedback_sender->thread, NULL);
+	if(feedback_sender->loop)
+		chiaki_event_loop_timer_fini(&feedback_sender->timer);
+	else
+	{
+		chiaki_mutex_lock(&feedback_sender->state_mutex);
+		feedback_sender->should_stop = true;
+		chiaki_mutex_unlock(&feedback_sender->state_mutex);
+		chiaki_cond_signal(&feedback_sender->state_cond);
+		chiaki_thread_join(&feedback_sender->thread, NULL);
+	}
+	ChiakiFeedbackSenderStats *stats = &feedback_sender->stats;
+	CHIAKI_LOGI(feedback_sender->log, "Feedback Sender sent %llu history packets for %llu controller state changes (%.2f per change) and %llu state packets",
+			(unsigned long long)stats->history_packets, (unsigned long long)stats->state_changes,
+			chiaki_feedback_sender_stats_history_packets_per_change(stats), (unsigned long long)stats->state_packets);
 	chiaki_cond_fini(&feedback_sender->state_cond);
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
@@ -72,11 +104,25 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(Chiaki
 		return CHIAKI_ERR_SUCCESS;
 	}
 
+	// history events are taken from every update, so short presses are not lost while waiting for interval_min_us
+	feedback_sender_push_history(feedback_sender, &feedback_sender->controller_state, state);
 	feedback_sender->controller_state = *state;
 	feedback_sender->controller_state_changed = true;
+	feedback_sender->stats.state_changes++;
+
+	if(feedback_sender->loop)
+	{
+		uint64_t due_us = feedback_sender_change_due_us(feedback_sender, chiaki_time_now_monotonic_us());
+		if(due_us < feedback_sender->timer_due_us)
+		{
+			feedback_sender->timer_due_us = due_us;
+			chiaki_event_loop_timer_start(&feedback_sender->timer, due_us, 0);
+		}
+	}
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
+	if(!feedback_sender->loop)
+		chiaki_cond_signal(&feedback_sender->state_cond);
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -125,25 +171,12 @@ static void feedback_sender_send_state(ChiakiFeedbackSender *feedback_sender)
 	ChiakiErrorCode err = chiaki_takion_send_feedback_state(feedback_sender->takion, feedback_sender->state_seq_num++, &state);
 	if(err != CHIAKI_ERR_SUCCESS)
 		CHIAKI_LOGE(feedback_sender->log, "FeedbackSender failed to send Feedback State");
+	feedback_sender->stats.state_packets++;
 }
 
-static bool controller_state_equals_for_feedback_history(ChiakiControllerState *a, ChiakiControllerState *b)
-{
-	if(!(a->buttons == b->buttons
-		&& a->l2_state == b->l2_state
-		&& a->r2_state == b->r2_state))
-		return false;
-
-	for(size_t i=0; i<CHIAKI_CONTROLLER_TOUCHES_MAX; i++)
-	{
-		if(a->touches[i].id != b->touches[i].id)
-			return false;
-		if(a->touches[i].id >= 0 && (a->touches[i].x != b->touches[i].x || a->touches[i].y != b->touches[i].y))
-			return false;
-	}
-	return true;
-}
-
+/**
+ * Send everything in the history buffer in one packet.
+ */
 static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_sender)
 {
 	uint8_t buf[0x300];
@@ -158,12 +191,21 @@ static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_s
 	//CHIAKI_LOGD(feedback_sender->log, "Feedback History:");
 	//chiaki_log_hexdump(feedback_sender->log, CHIAKI_LOG_DEBUG, buf, buf_size);
 	chiaki_takion_send_feedback_history(feedback_sender->takion, feedback_sender->history_seq_num++, buf, buf_size);
+	feedback_sender->history_events_pending = 0;
+	feedback_sender->stats.history_packets++;
+}
+
+static void feedback_sender_push_history_event(ChiakiFeedbackSender *feedback_sender, ChiakiFeedbackHistoryEvent *event)
+{
+	chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, event);
+	feedback_sender->history_events_pending++;
 }
 
-static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
+/**
+ * Push history events for all transitions from state_prev to state_now, to be sent by the thread.
+ */
+static void feedback_sender_push_history(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state_prev, ChiakiControllerState *state_now)
 {
-	ChiakiControllerState *state_prev = &feedback_sender->controller_state_prev;
-	ChiakiControllerState *state_now = &feedback_sender->controller_state;
 	uint64_t buttons_prev = state_prev->buttons;
 	uint64_t buttons_now = state_now->buttons;
 	for(uint8_t i=0; i<CHIAKI_CONTROLLER_BUTTONS_COUNT; i++)
@@ -180,8 +222,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 				CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for button id %llu", (unsigned long long)button_id);
 				continue;
 			}
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event);
 		}
 	}
 
@@ -191,8 +232,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, state_now->l2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
 		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event);
 		}
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for L2");
@@ -204,8 +244,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_R2, state_now->r2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
 		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event);
 		}
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for R2");
@@ -218,8 +257,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 			ChiakiFeedbackHistoryEvent event;
 			chiaki_feedback_history_event_set_touchpad(&event, false, (uint8_t)state_prev->touches[i].id,
 					state_prev->touches[i].x, state_prev->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event);
 		}
 		else if(state_now->touches[i].id >= 0
 				&& (state_prev->touches[i].id != state_now->touches[i].id
@@ -229,18 +267,73 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 			ChiakiFeedbackHistoryEvent event;
 			chiaki_feedback_history_event_set_touchpad(&event, true, (uint8_t)state_now->touches[i].id,
 					state_now->touches[i].x, state_now->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event);
 		}
 	}
 }
 
+/**
+ * When packets for a change may be sent, now_us if right away.
+ * The first change goes out right away, the ones right after it are gathered until interval_min_us is over
+ * or so many history events are pending that the buffer could not hold them much longer.
+ */
+static uint64_t feedback_sender_change_due_us(ChiakiFeedbackSender *feedback_sender, uint64_t now_us)
+{
+	if(!feedback_sender->interval_min_us || !feedback_sender->change_sent_us
+		|| feedback_sender->history_events_pending >= FEEDBACK_HISTORY_EVENTS_FLUSH)
+		return now_us;
+	uint64_t due_us = feedback_sender->change_sent_us + feedback_sender->interval_min_us;
+	return due_us > now_us ? due_us : now_us;
+}
+
 static bool state_cond_check(void *user)
 {
 	ChiakiFeedbackSender *feedback_sender = user;
 	return feedback_sender->should_stop || feedback_sender->controller_state_changed;
 }
 
+static bool interval_cond_check(void *user)
+{
+	ChiakiFeedbackSender *feedback_sender = user;
+	return feedback_sender->should_stop || feedback_sender->history_events_pending >= FEEDBACK_HISTORY_EVENTS_FLUSH;
+}
+
+/**
+ * Send the state and the pending history events. state_mutex must be locked.
+ *
+ * @param changed whether this is for a change of the controller state, otherwise the state is just repeated
+ */
+static void feedback_sender_send(ChiakiFeedbackSender *feedback_sender, bool changed)
+{
+	bool send_feedback_state = true;
+	bool send_feedback_history = feedback_sender->history_events_pending > 0;
+
+	if(changed)
+	{
+		feedback_sender->controller_state_changed = false;
+
+		// don't need to send feedback state if nothing relevant changed
+		if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
+			send_feedback_state = false;
+
+		if(send_feedback_state || send_feedback_history)
+			feedback_sender->change_sent_us = chiaki_time_now_monotonic_us();
+	} // else: timeout
+
+	// everything from this update leaves together
+	chiaki_takion_send_begin(feedback_sender->takion);
+
+	if(send_feedback_state)
+		feedback_sender_send_state(feedback_sender);
+
+	if(send_feedback_history)
+		feedback_sender_send_history_packet(feedback_sender);
+
+	chiaki_takion_send_end(feedback_sender->takion);
+
+	feedback_sender->controller_state_prev = feedback_sender->controller_state;
+}
+
 static void *feedback_sender_thread_func(void *user)
 {
 	ChiakiFeedbackSender *feedback_sender = user;
@@ -259,31 +352,35 @@ static void *feedback_sender_thread_func(void *user)
 		if(feedback_sender->should_stop)
 			break;
 
-		bool send_feedback_state = true;
-		bool send_feedback_history = false;
-
-		if(feedback_sender->controller_state_changed)
+		bool changed = feedback_sender->controller_state_changed;
+		if(changed)
 		{
-			// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
-			feedback_sender->controller_state_changed = false;
-
-			// don't need to send feedback state if nothing relevant changed
-			if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
-				send_feedback_state = false;
-
-			send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
-		} // else: timeout
-
-		if(send_feedback_state)
-			feedback_sender_send_state(feedback_sender);
-
-		if(send_feedback_history)
-			feedback_sender_send_history(feedback_sender);
+			uint64_t now_us = chiaki_time_now_monotonic_us();
+			uint64_t due_us = feedback_sender_change_due_us(feedback_sender, now_us);
+			if(due_us > now_us)
+			{
+				err = chiaki_cond_timedwait_pred(&feedback_sender->state_cond, &feedback_sender->state_mutex, (due_us - now_us + 999) / 1000, interval_cond_check, feedback_sender);
+				if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+					break;
+				if(feedback_sender->should_stop)
+					break;
+			}
+		}
 
-		feedback_sender->controller_state_prev = feedback_sender->controller_state;
+		feedback_sender_send(feedback_sender, changed);
 	}
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
 
 	return NULL;
 }
+
+static void feedback_sender_timer_cb(void *user)
+{
+	ChiakiFeedbackSender *feedback_sender = user;
+	chiaki_mutex_lock(&feedback_sender->state_mutex);
+	feedback_sender_send(feedback_sender, feedback_sender->controller_state_changed);
+	feedback_sender->timer_due_us = chiaki_time_now_monotonic_us() + FEEDBACK_STATE_TIMEOUT_MAX_MS * 1000;
+	chiaki_event_loop_timer_start(&feedback_sender->timer, feedback_sender->timer_due_us, 0);
+	chiaki_mutex_unlock(&feedback_sender->state_mutex);
+}
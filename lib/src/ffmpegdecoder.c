@@ -1,8 +1,18 @@
 
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/video.h>
+#include <chiaki/time.h>
+#include <chiaki/trace.h>
 
 #include <libavcodec/avcodec.h>
 
+#include <string.h>
+
+// how long the video callbacks wait for room in the packet queue before dropping, by default
+#define SUBMIT_TIMEOUT_MS 20
+
+static void *ffmpeg_decoder_thread_func(void *user);
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -15,14 +25,71 @@ static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 	}
 }
 
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_profile_name(ChiakiFfmpegDecoderProfile profile)
+{
+	switch(profile)
+	{
+		case CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY:
+			return "latency";
+		case CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT:
+			return "throughput";
+		case CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER:
+			return "power saver";
+		default:
+			return "default";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_profile_apply(ChiakiFfmpegDecoderProfile profile, unsigned int threads, AVCodecContext *codec_context)
+{
+	switch(profile)
+	{
+		case CHIAKI_FFMPEG_DECODER_PROFILE_LATENCY:
+			// frame threading delays output by one frame per thread, slices are decoded in parallel right away
+			codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+			codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+			codec_context->thread_type = FF_THREAD_SLICE;
+			codec_context->thread_count = threads;
+			break;
+		case CHIAKI_FFMPEG_DECODER_PROFILE_THROUGHPUT:
+			codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+			codec_context->thread_count = threads;
+			break;
+		case CHIAKI_FFMPEG_DECODER_PROFILE_POWER_SAVER:
+			codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+			codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+			codec_context->skip_loop_filter = AVDISCARD_NONREF;
+			codec_context->thread_type = FF_THREAD_SLICE;
+			codec_context->thread_count = threads ? threads : 1;
+			break;
+		default:
+			if(threads)
+				codec_context->thread_count = threads;
+			break;
+	}
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
-		ChiakiCodec codec, const char *hw_decoder_name,
+		ChiakiCodec codec, const char *hw_decoder_name, ChiakiFfmpegDecoderProfile profile,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
 {
 	decoder->log = log;
+	decoder->profile = profile;
 	decoder->frame_available_cb = frame_available_cb;
 	decoder->frame_available_cb_user = frame_available_cb_user;
 
+	decoder->submit_timeout_ms = SUBMIT_TIMEOUT_MS;
+	decoder->output_policy = CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE;
+	decoder->output_first = 0;
+	decoder->output_count = 0;
+	memset(&decoder->stats, 0, sizeof(decoder->stats));
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT; i++)
+	{
+		decoder->in_flight_pts[i] = AV_NOPTS_VALUE;
+		decoder->in_flight_frame_index[i] = -1;
+	}
+	decoder->in_flight_next = 0;
+
 	ChiakiErrorCode err = chiaki_mutex_init(&decoder->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -81,16 +148,34 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 		decoder->codec_context->hw_device_ctx = av_buffer_ref(decoder->hw_device_ctx);
 	}
 
+	CHIAKI_LOGI(log, "Using %s decoder profile", chiaki_ffmpeg_decoder_profile_name(profile));
+	chiaki_ffmpeg_decoder_profile_apply(profile, 0, decoder->codec_context);
+
 	if(avcodec_open2(decoder->codec_context, decoder->av_codec, NULL) < 0)
 	{
 		CHIAKI_LOGE(log, "Failed to open codec context");
 		goto error_codec_context;
 	}
 
+	err = chiaki_spsc_queue_init(&decoder->packet_queue, sizeof(AVPacket *), CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_codec_context;
+
+	err = chiaki_thread_create(&decoder->decode_thread, ffmpeg_decoder_thread_func, decoder);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Failed to create FFMPEG decode thread");
+		goto error_packet_queue;
+	}
+	chiaki_thread_set_name(&decoder->decode_thread, "Chiaki FFMPEG Decode");
+
 	return CHIAKI_ERR_SUCCESS;
+error_packet_queue:
+	chiaki_spsc_queue_fini(&decoder->packet_queue);
 error_codec_context:
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
+	avcodec_close(decoder->codec_context);
 	avcodec_free_context(&decoder->codec_context);
 error_mutex:
 	chiaki_mutex_fini(&decoder->mutex);
@@ -99,113 +184,320 @@ error_mutex:
 
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 {
+	chiaki_spsc_queue_close(&decoder->packet_queue);
+	chiaki_thread_join(&decoder->decode_thread, NULL);
+
+	// the thread is gone, so drain whatever was never decoded from here
+	AVPacket **slot;
+	while((slot = chiaki_spsc_queue_read_slot(&decoder->packet_queue)))
+	{
+		av_packet_free(slot);
+		chiaki_spsc_queue_pop(&decoder->packet_queue);
+	}
+	chiaki_spsc_queue_fini(&decoder->packet_queue);
+
+	for(size_t i=0; i<decoder->output_count; i++)
+		av_frame_free(&decoder->output[(decoder->output_first + i) % CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE]);
+	decoder->output_count = 0;
+
+	CHIAKI_LOGI(decoder->log, "FFMPEG Decoder: %llu packets decoded, %llu dropped, %llu frames decoded, %llu replaced before being pulled",
+			(unsigned long long)decoder->stats.packets_decoded,
+			(unsigned long long)decoder->stats.packets_dropped,
+			(unsigned long long)decoder->stats.frames_decoded,
+			(unsigned long long)decoder->stats.frames_replaced);
+	if(decoder->stats.frames_timed)
+		CHIAKI_LOGI(decoder->log, "FFMPEG Decoder with %s profile: decode latency mean %llu us, max %llu us",
+				chiaki_ffmpeg_decoder_profile_name(decoder->profile),
+				(unsigned long long)(decoder->stats.decode_latency_us_sum / decoder->stats.frames_timed),
+				(unsigned long long)decoder->stats.decode_latency_us_max);
+
 	avcodec_close(decoder->codec_context);
 	avcodec_free_context(&decoder->codec_context);
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
+	chiaki_mutex_fini(&decoder->mutex);
 }
 
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_output_policy(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderOutputPolicy policy)
 {
-	ChiakiFfmpegDecoder *decoder = user;
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->output_policy = policy;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_submit_timeout(ChiakiFfmpegDecoder *decoder, uint64_t timeout_ms)
+{
+	decoder->submit_timeout_ms = timeout_ms;
+}
 
+static void ffmpeg_decoder_packet_dropped(ChiakiFfmpegDecoder *decoder)
+{
 	chiaki_mutex_lock(&decoder->mutex);
-	AVPacket packet;
-	av_init_packet(&packet);
-	packet.data = buf;
-	packet.size = buf_size;
-	int r;
-send_packet:
-	r = avcodec_send_packet(decoder->codec_context, &packet);
-	if(r != 0)
+	decoder->stats.packets_dropped++;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+/**
+ * Hand packet to the decode thread, which takes ownership of it in any case.
+ */
+static bool ffmpeg_decoder_submit_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet)
+{
+	AVPacket **slot = chiaki_spsc_queue_write_slot(&decoder->packet_queue);
+	if(!slot)
 	{
-		if(r == AVERROR(EAGAIN))
-		{
-			CHIAKI_LOGE(decoder->log, "AVCodec internal buffer is full removing frames before pushing");
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
-			{
-				CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
-				goto hell;
-			}
-			r = avcodec_receive_frame(decoder->codec_context, frame);
-			av_frame_free(&frame);
-			if(r != 0)
-			{
-				CHIAKI_LOGE(decoder->log, "Failed to pull frame");
-				goto hell;
-			}
-			goto send_packet;
-		}
-		else
+		// decoding is falling behind, give it a moment before dropping anything
+		ChiakiErrorCode err = chiaki_spsc_queue_wait_writable(&decoder->packet_queue, decoder->submit_timeout_ms);
+		if(err == CHIAKI_ERR_SUCCESS)
+			slot = chiaki_spsc_queue_write_slot(&decoder->packet_queue);
+		if(!slot)
 		{
-			char errbuf[128];
-			av_make_error_string(errbuf, sizeof(errbuf), r);
-			CHIAKI_LOGE(decoder->log, "Failed to push frame: %s", errbuf);
-			goto hell;
+			if(err != CHIAKI_ERR_CANCELED)
+				CHIAKI_LOGW(decoder->log, "FFMPEG Decoder packet queue is full, dropping packet");
+			goto drop;
 		}
 	}
-	chiaki_mutex_unlock(&decoder->mutex);
+	if(chiaki_spsc_queue_is_closed(&decoder->packet_queue))
+		goto drop;
 
-	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+	*slot = packet;
+	chiaki_spsc_queue_push(&decoder->packet_queue);
 	return true;
-hell:
-	chiaki_mutex_unlock(&decoder->mutex);
+
+drop:
+	av_packet_free(&packet);
+	ffmpeg_decoder_packet_dropped(decoder);
+	return false;
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+	AVPacket *packet = av_packet_alloc();
+	if(!packet || av_new_packet(packet, buf_size) < 0)
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to alloc AVPacket");
+		av_packet_free(&packet);
+		ffmpeg_decoder_packet_dropped(decoder);
+		return false;
+	}
+	memcpy(packet->data, buf, buf_size);
+	return ffmpeg_decoder_submit_packet(decoder, packet);
+}
+
+static void ffmpeg_decoder_video_frame_free(void *opaque, uint8_t *data)
+{
+	chiaki_video_frame_unref(opaque);
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiVideoFrame *frame, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+		goto error;
+	// the buffer keeps a reference to frame for as long as FFmpeg holds on to the packet data
+	chiaki_video_frame_ref(frame);
+	packet->buf = av_buffer_create(frame->buf, frame->buf_size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE,
+			ffmpeg_decoder_video_frame_free, frame, AV_BUFFER_FLAG_READONLY);
+	if(!packet->buf)
+	{
+		chiaki_video_frame_unref(frame);
+		av_packet_free(&packet);
+		goto error;
+	}
+	packet->data = frame->buf;
+	packet->size = frame->buf_size;
+	// unused by the decoder, carries the frame index to the decode thread
+	packet->pos = frame->frame_index;
+	return ffmpeg_decoder_submit_packet(decoder, packet);
+
+error:
+	CHIAKI_LOGE(decoder->log, "Failed to create AVPacket for frame");
+	ffmpeg_decoder_packet_dropped(decoder);
 	return false;
 }
 
 static AVFrame *pull_from_hw(ChiakiFfmpegDecoder *decoder, AVFrame *hw_frame)
 {
 	AVFrame *sw_frame = av_frame_alloc();
-	if(av_hwframe_transfer_data(sw_frame, hw_frame, 0) < 0)
+	if(sw_frame && av_hwframe_transfer_data(sw_frame, hw_frame, 0) < 0)
 	{
 		CHIAKI_LOGE(decoder->log, "Failed to transfer frame from hardware");
-		av_frame_unref(sw_frame);
-		sw_frame = NULL;
+		av_frame_free(&sw_frame);
 	}
-	av_frame_unref(hw_frame);
+	av_frame_free(&hw_frame);
 	return sw_frame;
 }
 
-CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder)
+/**
+ * @param latency_us time spent in the decoder or UINT64_MAX if unknown
+ */
+static void ffmpeg_decoder_output_frame(ChiakiFfmpegDecoder *decoder, AVFrame *frame, uint64_t latency_us)
 {
 	chiaki_mutex_lock(&decoder->mutex);
-	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = NULL;
-	AVFrame *frame = NULL;
+	decoder->stats.frames_decoded++;
+	if(latency_us != UINT64_MAX)
+	{
+		decoder->stats.frames_timed++;
+		decoder->stats.decode_latency_us_sum += latency_us;
+		if(latency_us > decoder->stats.decode_latency_us_max)
+			decoder->stats.decode_latency_us_max = latency_us;
+	}
+	size_t keep = decoder->output_policy == CHIAKI_FFMPEG_DECODER_OUTPUT_LATEST ? 0 : CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE - 1;
+	while(decoder->output_count > keep)
+	{
+		av_frame_free(&decoder->output[decoder->output_first]);
+		decoder->output_first = (decoder->output_first + 1) % CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE;
+		decoder->output_count--;
+		decoder->stats.frames_replaced++;
+	}
+	decoder->output[(decoder->output_first + decoder->output_count) % CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE] = frame;
+	decoder->output_count++;
+	chiaki_mutex_unlock(&decoder->mutex);
+
+	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+}
+
+/**
+ * Move all frames the codec has ready to the output.
+ * @return number of frames received
+ */
+static size_t ffmpeg_decoder_receive_frames(ChiakiFfmpegDecoder *decoder)
+{
+	size_t count = 0;
 	while(true)
 	{
-		AVFrame *next_frame;
-		if(frame_last)
+		AVFrame *frame = av_frame_alloc();
+		if(!frame)
 		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
-		}
-		else
-		{
-			next_frame = av_frame_alloc();
-			if(!next_frame)
-				break;
+			CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
+			break;
 		}
-		frame_last = frame;
-		frame = next_frame;
 		int r = avcodec_receive_frame(decoder->codec_context, frame);
-		if(!r)
-			frame = decoder->hw_device_ctx ? pull_from_hw(decoder, frame) : frame;
-		else
+		if(r != 0)
 		{
-			if(r != AVERROR(EAGAIN))
+			if(r != AVERROR(EAGAIN) && r != AVERROR_EOF)
 				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
 			av_frame_free(&frame);
-			frame = frame_last;
 			break;
 		}
+		count++;
+
+		// the pts carries the time the packet was sent in, see ffmpeg_decoder_decode_packet()
+		uint64_t latency_us = UINT64_MAX;
+		int32_t frame_index = -1;
+		if(frame->pts != AV_NOPTS_VALUE)
+		{
+			uint64_t now = chiaki_time_now_monotonic_us();
+			if(now >= (uint64_t)frame->pts)
+				latency_us = now - (uint64_t)frame->pts;
+			for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT; i++)
+			{
+				if(decoder->in_flight_pts[i] == frame->pts)
+				{
+					frame_index = decoder->in_flight_frame_index[i];
+					chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_DECODE_OUTPUT, frame_index, now);
+					break;
+				}
+			}
+		}
+
+		if(decoder->hw_device_ctx)
+		{
+			frame = pull_from_hw(decoder, frame);
+			if(!frame)
+				continue;
+		}
+		frame->opaque = (void *)(intptr_t)(frame_index + 1);
+		ffmpeg_decoder_output_frame(decoder, frame, latency_us);
+	}
+	return count;
+}
+
+static void ffmpeg_decoder_decode_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet)
+{
+	// timestamps mean nothing to the decoder here, so use them to measure its latency
+	uint64_t now = chiaki_time_now_monotonic_us();
+	packet->pts = (int64_t)now;
+	packet->dts = AV_NOPTS_VALUE;
+	int32_t frame_index = packet->pos >= 0 && packet->pos <= INT32_MAX ? (int32_t)packet->pos : -1;
+	packet->pos = -1;
+	decoder->in_flight_pts[decoder->in_flight_next] = packet->pts;
+	decoder->in_flight_frame_index[decoder->in_flight_next] = frame_index;
+	decoder->in_flight_next = (decoder->in_flight_next + 1) % CHIAKI_FFMPEG_DECODER_FRAMES_IN_FLIGHT;
+	chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_DECODE_SUBMIT, frame_index, now);
+	int r = avcodec_send_packet(decoder->codec_context, packet);
+	if(r == AVERROR(EAGAIN))
+	{
+		// frames are received after every packet, so this should be rare, but they are never thrown away here
+		if(ffmpeg_decoder_receive_frames(decoder))
+			r = avcodec_send_packet(decoder->codec_context, packet);
 	}
+	if(r != 0)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGE(decoder->log, "Failed to push frame: %s", errbuf);
+		ffmpeg_decoder_packet_dropped(decoder);
+		return;
+	}
+
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->stats.packets_decoded++;
 	chiaki_mutex_unlock(&decoder->mutex);
 
+	ffmpeg_decoder_receive_frames(decoder);
+}
+
+static void *ffmpeg_decoder_thread_func(void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+	while(true)
+	{
+		AVPacket **slot = chiaki_spsc_queue_read_slot(&decoder->packet_queue);
+		if(!slot)
+		{
+			// chiaki_ffmpeg_decoder_fini() closes the queue to wake this up
+			ChiakiErrorCode err = chiaki_spsc_queue_wait_readable(&decoder->packet_queue, UINT64_MAX);
+			if(err != CHIAKI_ERR_SUCCESS)
+				break;
+			continue;
+		}
+		AVPacket *packet = *slot;
+		chiaki_spsc_queue_pop(&decoder->packet_queue);
+		ffmpeg_decoder_decode_packet(decoder, packet);
+		av_packet_free(&packet);
+	}
+	return NULL;
+}
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder)
+{
+	AVFrame *frame = NULL;
+	chiaki_mutex_lock(&decoder->mutex);
+	if(decoder->output_count)
+	{
+		frame = decoder->output[decoder->output_first];
+		decoder->output[decoder->output_first] = NULL;
+		decoder->output_first = (decoder->output_first + 1) % CHIAKI_FFMPEG_DECODER_OUTPUT_QUEUE_SIZE;
+		decoder->output_count--;
+	}
+	chiaki_mutex_unlock(&decoder->mutex);
 	return frame;
 }
 
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	*stats = decoder->stats;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+CHIAKI_EXPORT int32_t chiaki_ffmpeg_decoder_frame_index(AVFrame *frame)
+{
+	return (int32_t)(intptr_t)frame->opaque - 1;
+}
+
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder)
 {
 	// TODO: this is probably very wrong, especially for hdr
@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/framepool.h>
+#include <chiaki/video.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// buffers grow in steps of this, so slightly larger frames do not cause a realloc every time
+#define FRAME_BUF_GRANULARITY 0x4000
+
+static void frame_pool_destroy(ChiakiFramePool *pool);
+
+CHIAKI_EXPORT ChiakiFramePool *chiaki_frame_pool_new(ChiakiLog *log, size_t frames_max)
+{
+	ChiakiFramePool *pool = CHIAKI_NEW(ChiakiFramePool);
+	if(!pool)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+	pool->log = log;
+	pool->frames_max = frames_max;
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+CHIAKI_EXPORT void chiaki_frame_pool_free(ChiakiFramePool *pool)
+{
+	if(!pool)
+		return;
+
+	chiaki_mutex_lock(&pool->mutex);
+	pool->owner_released = true;
+	bool destroy = pool->stats.frames_in_use == 0;
+	ChiakiFramePoolStats stats = pool->stats;
+	// unless destroy, the last frame may be released and the pool freed as soon as the mutex is unlocked
+	ChiakiLog *log = pool->log;
+	chiaki_mutex_unlock(&pool->mutex);
+
+	CHIAKI_LOGI(log, "Frame Pool: %llu frames allocated, max %llu in use, %llu bytes allocated, max %llu, largest frame %llu bytes, exhausted %llu times",
+			(unsigned long long)stats.frames_allocated,
+			(unsigned long long)stats.frames_in_use_max,
+			(unsigned long long)stats.bytes_allocated,
+			(unsigned long long)stats.bytes_allocated_max,
+			(unsigned long long)stats.frame_size_max,
+			(unsigned long long)stats.exhausted);
+	if(!destroy)
+		CHIAKI_LOGI(log, "Frame Pool still has %llu frames in use, will be freed when they are released",
+				(unsigned long long)stats.frames_in_use);
+
+	if(destroy)
+		frame_pool_destroy(pool);
+}
+
+static void frame_pool_destroy(ChiakiFramePool *pool)
+{
+	ChiakiVideoFrame *frame = pool->free_frames;
+	while(frame)
+	{
+		ChiakiVideoFrame *next = frame->next_free;
+		free(frame->buf);
+		free(frame);
+		frame = next;
+	}
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool);
+}
+
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_frame_pool_acquire(ChiakiFramePool *pool, size_t size)
+{
+	chiaki_mutex_lock(&pool->mutex);
+
+	// prefer a free frame that is large enough already, otherwise grow any free one
+	ChiakiVideoFrame *frame = NULL;
+	for(ChiakiVideoFrame **it = &pool->free_frames; *it; it = &(*it)->next_free)
+	{
+		if((*it)->buf_capacity >= size)
+		{
+			frame = *it;
+			*it = frame->next_free;
+			break;
+		}
+	}
+	if(!frame && pool->free_frames)
+	{
+		frame = pool->free_frames;
+		pool->free_frames = frame->next_free;
+	}
+
+	bool frame_new = !frame;
+	if(frame_new)
+	{
+		if(pool->stats.frames_allocated >= pool->frames_max)
+		{
+			pool->stats.exhausted++;
+			chiaki_mutex_unlock(&pool->mutex);
+			CHIAKI_LOGW(pool->log, "Frame Pool exhausted, all %llu frames are in use", (unsigned long long)pool->frames_max);
+			return NULL;
+		}
+		pool->stats.frames_allocated++; // reserved, allocated below
+	}
+
+	pool->stats.frames_in_use++;
+	if(pool->stats.frames_in_use > pool->stats.frames_in_use_max)
+		pool->stats.frames_in_use_max = pool->stats.frames_in_use;
+	if(size > pool->stats.frame_size_max)
+		pool->stats.frame_size_max = size;
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(frame_new)
+	{
+		frame = calloc(1, sizeof(ChiakiVideoFrame));
+		if(!frame)
+			goto error;
+		frame->pool = pool;
+	}
+
+	if(frame->buf_capacity < size)
+	{
+		size_t capacity = (size + FRAME_BUF_GRANULARITY - 1) & ~((size_t)FRAME_BUF_GRANULARITY - 1);
+		uint8_t *buf = realloc(frame->buf, capacity + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!buf)
+			goto error;
+
+		chiaki_mutex_lock(&pool->mutex);
+		pool->stats.bytes_allocated += capacity - frame->buf_capacity;
+		if(pool->stats.bytes_allocated > pool->stats.bytes_allocated_max)
+			pool->stats.bytes_allocated_max = pool->stats.bytes_allocated;
+		chiaki_mutex_unlock(&pool->mutex);
+
+		frame->buf = buf;
+		frame->buf_capacity = capacity;
+	}
+
+	frame->buf_size = size;
+	frame->frame_index = 0;
+	frame->next_free = NULL;
+	chiaki_atomic_u32_store(&frame->refcount, 1);
+	memset(frame->buf + size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	return frame;
+
+error:
+	CHIAKI_LOGE(pool->log, "Frame Pool failed to allocate frame of %llu bytes", (unsigned long long)size);
+	chiaki_mutex_lock(&pool->mutex);
+	pool->stats.frames_in_use--;
+	if(frame && frame->buf)
+	{
+		frame->next_free = pool->free_frames;
+		pool->free_frames = frame;
+	}
+	else
+	{
+		free(frame);
+		pool->stats.frames_allocated--;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_frame_pool_get_stats(ChiakiFramePool *pool, ChiakiFramePoolStats *stats)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_unref(ChiakiVideoFrame *frame)
+{
+	if(chiaki_atomic_u32_fetch_add(&frame->refcount, (uint32_t)-1) != 1)
+		return;
+
+	ChiakiFramePool *pool = frame->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	frame->next_free = pool->free_frames;
+	pool->free_frames = frame;
+	pool->stats.frames_in_use--;
+	bool destroy = pool->owner_released && pool->stats.frames_in_use == 0;
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(destroy)
+		frame_pool_destroy(pool);
+}
@@ -34,16 +34,29 @@ CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uin
 
 #define UNIT_SLOTS_MAX 256
 
+#define UNIT_HEADER_SIZE 2
+
 struct chiaki_frame_unit_t
 {
 	size_t data_size;
+	uint8_t header[UNIT_HEADER_SIZE]; // of source units, their payload is in the frame buffer
 };
 
+/**
+ * @return where the payload of source unit i goes in the frame buffer
+ */
+static uint8_t *frame_processor_payload(ChiakiFrameProcessor *frame_processor, size_t i)
+{
+	return frame_processor->frame_buf + i * (frame_processor->buf_size_per_unit - UNIT_HEADER_SIZE);
+}
+
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
 {
 	frame_processor->log = log;
 	frame_processor->frame_buf = NULL;
 	frame_processor->frame_buf_size = 0;
+	frame_processor->frame_pool = NULL;
+	frame_processor->frame = NULL;
 	frame_processor->buf_size_per_unit = 0;
 	frame_processor->buf_stride_per_unit = 0;
 	frame_processor->units_source_expected = 0;
@@ -52,17 +65,27 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->units_fec_received = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	frame_processor->iov = NULL;
 	frame_processor->flushed = true;
 	chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	chiaki_fec_cache_init(&frame_processor->fec_cache, CHIAKI_FEC_CACHE_MEM_BUDGET_DEFAULT);
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
-	free(frame_processor->frame_buf);
+	if(frame_processor->frame)
+		chiaki_video_frame_unref(frame_processor->frame);
+	else
+		free(frame_processor->frame_buf);
 	free(frame_processor->unit_slots);
+	free(frame_processor->iov);
+	chiaki_fec_cache_fini(&frame_processor->fec_cache);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
+/**
+ * @param gkcrypt if not NULL, packet->data is encrypted at key_pos
+ */
+static ChiakiErrorCode frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
 {
 	if(packet->units_in_frame_total < packet->units_in_frame_fec)
 	{
@@ -84,13 +107,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 			CHIAKI_LOGE(frame_processor->log, "Packet too small to read buf size extension");
 			return CHIAKI_ERR_BUF_TOO_SMALL;
 		}
-		frame_processor->buf_size_per_unit += ntohs(((chiaki_unaligned_uint16_t *)packet->data)[0]);
+		uint8_t padding_buf[2];
+		if(gkcrypt)
+		{
+			ChiakiErrorCode err = chiaki_gkcrypt_decrypt_to(gkcrypt, key_pos, packet->data, padding_buf, sizeof(padding_buf));
+			if(err != CHIAKI_ERR_SUCCESS)
+				return err;
+		}
+		else
+			memcpy(padding_buf, packet->data, sizeof(padding_buf));
+		frame_processor->buf_size_per_unit += ntohs(*((chiaki_unaligned_uint16_t *)padding_buf));
 	}
 	frame_processor->buf_stride_per_unit = ((frame_processor->buf_size_per_unit + 0xf) / 0x10) * 0x10;
 
-	if(frame_processor->buf_size_per_unit == 0)
+	if(frame_processor->buf_size_per_unit < UNIT_HEADER_SIZE)
 	{
-		CHIAKI_LOGE(frame_processor->log, "Frame Processor doesn't handle empty units");
+		CHIAKI_LOGE(frame_processor->log, "Frame Processor doesn't handle units without header");
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 	}
 
@@ -116,7 +148,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
 
 		frame_processor->unit_slots = new_ptr;
-		if(!new_ptr)
+		free(frame_processor->iov);
+		frame_processor->iov = new_ptr ? malloc(unit_slots_size_required * sizeof(ChiakiFrameIOVec)) : NULL;
+		if(!frame_processor->iov)
+		{
+			free(frame_processor->unit_slots);
+			frame_processor->unit_slots = NULL;
+		}
+		if(!frame_processor->unit_slots)
 		{
 			frame_processor->unit_slots_size = 0;
 			return CHIAKI_ERR_MEMORY;
@@ -129,7 +168,28 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_stride_per_unit)
 		return CHIAKI_ERR_OVERFLOW;
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_stride_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	if(frame_processor->frame_pool)
+	{
+		ChiakiVideoFrame *frame = frame_processor->frame;
+		// a frame that was never flushed is simply overwritten
+		if(!frame || frame->buf_capacity < frame_buf_size_required)
+		{
+			if(frame)
+				chiaki_video_frame_unref(frame);
+			frame = chiaki_frame_pool_acquire(frame_processor->frame_pool, frame_buf_size_required);
+			frame_processor->frame = frame;
+			if(!frame)
+			{
+				frame_processor->frame_buf = NULL;
+				frame_processor->frame_buf_size = 0;
+				frame_processor->flushed = true; // nothing to put the units into
+				return CHIAKI_ERR_MEMORY;
+			}
+		}
+		frame_processor->frame_buf = frame->buf;
+		frame_processor->frame_buf_size = frame_buf_size_required;
+	}
+	else if(frame_processor->frame_buf_size < frame_buf_size_required)
 	{
 		free(frame_processor->frame_buf);
 		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
@@ -140,14 +200,44 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		}
 		frame_processor->frame_buf_size = frame_buf_size_required;
 	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	// no memset of the frame buffer here, every unit slot is written completely before it is read,
+	// see frame_processor_put_unit(), chiaki_frame_processor_fec() and chiaki_frame_processor_flush()
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
+{
+	return frame_processor_alloc_frame(frame_processor, packet, NULL, 0);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame_encrypted(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
 {
-	if(packet->unit_index > frame_processor->unit_slots_size)
+	return frame_processor_alloc_frame(frame_processor, packet, gkcrypt, key_pos);
+}
+
+/**
+ * Copy or, if gkcrypt is not NULL, decrypt unit data at key_pos to dst.
+ */
+static ChiakiErrorCode frame_processor_unit_read(ChiakiFrameProcessor *frame_processor, uint8_t *dst, const uint8_t *src, size_t size, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	if(!gkcrypt)
+	{
+		memcpy(dst, src, size);
+		return CHIAKI_ERR_SUCCESS;
+	}
+	ChiakiErrorCode err = chiaki_gkcrypt_decrypt_to(gkcrypt, key_pos, src, dst, size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(frame_processor->log, "Failed to decrypt unit");
+	return err;
+}
+
+/**
+ * @param gkcrypt if not NULL, packet->data is encrypted at key_pos
+ */
+static ChiakiErrorCode frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	if(packet->unit_index >= frame_processor->unit_slots_size)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet's unit index is too high");
 		return CHIAKI_ERR_INVALID_DATA;
@@ -172,13 +262,26 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
-	unit->data_size = packet->data_size;
 	if(!frame_processor->flushed)
 	{
-		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
-				packet->data,
-				packet->data_size);
+		ChiakiErrorCode err;
+		if(packet->unit_index < frame_processor->units_source_expected)
+		{
+			size_t header_size = packet->data_size < UNIT_HEADER_SIZE ? packet->data_size : UNIT_HEADER_SIZE;
+			err = frame_processor_unit_read(frame_processor, unit->header, packet->data, header_size, gkcrypt, key_pos);
+			if(err == CHIAKI_ERR_SUCCESS && packet->data_size > header_size)
+				err = frame_processor_unit_read(frame_processor, frame_processor_payload(frame_processor, packet->unit_index),
+						packet->data + header_size, packet->data_size - header_size, gkcrypt, key_pos + header_size);
+		}
+		else
+		{
+			err = frame_processor_unit_read(frame_processor, frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
+					packet->data, packet->data_size, gkcrypt, key_pos);
+		}
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 	}
+	unit->data_size = packet->data_size;
 
 	if(packet->unit_index < frame_processor->units_source_expected)
 		frame_processor->units_source_received++;
@@ -188,6 +291,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
+{
+	return frame_processor_put_unit(frame_processor, packet, NULL, 0);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit_encrypted(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	return frame_processor_put_unit(frame_processor, packet, gkcrypt, key_pos);
+}
+
 CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats)
 {
 	uint64_t received = frame_processor->units_source_received + frame_processor->units_fec_received;
@@ -195,6 +308,41 @@ CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcess
 	chiaki_packet_stats_push_generation(packet_stats, received, expected - received);
 }
 
+/**
+ * Move the received source units from their payloads to their whole slots with header, as fec needs them.
+ * Goes backwards, because slots are larger than payloads.
+ */
+static void frame_processor_units_to_slots(ChiakiFrameProcessor *frame_processor)
+{
+	for(size_t i=frame_processor->units_source_expected; i-- > 0;)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		if(!unit->data_size)
+			continue;
+		uint8_t *slot = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
+		if(unit->data_size > UNIT_HEADER_SIZE)
+			memmove(slot + UNIT_HEADER_SIZE, frame_processor_payload(frame_processor, i), unit->data_size - UNIT_HEADER_SIZE);
+		memcpy(slot, unit->header, unit->data_size < UNIT_HEADER_SIZE ? unit->data_size : UNIT_HEADER_SIZE);
+	}
+}
+
+/**
+ * Inverse of frame_processor_units_to_slots(), including the units recovered in the meantime.
+ */
+static void frame_processor_units_from_slots(ChiakiFrameProcessor *frame_processor)
+{
+	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	{
+		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+		if(!unit->data_size)
+			continue;
+		uint8_t *slot = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
+		memcpy(unit->header, slot, unit->data_size < UNIT_HEADER_SIZE ? unit->data_size : UNIT_HEADER_SIZE);
+		if(unit->data_size > UNIT_HEADER_SIZE)
+			memmove(frame_processor_payload(frame_processor, i), slot + UNIT_HEADER_SIZE, unit->data_size - UNIT_HEADER_SIZE);
+	}
+}
+
 static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_processor)
 {
 	CHIAKI_LOGI(frame_processor->log, "Frame Processor received %u+%u / %u+%u units, attempting FEC",
@@ -208,16 +356,29 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	if(!erasures)
 		return CHIAKI_ERR_MEMORY;
 
+	frame_processor_units_to_slots(frame_processor);
+
 	size_t erasure_index = 0;
 	for(size_t i=0; i<frame_processor->units_source_expected + frame_processor->units_fec_expected; i++)
 	{
 		ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-		if(!slot->data_size)
+		if(slot->data_size)
+		{
+			// FEC works on whole units, so short ones must be zero-padded.
+			// Erased units don't need this, they are completely overwritten by the decoder.
+			if(slot->data_size < frame_processor->buf_size_per_unit)
+			{
+				memset(frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i + slot->data_size, 0,
+						frame_processor->buf_size_per_unit - slot->data_size);
+			}
+		}
+		else
 		{
 			if(erasure_index >= erasures_count)
 			{
 				// should never happen by design, but too scary not to check
 				assert(false);
+				frame_processor_units_from_slots(frame_processor);
 				free(erasures);
 				return CHIAKI_ERR_UNKNOWN;
 			}
@@ -226,7 +387,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	}
 	assert(erasure_index == erasures_count);
 
-	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf,
+	ChiakiErrorCode err = chiaki_fec_decode_cached(&frame_processor->fec_cache, frame_processor->frame_buf,
 			frame_processor->buf_size_per_unit, frame_processor->buf_stride_per_unit,
 			frame_processor->units_source_expected, frame_processor->units_fec_expected,
 			erasures, erasures_count);
@@ -258,11 +419,17 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 		}
 	}
 
+	// units that could not be recovered are left out
+	frame_processor_units_from_slots(frame_processor);
+
 	free(erasures);
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+/**
+ * Run FEC if necessary and collect the payloads of all source units into frame_processor->iov.
+ */
+static ChiakiFrameProcessorFlushResult frame_processor_flush_iov(ChiakiFrameProcessor *frame_processor, size_t *iov_count, size_t *frame_size)
 {
 	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
@@ -281,7 +448,8 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	}
 
-	size_t cur = 0;
+	size_t count = 0;
+	size_t size = 0;
 	for(size_t i=0; i<frame_processor->units_source_expected; i++)
 	{
 		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
@@ -290,21 +458,71 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
 			continue;
 		}
-		if(unit->data_size < 2)
+		if(unit->data_size < UNIT_HEADER_SIZE)
 		{
 			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
-			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, unit->header, unit->data_size);
 			continue;
 		}
-		size_t part_size = unit->data_size - 2;
-		uint8_t *buf_ptr = frame_processor->frame_buf + i*frame_processor->buf_stride_per_unit;
-		memmove(frame_processor->frame_buf + cur, buf_ptr + 2, part_size);
-		cur += part_size;
+		ChiakiFrameIOVec *part = &frame_processor->iov[count++];
+		part->buf = frame_processor_payload(frame_processor, i);
+		part->size = unit->data_size - UNIT_HEADER_SIZE;
+		size += part->size;
 	}
 
-	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
+	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)size);
+
+	*iov_count = count;
+	*frame_size = size;
+	return result;
+}
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_iov(ChiakiFrameProcessor *frame_processor, ChiakiFrameIOVec **iov, size_t *iov_count, size_t *frame_size)
+{
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush_iov(frame_processor, iov_count, frame_size);
+	if(result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		*iov = frame_processor->iov;
+	return result;
+}
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+{
+	size_t iov_count;
+	size_t size;
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush_iov(frame_processor, &iov_count, &size);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+
+	// only units that are missing or shorter than the others leave gaps to close
+	size_t cur = 0;
+	for(size_t i=0; i<iov_count; i++)
+	{
+		ChiakiFrameIOVec *part = &frame_processor->iov[i];
+		if(part->buf != frame_processor->frame_buf + cur)
+			memmove(frame_processor->frame_buf + cur, part->buf, part->size);
+		cur += part->size;
+	}
+	memset(frame_processor->frame_buf + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
 	*frame = frame_processor->frame_buf;
 	*frame_size = cur;
 	return result;
 }
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_frame(ChiakiFrameProcessor *frame_processor, ChiakiVideoFrame **frame)
+{
+	uint8_t *buf;
+	size_t size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(frame_processor, &buf, &size);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+
+	assert(frame_processor->frame && buf == frame_processor->frame->buf);
+	*frame = frame_processor->frame;
+	(*frame)->buf_size = size;
+	frame_processor->frame = NULL;
+	frame_processor->frame_buf = NULL;
+	frame_processor->frame_buf_size = 0;
+	frame_processor->flushed = true;
+	return result;
+}
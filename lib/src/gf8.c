@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/gf8.h>
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define GF8_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define GF8_NEON
+#include <arm_neon.h>
+#endif
+
+#define GF8_POLY 0x1d // 0x11d without the x^8 term
+
+CHIAKI_EXPORT const char *chiaki_gf8_impl_name(ChiakiGF8Impl impl)
+{
+	switch(impl)
+	{
+		case CHIAKI_GF8_IMPL_SCALAR:
+			return "scalar";
+		case CHIAKI_GF8_IMPL_SSSE3:
+			return "ssse3";
+		case CHIAKI_GF8_IMPL_AVX2:
+			return "avx2";
+		case CHIAKI_GF8_IMPL_NEON:
+			return "neon";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT bool chiaki_gf8_impl_supported(ChiakiGF8Impl impl)
+{
+	switch(impl)
+	{
+		case CHIAKI_GF8_IMPL_SCALAR:
+			return true;
+#ifdef GF8_X86
+		case CHIAKI_GF8_IMPL_SSSE3:
+			return __builtin_cpu_supports("ssse3");
+		case CHIAKI_GF8_IMPL_AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef GF8_NEON
+		case CHIAKI_GF8_IMPL_NEON:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+CHIAKI_EXPORT ChiakiGF8Impl chiaki_gf8_impl_best()
+{
+	if(chiaki_gf8_impl_supported(CHIAKI_GF8_IMPL_AVX2))
+		return CHIAKI_GF8_IMPL_AVX2;
+	if(chiaki_gf8_impl_supported(CHIAKI_GF8_IMPL_SSSE3))
+		return CHIAKI_GF8_IMPL_SSSE3;
+	if(chiaki_gf8_impl_supported(CHIAKI_GF8_IMPL_NEON))
+		return CHIAKI_GF8_IMPL_NEON;
+	return CHIAKI_GF8_IMPL_SCALAR;
+}
+
+CHIAKI_EXPORT uint8_t chiaki_gf8_mul(uint8_t a, uint8_t b)
+{
+	uint8_t r = 0;
+	while(b)
+	{
+		if(b & 1)
+			r ^= a;
+		b >>= 1;
+		a = (uint8_t)((a << 1) ^ ((a & 0x80) ? GF8_POLY : 0));
+	}
+	return r;
+}
+
+/**
+ * Split tables for multiplying by c: c * x == lo[x & 0xf] ^ hi[x >> 4]
+ */
+static void gf8_split_tables(uint8_t c, uint8_t *lo, uint8_t *hi)
+{
+	for(unsigned int x=0; x<16; x++)
+	{
+		lo[x] = chiaki_gf8_mul(c, (uint8_t)x);
+		hi[x] = chiaki_gf8_mul(c, (uint8_t)(x << 4));
+	}
+}
+
+static void gf8_region_mul_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool add)
+{
+	if(add)
+	{
+		for(size_t i=0; i<size; i++)
+			dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+	}
+	else
+	{
+		for(size_t i=0; i<size; i++)
+			dst[i] = lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+	}
+}
+
+#ifdef GF8_X86
+__attribute__((target("ssse3")))
+static void gf8_region_mul_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool add)
+{
+	const __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+	const __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+	const __m128i mask = _mm_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i l = _mm_and_si128(s, mask);
+		__m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+		if(add)
+			p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+	gf8_region_mul_scalar(dst + i, src + i, lo, hi, size - i, add);
+}
+
+__attribute__((target("avx2")))
+static void gf8_region_mul_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool add)
+{
+	// vpshufb works on each 128 bit lane separately, so both lanes get the same table
+	const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+	const __m256i mask = _mm256_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 32 <= size; i += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i l = _mm256_and_si256(s, mask);
+		__m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, l), _mm256_shuffle_epi8(thi, h));
+		if(add)
+			p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
+	}
+	gf8_region_mul_ssse3(dst + i, src + i, lo, hi, size - i, add);
+}
+#endif
+
+#ifdef GF8_NEON
+static void gf8_region_mul_neon(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool add)
+{
+	const uint8x16_t mask = vdupq_n_u8(0xf);
+#ifdef __aarch64__
+	const uint8x16_t tlo = vld1q_u8(lo);
+	const uint8x16_t thi = vld1q_u8(hi);
+#define GF8_NEON_LOOKUP(t, idx) vqtbl1q_u8((t), (idx))
+#else
+	const uint8x8x2_t tlo = { { vld1_u8(lo), vld1_u8(lo + 8) } };
+	const uint8x8x2_t thi = { { vld1_u8(hi), vld1_u8(hi + 8) } };
+#define GF8_NEON_LOOKUP(t, idx) vcombine_u8(vtbl2_u8((t), vget_low_u8(idx)), vtbl2_u8((t), vget_high_u8(idx)))
+#endif
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		uint8x16_t s = vld1q_u8(src + i);
+		uint8x16_t l = vandq_u8(s, mask);
+		uint8x16_t h = vshrq_n_u8(s, 4);
+		uint8x16_t p = veorq_u8(GF8_NEON_LOOKUP(tlo, l), GF8_NEON_LOOKUP(thi, h));
+		if(add)
+			p = veorq_u8(p, vld1q_u8(dst + i));
+		vst1q_u8(dst + i, p);
+	}
+#undef GF8_NEON_LOOKUP
+	gf8_region_mul_scalar(dst + i, src + i, lo, hi, size - i, add);
+}
+#endif
+
+CHIAKI_EXPORT void chiaki_gf8_region_mul_impl(ChiakiGF8Impl impl, uint8_t *dst, const uint8_t *src, uint8_t c, size_t size, bool add)
+{
+	if(c == 0)
+	{
+		if(!add)
+			memset(dst, 0, size);
+		return;
+	}
+
+	if(c == 1 && !add)
+	{
+		memmove(dst, src, size);
+		return;
+	}
+
+	uint8_t lo[16];
+	uint8_t hi[16];
+	gf8_split_tables(c, lo, hi);
+
+	switch(impl)
+	{
+#ifdef GF8_X86
+		case CHIAKI_GF8_IMPL_SSSE3:
+			gf8_region_mul_ssse3(dst, src, lo, hi, size, add);
+			break;
+		case CHIAKI_GF8_IMPL_AVX2:
+			gf8_region_mul_avx2(dst, src, lo, hi, size, add);
+			break;
+#endif
+#ifdef GF8_NEON
+		case CHIAKI_GF8_IMPL_NEON:
+			gf8_region_mul_neon(dst, src, lo, hi, size, add);
+			break;
+#endif
+		default:
+			gf8_region_mul_scalar(dst, src, lo, hi, size, add);
+			break;
+	}
+}
@@ -2,9 +2,11 @@
 
 #include <chiaki/gkcrypt.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 #include "mbedtls/aes.h"
@@ -21,9 +23,29 @@
 
 #define KEY_BUF_CHUNK_SIZE 0x1000
 
+#define KEY_BUF_READER_NONE UINT64_MAX
+
+// how much key stream the producer keeps generated ahead of the consumer, at the estimated rate
+#define KEY_BUF_PREFETCH_MS 50
+#define KEY_BUF_PREFETCH_MIN (2 * KEY_BUF_CHUNK_SIZE)
+
+#define KEY_BUF_RATE_SAMPLE_MS 100
+
+// how often the producer pauses for a consumer still reading a chunk to be replaced before yielding instead
+#define KEY_BUF_READER_SPINS_MAX 64
+
+// stack buffer size to generate key stream that is not in the ring
+#define KEY_STREAM_DIRECT_BUF_SIZE 0x200
+
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 static void *gkcrypt_thread_func(void *user);
+static ChiakiErrorCode gkcrypt_key_buf_fill(ChiakiGKCrypt *gkcrypt, uint64_t prefetch_size);
+
+static void gkcrypt_gmac_ctx_init(ChiakiGKCryptGmacCtx *gmac_ctx);
+static void gkcrypt_gmac_ctx_fini(ChiakiGKCryptGmacCtx *gmac_ctx);
+static void gkcrypt_key_stream_ctx_init(ChiakiGKCryptKeyStreamCtx *ks_ctx);
+static void gkcrypt_key_stream_ctx_fini(ChiakiGKCryptKeyStreamCtx *ks_ctx);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
@@ -31,12 +53,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->index = index;
 
 	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
-	gkcrypt->key_buf_populated = 0;
-	gkcrypt->key_buf_key_pos_min = 0;
-	gkcrypt->key_buf_start_offset = 0;
-	gkcrypt->last_key_pos = 0;
+	chiaki_atomic_u64_init(&gkcrypt->key_buf_key_pos_min, 0);
+	chiaki_atomic_u64_init(&gkcrypt->key_buf_key_pos_end, 0);
+	chiaki_atomic_u64_init(&gkcrypt->key_buf_watermark, 0);
+	chiaki_atomic_u64_init(&gkcrypt->key_buf_reader_pos, KEY_BUF_READER_NONE);
+	chiaki_atomic_u64_init(&gkcrypt->last_key_pos, 0);
+	gkcrypt->key_buf_rate = 0;
+	gkcrypt->key_buf_rate_key_pos = 0;
+	gkcrypt->key_buf_rate_time_ms = chiaki_time_now_monotonic_ms();
 	gkcrypt->key_buf_thread_stop = false;
 
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTX_COUNT; i++)
+		gkcrypt_gmac_ctx_init(&gkcrypt->gmac_ctx[i]);
+	gkcrypt_key_stream_ctx_init(&gkcrypt->key_stream_ctx);
+	gkcrypt_key_stream_ctx_init(&gkcrypt->key_stream_ctx_producer);
+
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
 	{
@@ -72,6 +103,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 
 	if(gkcrypt->key_buf)
 	{
+		// the first packets, usually a whole key frame, follow right after init, so do not let them wait for the thread
+		err = gkcrypt_key_buf_fill(gkcrypt, gkcrypt->key_buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_key_buf_cond;
+
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
 			goto error_key_buf_cond;
@@ -106,6 +142,11 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
 		chiaki_aligned_free(gkcrypt->key_buf);
 	}
+
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTX_COUNT; i++)
+		gkcrypt_gmac_ctx_fini(&gkcrypt->gmac_ctx[i]);
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx);
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx_producer);
 }
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -211,252 +252,434 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 		memcpy(key_out, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_base));
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+static inline uint64_t load_le64(const uint8_t *buf)
 {
-	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
-	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	uint64_t r = 0;
+	for(size_t i=0; i<8; i++)
+		r |= (uint64_t)buf[i] << (i * 8);
+	return r;
+}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
+static inline void store_le64(uint8_t *buf, uint64_t v)
+{
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_WIN32)
+	memcpy(buf, &v, sizeof(v));
+#else
+	for(size_t i=0; i<8; i++)
+		buf[i] = (uint8_t)(v >> (i * 8));
+#endif
+}
+
+/**
+ * Write the counter blocks iv + counter_offset, iv + counter_offset + 1, ... for blocks_count blocks.
+ * Same as calling counter_add() for each block, but on 64 bit halves, so the inner loop has no dependency
+ * between blocks and can be vectorized.
+ */
+static void counter_fill(uint8_t *buf, const uint8_t *iv, uint64_t counter_offset, size_t blocks_count)
+{
+	uint64_t lo = load_le64(iv);
+	uint64_t hi = load_le64(iv + 8);
+	uint64_t cur = lo + counter_offset;
+	if(cur < lo)
+		hi++;
 
-	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
+	while(blocks_count)
 	{
-		mbedtls_aes_free(&ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		// number of blocks until the low half wraps around
+		uint64_t run = ~cur + 1;
+		size_t count = (run && run < blocks_count) ? (size_t)run : blocks_count;
+		for(size_t i=0; i<count; i++)
+		{
+			store_le64(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE, cur + i);
+			store_le64(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE + 8, hi);
+		}
+		buf += count * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		blocks_count -= count;
+		cur += count;
+		if(!cur)
+			hi++;
 	}
+}
 
+/**
+ * A zeroed ChiakiGKCryptKeyStreamCtx is valid, it is keyed with key_base on first use.
+ */
+static void gkcrypt_key_stream_ctx_init(ChiakiGKCryptKeyStreamCtx *ks_ctx)
+{
+	memset(ks_ctx, 0, sizeof(*ks_ctx));
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_init(&ks_ctx->aes);
+#endif
+}
+
+static void gkcrypt_key_stream_ctx_fini(ChiakiGKCryptKeyStreamCtx *ks_ctx)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_free(&ks_ctx->aes);
 #else
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
+	EVP_CIPHER_CTX_free(ks_ctx->ctx);
+	ks_ctx->ctx = NULL;
+#endif
+	ks_ctx->keyed = false;
+}
 
-	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
-	{
-		EVP_CIPHER_CTX_free(ctx);
+static ChiakiErrorCode gkcrypt_key_stream_ctx_set_key(ChiakiGKCryptKeyStreamCtx *ks_ctx, const uint8_t *key)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	if(mbedtls_aes_setkey_enc(&ks_ctx->aes, key, 128) != 0)
 		return CHIAKI_ERR_UNKNOWN;
+#else
+	if(!ks_ctx->ctx)
+	{
+		ks_ctx->ctx = EVP_CIPHER_CTX_new();
+		if(!ks_ctx->ctx)
+			return CHIAKI_ERR_MEMORY;
 	}
 
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
-	{
-		EVP_CIPHER_CTX_free(ctx);
+	if(!EVP_EncryptInit_ex(ks_ctx->ctx, EVP_aes_128_ecb(), NULL, key, NULL))
+		return CHIAKI_ERR_UNKNOWN;
+
+	if(!EVP_CIPHER_CTX_set_padding(ks_ctx->ctx, 0))
 		return CHIAKI_ERR_UNKNOWN;
-	}
 #endif
-	int counter_offset = (int)(key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
+	ks_ctx->keyed = true;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode gkcrypt_gen_key_stream_ctx(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptKeyStreamCtx *ks_ctx, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
 
-	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
-		counter_add(cur, gkcrypt->iv, counter_offset++);
+	if(!ks_ctx->keyed)
+	{
+		ChiakiErrorCode err = gkcrypt_key_stream_ctx_set_key(ks_ctx, gkcrypt->key_base);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
+	counter_fill(buf, gkcrypt->iv, key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE, buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE);
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	for(int i = 0; i < buf_size; i = i + 16)
+	for(size_t i=0; i<buf_size; i+=CHIAKI_GKCRYPT_BLOCK_SIZE)
 	{
-		// loop over all blocks of 16 bytes (128 bits)
-		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
-		{
-			mbedtls_aes_free(&ctx);
+		if(mbedtls_aes_crypt_ecb(&ks_ctx->aes, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
 			return CHIAKI_ERR_UNKNOWN;
-		}
 	}
-
-	mbedtls_aes_free(&ctx);
 #else
-	int outl;
-	EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
-	if(outl != buf_size)
+	// one call for the whole batch lets OpenSSL use its interleaved AES-NI/ARMv8 ECB kernels
+	while(buf_size)
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		int size = buf_size > INT_MAX ? (INT_MAX / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE : (int)buf_size;
+		int outl;
+		if(!EVP_EncryptUpdate(ks_ctx->ctx, buf, &outl, buf, size) || outl != size)
+			return CHIAKI_ERR_UNKNOWN;
+		buf += size;
+		buf_size -= size;
 	}
-
-	EVP_CIPHER_CTX_free(ctx);
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	return gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated / 2;
+	return gkcrypt_gen_key_stream_ctx(gkcrypt, &gkcrypt->key_stream_ctx, key_pos, buf, buf_size);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * Write src xor the key stream for key_pos (or only the key stream if src is NULL) directly from the ring into buf.
+ * Consumer side only.
+ *
+ * @return false if the requested range is not (or no longer) in the ring
+ */
+static bool gkcrypt_key_buf_read(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size)
 {
-	if(!gkcrypt->key_buf)
-		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+	// announce what we are reading before checking min, so the producer will not overwrite it from now on
+	chiaki_atomic_u64_store(&gkcrypt->key_buf_reader_pos, key_pos);
+	uint64_t key_pos_min = chiaki_atomic_u64_load(&gkcrypt->key_buf_key_pos_min);
+	uint64_t key_pos_end = chiaki_atomic_u64_load_acquire(&gkcrypt->key_buf_key_pos_end);
+	bool available = key_pos >= key_pos_min && key_pos + buf_size <= key_pos_end;
+	if(available)
+	{
+		size_t offset = (size_t)(key_pos % gkcrypt->key_buf_size);
+		size_t first = buf_size;
+		if(offset + first > gkcrypt->key_buf_size)
+			first = gkcrypt->key_buf_size - offset;
+		if(src)
+		{
+			xor_bytes_to(buf, src, gkcrypt->key_buf + offset, first);
+			xor_bytes_to(buf + first, src + first, gkcrypt->key_buf, buf_size - first);
+		}
+		else
+		{
+			memcpy(buf, gkcrypt->key_buf + offset, first);
+			memcpy(buf + first, gkcrypt->key_buf, buf_size - first);
+		}
+	}
+	chiaki_atomic_u64_store_release(&gkcrypt->key_buf_reader_pos, KEY_BUF_READER_NONE);
+	return available;
+}
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+/**
+ * Generate the key stream for an arbitrary range without the ring and write src xor it (or only the key stream if src is NULL) into buf.
+ */
+static ChiakiErrorCode gkcrypt_key_stream_direct(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size)
+{
+	uint8_t key_stream[KEY_STREAM_DIRECT_BUF_SIZE];
+	while(buf_size)
+	{
+		uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+		size_t size = buf_size;
+		if(padding_pre + size > sizeof(key_stream))
+			size = sizeof(key_stream) - padding_pre;
+		size_t full_size = ((padding_pre + size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		if(src)
+		{
+			xor_bytes_to(buf, src, key_stream + padding_pre, size);
+			src += size;
+		}
+		else
+			memcpy(buf, key_stream + padding_pre, size);
+		buf += size;
+		buf_size -= size;
+		key_pos += size;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(key_pos + buf_size > gkcrypt->last_key_pos)
-		gkcrypt->last_key_pos = key_pos + buf_size;
-	bool signal = gkcrypt_key_buf_should_generate(gkcrypt);
+static ChiakiErrorCode gkcrypt_key_stream_apply(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size)
+{
+	if(!gkcrypt->key_buf)
+		return gkcrypt_key_stream_direct(gkcrypt, key_pos, src, buf, buf_size);
 
-	ChiakiErrorCode err;
-	if(key_pos < gkcrypt->key_buf_key_pos_min
-		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
+	uint64_t key_pos_end = key_pos + buf_size;
+	if(key_pos_end > chiaki_atomic_u64_load_relaxed(&gkcrypt->last_key_pos))
+		chiaki_atomic_u64_store_release(&gkcrypt->last_key_pos, key_pos_end);
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	if(!gkcrypt_key_buf_read(gkcrypt, key_pos, src, buf, buf_size))
 	{
 		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
-				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
+				" key buf size %#llx, min key pos: %#llx, end key pos: %#llx",
 				(unsigned long long)key_pos,
 				gkcrypt->index,
 				(unsigned long long)gkcrypt->key_buf_size,
-				(unsigned long long)gkcrypt->key_buf_start_offset,
-				(unsigned long long)gkcrypt->key_buf_populated,
-				(unsigned long long)gkcrypt->key_buf_key_pos_min,
-				(unsigned long long)gkcrypt->last_key_pos);
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+				(unsigned long long)chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_min),
+				(unsigned long long)chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_end));
+		err = gkcrypt_key_stream_direct(gkcrypt, key_pos, src, buf, buf_size);
 	}
-	else
+
+	// only once in a while, so the producer can wait without a timeout and no wakeup is lost
+	if(key_pos_end > chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_watermark))
 	{
-		size_t offset_in_buf = key_pos - gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_start_offset;
-		offset_in_buf %= gkcrypt->key_buf_size;
-		size_t end = offset_in_buf + buf_size;
-		if(end > gkcrypt->key_buf_size)
-		{
-			size_t excess = end - gkcrypt->key_buf_size;
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
-			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
-		}
-		else
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size);
-		err = CHIAKI_ERR_SUCCESS;
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+		chiaki_cond_signal(&gkcrypt->key_buf_cond);
 		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 	}
 
-	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
-
 	return err;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	return gkcrypt_key_stream_apply(gkcrypt, key_pos, NULL, buf, buf_size);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
-	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	return gkcrypt_key_stream_apply(gkcrypt, key_pos, buf, buf, buf_size);
+}
 
-	uint8_t *key_stream = malloc(full_size);
-	if(!key_stream)
-		return CHIAKI_ERR_MEMORY;
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt_to(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *dst, size_t size)
+{
+	return gkcrypt_key_stream_apply(gkcrypt, key_pos, src, dst, size);
+}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		free(key_stream);
-		return err;
-	}
+/**
+ * A zeroed ChiakiGKCryptGmacCtx is valid, the backend context is only created when it is keyed first.
+ */
+static void gkcrypt_gmac_ctx_init(ChiakiGKCryptGmacCtx *gmac_ctx)
+{
+	memset(gmac_ctx, 0, sizeof(*gmac_ctx));
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_init(&gmac_ctx->gcm);
+#endif
+}
 
-	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+static void gkcrypt_gmac_ctx_fini(ChiakiGKCryptGmacCtx *gmac_ctx)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_free(&gmac_ctx->gcm);
+#else
+	EVP_CIPHER_CTX_free(gmac_ctx->ctx);
+	gmac_ctx->ctx = NULL;
+#endif
+	gmac_ctx->keyed = false;
+}
 
+static ChiakiErrorCode gkcrypt_gmac_ctx_set_key(ChiakiGKCryptGmacCtx *gmac_ctx, uint64_t key_index, const uint8_t *key)
+{
+	gmac_ctx->keyed = false;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	if(mbedtls_gcm_setkey(&gmac_ctx->gcm, MBEDTLS_CIPHER_ID_AES, key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
+		return CHIAKI_ERR_UNKNOWN;
+#else
+	if(!gmac_ctx->ctx)
+	{
+		gmac_ctx->ctx = EVP_CIPHER_CTX_new();
+		if(!gmac_ctx->ctx)
+			return CHIAKI_ERR_MEMORY;
+		if(!EVP_CipherInit_ex(gmac_ctx->ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+			|| !EVP_CIPHER_CTX_ctrl(gmac_ctx->ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
+		{
+			EVP_CIPHER_CTX_free(gmac_ctx->ctx);
+			gmac_ctx->ctx = NULL;
+			return CHIAKI_ERR_UNKNOWN;
+		}
+	}
+	if(!EVP_CipherInit_ex(gmac_ctx->ctx, NULL, NULL, key, NULL, 1))
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+	gmac_ctx->keyed = true;
+	gmac_ctx->key_index = key_index;
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+static uint64_t gkcrypt_gmac_key_index(uint64_t key_pos)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
-
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+	return (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+}
 
+/**
+ * Get the cipher context for the gmac key of key_pos, rekeying its slot only if it currently holds a different key index.
+ */
+static ChiakiErrorCode gkcrypt_gmac_ctx_get(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, ChiakiGKCryptGmacCtx **gmac_ctx_out)
+{
+	uint64_t key_index = gkcrypt_gmac_key_index(key_pos);
 	if(key_index > gkcrypt->key_gmac_index_current)
-	{
 		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
-	}
-	else if(key_index < gkcrypt->key_gmac_index_current)
-	{
-		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
-		gmac_key = gmac_key_tmp;
-	}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls gcm context AES_128_GCM
-	// Encryption
-	mbedtls_gcm_context actx;
-	mbedtls_gcm_init(&actx);
-	// set gmac_key 128 bits key
-	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
-	{
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
+	ChiakiGKCryptGmacCtx *gmac_ctx = &gkcrypt->gmac_ctx[key_index % CHIAKI_GKCRYPT_GMAC_CTX_COUNT];
+	*gmac_ctx_out = gmac_ctx;
+	if(gmac_ctx->keyed && gmac_ctx->key_index == key_index)
+		return CHIAKI_ERR_SUCCESS;
 
-	// encrypt without additional data
-	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL, 0) != 0)
-	{
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
-	// set "additional data" only whitout input nor output
+	if(key_index == gkcrypt->key_gmac_index_current)
+		return gkcrypt_gmac_ctx_set_key(gmac_ctx, key_index, gkcrypt->key_gmac_current);
+
+	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+	return gkcrypt_gmac_ctx_set_key(gmac_ctx, key_index, gmac_key_tmp);
+}
+
+static ChiakiErrorCode gkcrypt_gmac_ctx_tag(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGmacCtx *gmac_ctx, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	// buf is only passed as "additional data" without input nor output
 	// to get the same result as:
 	// EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
-	if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+	if(mbedtls_gcm_crypt_and_tag(&gmac_ctx->gcm, MBEDTLS_GCM_ENCRYPT,
 		   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		   buf, buf_size, NULL, NULL,
 		   CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0)
-	{
-
-		mbedtls_gcm_free(&actx);
 		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	mbedtls_gcm_free(&actx);
-
-	return CHIAKI_ERR_SUCCESS;
 #else
-	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	// key and iv length are kept in the context, only the iv is set here
+	if(!EVP_CipherInit_ex(gmac_ctx->ctx, NULL, NULL, NULL, iv, 1))
+		return CHIAKI_ERR_UNKNOWN;
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-	{
-		ret = CHIAKI_ERR_MEMORY;
-		goto fail;
-	}
+	int len;
+	if(!EVP_EncryptUpdate(gmac_ctx->ctx, NULL, &len, buf, (int)buf_size))
+		return CHIAKI_ERR_UNKNOWN;
 
-	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(!EVP_EncryptFinal_ex(gmac_ctx->ctx, NULL, &len))
+		return CHIAKI_ERR_UNKNOWN;
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(!EVP_CIPHER_CTX_ctrl(gmac_ctx->ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	ChiakiGKCryptGmacCtx *gmac_ctx;
+	ChiakiErrorCode err = gkcrypt_gmac_ctx_get(gkcrypt, key_pos, &gmac_ctx);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return gkcrypt_gmac_ctx_tag(gkcrypt, gmac_ctx, key_pos, buf, buf_size, gmac_out);
+}
 
-	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGmacRequest *reqs, size_t count)
+{
+	uint64_t key_pos_max = 0;
+	for(size_t i=0; i<count; i++)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		if(reqs[i].key_pos > key_pos_max)
+			key_pos_max = reqs[i].key_pos;
 	}
+	uint64_t key_index_max = gkcrypt_gmac_key_index(key_pos_max);
+	if(key_index_max > gkcrypt->key_gmac_index_current)
+		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index_max);
 
-	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	for(size_t i=0; i<count; i++)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		ChiakiGKCryptGmacRequest *req = &reqs[i];
+		req->valid = false;
+		ChiakiGKCryptGmacCtx *gmac_ctx;
+		ChiakiErrorCode req_err = gkcrypt_gmac_ctx_get(gkcrypt, req->key_pos, &gmac_ctx);
+		if(req_err == CHIAKI_ERR_SUCCESS)
+			req_err = gkcrypt_gmac_ctx_tag(gkcrypt, gmac_ctx, req->key_pos, req->buf, req->buf_size, req->gmac);
+		if(req_err != CHIAKI_ERR_SUCCESS)
+		{
+			err = req_err;
+			continue;
+		}
+		req->valid = !req->gmac_expected || memcmp(req->gmac, req->gmac_expected, CHIAKI_GKCRYPT_GMAC_SIZE) == 0;
 	}
+	return err;
+}
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+/**
+ * @return how far the producer should stay ahead of last_key_pos
+ */
+static uint64_t gkcrypt_key_buf_prefetch_size(ChiakiGKCrypt *gkcrypt)
+{
+	// keep at least a quarter of the ring behind last_key_pos for late packets
+	uint64_t max = gkcrypt->key_buf_size - gkcrypt->key_buf_size / 4;
+	if(!gkcrypt->key_buf_rate)
+		return gkcrypt->key_buf_size / 2;
+	uint64_t size = gkcrypt->key_buf_rate * KEY_BUF_PREFETCH_MS / 1000;
+	size = ((size + KEY_BUF_CHUNK_SIZE - 1) / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+	if(size < KEY_BUF_PREFETCH_MIN)
+		size = KEY_BUF_PREFETCH_MIN;
+	if(size > max)
+		size = max;
+	return size;
+}
 
-fail_cipher:
-	EVP_CIPHER_CTX_free(ctx);
-fail:
-	return ret;
-#endif
+static void gkcrypt_key_buf_update_rate(ChiakiGKCrypt *gkcrypt)
+{
+	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t dt = now - gkcrypt->key_buf_rate_time_ms;
+	if(dt < KEY_BUF_RATE_SAMPLE_MS)
+		return;
+	uint64_t last_key_pos = chiaki_atomic_u64_load_acquire(&gkcrypt->last_key_pos);
+	uint64_t rate = last_key_pos > gkcrypt->key_buf_rate_key_pos
+		? (last_key_pos - gkcrypt->key_buf_rate_key_pos) * 1000 / dt
+		: 0;
+	// only start to estimate once there is traffic, before that key_buf_size / 2 is prefetched
+	if(rate || gkcrypt->key_buf_rate)
+		gkcrypt->key_buf_rate = gkcrypt->key_buf_rate ? (gkcrypt->key_buf_rate * 3 + rate) / 4 : rate;
+	gkcrypt->key_buf_rate_key_pos = last_key_pos;
+	gkcrypt->key_buf_rate_time_ms = now;
 }
 
 static bool key_buf_mutex_pred(void *user)
@@ -465,34 +688,88 @@ static bool key_buf_mutex_pred(void *user)
 	if(gkcrypt->key_buf_thread_stop)
 		return true;
 
-	if(gkcrypt->key_buf_populated < gkcrypt->key_buf_size)
-		return true;
-
-	if(gkcrypt_key_buf_should_generate(gkcrypt))
-		return true;
+	// the same condition the consumer signals on, after a fill the watermark is always ahead of last_key_pos
+	return chiaki_atomic_u64_load_acquire(&gkcrypt->last_key_pos) > chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_watermark);
+}
 
-	return false;
+static inline void gkcrypt_cpu_relax(void)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7))
+	__asm__ __volatile__("yield");
+#elif defined(_WIN32)
+	YieldProcessor();
+#endif
 }
 
-static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
+/**
+ * Producer side only, called without key_buf_mutex.
+ */
+static ChiakiErrorCode gkcrypt_key_buf_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
-	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
-	uint64_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
-	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
+	uint64_t key_pos_min = chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_min);
+	uint64_t key_pos_end = chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_end);
+	uint64_t last_key_pos = chiaki_atomic_u64_load_acquire(&gkcrypt->last_key_pos);
 
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	if(last_key_pos > key_pos_end + KEY_BUF_CHUNK_SIZE)
+	{
+		// skip ahead if the last key pos is already beyond our buffer
+		uint64_t key_pos = (last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+		CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from %#llx to %#llx",
+					(unsigned long long)key_pos_end,
+					(unsigned long long)key_pos);
+		key_pos_min = key_pos;
+		chiaki_atomic_u64_store(&gkcrypt->key_buf_key_pos_min, key_pos_min);
+		key_pos_end = key_pos;
+		chiaki_atomic_u64_store_release(&gkcrypt->key_buf_key_pos_end, key_pos_end);
+	}
+
+	// the new chunk replaces the oldest one once the ring is full
+	if(key_pos_end + KEY_BUF_CHUNK_SIZE > key_pos_min + gkcrypt->key_buf_size)
+	{
+		key_pos_min = key_pos_end + KEY_BUF_CHUNK_SIZE - gkcrypt->key_buf_size;
+		chiaki_atomic_u64_store(&gkcrypt->key_buf_key_pos_min, key_pos_min);
+	}
+
+	// a consumer that has checked the old min before we raised it may still be reading the chunk.
+	// This is very short unless the consumer has been preempted, so only spin for a bit.
+	for(unsigned int spins=0; chiaki_atomic_u64_load(&gkcrypt->key_buf_reader_pos) < key_pos_min; spins++)
+	{
+		if(spins < KEY_BUF_READER_SPINS_MAX)
+			gkcrypt_cpu_relax();
+		else
+			chiaki_thread_yield();
+	}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
+	uint8_t *buf_start = gkcrypt->key_buf + (size_t)(key_pos_end % gkcrypt->key_buf_size);
+	ChiakiErrorCode err = gkcrypt_gen_key_stream_ctx(gkcrypt, &gkcrypt->key_stream_ctx_producer, key_pos_end, buf_start, KEY_BUF_CHUNK_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+		return err;
+	}
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
-
-	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
+	chiaki_atomic_u64_store_release(&gkcrypt->key_buf_key_pos_end, key_pos_end + KEY_BUF_CHUNK_SIZE);
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	return err;
+/**
+ * Producer side only, generate up to prefetch_size ahead of last_key_pos and move the watermark
+ * to where the consumer should wake the producer up again.
+ */
+static ChiakiErrorCode gkcrypt_key_buf_fill(ChiakiGKCrypt *gkcrypt, uint64_t prefetch_size)
+{
+	while(chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_end) < chiaki_atomic_u64_load_acquire(&gkcrypt->last_key_pos) + prefetch_size)
+	{
+		ChiakiErrorCode err = gkcrypt_key_buf_generate_next_chunk(gkcrypt);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+	uint64_t key_pos_end = chiaki_atomic_u64_load_relaxed(&gkcrypt->key_buf_key_pos_end);
+	uint64_t prefetch_half = prefetch_size / 2;
+	chiaki_atomic_u64_store_release(&gkcrypt->key_buf_watermark, key_pos_end > prefetch_half ? key_pos_end - prefetch_half : 0);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static void *gkcrypt_thread_func(void *user)
@@ -509,32 +786,12 @@ static void *gkcrypt_thread_func(void *user)
 		if(gkcrypt->key_buf_thread_stop || err != CHIAKI_ERR_SUCCESS)
 			break;
 
-		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx, generating next chunk",
-					(int)gkcrypt->index,
-					(unsigned long long)gkcrypt->key_buf_size,
-					(unsigned long long)gkcrypt->key_buf_start_offset,
-					(unsigned long long)gkcrypt->key_buf_populated,
-					(unsigned long long)gkcrypt->key_buf_key_pos_min,
-					(unsigned long long)gkcrypt->last_key_pos);
+		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
-		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
-		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
+		gkcrypt_key_buf_update_rate(gkcrypt);
+		err = gkcrypt_key_buf_fill(gkcrypt, gkcrypt_key_buf_prefetch_size(gkcrypt));
+
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 		if(err != CHIAKI_ERR_SUCCESS)
 			break;
 	}
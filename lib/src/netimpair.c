@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/netimpair.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TOKENS_ELAPSED_MAX_US 10000000
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_config_parse(ChiakiNetImpairConfig *config, const char *spec)
+{
+	memset(config, 0, sizeof(*config));
+	double loss = 0.0;
+	double burst = 1.0;
+	bool loss_set = false;
+
+	const char *cur = spec;
+	while(*cur)
+	{
+		const char *end = strchr(cur, ',');
+		if(!end)
+			end = cur + strlen(cur);
+		const char *eq = memchr(cur, '=', (size_t)(end - cur));
+		if(!eq)
+			return CHIAKI_ERR_INVALID_DATA;
+		size_t key_len = (size_t)(eq - cur);
+		char *value_end;
+		double value = strtod(eq + 1, &value_end);
+		if(value_end != end || value < 0.0)
+			return CHIAKI_ERR_INVALID_DATA;
+
+#define KEY(k) (key_len == strlen(k) && !strncmp(cur, k, key_len))
+		if(KEY("seed"))
+			config->seed = (uint64_t)value;
+		else if(KEY("loss"))
+		{
+			loss = value / 100.0;
+			loss_set = true;
+		}
+		else if(KEY("burst"))
+			burst = value;
+		else if(KEY("ge_p"))
+			config->ge_p = value;
+		else if(KEY("ge_r"))
+			config->ge_r = value;
+		else if(KEY("loss_good"))
+			config->loss_good = value;
+		else if(KEY("loss_bad"))
+			config->loss_bad = value;
+		else if(KEY("dup"))
+			config->duplicate = value / 100.0;
+		else if(KEY("reorder"))
+			config->reorder = value / 100.0;
+		else if(KEY("reorder_delay"))
+			config->reorder_delay_ms = (uint32_t)value;
+		else if(KEY("delay"))
+			config->delay_ms = (uint32_t)value;
+		else if(KEY("jitter"))
+			config->jitter_ms = (uint32_t)value;
+		else if(KEY("rate"))
+			config->rate_kbps = (uint32_t)value;
+		else if(KEY("bucket"))
+			config->burst_bytes = (uint32_t)value;
+		else if(KEY("queue"))
+			config->queue_ms = (uint32_t)value;
+		else
+			return CHIAKI_ERR_INVALID_DATA;
+#undef KEY
+
+		cur = *end ? end + 1 : end;
+	}
+
+	if(loss_set)
+	{
+		// stationary loss of the chain is p / (p + r), the mean burst length 1 / r
+		if(loss >= 1.0 || burst < 1.0)
+			return CHIAKI_ERR_INVALID_DATA;
+		config->ge_r = 1.0 / burst;
+		config->ge_p = loss * config->ge_r / (1.0 - loss);
+		config->loss_good = 0.0;
+		config->loss_bad = 1.0;
+	}
+
+	if(config->reorder > 0.0 && !config->reorder_delay_ms)
+		config->reorder_delay_ms = 10;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT bool chiaki_net_impair_config_active(const ChiakiNetImpairConfig *config)
+{
+	return config->loss_good > 0.0 || (config->ge_p > 0.0 && config->loss_bad > 0.0)
+		|| config->duplicate > 0.0 || config->reorder > 0.0
+		|| config->delay_ms || config->jitter_ms || config->rate_kbps;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_init(ChiakiNetImpair *impair, const ChiakiNetImpairConfig *config, ChiakiPacketPool *pool)
+{
+	memset(impair, 0, sizeof(*impair));
+	impair->heap = malloc(CHIAKI_NET_IMPAIR_QUEUE_SIZE * sizeof(ChiakiNetImpairEntry));
+	if(!impair->heap)
+		return CHIAKI_ERR_MEMORY;
+	impair->config = *config;
+	if(!impair->config.burst_bytes)
+		impair->config.burst_bytes = CHIAKI_PACKET_BUF_SIZE;
+	impair->pool = pool;
+	impair->rng_state = config->seed;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_fini(ChiakiNetImpair *impair)
+{
+	for(size_t i=0; i<impair->heap_count; i++)
+		chiaki_packet_pool_release(impair->pool, impair->heap[i].packet);
+	impair->heap_count = 0;
+	free(impair->heap);
+	impair->heap = NULL;
+}
+
+/**
+ * splitmix64, uniform in [0, 1)
+ */
+static double impair_random(ChiakiNetImpair *impair)
+{
+	uint64_t z = (impair->rng_state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	z ^= z >> 31;
+	return (double)(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool impair_chance(ChiakiNetImpair *impair, double p)
+{
+	return p > 0.0 && impair_random(impair) < p;
+}
+
+static bool entry_before(const ChiakiNetImpairEntry *a, const ChiakiNetImpairEntry *b)
+{
+	return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+static bool impair_enqueue(ChiakiNetImpair *impair, ChiakiPacketBuf *packet, uint64_t due_us)
+{
+	if(impair->heap_count >= CHIAKI_NET_IMPAIR_QUEUE_SIZE)
+		return false;
+	ChiakiNetImpairEntry entry = { due_us, impair->order_next++, packet };
+	size_t i = impair->heap_count++;
+	while(i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if(!entry_before(&entry, &impair->heap[parent]))
+			break;
+		impair->heap[i] = impair->heap[parent];
+		i = parent;
+	}
+	impair->heap[i] = entry;
+	return true;
+}
+
+/**
+ * @return whether the token bucket lets the packet through, possibly after waiting *wait_us
+ */
+static bool impair_tokens_take(ChiakiNetImpair *impair, size_t size, uint64_t now_us, uint64_t *wait_us)
+{
+	*wait_us = 0;
+	const ChiakiNetImpairConfig *config = &impair->config;
+	if(!config->rate_kbps)
+		return true;
+
+	int64_t tokens_max = (int64_t)config->burst_bytes * 8;
+	if(!impair->tokens_us)
+		impair->tokens_bits = tokens_max;
+	else if(now_us > impair->tokens_us)
+	{
+		uint64_t elapsed_us = now_us - impair->tokens_us;
+		if(elapsed_us > TOKENS_ELAPSED_MAX_US)
+			elapsed_us = TOKENS_ELAPSED_MAX_US;
+		impair->tokens_bits += (int64_t)(elapsed_us * config->rate_kbps / 1000);
+		if(impair->tokens_bits > tokens_max)
+			impair->tokens_bits = tokens_max;
+	}
+	if(now_us > impair->tokens_us)
+		impair->tokens_us = now_us;
+
+	int64_t tokens_after = impair->tokens_bits - (int64_t)size * 8;
+	if(tokens_after < 0)
+	{
+		*wait_us = (uint64_t)(-tokens_after) * 1000 / config->rate_kbps;
+		if(config->queue_ms && *wait_us > (uint64_t)config->queue_ms * 1000)
+			return false;
+	}
+	impair->tokens_bits = tokens_after;
+	return true;
+}
+
+static uint64_t impair_delay_us(ChiakiNetImpair *impair)
+{
+	const ChiakiNetImpairConfig *config = &impair->config;
+	uint64_t delay_us = (uint64_t)config->delay_ms * 1000;
+	if(config->jitter_ms)
+		delay_us += (uint64_t)(impair_random(impair) * (double)config->jitter_ms * 1000.0);
+	if(impair_chance(impair, config->reorder))
+	{
+		delay_us += (uint64_t)config->reorder_delay_ms * 1000;
+		impair->stats.reordered++;
+	}
+	return delay_us;
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_push(ChiakiNetImpair *impair, ChiakiPacketBuf *packet, uint64_t now_us)
+{
+	const ChiakiNetImpairConfig *config = &impair->config;
+	impair->stats.packets_in++;
+
+	if(impair->ge_bad)
+	{
+		if(impair_chance(impair, config->ge_r))
+			impair->ge_bad = false;
+	}
+	else if(impair_chance(impair, config->ge_p))
+		impair->ge_bad = true;
+	if(impair_chance(impair, impair->ge_bad ? config->loss_bad : config->loss_good))
+	{
+		impair->stats.dropped_loss++;
+		chiaki_packet_pool_release(impair->pool, packet);
+		return;
+	}
+
+	uint64_t wait_us;
+	if(!impair_tokens_take(impair, packet->size, now_us, &wait_us))
+		goto drop_queue;
+	uint64_t due_us = now_us + wait_us;
+
+	if(impair_chance(impair, config->duplicate))
+	{
+		ChiakiPacketBuf *dup = chiaki_packet_pool_acquire(impair->pool);
+		if(dup)
+		{
+			memcpy(dup->data, packet->data, packet->size);
+			dup->size = packet->size;
+			if(impair_enqueue(impair, dup, due_us + impair_delay_us(impair)))
+				impair->stats.duplicated++;
+			else
+				chiaki_packet_pool_release(impair->pool, dup);
+		}
+	}
+
+	if(impair_enqueue(impair, packet, due_us + impair_delay_us(impair)))
+		return;
+
+drop_queue:
+	impair->stats.dropped_queue++;
+	chiaki_packet_pool_release(impair->pool, packet);
+}
+
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_net_impair_pop(ChiakiNetImpair *impair, uint64_t now_us)
+{
+	if(!impair->heap_count || impair->heap[0].due_us > now_us)
+		return NULL;
+	ChiakiPacketBuf *packet = impair->heap[0].packet;
+
+	ChiakiNetImpairEntry last = impair->heap[--impair->heap_count];
+	size_t i = 0;
+	while(true)
+	{
+		size_t child = 2 * i + 1;
+		if(child >= impair->heap_count)
+			break;
+		if(child + 1 < impair->heap_count && entry_before(&impair->heap[child + 1], &impair->heap[child]))
+			child++;
+		if(!entry_before(&impair->heap[child], &last))
+			break;
+		impair->heap[i] = impair->heap[child];
+		i = child;
+	}
+	if(impair->heap_count)
+		impair->heap[i] = last;
+
+	impair->stats.packets_out++;
+	return packet;
+}
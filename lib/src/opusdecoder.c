@@ -11,6 +11,7 @@
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user);
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user);
+static void chiaki_opus_decoder_frame_lost(size_t frames_count, uint8_t *next_buf, size_t next_buf_size, void *user);
 
 CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log)
 {
@@ -20,6 +21,8 @@ CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLo
 
 	decoder->pcm_buf = NULL;
 	decoder->pcm_buf_size = 0;
+	decoder->frames_recovered_fec = 0;
+	decoder->frames_concealed = 0;
 
 	decoder->cb_user = NULL;
 	decoder->settings_cb = NULL;
@@ -28,6 +31,10 @@ CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLo
 
 CHIAKI_EXPORT void chiaki_opus_decoder_fini(ChiakiOpusDecoder *decoder)
 {
+	if(decoder->frames_recovered_fec || decoder->frames_concealed)
+		CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder recovered %llu lost frames from FEC, concealed %llu",
+				(unsigned long long)decoder->frames_recovered_fec,
+				(unsigned long long)decoder->frames_concealed);
 	free(decoder->pcm_buf);
 }
 
@@ -36,6 +43,7 @@ CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, Chia
 	sink->user = decoder;
 	sink->header_cb = chiaki_opus_decoder_header;
 	sink->frame_cb = chiaki_opus_decoder_frame;
+	sink->frame_lost_cb = chiaki_opus_decoder_frame_lost;
 }
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
@@ -94,4 +102,32 @@ static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user)
 		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
 }
 
-#endif
\ No newline at end of file
+static void chiaki_opus_decoder_frame_lost(size_t frames_count, uint8_t *next_buf, size_t next_buf_size, void *user)
+{
+	ChiakiOpusDecoder *decoder = user;
+	if(!decoder->opus_decoder)
+		return;
+
+	// Only the frame right before next_buf can be restored from its in-band FEC data,
+	// all others are concealed. Opus falls back to concealment by itself if next_buf has no FEC data.
+	for(size_t i=0; i<frames_count; i++)
+	{
+		bool fec = i == frames_count - 1;
+		int r = opus_decode(decoder->opus_decoder,
+				fec ? next_buf : NULL, fec ? (opus_int32)next_buf_size : 0,
+				decoder->pcm_buf, decoder->audio_header.frame_size, fec ? 1 : 0);
+		if(r < 1)
+		{
+			CHIAKI_LOGE(decoder->log, "Recovering lost audio frame with opus failed: %s", opus_strerror(r));
+			return;
+		}
+		if(fec)
+			decoder->frames_recovered_fec++;
+		else
+			decoder->frames_concealed++;
+		if(decoder->frame_cb)
+			decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
+	}
+}
+
+#endif
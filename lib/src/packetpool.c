@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/packetpool.h>
+
+#include <stdlib.h>
+#include <assert.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t count)
+{
+	pool->bufs = calloc(count, sizeof(ChiakiPacketBuf));
+	if(!pool->bufs)
+		return CHIAKI_ERR_MEMORY;
+	pool->bufs_count = count;
+	pool->free_list = NULL;
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiPacketBuf *buf = &pool->bufs[count - 1 - i];
+		buf->pooled = true;
+		buf->next = pool->free_list;
+		pool->free_list = buf;
+	}
+	pool->free_count = count;
+	pool->exhausted_count = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool)
+{
+	assert(pool->free_count == pool->bufs_count);
+	free(pool->bufs);
+}
+
+CHIAKI_EXPORT ChiakiPacketBuf *chiaki_packet_pool_acquire(ChiakiPacketPool *pool)
+{
+	ChiakiPacketBuf *buf = pool->free_list;
+	if(buf)
+	{
+		pool->free_list = buf->next;
+		pool->free_count--;
+	}
+	else
+	{
+		pool->exhausted_count++;
+		buf = malloc(sizeof(ChiakiPacketBuf));
+		if(!buf)
+			return NULL;
+		buf->pooled = false;
+	}
+	buf->next = NULL;
+	buf->size = CHIAKI_PACKET_BUF_SIZE;
+	return buf;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_release(ChiakiPacketPool *pool, ChiakiPacketBuf *buf)
+{
+	if(!buf)
+		return;
+	if(!buf->pooled)
+	{
+		free(buf);
+		return;
+	}
+	assert(buf >= pool->bufs && buf < pool->bufs + pool->bufs_count);
+	buf->next = pool->free_list;
+	pool->free_list = buf;
+	pool->free_count++;
+}
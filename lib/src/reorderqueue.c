@@ -185,4 +185,219 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 			entry = &queue->queue[idx(seq_num)];
 		}
 	}
-}
\ No newline at end of file
+}
+#undef gt
+#undef lt
+#undef ge
+#undef le
+#undef add
+#undef QUEUE_SIZE
+#undef IDX_MASK
+#undef idx
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ctz64(x) ((size_t)__builtin_ctzll(x))
+#else
+static inline size_t ctz64(uint64_t x)
+{
+	size_t r = 0;
+	while(!(x & 1))
+	{
+		x >>= 1;
+		r++;
+	}
+	return r;
+}
+#endif
+
+#define BITMAP_WORDS(size) (((size) + 63) / 64)
+
+static inline bool bitmap_get(const uint64_t *bitmap, size_t i)	{ return (bitmap[i >> 6] >> (i & 63)) & 1; }
+static inline void bitmap_set(uint64_t *bitmap, size_t i)			{ bitmap[i >> 6] |= ((uint64_t)1) << (i & 63); }
+static inline void bitmap_clear(uint64_t *bitmap, size_t i)		{ bitmap[i >> 6] &= ~(((uint64_t)1) << (i & 63)); }
+
+/**
+ * Find the first clear bit in a ring of size bits (power of 2), looking at len bits from start on.
+ *
+ * @return offset from start of the clear bit, len if all are set
+ */
+static size_t bitmap_find_clear(const uint64_t *bitmap, size_t size, size_t start, size_t len)
+{
+	size_t offset = 0;
+	while(offset < len)
+	{
+		size_t i = (start + offset) & (size - 1);
+		size_t bit = i & 63;
+		size_t avail = 64 - bit;
+		if(avail > size - i)
+			avail = size - i;
+		if(avail > len - offset)
+			avail = len - offset;
+		uint64_t clear = ~bitmap[i >> 6] >> bit;
+		if(avail < 64)
+			clear &= (((uint64_t)1) << avail) - 1;
+		if(clear)
+			return offset + ctz64(clear);
+		offset += avail;
+	}
+	return len;
+}
+
+#define REORDER_QUEUE_DEFINE(bits) \
+\
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_##bits##_init(ChiakiReorderQueue##bits *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
+{ \
+	if(size_exp >= bits) \
+		return CHIAKI_ERR_INVALID_DATA; \
+	queue->size_exp = size_exp; \
+	queue->begin = seq_num_start; \
+	queue->count = 0; \
+	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END; \
+	queue->drop_cb = NULL; \
+	queue->drop_cb_user = NULL; \
+	size_t size = ((size_t)1) << size_exp; \
+	queue->elems = calloc(size, sizeof(void *)); \
+	if(!queue->elems) \
+		return CHIAKI_ERR_MEMORY; \
+	queue->set = calloc(BITMAP_WORDS(size), sizeof(uint64_t)); \
+	if(!queue->set) \
+	{ \
+		free(queue->elems); \
+		return CHIAKI_ERR_MEMORY; \
+	} \
+	return CHIAKI_ERR_SUCCESS; \
+} \
+\
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_fini(ChiakiReorderQueue##bits *queue) \
+{ \
+	size_t mask = chiaki_reorder_queue_##bits##_size(queue) - 1; \
+	if(queue->drop_cb) \
+	{ \
+		for(size_t i=0; i<queue->count; i++) \
+		{ \
+			ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + i); \
+			if(bitmap_get(queue->set, seq_num & mask)) \
+				queue->drop_cb(seq_num, queue->elems[seq_num & mask], queue->drop_cb_user); \
+		} \
+	} \
+	free(queue->set); \
+	free(queue->elems); \
+} \
+\
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_push(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits seq_num, void *user) \
+{ \
+	size_t size = chiaki_reorder_queue_##bits##_size(queue); \
+	size_t mask = size - 1; \
+	assert(queue->count <= size); \
+\
+	if(chiaki_seq_num_##bits##_lt(seq_num, queue->begin)) \
+		goto drop_it; \
+\
+	size_t offset = (ChiakiSeqNum##bits)(seq_num - queue->begin); \
+	if(offset < queue->count) \
+	{ \
+		if(bitmap_get(queue->set, seq_num & mask)) /* received twice */ \
+			goto drop_it; \
+		queue->elems[seq_num & mask] = user; \
+		bitmap_set(queue->set, seq_num & mask); \
+		return; \
+	} \
+\
+	if(offset >= size) \
+	{ \
+		if(queue->drop_strategy == CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END) \
+			goto drop_it; \
+\
+		/* drop first until empty or enough space */ \
+		while(queue->count > 0 && offset >= size) \
+		{ \
+			size_t i = queue->begin & mask; \
+			if(bitmap_get(queue->set, i)) \
+			{ \
+				bitmap_clear(queue->set, i); \
+				if(queue->drop_cb) \
+					queue->drop_cb(queue->begin, queue->elems[i], queue->drop_cb_user); \
+			} \
+			queue->begin++; \
+			queue->count--; \
+			offset--; \
+		} \
+\
+		/* empty, just shift to the seq_num */ \
+		if(queue->count == 0) \
+		{ \
+			queue->begin = seq_num; \
+			offset = 0; \
+		} \
+	} \
+\
+	/* slots outside of the window are always empty, so the window can simply grow until seq_num */ \
+	queue->count = offset + 1; \
+	queue->elems[seq_num & mask] = user; \
+	bitmap_set(queue->set, seq_num & mask); \
+	return; \
+drop_it: \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, user, queue->drop_cb_user); \
+} \
+\
+CHIAKI_EXPORT bool chiaki_reorder_queue_##bits##_pull(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits *seq_num, void **user) \
+{ \
+	if(queue->count == 0) \
+		return false; \
+	size_t i = queue->begin & (chiaki_reorder_queue_##bits##_size(queue) - 1); \
+	if(!bitmap_get(queue->set, i)) \
+		return false; \
+	bitmap_clear(queue->set, i); \
+	if(seq_num) \
+		*seq_num = queue->begin; \
+	if(user) \
+		*user = queue->elems[i]; \
+	queue->begin++; \
+	queue->count--; \
+	return true; \
+} \
+\
+CHIAKI_EXPORT bool chiaki_reorder_queue_##bits##_peek(ChiakiReorderQueue##bits *queue, size_t index, ChiakiSeqNum##bits *seq_num, void **user) \
+{ \
+	if(index >= queue->count) \
+		return false; \
+	ChiakiSeqNum##bits seq_num_val = (ChiakiSeqNum##bits)(queue->begin + index); \
+	size_t i = seq_num_val & (chiaki_reorder_queue_##bits##_size(queue) - 1); \
+	if(!bitmap_get(queue->set, i)) \
+		return false; \
+	if(seq_num) \
+		*seq_num = seq_num_val; \
+	if(user) \
+		*user = queue->elems[i]; \
+	return true; \
+} \
+\
+CHIAKI_EXPORT void chiaki_reorder_queue_##bits##_drop(ChiakiReorderQueue##bits *queue, size_t index) \
+{ \
+	if(index >= queue->count) \
+		return; \
+	size_t mask = chiaki_reorder_queue_##bits##_size(queue) - 1; \
+	ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + index); \
+	if(!bitmap_get(queue->set, seq_num & mask)) \
+		return; \
+	bitmap_clear(queue->set, seq_num & mask); \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, queue->elems[seq_num & mask], queue->drop_cb_user); \
+\
+	/* reduce count if necessary */ \
+	if(index == queue->count - 1) \
+	{ \
+		while(queue->count > 0 && !bitmap_get(queue->set, (queue->begin + queue->count - 1) & mask)) \
+			queue->count--; \
+	} \
+} \
+\
+CHIAKI_EXPORT size_t chiaki_reorder_queue_##bits##_next_missing(ChiakiReorderQueue##bits *queue) \
+{ \
+	size_t size = chiaki_reorder_queue_##bits##_size(queue); \
+	return bitmap_find_clear(queue->set, size, queue->begin & (size - 1), queue->count); \
+}
+
+REORDER_QUEUE_DEFINE(16)
+REORDER_QUEUE_DEFINE(32)
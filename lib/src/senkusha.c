@@ -144,6 +144,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	takion_info.enable_crypt = false;
 	takion_info.protocol_version = 7;
+	takion_info.capture = NULL;
+	takion_info.replay = NULL;
+	takion_info.replay_realtime = false;
+	takion_info.net_impair = NULL;
+	takion_info.rtt_us = 0;
+	takion_info.data_queue_size_exp = 0;
+	takion_info.event_loop = NULL;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
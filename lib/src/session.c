@@ -228,6 +228,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.disable_av_pipeline = connect_info->disable_av_pipeline;
+	session->connect_info.video_jitter_buffer_max_ms = connect_info->video_jitter_buffer_max_ms;
+	session->connect_info.feedback_interval_min_ms = connect_info->feedback_interval_min_ms;
+	session->connect_info.event_loop = connect_info->event_loop;
+	session->connect_info.net_impair_set = connect_info->net_impair != NULL;
+	if(connect_info->net_impair)
+		session->connect_info.net_impair = *connect_info->net_impair;
+	if(connect_info->capture_filename)
+	{
+		session->connect_info.capture_filename = strdup(connect_info->capture_filename);
+		if(!session->connect_info.capture_filename)
+		{
+			chiaki_session_fini(session);
+			return CHIAKI_ERR_MEMORY;
+		}
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 error_stop_pipe:
@@ -248,6 +264,7 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 		return;
 	free(session->login_pin);
 	free(session->quit_reason_str);
+	free(session->connect_info.capture_filename);
 	chiaki_stream_connection_fini(&session->stream_connection);
 	chiaki_ctrl_fini(&session->ctrl);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
@@ -842,3 +859,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *sess
 {
 	return chiaki_ctrl_keyboard_accept(&session->ctrl);
 }
+
+CHIAKI_EXPORT void chiaki_session_get_bandwidth_estimate(ChiakiSession *session, ChiakiBandwidthEstimate *estimate)
+{
+	chiaki_bandwidth_estimator_get(&session->stream_connection.bandwidth_estimator, estimate);
+}
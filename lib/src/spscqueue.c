@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/spscqueue.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_init(ChiakiSPSCQueue *queue, size_t slot_size, size_t count)
+{
+	size_t count_pow2 = 1;
+	while(count_pow2 < count)
+		count_pow2 <<= 1;
+
+	queue->slot_size = slot_size;
+	queue->count = count_pow2;
+	queue->slots = calloc(count_pow2, slot_size);
+	if(!queue->slots)
+		return CHIAKI_ERR_MEMORY;
+
+	chiaki_atomic_u64_init(&queue->head, 0);
+	chiaki_atomic_u64_init(&queue->tail, 0);
+	chiaki_atomic_u32_init(&queue->consumer_waiting, 0);
+	chiaki_atomic_u32_init(&queue->producer_waiting, 0);
+	chiaki_atomic_u32_init(&queue->closed, 0);
+
+	ChiakiErrorCode err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_slots;
+
+	err = chiaki_cond_init(&queue->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+error_slots:
+	free(queue->slots);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_spsc_queue_fini(ChiakiSPSCQueue *queue)
+{
+	chiaki_cond_fini(&queue->cond);
+	chiaki_mutex_fini(&queue->mutex);
+	free(queue->slots);
+}
+
+static inline void *spsc_queue_slot(ChiakiSPSCQueue *queue, uint64_t index)
+{
+	return queue->slots + (size_t)(index & (queue->count - 1)) * queue->slot_size;
+}
+
+/**
+ * Wake up the other side if it announced that it is waiting.
+ * Must be called after a seq_cst store of head or tail, so that either the waiter sees the new value
+ * in its predicate or we see its waiting flag.
+ */
+static void spsc_queue_notify(ChiakiSPSCQueue *queue, ChiakiAtomicU32 *waiting)
+{
+	if(!chiaki_atomic_u32_load(waiting))
+		return;
+	chiaki_mutex_lock(&queue->mutex);
+	chiaki_cond_broadcast(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
+}
+
+CHIAKI_EXPORT void *chiaki_spsc_queue_write_slot(ChiakiSPSCQueue *queue)
+{
+	uint64_t tail = chiaki_atomic_u64_load_relaxed(&queue->tail);
+	if(tail - chiaki_atomic_u64_load_acquire(&queue->head) >= queue->count)
+		return NULL;
+	return spsc_queue_slot(queue, tail);
+}
+
+CHIAKI_EXPORT void chiaki_spsc_queue_push(ChiakiSPSCQueue *queue)
+{
+	chiaki_atomic_u64_store(&queue->tail, chiaki_atomic_u64_load_relaxed(&queue->tail) + 1);
+	spsc_queue_notify(queue, &queue->consumer_waiting);
+}
+
+CHIAKI_EXPORT void *chiaki_spsc_queue_read_slot(ChiakiSPSCQueue *queue)
+{
+	uint64_t head = chiaki_atomic_u64_load_relaxed(&queue->head);
+	if(head == chiaki_atomic_u64_load_acquire(&queue->tail))
+		return NULL;
+	return spsc_queue_slot(queue, head);
+}
+
+CHIAKI_EXPORT void chiaki_spsc_queue_pop(ChiakiSPSCQueue *queue)
+{
+	chiaki_atomic_u64_store(&queue->head, chiaki_atomic_u64_load_relaxed(&queue->head) + 1);
+	spsc_queue_notify(queue, &queue->producer_waiting);
+}
+
+static bool spsc_queue_readable(ChiakiSPSCQueue *queue)
+{
+	return chiaki_atomic_u64_load(&queue->tail) != chiaki_atomic_u64_load_relaxed(&queue->head);
+}
+
+static bool spsc_queue_writable(ChiakiSPSCQueue *queue)
+{
+	return chiaki_atomic_u64_load_relaxed(&queue->tail) - chiaki_atomic_u64_load(&queue->head) < queue->count;
+}
+
+static bool spsc_queue_readable_pred(void *user)
+{
+	ChiakiSPSCQueue *queue = user;
+	return spsc_queue_readable(queue) || chiaki_spsc_queue_is_closed(queue);
+}
+
+static bool spsc_queue_writable_pred(void *user)
+{
+	ChiakiSPSCQueue *queue = user;
+	return spsc_queue_writable(queue) || chiaki_spsc_queue_is_closed(queue);
+}
+
+static ChiakiErrorCode spsc_queue_wait(ChiakiSPSCQueue *queue, ChiakiAtomicU32 *waiting, bool (*ready)(ChiakiSPSCQueue *), ChiakiCheckPred pred, uint64_t timeout_ms)
+{
+	if(chiaki_spsc_queue_is_closed(queue))
+		return CHIAKI_ERR_CANCELED;
+	if(ready(queue))
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_atomic_u32_store(waiting, 1);
+	if(timeout_ms == UINT64_MAX)
+		err = chiaki_cond_wait_pred(&queue->cond, &queue->mutex, pred, queue);
+	else
+		err = chiaki_cond_timedwait_pred(&queue->cond, &queue->mutex, timeout_ms, pred, queue);
+	chiaki_atomic_u32_store(waiting, 0);
+	chiaki_mutex_unlock(&queue->mutex);
+
+	if(chiaki_spsc_queue_is_closed(queue))
+		return CHIAKI_ERR_CANCELED;
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_wait_readable(ChiakiSPSCQueue *queue, uint64_t timeout_ms)
+{
+	return spsc_queue_wait(queue, &queue->consumer_waiting, spsc_queue_readable, spsc_queue_readable_pred, timeout_ms);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_queue_wait_writable(ChiakiSPSCQueue *queue, uint64_t timeout_ms)
+{
+	return spsc_queue_wait(queue, &queue->producer_waiting, spsc_queue_writable, spsc_queue_writable_pred, timeout_ms);
+}
+
+CHIAKI_EXPORT void chiaki_spsc_queue_close(ChiakiSPSCQueue *queue)
+{
+	chiaki_atomic_u32_store(&queue->closed, 1);
+	chiaki_mutex_lock(&queue->mutex);
+	chiaki_cond_broadcast(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
+}
@@ -8,7 +8,9 @@
 #include <chiaki/base64.h>
 #include <chiaki/audio.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #ifndef _WIN32
@@ -33,6 +35,8 @@
 
 #define HEARTBEAT_INTERVAL_MS 1000
 
+#define FRAME_INTERVAL_DEFAULT_US (1000000 / 60)
+
 
 typedef enum {
 	STATE_IDLE,
@@ -56,6 +60,8 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode stream_connection_send_streaminfo_ack(ChiakiStreamConnection *stream_connection);
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet);
+static void stream_connection_av_pipeline_packet(ChiakiTakionAVPacket *packet, void *user);
+static void stream_connection_av_pipeline_frame(ChiakiVideoFrame *frame, void *user);
 static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session)
@@ -79,13 +85,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
 
+	err = chiaki_bandwidth_estimator_init(&stream_connection->bandwidth_estimator, FRAME_INTERVAL_DEFAULT_US);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_packet_stats;
+
 	stream_connection->video_receiver = NULL;
 	stream_connection->audio_receiver = NULL;
 	stream_connection->haptics_receiver = NULL;
+	stream_connection->av_pipeline_active = false;
+	stream_connection->event_loop_active = false;
+	memset(&stream_connection->video_receiver_stats, 0, sizeof(stream_connection->video_receiver_stats));
 
 	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_packet_stats;
+		goto error_bandwidth_estimator;
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
@@ -94,8 +107,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	stream_connection->remote_disconnected = false;
 	stream_connection->remote_disconnect_reason = NULL;
 
+	stream_connection->capture_active = false;
+	stream_connection->replay = NULL;
+	stream_connection->replay_realtime = false;
+	stream_connection->replay_finished = false;
+
 	return CHIAKI_ERR_SUCCESS;
 
+error_bandwidth_estimator:
+	chiaki_bandwidth_estimator_fini(&stream_connection->bandwidth_estimator);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -115,6 +135,7 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 
 	free(stream_connection->ecdh_secret);
 
+	chiaki_bandwidth_estimator_fini(&stream_connection->bandwidth_estimator);
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
@@ -126,7 +147,27 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 static bool state_finished_cond_check(void *user)
 {
 	ChiakiStreamConnection *stream_connection = user;
-	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected;
+	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected
+		|| stream_connection->replay_finished;
+}
+
+/**
+ * stream_connection->state_mutex must be locked
+ */
+static void stream_connection_enter_state(ChiakiStreamConnection *stream_connection, StreamConnectionState state)
+{
+	stream_connection->state = state;
+	stream_connection->state_finished = false;
+	stream_connection->state_failed = false;
+	// a replaying Takion thread may be waiting for this, see stream_connection_replay_wait_state()
+	if(stream_connection->replay)
+		chiaki_cond_broadcast(&stream_connection->state_cond);
+}
+
+CHIAKI_EXPORT void chiaki_stream_connection_set_replay(ChiakiStreamConnection *stream_connection, ChiakiCaptureReader *replay, bool realtime)
+{
+	stream_connection->replay = replay;
+	stream_connection->replay_realtime = realtime;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection)
@@ -136,13 +177,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	ChiakiTakionConnectInfo takion_info;
 	takion_info.log = stream_connection->log;
-	takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
-	takion_info.sa = malloc(takion_info.sa_len);
-	if(!takion_info.sa)
-		return CHIAKI_ERR_MEMORY;
-	memcpy(takion_info.sa, session->connect_info.host_addrinfo_selected->ai_addr, takion_info.sa_len);
-	err = set_port(takion_info.sa, htons(STREAM_CONNECTION_PORT));
-	assert(err == CHIAKI_ERR_SUCCESS);
+	takion_info.sa = NULL;
+	takion_info.sa_len = 0;
+	if(stream_connection->replay)
+	{
+		if(!stream_connection->replay->keys_valid)
+		{
+			CHIAKI_LOGE(session->log, "StreamConnection replay capture does not contain the session keys");
+			return CHIAKI_ERR_INVALID_DATA;
+		}
+		// the captured bang can only be decrypted with the key that was sent in the big back then
+		memcpy(session->handshake_key, stream_connection->replay->handshake_key, sizeof(session->handshake_key));
+		stream_connection->replay_finished = false;
+	}
+	else
+	{
+		takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
+		takion_info.sa = malloc(takion_info.sa_len);
+		if(!takion_info.sa)
+			return CHIAKI_ERR_MEMORY;
+		memcpy(takion_info.sa, session->connect_info.host_addrinfo_selected->ai_addr, takion_info.sa_len);
+		err = set_port(takion_info.sa, htons(STREAM_CONNECTION_PORT));
+		assert(err == CHIAKI_ERR_SUCCESS);
+	}
 	takion_info.ip_dontfrag = false;
 
 	takion_info.enable_crypt = true;
@@ -151,6 +208,32 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
+	takion_info.capture = NULL;
+	takion_info.replay = stream_connection->replay;
+	takion_info.replay_realtime = stream_connection->replay_realtime;
+	takion_info.rtt_us = session->rtt_us;
+	takion_info.data_queue_size_exp = 0;
+	takion_info.event_loop = NULL;
+
+	unsigned int max_fps = session->connect_info.video_profile.max_fps;
+	chiaki_bandwidth_estimator_reset(&stream_connection->bandwidth_estimator,
+			max_fps ? 1000000 / max_fps : FRAME_INTERVAL_DEFAULT_US);
+
+	ChiakiNetImpairConfig net_impair_env;
+	takion_info.net_impair = NULL;
+	if(session->connect_info.net_impair_set)
+		takion_info.net_impair = &session->connect_info.net_impair;
+	else
+	{
+		const char *net_impair_spec = getenv(CHIAKI_NET_IMPAIR_ENV);
+		if(net_impair_spec && *net_impair_spec)
+		{
+			if(chiaki_net_impair_config_parse(&net_impair_env, net_impair_spec) == CHIAKI_ERR_SUCCESS)
+				takion_info.net_impair = &net_impair_env;
+			else
+				CHIAKI_LOGW(session->log, "StreamConnection ignores invalid " CHIAKI_NET_IMPAIR_ENV " \"%s\"", net_impair_spec);
+		}
+	}
 
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -184,20 +267,64 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_haptics_receiver;
 	}
 
-	stream_connection->state = STATE_TAKION_CONNECT;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	if(!session->connect_info.disable_av_pipeline)
+	{
+		err = chiaki_av_pipeline_init(&stream_connection->av_pipeline, stream_connection->log,
+				stream_connection_av_pipeline_packet, stream_connection,
+				stream_connection_av_pipeline_frame, stream_connection);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(session->log, "StreamConnection failed to start AV Pipeline");
+			chiaki_mutex_unlock(&stream_connection->state_mutex);
+			goto err_video_receiver;
+		}
+		stream_connection->av_pipeline_active = true;
+		stream_connection->video_receiver->av_pipeline = &stream_connection->av_pipeline;
+	}
+
+	if(session->connect_info.capture_filename && !stream_connection->replay)
+	{
+		ChiakiCaptureInfo capture_info;
+		capture_info.target = session->target;
+		capture_info.codec = session->connect_info.video_profile.codec;
+		if(chiaki_capture_writer_init(&stream_connection->capture, stream_connection->log, session->connect_info.capture_filename, &capture_info) == CHIAKI_ERR_SUCCESS)
+		{
+			stream_connection->capture_active = true;
+			takion_info.capture = &stream_connection->capture;
+		}
+		else
+			CHIAKI_LOGW(session->log, "StreamConnection continues without capturing");
+	}
+
+	if(session->connect_info.event_loop)
+	{
+		if(chiaki_event_loop_init(&stream_connection->event_loop, stream_connection->log) == CHIAKI_ERR_SUCCESS)
+		{
+			if(chiaki_event_loop_start(&stream_connection->event_loop, "Chiaki Event Loop") == CHIAKI_ERR_SUCCESS)
+			{
+				stream_connection->event_loop_active = true;
+				takion_info.event_loop = &stream_connection->event_loop;
+			}
+			else
+				chiaki_event_loop_fini(&stream_connection->event_loop);
+		}
+		if(!stream_connection->event_loop_active)
+			CHIAKI_LOGW(session->log, "StreamConnection continues without event loop");
+	}
+
+	stream_connection_enter_state(stream_connection, STATE_TAKION_CONNECT);
 	err = chiaki_takion_connect(&stream_connection->takion, &takion_info);
 	free(takion_info.sa);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection connect failed");
 		chiaki_mutex_unlock(&stream_connection->state_mutex);
-		goto err_video_receiver;
+		goto err_av_pipeline;
 	}
 
 	ChiakiCongestionControl congestion_control;
-	err = chiaki_congestion_control_start(&congestion_control, &stream_connection->takion, &stream_connection->packet_stats);
+	err = chiaki_congestion_control_start(&congestion_control, &stream_connection->takion, &stream_connection->packet_stats,
+			&stream_connection->bandwidth_estimator, takion_info.event_loop);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
@@ -206,7 +333,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-	CHECK_STOP(close_takion);
+	CHECK_STOP(err_congestion_control);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection Takion connect failed");
@@ -215,10 +342,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	CHIAKI_LOGI(session->log, "StreamConnection sending big");
 
-	stream_connection->state = STATE_EXPECT_BANG;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
-	err = stream_connection_send_big(stream_connection);
+	stream_connection_enter_state(stream_connection, STATE_EXPECT_BANG);
+	// a replay already contains the answer to the big that was sent when capturing
+	err = stream_connection->replay ? CHIAKI_ERR_SUCCESS : stream_connection_send_big(stream_connection);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to send big");
@@ -241,9 +367,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	CHIAKI_LOGI(session->log, "StreamConnection successfully received bang");
 
-	stream_connection->state = STATE_EXPECT_STREAMINFO;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_enter_state(stream_connection, STATE_EXPECT_STREAMINFO);
 	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 	CHECK_STOP(disconnect);
@@ -262,7 +386,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion);
+	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion, session->connect_info.feedback_interval_min_ms,
+			takion_info.event_loop);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
@@ -273,9 +398,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state);
 	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
 
-	stream_connection->state = STATE_IDLE;
-	stream_connection->state_finished = false;
-	stream_connection->state_failed = false;
+	stream_connection_enter_state(stream_connection, STATE_IDLE);
 
 	ChiakiEvent event = { 0 };
 	event.type = CHIAKI_EVENT_CONNECTED;
@@ -319,6 +442,8 @@ disconnect:
 		CHIAKI_LOGI(stream_connection->log, "StreamConnection closing after Remote disconnected");
 		err = CHIAKI_ERR_DISCONNECTED;
 	}
+	else if(stream_connection->replay_finished)
+		CHIAKI_LOGI(stream_connection->log, "StreamConnection finished replaying the capture");
 
 err_congestion_control:
 	chiaki_congestion_control_stop(&congestion_control);
@@ -326,10 +451,30 @@ err_congestion_control:
 close_takion:
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 
+	// stages may still send through takion, so they have to be stopped first
+	if(stream_connection->av_pipeline_active)
+		chiaki_av_pipeline_stop(&stream_connection->av_pipeline);
+
 	chiaki_takion_close(&stream_connection->takion);
 	CHIAKI_LOGI(session->log, "StreamConnection closed takion");
 
+err_av_pipeline:
+	if(stream_connection->event_loop_active)
+	{
+		chiaki_event_loop_stop(&stream_connection->event_loop);
+		chiaki_event_loop_join(&stream_connection->event_loop);
+		chiaki_event_loop_fini(&stream_connection->event_loop);
+		stream_connection->event_loop_active = false;
+	}
+
+	if(stream_connection->av_pipeline_active)
+	{
+		chiaki_av_pipeline_fini(&stream_connection->av_pipeline);
+		stream_connection->av_pipeline_active = false;
+	}
+
 err_video_receiver:
+	stream_connection->video_receiver_stats = stream_connection->video_receiver->stats;
 	chiaki_video_receiver_free(stream_connection->video_receiver);
 	stream_connection->video_receiver = NULL;
 
@@ -341,6 +486,12 @@ err_audio_receiver:
 	chiaki_audio_receiver_free(stream_connection->audio_receiver);
 	stream_connection->audio_receiver = NULL;
 
+	if(stream_connection->capture_active)
+	{
+		chiaki_capture_writer_fini(&stream_connection->capture);
+		stream_connection->capture_active = false;
+	}
+
 	return err;
 }
 
@@ -369,13 +520,28 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 				stream_connection->state_failed = event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 				chiaki_cond_signal(&stream_connection->state_cond);
 			}
+			else if(event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT && stream_connection->replay)
+			{
+				stream_connection->replay_finished = true;
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
 			chiaki_mutex_unlock(&stream_connection->state_mutex);
 			break;
 		case CHIAKI_TAKION_EVENT_TYPE_DATA:
 			stream_connection_takion_data(stream_connection, event->data.data_type, event->data.buf, event->data.buf_size);
 			break;
 		case CHIAKI_TAKION_EVENT_TYPE_AV:
-			stream_connection_takion_av(stream_connection, event->av);
+			// arrival times must be taken here, before any queueing on our side
+			if(event->av->is_video)
+				chiaki_bandwidth_estimator_packet(&stream_connection->bandwidth_estimator, chiaki_time_now_monotonic_us(),
+						event->av->frame_index, event->av->data_size);
+			if(stream_connection->av_pipeline_active)
+				chiaki_av_pipeline_push_packet(&stream_connection->av_pipeline, event->av);
+			else
+				stream_connection_takion_av(stream_connection, event->av);
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_AV_DEADLINE:
+			stream_connection_takion_av(stream_connection, NULL);
 			break;
 		default:
 			break;
@@ -400,9 +566,34 @@ static void stream_connection_takion_data(ChiakiStreamConnection *stream_connect
 	}
 }
 
+static bool replay_state_consumed_cond_check(void *user)
+{
+	ChiakiStreamConnection *stream_connection = user;
+	if(stream_connection->should_stop)
+		return true;
+	if(stream_connection->state == STATE_TAKION_CONNECT)
+		return false;
+	return stream_connection->state == STATE_IDLE || !stream_connection->state_finished;
+}
+
+/**
+ * When replaying, the next message arrives right away instead of a round trip later,
+ * so wait for the run thread to pick up the result of the previous one and enter the next state.
+ *
+ * stream_connection->state_mutex must be locked
+ */
+static void stream_connection_replay_wait_state(ChiakiStreamConnection *stream_connection)
+{
+	ChiakiErrorCode err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, replay_state_consumed_cond_check, stream_connection);
+	if(err == CHIAKI_ERR_TIMEOUT)
+		CHIAKI_LOGW(stream_connection->log, "StreamConnection replay timed out waiting for the next state");
+}
+
 static void stream_connection_takion_data_protobuf(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size)
 {
 	chiaki_mutex_lock(&stream_connection->state_mutex);
+	if(stream_connection->replay)
+		stream_connection_replay_wait_state(stream_connection);
 	switch(stream_connection->state)
 	{
 		case STATE_EXPECT_BANG:
@@ -525,6 +716,10 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 
 	chiaki_takion_set_crypt(&stream_connection->takion, stream_connection->gkcrypt_local, stream_connection->gkcrypt_remote);
 
+	// called on the Takion thread, so the capture is not written concurrently
+	if(stream_connection->capture_active)
+		chiaki_capture_writer_keys(&stream_connection->capture, chiaki_time_now_monotonic_us(), session->handshake_key, stream_connection->ecdh_secret);
+
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -598,11 +793,19 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 		goto error;
 	}
 
-	ChiakiErrorCode err = chiaki_ecdh_derive_secret(&stream_connection->session->ecdh,
-			stream_connection->ecdh_secret,
-			ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
-			stream_connection->session->handshake_key,
-			ecdh_sig_buf.buf, ecdh_sig_buf.size);
+	ChiakiErrorCode err;
+	if(stream_connection->replay)
+	{
+		// our private key of the captured session is gone, but the capture contains the secret itself
+		memcpy(stream_connection->ecdh_secret, stream_connection->replay->ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	else
+		err = chiaki_ecdh_derive_secret(&stream_connection->session->ecdh,
+				stream_connection->ecdh_secret,
+				ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
+				stream_connection->session->handshake_key,
+				ecdh_sig_buf.buf, ecdh_sig_buf.size);
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -936,18 +1139,62 @@ static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection
 	return err;
 }
 
+/**
+ * Called from the thread that feeds the video receiver, so it can hand on held frames in time when packets stop arriving.
+ */
+static void stream_connection_video_deadline_update(ChiakiStreamConnection *stream_connection)
+{
+	uint64_t deadline_us = chiaki_video_receiver_deadline_us(stream_connection->video_receiver);
+	if(stream_connection->av_pipeline_active)
+		chiaki_av_pipeline_set_packet_deadline(&stream_connection->av_pipeline, deadline_us);
+	else
+		chiaki_takion_set_av_deadline(&stream_connection->takion, deadline_us);
+}
+
+/**
+ * @param packet NULL if the deadline set by stream_connection_video_deadline_update() has come
+ */
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet)
 {
-	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
+	if(!packet)
+	{
+		chiaki_video_receiver_expire(stream_connection->video_receiver);
+		stream_connection_video_deadline_update(stream_connection);
+		return;
+	}
 
+	uint64_t key_pos = packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE;
 	if(packet->is_video)
-		chiaki_video_receiver_av_packet(stream_connection->video_receiver, packet);
-	else if(packet->is_haptics)
+	{
+		// decrypted directly into the frame buffer by the frame processor
+		chiaki_video_receiver_av_packet_encrypted(stream_connection->video_receiver, packet, stream_connection->gkcrypt_remote, key_pos);
+		stream_connection_video_deadline_update(stream_connection);
+		return;
+	}
+
+	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, key_pos, packet->data, packet->data_size);
+
+	if(packet->is_haptics)
 	    chiaki_audio_receiver_av_packet(stream_connection->haptics_receiver, packet);
 	else
 		chiaki_audio_receiver_av_packet(stream_connection->audio_receiver, packet);
 }
 
+static void stream_connection_av_pipeline_packet(ChiakiTakionAVPacket *packet, void *user)
+{
+	stream_connection_takion_av(user, packet);
+}
+
+static void stream_connection_av_pipeline_frame(ChiakiVideoFrame *frame, void *user)
+{
+	ChiakiStreamConnection *stream_connection = user;
+	if(chiaki_video_receiver_sink_frame(stream_connection->video_receiver, frame) || frame->frame_index < 0)
+		return;
+	// the video receiver has already moved on, so request a new keyframe from here
+	CHIAKI_LOGW(stream_connection->log, "Video callback did not process frame %d successfully.", (int)frame->frame_index);
+	stream_connection_send_corrupt_frame(stream_connection, (ChiakiSeqNum16)frame->frame_index, (ChiakiSeqNum16)frame->frame_index);
+}
+
 static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection)
 {
 	tkproto_TakionMessage msg = { 0 };
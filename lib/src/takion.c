@@ -1,10 +1,15 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for recvmmsg()
+#endif
+
 #include "chiaki/feedback.h"
 #include <chiaki/takion.h>
 #include <chiaki/congestioncontrol.h>
 #include <chiaki/random.h>
 #include <chiaki/gkcrypt.h>
+#include <chiaki/time.h>
 
 #include <fcntl.h>
 #include <stdbool.h>
@@ -27,6 +32,12 @@
 #include <sys/socket.h>
 #endif
 
+#if defined(__linux__)
+// receive and send multiple datagrams with a single syscall
+#define TAKION_RECVMMSG
+#define TAKION_SENDMMSG
+#endif
+
 
 // VERY similar to SCTP, see RFC 4960
 
@@ -34,17 +45,25 @@
 #define TAKION_OUTBOUND_STREAMS 0x64
 #define TAKION_INBOUND_STREAMS 0x64
 
-#define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
-#define TAKION_SEND_BUFFER_SIZE 16
+#define TAKION_REORDER_QUEUE_SIZE_EXP_DEFAULT 4 // => 16 entries
+#define TAKION_SEND_BUFFER_SIZE 64
 
 #define TAKION_POSTPONE_PACKETS_SIZE 32
 
+// must be large enough to hold the reorder queue and postponed packets plus one batch without exhausting
+#define TAKION_PACKET_POOL_SIZE 128
+#define TAKION_RECV_BATCH_SIZE 32
+#define TAKION_SEND_QUEUE_SIZE 16
+
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
 #define TAKION_PACKET_BASE_TYPE_MASK 0xf
 
 #define TAKION_EXPECT_TIMEOUT_MS 5000
 
+// replaying flat-out only polls the stop pipe once per this many datagrams
+#define TAKION_REPLAY_STOP_CHECK_INTERVAL 64
+
 /**
  * Base type of Takion packets. Lower nibble of the first byte in datagrams.
  */
@@ -143,31 +162,35 @@ typedef struct takion_message_payload_init_ack_t
 
 typedef struct
 {
-	uint8_t *packet_buf;
-	size_t packet_size;
+	ChiakiPacketBuf *packet; // owned, from takion->packet_pool
 	uint8_t type_b;
-	uint8_t *payload; // inside packet_buf
+	uint8_t *payload; // inside packet
 	size_t payload_size;
 	uint16_t channel;
 } TakionDataPacketEntry;
 
 typedef struct chiaki_takion_postponed_packet_t
 {
-	uint8_t *buf;
-	size_t buf_size;
+	ChiakiPacketBuf *packet; // owned, from takion->packet_pool
 } ChiakiTakionPostponedPacket;
 
 static void *takion_thread_func(void *user);
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet);
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet, uint8_t type_b, uint8_t *payload, size_t payload_size);
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, TakionMessage *msg);
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
+static ChiakiErrorCode takion_sock_create(ChiakiTakion *takion, ChiakiTakionConnectInfo *info);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t packets_max, size_t *packets_count, uint64_t timeout_ms);
+static size_t takion_net_impair_apply(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t packets_count, size_t packets_max);
+static uint64_t takion_net_impair_timeout_ms(ChiakiTakion *takion);
+static uint64_t takion_av_deadline_timeout_ms(ChiakiTakion *takion);
+static void takion_check_av_deadline(ChiakiTakion *takion);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
 static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
@@ -195,21 +218,49 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 			return CHIAKI_ERR_INVALID_DATA;
 	}
 
+	takion->capture = info->capture;
+	takion->replay = info->replay;
+	takion->replay_realtime = info->replay_realtime;
+	if(takion->replay)
+	{
+		if(!takion->replay->takion_tag_valid)
+		{
+			CHIAKI_LOGE(takion->log, "Takion replay capture does not contain the local tag");
+			return CHIAKI_ERR_INVALID_DATA;
+		}
+		ret = chiaki_capture_reader_rewind(takion->replay);
+		if(ret != CHIAKI_ERR_SUCCESS)
+			return ret;
+	}
+
 	takion->gkcrypt_local = NULL;
 	ret = chiaki_mutex_init(&takion->gkcrypt_local_mutex, true);
 	if(ret != CHIAKI_ERR_SUCCESS)
 		return ret;
 	takion->key_pos_local = 0;
+	takion->send_queue = calloc(TAKION_SEND_QUEUE_SIZE, sizeof(ChiakiPacketBuf));
+	if(!takion->send_queue)
+	{
+		ret = CHIAKI_ERR_MEMORY;
+		goto error_gkcrypt_local_mutex;
+	}
+	takion->send_queue_macs = calloc(TAKION_SEND_QUEUE_SIZE, sizeof(ChiakiTakionSendQueueMac));
+	if(!takion->send_queue_macs)
+	{
+		ret = CHIAKI_ERR_MEMORY;
+		goto error_send_queue;
+	}
+	takion->send_queue_count = 0;
+	takion->send_queue_holds = 0;
+	memset(&takion->send_stats, 0, sizeof(takion->send_stats));
 	takion->gkcrypt_remote = NULL;
 	takion->cb = info->cb;
 	takion->cb_user = info->cb_user;
 	takion->a_rwnd = TAKION_A_RWND;
 
-	takion->tag_local = chiaki_random_32(); // 0x4823
+	// replayed messages are addressed to the tag of the captured session
+	takion->tag_local = takion->replay ? takion->replay->takion_tag : chiaki_random_32(); // 0x4823
 	takion->seq_num_local = takion->tag_local;
-	ret = chiaki_mutex_init(&takion->seq_num_local_mutex, false);
-	if(ret != CHIAKI_ERR_SUCCESS)
-		goto error_gkcrypt_local_mutex;
 	takion->tag_remote = 0;
 
 	takion->enable_crypt = info->enable_crypt;
@@ -217,22 +268,73 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->postponed_packets_size = 0;
 	takion->postponed_packets_count = 0;
 	takion->enable_dualsense = info->enable_dualsense;
+	takion->rtt_us = info->rtt_us;
+	takion->data_queue_size_exp = info->data_queue_size_exp ? info->data_queue_size_exp : TAKION_REORDER_QUEUE_SIZE_EXP_DEFAULT;
+	takion->event_loop = info->event_loop;
+	takion->av_deadline_us = UINT64_MAX;
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	memset(&takion->net_impair, 0, sizeof(takion->net_impair));
+	takion->net_impair_enabled = info->net_impair && chiaki_net_impair_config_active(info->net_impair);
+	if(takion->net_impair_enabled)
+		takion->net_impair_config = *info->net_impair;
+
+	if(takion->capture)
+	{
+		uint32_t tag = htonl(takion->tag_local);
+		chiaki_capture_writer_record(takion->capture, CHIAKI_CAPTURE_RECORD_TAKION_TAG, chiaki_time_now_monotonic_us(), (const uint8_t *)&tag, sizeof(tag));
+	}
 
-	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
+	CHIAKI_LOGI(takion->log, "Takion %s (version %u)", takion->replay ? "replaying capture" : "connecting", (unsigned int)info->protocol_version);
 
 	ChiakiErrorCode err = chiaki_stop_pipe_init(&takion->stop_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		goto error_send_queue;
+	}
+
+	if(takion->replay)
+		takion->sock = CHIAKI_INVALID_SOCKET;
+	else
+	{
+		ret = takion_sock_create(takion, info);
+		if(ret != CHIAKI_ERR_SUCCESS)
+			goto error_pipe;
+	}
+
+	takion->replay_start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		ret = err;
+		goto error_sock;
 	}
 
+	chiaki_thread_set_name(&takion->thread, "Chiaki Takion");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_sock:
+	if(!CHIAKI_SOCKET_IS_INVALID(takion->sock))
+		CHIAKI_SOCKET_CLOSE(takion->sock);
+error_pipe:
+	chiaki_stop_pipe_fini(&takion->stop_pipe);
+error_send_queue:
+	free(takion->send_queue_macs);
+	free(takion->send_queue);
+error_gkcrypt_local_mutex:
+	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
+	return ret;
+}
+
+static ChiakiErrorCode takion_sock_create(ChiakiTakion *takion, ChiakiTakionConnectInfo *info)
+{
+	ChiakiErrorCode ret;
 	takion->sock = socket(info->sa->sa_family, SOCK_DGRAM, IPPROTO_UDP);
 	if(CHIAKI_SOCKET_IS_INVALID(takion->sock))
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create socket");
-		ret = CHIAKI_ERR_NETWORK;
-		goto error_pipe;
+		return CHIAKI_ERR_NETWORK;
 	}
 
 	const int rcvbuf_val = takion->a_rwnd;
@@ -280,25 +382,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_sock;
 	}
 
-	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
-	if(r != CHIAKI_ERR_SUCCESS)
-	{
-		ret = err;
-		goto error_sock;
-	}
-
-	chiaki_thread_set_name(&takion->thread, "Chiaki Takion");
-
 	return CHIAKI_ERR_SUCCESS;
 
 error_sock:
 	CHIAKI_SOCKET_CLOSE(takion->sock);
-error_pipe:
-	chiaki_stop_pipe_fini(&takion->stop_pipe);
-error_seq_num_local_mutex:
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
-error_gkcrypt_local_mutex:
-	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
+	takion->sock = CHIAKI_INVALID_SOCKET;
 	return ret;
 }
 
@@ -307,41 +395,247 @@ CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 	chiaki_stop_pipe_stop(&takion->stop_pipe);
 	chiaki_thread_join(&takion->thread, NULL);
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
+	free(takion->send_queue_macs);
+	free(takion->send_queue);
 	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 }
 
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats)
+{
+	*stats = takion->recv_stats;
+}
+
+static ChiakiErrorCode takion_advance_key_pos_locked(ChiakiTakion *takion, size_t data_size, uint64_t *key_pos)
+{
+	if(!takion->gkcrypt_local)
+	{
+		*key_pos = 0;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	uint64_t cur = takion->key_pos_local;
+	if(SIZE_MAX - cur < data_size)
+		return CHIAKI_ERR_OVERFLOW;
+
+	*key_pos = cur;
+	takion->key_pos_local = cur + data_size;
+	return CHIAKI_ERR_SUCCESS;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, uint64_t *key_pos)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	err = takion_advance_key_pos_locked(takion, data_size, key_pos);
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	if(takion->replay)
+		return CHIAKI_ERR_SUCCESS;
+	int r = send(takion->sock, buf, buf_size, 0);
+	if(r < 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(takion->gkcrypt_local)
+/**
+ * Calculate the pending MACs of the first count packets in the send queue in one batch.
+ * Packets whose MAC could not be calculated are removed from the queue and count is updated.
+ * gkcrypt_local_mutex must be locked.
+ */
+static ChiakiErrorCode takion_send_queue_mac(ChiakiTakion *takion, size_t *count)
+{
+	ChiakiGKCryptGmacRequest reqs[TAKION_SEND_QUEUE_SIZE];
+	size_t reqs_index[TAKION_SEND_QUEUE_SIZE];
+	uint8_t key_pos_tmp[TAKION_SEND_QUEUE_SIZE][sizeof(uint32_t)];
+	size_t reqs_count = 0;
+	for(size_t i=0; i<*count; i++)
 	{
-		uint64_t cur = takion->key_pos_local;
-		if(SIZE_MAX - cur < data_size)
+		ChiakiTakionSendQueueMac *mac = &takion->send_queue_macs[i];
+		if(!mac->pending)
+			continue;
+		mac->pending = false;
+		ChiakiPacketBuf *packet = &takion->send_queue[i];
+		if(mac->key_pos_offset >= 0)
 		{
-			chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
-			return CHIAKI_ERR_OVERFLOW;
+			memcpy(key_pos_tmp[reqs_count], packet->data + mac->key_pos_offset, sizeof(uint32_t));
+			memset(packet->data + mac->key_pos_offset, 0, sizeof(uint32_t));
 		}
+		ChiakiGKCryptGmacRequest *req = &reqs[reqs_count];
+		req->key_pos = mac->key_pos;
+		req->buf = packet->data;
+		req->buf_size = packet->size;
+		req->gmac_expected = NULL;
+		reqs_index[reqs_count++] = i;
+	}
+	if(!reqs_count)
+		return CHIAKI_ERR_SUCCESS;
 
-		*key_pos = cur;
-		takion->key_pos_local = cur + data_size;
+	ChiakiErrorCode err = chiaki_gkcrypt_gmac_batch(takion->gkcrypt_local, reqs, reqs_count);
+
+	for(size_t i=0; i<reqs_count; i++)
+	{
+		ChiakiTakionSendQueueMac *mac = &takion->send_queue_macs[reqs_index[i]];
+		ChiakiPacketBuf *packet = &takion->send_queue[reqs_index[i]];
+		if(reqs[i].valid)
+			memcpy(packet->data + mac->mac_offset, reqs[i].gmac, CHIAKI_GKCRYPT_GMAC_SIZE);
+		else
+			packet->size = 0; // dropped below
+		if(mac->key_pos_offset >= 0)
+			memcpy(packet->data + mac->key_pos_offset, key_pos_tmp[i], sizeof(uint32_t));
 	}
-	else
-		*key_pos = 0;
+	if(err == CHIAKI_ERR_SUCCESS)
+		return CHIAKI_ERR_SUCCESS;
 
+	size_t kept = 0;
+	for(size_t i=0; i<*count; i++)
+	{
+		ChiakiPacketBuf *packet = &takion->send_queue[i];
+		if(!packet->size)
+			continue;
+		if(kept != i)
+		{
+			memcpy(takion->send_queue[kept].data, packet->data, packet->size);
+			takion->send_queue[kept].size = packet->size;
+		}
+		kept++;
+	}
+	CHIAKI_LOGE(takion->log, "Takion failed to mac %llu queued packets, dropping them: %s",
+			(unsigned long long)(*count - kept), chiaki_error_string(err));
+	*count = kept;
+	return err;
+}
+
+/**
+ * Send everything in the send queue.
+ * gkcrypt_local_mutex must be locked.
+ */
+static ChiakiErrorCode takion_send_queue_flush(ChiakiTakion *takion)
+{
+	size_t count = takion->send_queue_count;
+	takion->send_queue_count = 0;
+	if(!count)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode mac_err = takion_send_queue_mac(takion, &count);
+	if(takion->replay)
+		return mac_err;
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+#ifdef TAKION_SENDMMSG
+	struct mmsghdr msgs[TAKION_SEND_QUEUE_SIZE];
+	struct iovec iovs[TAKION_SEND_QUEUE_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(size_t i=0; i<count; i++)
+	{
+		iovs[i].iov_base = takion->send_queue[i].data;
+		iovs[i].iov_len = takion->send_queue[i].size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	size_t sent = 0;
+	while(sent < count)
+	{
+		int r = sendmmsg(takion->sock, msgs + sent, (unsigned int)(count - sent), 0);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			CHIAKI_LOGE(takion->log, "Takion sendmmsg failed: %s", strerror(errno));
+			err = CHIAKI_ERR_NETWORK;
+			r = 1; // drop the packet that failed and go on with the rest
+		}
+		else
+			takion->send_stats.packets += (uint64_t)r;
+		takion->send_stats.syscalls++;
+		sent += (size_t)r;
+	}
+#else
+	for(size_t i=0; i<count; i++)
+	{
+		takion->send_stats.syscalls++;
+		if(chiaki_takion_send_raw(takion, takion->send_queue[i].data, takion->send_queue[i].size) != CHIAKI_ERR_SUCCESS)
+			err = CHIAKI_ERR_NETWORK;
+		else
+			takion->send_stats.packets++;
+	}
+#endif
+	return mac_err != CHIAKI_ERR_SUCCESS ? mac_err : err;
+}
+
+/**
+ * Get the buffer to format the next outbound packet into, flushing the queue first if it is full.
+ * gkcrypt_local_mutex must be locked until the packet is committed with takion_send_queue_commit().
+ *
+ * @return buffer of CHIAKI_PACKET_BUF_SIZE bytes
+ */
+static uint8_t *takion_send_queue_next(ChiakiTakion *takion)
+{
+	if(takion->send_queue_count == TAKION_SEND_QUEUE_SIZE)
+		takion_send_queue_flush(takion);
+	return takion->send_queue[takion->send_queue_count].data;
+}
+
+/**
+ * Queue the packet formatted into the buffer from takion_send_queue_next() and send it unless the queue is held.
+ * gkcrypt_local_mutex must be locked.
+ */
+static ChiakiErrorCode takion_send_queue_commit(ChiakiTakion *takion, size_t size)
+{
+	assert(size <= CHIAKI_PACKET_BUF_SIZE);
+	takion->send_queue[takion->send_queue_count++].size = size;
+	if(takion->send_queue_holds)
+		return CHIAKI_ERR_SUCCESS;
+	return takion_send_queue_flush(takion);
+}
+
+/**
+ * Like takion_send_queue_commit(), but leave the MAC at mac_offset to be calculated when the queue is flushed.
+ * gkcrypt_local_mutex must be locked.
+ *
+ * @param key_pos_offset if >= 0, the key pos at this offset is zeroed while calculating the MAC
+ */
+static ChiakiErrorCode takion_send_queue_commit_mac(ChiakiTakion *takion, size_t size, uint64_t key_pos, size_t mac_offset, int key_pos_offset)
+{
+	assert(mac_offset + CHIAKI_GKCRYPT_GMAC_SIZE <= size);
+	memset(takion->send_queue[takion->send_queue_count].data + mac_offset, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	ChiakiTakionSendQueueMac *mac = &takion->send_queue_macs[takion->send_queue_count];
+	mac->pending = takion->gkcrypt_local != NULL;
+	mac->key_pos = key_pos;
+	mac->mac_offset = mac_offset;
+	mac->key_pos_offset = key_pos_offset;
+	return takion_send_queue_commit(takion, size);
+}
+
+CHIAKI_EXPORT void chiaki_takion_send_begin(ChiakiTakion *takion)
+{
+	if(chiaki_mutex_lock(&takion->gkcrypt_local_mutex) != CHIAKI_ERR_SUCCESS)
+		return;
+	takion->send_queue_holds++;
 	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
-	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_end(ChiakiTakion *takion)
 {
-	int r = send(takion->sock, buf, buf_size, 0);
-	if(r < 0)
-		return CHIAKI_ERR_NETWORK;
-	return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	assert(takion->send_queue_holds > 0);
+	if(takion->send_queue_holds && !--takion->send_queue_holds)
+		err = takion_send_queue_flush(takion);
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_takion_get_send_stats(ChiakiTakion *takion, ChiakiTakionSendStats *stats)
+{
+	chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
+	*stats = takion->send_stats;
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
 }
 
 static ChiakiErrorCode chiaki_takion_packet_read_key_pos(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t *key_pos_out)
@@ -401,48 +695,73 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uin
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * gkcrypt_local_mutex must be locked.
+ */
+static ChiakiErrorCode takion_packet_mac_locked(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
+{
+	return chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, key_pos, NULL, NULL);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
-	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
-	err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, key_pos, mac, NULL);
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+
+	err = takion_packet_mac_locked(takion, buf, buf_size, key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+		goto beach;
 
 	//CHIAKI_LOGD(takion->log, "Takion sending:");
 	//chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, buf, buf_size);
 
-	return chiaki_takion_send_raw(takion, buf, buf_size);
+	if(buf_size > CHIAKI_PACKET_BUF_SIZE)
+	{
+		takion_send_queue_flush(takion);
+		err = chiaki_takion_send_raw(takion, buf, buf_size);
+		goto beach;
+	}
+
+	memcpy(takion_send_queue_next(takion), buf, buf_size);
+	err = takion_send_queue_commit(takion, buf_size);
+
+beach:
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *takion, uint8_t chunk_flags, uint16_t channel, uint8_t *buf, size_t buf_size, ChiakiSeqNum32 *seq_num)
 {
-	// TODO: can we make this more memory-efficient?
 	// TODO: split packet if necessary?
 
-	uint64_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, buf_size, &key_pos);
+	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
+	// larger messages will be fragmented anyway, so they are not worth a buffer in the send queue
+	bool queued = packet_size <= CHIAKI_PACKET_BUF_SIZE;
+	uint8_t *packet_buf = NULL;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
-	uint8_t *packet_buf = malloc(packet_size);
+	uint64_t key_pos;
+	err = takion_advance_key_pos_locked(takion, buf_size, &key_pos);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	packet_buf = queued ? takion_send_queue_next(takion) : malloc(packet_size);
 	if(!packet_buf)
-		return CHIAKI_ERR_MEMORY;
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto beach;
+	}
 	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
 
 	takion_write_message_header(packet_buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA, chunk_flags, 9 + buf_size);
 
 	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 
-	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
 	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
-	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
 
 	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
@@ -450,32 +769,56 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	*(msg_payload + 8) = 0;
 	memcpy(msg_payload + 9, buf, buf_size);
 
-	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
+	err = takion_packet_mac_locked(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
-		return err;
+		CHIAKI_LOGE(takion->log, "Takion failed to mac data packet: %s", chiaki_error_string(err));
+		goto beach;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	// push before sending, so the packet is known when its ack comes in
+	err = chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	ChiakiErrorCode send_err;
+	if(queued)
+		send_err = takion_send_queue_commit(takion, packet_size);
+	else
+	{
+		takion_send_queue_flush(takion);
+		send_err = chiaki_takion_send_raw(takion, packet_buf, packet_size);
+	}
+	// on failure, the send buffer will try again
+	if(send_err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(send_err));
 
 	if(seq_num)
 		*seq_num = seq_num_val;
 
+beach:
+	if(!queued)
+		free(packet_buf);
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
 	return err;
 }
 
 static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion, uint32_t seq_num)
 {
-	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc];
-	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	const size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 0xc;
 
-	uint64_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, sizeof(buf), &key_pos);
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
+	uint64_t key_pos;
+	err = takion_advance_key_pos_locked(takion, packet_size, &key_pos);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	uint8_t *buf = takion_send_queue_next(takion);
+	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+
 	takion_write_message_header(buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, 0xc);
 
 	uint8_t *data_ack = buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
@@ -484,7 +827,13 @@ static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion,
 	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = 0;
 	*((chiaki_unaligned_uint16_t *)(data_ack + 0xa)) = 0;
 
-	return chiaki_takion_send(takion, buf, sizeof(buf), key_pos);
+	err = takion_send_queue_commit_mac(takion, packet_size, key_pos,
+			takion_packet_type_mac_offset(TAKION_PACKET_TYPE_CONTROL),
+			takion_packet_type_key_pos_offset(TAKION_PACKET_TYPE_CONTROL));
+
+beach:
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
 }
 
 CHIAKI_EXPORT void chiaki_takion_format_congestion(uint8_t *buf, ChiakiTakionCongestionPacket *packet, uint64_t key_pos)
@@ -499,56 +848,74 @@ CHIAKI_EXPORT void chiaki_takion_format_congestion(uint8_t *buf, ChiakiTakionCon
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_congestion(ChiakiTakion *takion, ChiakiTakionCongestionPacket *packet)
 {
-	uint64_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, CHIAKI_TAKION_CONGESTION_PACKET_SIZE, &key_pos);
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	uint8_t buf[CHIAKI_TAKION_CONGESTION_PACKET_SIZE];
+	uint64_t key_pos;
+	err = takion_advance_key_pos_locked(takion, CHIAKI_TAKION_CONGESTION_PACKET_SIZE, &key_pos);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	uint8_t *buf = takion_send_queue_next(takion);
 	chiaki_takion_format_congestion(buf, packet, key_pos);
-	return chiaki_takion_send(takion, buf, sizeof(buf), key_pos);
+	err = takion_send_queue_commit_mac(takion, CHIAKI_TAKION_CONGESTION_PACKET_SIZE, key_pos,
+			takion_packet_type_mac_offset(TAKION_PACKET_TYPE_CONGESTION),
+			takion_packet_type_key_pos_offset(TAKION_PACKET_TYPE_CONGESTION));
+
+beach:
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
 }
 
+/**
+ * Format the header of a feedback packet into the next buffer of the send queue.
+ * gkcrypt_local_mutex must be locked until the packet is sent with takion_send_feedback_packet().
+ */
+static uint8_t *takion_feedback_packet_header(ChiakiTakion *takion, TakionPacketType type, ChiakiSeqNum16 seq_num)
+{
+	uint8_t *buf = takion_send_queue_next(takion);
+	buf[0] = type;
+	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
+	buf[3] = 0; // TODO
+	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
+	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
+	return buf;
+}
+
+/**
+ * Encrypt the feedback packet formatted in place by takion_feedback_packet_header() and queue it, its MAC is calculated when the queue is flushed.
+ * gkcrypt_local_mutex must be locked.
+ */
 static ChiakiErrorCode takion_send_feedback_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
 {
 	assert(buf_size >= 0xc);
 
 	size_t payload_size = buf_size - 0xc;
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
 	uint64_t key_pos;
-	err = chiaki_takion_crypt_advance_key_pos(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
+	ChiakiErrorCode err = takion_advance_key_pos_locked(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
 	err = chiaki_gkcrypt_encrypt(takion->gkcrypt_local, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + 0xc, payload_size);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
 	*((chiaki_unaligned_uint32_t *)(buf + 4)) = htonl((uint32_t)key_pos);
 
-	err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, key_pos, buf, buf_size, buf + 8);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
-
-	chiaki_takion_send_raw(takion, buf, buf_size);
-
-beach:
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
-	return err;
+	// the key pos stays in while calculating the MAC
+	takion_send_queue_commit_mac(takion, buf_size, key_pos, 8, -1);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, ChiakiFeedbackState *feedback_state)
 {
-	uint8_t buf[0xc + CHIAKI_FEEDBACK_STATE_BUF_SIZE_MAX];
-	buf[0] = TAKION_PACKET_TYPE_FEEDBACK_STATE;
-	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
-	buf[3] = 0; // TODO
-	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
-	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	uint8_t *buf = takion_feedback_packet_header(takion, TAKION_PACKET_TYPE_FEEDBACK_STATE, seq_num);
 	size_t buf_sz;
 	if(takion->version <= 9)
 	{
@@ -560,23 +927,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *ta
 		buf_sz = 0xc + CHIAKI_FEEDBACK_STATE_BUF_SIZE_V12;
 		chiaki_feedback_state_format_v12(buf + 0xc, feedback_state, takion->enable_dualsense);
 	}
-	return takion_send_feedback_packet(takion, buf, buf_sz);
+	err = takion_send_feedback_packet(takion, buf, buf_sz);
+
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	return err;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *payload, size_t payload_size)
 {
 	size_t buf_size = 0xc + payload_size;
-	uint8_t *buf = malloc(buf_size);
-	if(!buf)
-		return CHIAKI_ERR_MEMORY;
-	buf[0] = TAKION_PACKET_TYPE_FEEDBACK_HISTORY;
-	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
-	buf[3] = 0; // TODO
-	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
-	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
+	if(buf_size > CHIAKI_PACKET_BUF_SIZE)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	uint8_t *buf = takion_feedback_packet_header(takion, TAKION_PACKET_TYPE_FEEDBACK_HISTORY, seq_num);
 	memcpy(buf + 0xc, payload, payload_size);
-	ChiakiErrorCode err = takion_send_feedback_packet(takion, buf, buf_size);
-	free(buf);
+	err = takion_send_feedback_packet(takion, buf, buf_size);
+
+	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
 	return err;
 }
 
@@ -592,6 +963,7 @@ static ChiakiErrorCode takion_handshake(ChiakiTakion *takion, uint32_t *seq_num_
 	init_payload.outbound_streams = TAKION_OUTBOUND_STREAMS;
 	init_payload.inbound_streams = TAKION_INBOUND_STREAMS;
 	init_payload.initial_seq_num = takion->seq_num_local;
+	uint64_t init_sent_us = chiaki_time_now_monotonic_us();
 	err = takion_send_message_init(takion, &init_payload);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -610,6 +982,8 @@ static ChiakiErrorCode takion_handshake(ChiakiTakion *takion, uint32_t *seq_num_
 		CHIAKI_LOGE(takion->log, "Takion failed to receive init ack");
 		return err;
 	}
+	if(!takion->rtt_us)
+		takion->rtt_us = chiaki_time_now_monotonic_us() - init_sent_us;
 
 	if(init_ack_payload.tag == 0)
 	{
@@ -665,10 +1039,62 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
+	chiaki_packet_pool_release(&takion->packet_pool, entry->packet);
 	free(entry);
 }
 
+static void takion_check_crypt_available(ChiakiTakion *takion, bool *crypt_available)
+{
+	if(takion->enable_crypt && !*crypt_available && takion->gkcrypt_remote)
+	{
+		*crypt_available = true;
+		CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_32_count(&takion->data_queue));
+		for(size_t i=0; i<chiaki_reorder_queue_32_count(&takion->data_queue); i++)
+		{
+			TakionDataPacketEntry *entry;
+			bool peeked = chiaki_reorder_queue_32_peek(&takion->data_queue, i, NULL, (void **)&entry);
+			if(!peeked)
+				continue;
+			if(entry->packet->size == 0)
+				continue;
+			uint8_t base_type = (uint8_t)(entry->packet->data[0] & TAKION_PACKET_BASE_TYPE_MASK);
+			if(takion_handle_packet_mac(takion, base_type, entry->packet->data, entry->packet->size) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+				chiaki_reorder_queue_32_drop(&takion->data_queue, i);
+			}
+		}
+	}
+
+	if(takion->postponed_packets && takion->gkcrypt_remote)
+	{
+		// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+
+		CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+
+		ChiakiTakionPostponedPacket *postponed_packets = takion->postponed_packets;
+		size_t postponed_packets_count = takion->postponed_packets_count;
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+		for(size_t i=0; i<postponed_packets_count; i++)
+			takion_handle_packet(takion, postponed_packets[i].packet);
+		free(postponed_packets);
+	}
+}
+
+static void takion_release_postponed_packets(ChiakiTakion *takion)
+{
+	if(!takion->postponed_packets)
+		return;
+	for(size_t i=0; i<takion->postponed_packets_count; i++)
+		chiaki_packet_pool_release(&takion->packet_pool, takion->postponed_packets[i].packet);
+	free(takion->postponed_packets);
+	takion->postponed_packets = NULL;
+	takion->postponed_packets_size = 0;
+	takion->postponed_packets_count = 0;
+}
+
 static void *takion_thread_func(void *user)
 {
 	ChiakiTakion *takion = user;
@@ -677,14 +1103,26 @@ static void *takion_thread_func(void *user)
 	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_packet_pool_init(&takion->packet_pool, TAKION_PACKET_POOL_SIZE) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
+	if(takion->net_impair_enabled)
+	{
+		if(chiaki_net_impair_init(&takion->net_impair, &takion->net_impair_config, &takion->packet_pool) == CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGI(takion->log, "Takion is impairing received packets for testing");
+		else
+			takion->net_impair_enabled = false;
+	}
+
+	if(chiaki_reorder_queue_32_init(&takion->data_queue, takion->data_queue_size_exp, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+		goto error_net_impair;
+
+	chiaki_reorder_queue_32_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
-	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, takion->event_loop, takion->seq_num_local, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
+	chiaki_takion_send_buffer_set_rtt(&takion->send_buffer, takion->rtt_us);
 
 
 	if(takion->cb)
@@ -696,64 +1134,33 @@ static void *takion_thread_func(void *user)
 
 	bool crypt_available = takion->gkcrypt_remote ? true : false;
 
+	ChiakiPacketBuf *packets[TAKION_RECV_BATCH_SIZE];
 	while(true)
 	{
-		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
-		{
-			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
-		}
+		takion_check_crypt_available(takion, &crypt_available);
+
+		size_t packets_count;
+		uint64_t timeout_ms = takion->net_impair_enabled ? takion_net_impair_timeout_ms(takion) : UINT64_MAX;
+		uint64_t av_deadline_timeout_ms = takion_av_deadline_timeout_ms(takion);
+		if(av_deadline_timeout_ms < timeout_ms)
+			timeout_ms = av_deadline_timeout_ms;
+		ChiakiErrorCode err = takion_recv_batch(takion, packets, TAKION_RECV_BATCH_SIZE, &packets_count, timeout_ms);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			packets_count = 0;
+		else if(err != CHIAKI_ERR_SUCCESS)
+			break;
+		if(takion->net_impair_enabled)
+			packets_count = takion_net_impair_apply(takion, packets, packets_count, TAKION_RECV_BATCH_SIZE);
 
-		if(takion->postponed_packets && takion->gkcrypt_remote)
+		for(size_t i=0; i<packets_count; i++)
 		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
-
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
-
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
-			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
-			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
+			// crypt may become available while handling any packet of the batch
+			if(i > 0)
+				takion_check_crypt_available(takion, &crypt_available);
+			takion_handle_packet(takion, packets[i]);
 		}
 
-		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
-		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			free(buf);
-			break;
-		}
-		uint8_t *resized_buf = realloc(buf, received_size);
-		if(!resized_buf)
-		{
-			free(buf);
-			continue;
-		}
-		takion_handle_packet(takion, resized_buf, received_size);
+		takion_check_av_deadline(takion);
 	}
 
 	// chiaki_congestion_control_stop(&congestion_control);
@@ -761,7 +1168,29 @@ static void *takion_thread_func(void *user)
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
-	chiaki_reorder_queue_fini(&takion->data_queue);
+	chiaki_reorder_queue_32_fini(&takion->data_queue);
+
+error_net_impair:
+	if(takion->net_impair_enabled)
+	{
+		ChiakiNetImpairStats *impair_stats = &takion->net_impair.stats;
+		CHIAKI_LOGI(takion->log, "Takion impairment: %llu packets in, %llu out, %llu lost, %llu dropped by the rate limit, %llu duplicated, %llu reordered",
+				(unsigned long long)impair_stats->packets_in, (unsigned long long)impair_stats->packets_out,
+				(unsigned long long)impair_stats->dropped_loss, (unsigned long long)impair_stats->dropped_queue,
+				(unsigned long long)impair_stats->duplicated, (unsigned long long)impair_stats->reordered);
+		chiaki_net_impair_fini(&takion->net_impair);
+	}
+
+	takion_release_postponed_packets(takion);
+	CHIAKI_LOGI(takion->log, "Takion received %llu packets in %llu syscalls (%.2f per syscall), packet pool exhausted %llu times",
+			(unsigned long long)takion->recv_stats.packets, (unsigned long long)takion->recv_stats.syscalls,
+			chiaki_takion_recv_stats_packets_per_syscall(&takion->recv_stats),
+			(unsigned long long)takion->recv_stats.pool_exhausted);
+	ChiakiTakionSendStats send_stats;
+	chiaki_takion_get_send_stats(takion, &send_stats);
+	CHIAKI_LOGI(takion->log, "Takion sent %llu packets in %llu syscalls",
+			(unsigned long long)send_stats.packets, (unsigned long long)send_stats.syscalls);
+	chiaki_packet_pool_fini(&takion->packet_pool);
 
 beach:
 	if(takion->cb)
@@ -770,12 +1199,55 @@ beach:
 		event.type = CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 		takion->cb(&event, takion->cb_user);
 	}
-	CHIAKI_SOCKET_CLOSE(takion->sock);
+	if(!CHIAKI_SOCKET_IS_INVALID(takion->sock))
+		CHIAKI_SOCKET_CLOSE(takion->sock);
 	return NULL;
 }
 
+/**
+ * Read the next datagram from the capture instead of the socket.
+ * In realtime mode, wait until it is due, otherwise only check for a stop every few datagrams.
+ */
+static ChiakiErrorCode takion_replay_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size)
+{
+	ChiakiCaptureRecord record;
+	ChiakiErrorCode err;
+	do
+	{
+		err = chiaki_capture_reader_next(takion->replay, &record);
+		if(err == CHIAKI_ERR_DISCONNECTED)
+			CHIAKI_LOGI(takion->log, "Takion reached the end of the replayed capture");
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	} while(record.type != CHIAKI_CAPTURE_RECORD_DATAGRAM);
+
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t due_us = takion->replay_start_us + record.time_us;
+	if(takion->replay_realtime && due_us > now_us)
+		err = chiaki_stop_pipe_sleep(&takion->stop_pipe, (due_us - now_us + 999) / 1000);
+	else if(!takion->replay_realtime && !(takion->recv_stats.packets % TAKION_REPLAY_STOP_CHECK_INTERVAL))
+		err = chiaki_stop_pipe_sleep(&takion->stop_pipe, 0);
+	else
+		err = CHIAKI_ERR_TIMEOUT;
+	if(err != CHIAKI_ERR_TIMEOUT)
+		return err;
+
+	if(record.size > *buf_size)
+	{
+		CHIAKI_LOGE(takion->log, "Takion replayed datagram of %llu bytes does not fit into %llu bytes",
+				(unsigned long long)record.size, (unsigned long long)*buf_size);
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	}
+	memcpy(buf, record.data, record.size);
+	*buf_size = record.size;
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
 {
+	if(takion->replay)
+		return takion_replay_recv(takion, buf, buf_size);
+
 	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
@@ -795,9 +1267,184 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 		return CHIAKI_ERR_NETWORK;
 	}
 	*buf_size = (size_t)received_sz;
+	if(takion->capture)
+		chiaki_capture_writer_record(takion->capture, CHIAKI_CAPTURE_RECORD_DATAGRAM, chiaki_time_now_monotonic_us(), buf, *buf_size);
 	return CHIAKI_ERR_SUCCESS;
 }
 
+#ifdef TAKION_RECVMMSG
+static ChiakiErrorCode takion_recv_batch_mmsg(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t packets_max, size_t *packets_count, uint64_t timeout_ms)
+{
+	*packets_count = 0;
+	ChiakiPacketPool *pool = &takion->packet_pool;
+	uint64_t exhausted_prev = pool->exhausted_count;
+
+	assert(packets_max <= TAKION_RECV_BATCH_SIZE);
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
+		return err;
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion select failed: %s", strerror(errno));
+		return err;
+	}
+
+	// only take what is left in the pool, but always at least one buffer
+	size_t count = chiaki_packet_pool_available(pool);
+	if(count > packets_max)
+		count = packets_max;
+	if(count < 1)
+		count = 1;
+
+	struct mmsghdr msgs[TAKION_RECV_BATCH_SIZE];
+	struct iovec iovs[TAKION_RECV_BATCH_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(size_t i=0; i<count; i++)
+	{
+		packets[i] = chiaki_packet_pool_acquire(pool);
+		if(!packets[i])
+		{
+			count = i;
+			break;
+		}
+		iovs[i].iov_base = packets[i]->data;
+		iovs[i].iov_len = sizeof(packets[i]->data);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if(!count)
+		return CHIAKI_ERR_MEMORY;
+
+	int r = recvmmsg(takion->sock, msgs, (unsigned int)count, MSG_DONTWAIT, NULL);
+	if(r < 0)
+	{
+		for(size_t i=0; i<count; i++)
+			chiaki_packet_pool_release(pool, packets[i]);
+		takion->recv_stats.pool_exhausted += pool->exhausted_count - exhausted_prev;
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return CHIAKI_ERR_SUCCESS;
+		CHIAKI_LOGE(takion->log, "Takion recvmmsg failed: %s", strerror(errno));
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	size_t received = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		if(i >= (size_t)r || msgs[i].msg_len == 0)
+		{
+			chiaki_packet_pool_release(pool, packets[i]);
+			continue;
+		}
+		packets[i]->size = msgs[i].msg_len;
+		packets[received++] = packets[i];
+	}
+	takion->recv_stats.packets += received;
+	takion->recv_stats.syscalls++;
+	takion->recv_stats.pool_exhausted += pool->exhausted_count - exhausted_prev;
+	*packets_count = received;
+
+	if(takion->capture)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		for(size_t i=0; i<received; i++)
+			chiaki_capture_writer_record(takion->capture, CHIAKI_CAPTURE_RECORD_DATAGRAM, now_us, packets[i]->data, packets[i]->size);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
+
+static ChiakiErrorCode takion_recv_batch_single(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t *packets_count, uint64_t timeout_ms)
+{
+	*packets_count = 0;
+	ChiakiPacketPool *pool = &takion->packet_pool;
+	uint64_t exhausted_prev = pool->exhausted_count;
+
+	ChiakiPacketBuf *packet = chiaki_packet_pool_acquire(pool);
+	if(!packet)
+		return CHIAKI_ERR_MEMORY;
+	size_t received_size = sizeof(packet->data);
+	ChiakiErrorCode err = takion_recv(takion, packet->data, &received_size, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_packet_pool_release(pool, packet);
+		return err;
+	}
+	packet->size = received_size;
+	packets[0] = packet;
+	takion->recv_stats.packets++;
+	takion->recv_stats.syscalls++;
+	takion->recv_stats.pool_exhausted += pool->exhausted_count - exhausted_prev;
+	*packets_count = 1;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Wait for incoming datagrams and receive as many as possible (up to packets_max) into buffers from takion->packet_pool.
+ *
+ * @param packets array of at least packets_max elements, ownership of the first *packets_count buffers is passed to the caller
+ * @return CHIAKI_ERR_TIMEOUT if nothing arrived within timeout_ms
+ */
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t packets_max, size_t *packets_count, uint64_t timeout_ms)
+{
+#ifdef TAKION_RECVMMSG
+	// a replay hands out one datagram at a time, like a socket without recvmmsg()
+	if(!takion->replay)
+		return takion_recv_batch_mmsg(takion, packets, packets_max, packets_count, timeout_ms);
+#else
+	(void)packets_max;
+#endif
+	return takion_recv_batch_single(takion, packets, packets_count, timeout_ms);
+}
+
+/**
+ * How long to wait for datagrams until the next impaired one is due.
+ */
+static uint64_t takion_net_impair_timeout_ms(ChiakiTakion *takion)
+{
+	uint64_t due_us = chiaki_net_impair_next_due_us(&takion->net_impair);
+	if(due_us == UINT64_MAX)
+		return UINT64_MAX;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	return due_us > now_us ? (due_us - now_us + 999) / 1000 : 0;
+}
+
+static uint64_t takion_av_deadline_timeout_ms(ChiakiTakion *takion)
+{
+	if(takion->av_deadline_us == UINT64_MAX)
+		return UINT64_MAX;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	return takion->av_deadline_us > now_us ? (takion->av_deadline_us - now_us + 999) / 1000 : 0;
+}
+
+static void takion_check_av_deadline(ChiakiTakion *takion)
+{
+	if(takion->av_deadline_us == UINT64_MAX || chiaki_time_now_monotonic_us() < takion->av_deadline_us)
+		return;
+	takion->av_deadline_us = UINT64_MAX;
+	if(takion->cb)
+	{
+		ChiakiTakionEvent event = { 0 };
+		event.type = CHIAKI_TAKION_EVENT_TYPE_AV_DEADLINE;
+		takion->cb(&event, takion->cb_user);
+	}
+}
+
+/**
+ * Pass freshly received packets into the impairment and replace them with the ones that are due now.
+ *
+ * @return new number of packets in packets
+ */
+static size_t takion_net_impair_apply(ChiakiTakion *takion, ChiakiPacketBuf **packets, size_t packets_count, size_t packets_max)
+{
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<packets_count; i++)
+		chiaki_net_impair_push(&takion->net_impair, packets[i], now_us);
+	size_t count = 0;
+	while(count < packets_max && (packets[count] = chiaki_net_impair_pop(&takion->net_impair, now_us)))
+		count++;
+	return count;
+}
+
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
 {
 	if(!takion->gkcrypt_remote)
@@ -835,13 +1482,16 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_postpone_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
 	if(!takion->postponed_packets)
 	{
 		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
+		{
+			chiaki_packet_pool_release(&takion->packet_pool, packet);
 			return;
+		}
 		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
 		takion->postponed_packets_count = 0;
 	}
@@ -849,60 +1499,61 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 	if(takion->postponed_packets_count >= takion->postponed_packets_size)
 	{
 		CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
+		chiaki_packet_pool_release(&takion->packet_pool, packet);
 		return;
 	}
 
-	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
-	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
-	packet->buf = buf;
-	packet->buf_size = buf_size;
+	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)packet->size);
+	takion->postponed_packets[takion->postponed_packets_count++].packet = packet;
 }
 
 /**
- * @param buf ownership of this buf is taken.
+ * @param packet ownership of this packet is taken, it will eventually be released to takion->packet_pool.
  */
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
+	uint8_t *buf = packet->data;
+	size_t buf_size = packet->size;
 	assert(buf_size > 0);
 	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
 
 	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_pool_release(&takion->packet_pool, packet);
 		return;
 	}
 
 	switch(base_type)
 	{
 		case TAKION_PACKET_TYPE_CONTROL:
-			takion_handle_packet_message(takion, buf, buf_size);
+			takion_handle_packet_message(takion, packet);
 			break;
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
 			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
+				takion_postpone_packet(takion, packet);
 			else
 			{
 				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
+				chiaki_packet_pool_release(&takion->packet_pool, packet);
 			}
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
+			chiaki_packet_pool_release(&takion->packet_pool, packet);
 			break;
 	}
 }
 
 
-static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet_message(ChiakiTakion *takion, ChiakiPacketBuf *packet)
 {
 	TakionMessage msg;
-	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
+	ChiakiErrorCode err = takion_parse_message(takion, packet->data + 1, packet->size - 1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_pool_release(&takion->packet_pool, packet);
 		return;
 	}
 
@@ -912,34 +1563,34 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	switch(msg.chunk_type)
 	{
 		case TAKION_CHUNK_TYPE_DATA:
-			takion_handle_packet_message_data(takion, buf, buf_size, msg.chunk_flags, msg.payload, msg.payload_size);
+			takion_handle_packet_message_data(takion, packet, msg.chunk_flags, msg.payload, msg.payload_size);
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
+			chiaki_packet_pool_release(&takion->packet_pool, packet);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
+			chiaki_packet_pool_release(&takion->packet_pool, packet);
 			break;
 	}
 }
 
 static void takion_flush_data_queue(ChiakiTakion *takion)
 {
-	uint64_t seq_num = 0;
+	ChiakiSeqNum32 seq_num = 0;
 	bool ack = false;
 	while(true)
 	{
 		TakionDataPacketEntry *entry;
-		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
+		bool pulled = chiaki_reorder_queue_32_pull(&takion->data_queue, &seq_num, (void **)&entry);
 		if(!pulled)
 			break;
 		ack = true;
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
+			chiaki_packet_pool_release(&takion->packet_pool, entry->packet);
 			free(entry);
 			continue;
 		}
@@ -956,7 +1607,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 				&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_9)
 		{
 			CHIAKI_LOGW(takion->log, "Takion received data with unexpected data type %#x", data_type);
-			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, entry->packet_buf, entry->packet_size);
+			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, entry->packet->data, entry->packet->size);
 		}
 		else if(takion->cb)
 		{
@@ -968,7 +1619,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
+		chiaki_packet_pool_release(&takion->packet_pool, entry->packet);
 		free(entry);
 	}
 
@@ -976,7 +1627,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
 }
 
-static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
+static void takion_handle_packet_message_data(ChiakiTakion *takion, ChiakiPacketBuf *packet, uint8_t type_b, uint8_t *payload, size_t payload_size)
 {
 	if(type_b != 1)
 		CHIAKI_LOGW(takion->log, "Takion received data with type_b = %#x (was expecting %#x)", type_b, 1);
@@ -984,30 +1635,33 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	if(payload_size < 9)
 	{
 		CHIAKI_LOGE(takion->log, "Takion received data with a size less than the header size");
+		chiaki_packet_pool_release(&takion->packet_pool, packet);
 		return;
 	}
 
 	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
 	if(!entry)
+	{
+		chiaki_packet_pool_release(&takion->packet_pool, packet);
 		return;
+	}
 
 	entry->type_b = type_b;
-	entry->packet_buf = packet_buf;
-	entry->packet_size = packet_buf_size;
+	entry->packet = packet;
 	entry->payload = payload;
 	entry->payload_size = payload_size;
 	entry->channel = ntohs(*((chiaki_unaligned_uint16_t *)(payload + 4)));
 	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
 
-	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
+	chiaki_reorder_queue_32_push(&takion->data_queue, seq_num, entry);
 	takion_flush_data_queue(takion);
 }
 
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size)
 {
-	if(buf_size != 0xc)
+	if(buf_size < 0xc)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#x != %#x", buf_size, 0xa);
+		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#x < %#x", buf_size, 0xc);
 		return;
 	}
 
@@ -1016,21 +1670,27 @@ static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t
 	uint16_t gap_ack_blocks_count = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 8)));
 	uint16_t dup_tsns_count = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 0xa)));
 
-	if(buf_size != gap_ack_blocks_count * 4 + 0xc)
+	if(buf_size != gap_ack_blocks_count * 4 + dup_tsns_count * 4 + 0xc)
 	{
 		CHIAKI_LOGW(takion->log, "Takion received data ack with invalid gap_ack_blocks_count");
 		return;
 	}
 
-	if(dup_tsns_count != 0)
-		CHIAKI_LOGW(takion->log, "Takion received data ack with nonzero dup_tsns_count %#x", dup_tsns_count);
-
 	CHIAKI_LOGV(takion->log, "Takion received data ack with cumulative_seq_num = %#x, a_rwnd = %#x, gap_ack_blocks_count = %#x, dup_tsns_count = %#x",
 			cumulative_seq_num, a_rwnd, gap_ack_blocks_count, dup_tsns_count);
 
+	// blocks are in ascending order, so any further ones could only refer to packets beyond the send buffer
+	ChiakiTakionSendBufferGapAckBlock gap_ack_blocks[TAKION_SEND_BUFFER_SIZE];
+	size_t gap_ack_blocks_used = gap_ack_blocks_count < TAKION_SEND_BUFFER_SIZE ? gap_ack_blocks_count : TAKION_SEND_BUFFER_SIZE;
+	for(size_t i=0; i<gap_ack_blocks_used; i++)
+	{
+		gap_ack_blocks[i].start = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 0xc + i * 4)));
+		gap_ack_blocks[i].end = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 0xc + i * 4 + 2)));
+	}
+
 	ChiakiSeqNum32 acked_seq_nums[TAKION_SEND_BUFFER_SIZE];
 	size_t acked_seq_nums_count = 0;
-	chiaki_takion_send_buffer_ack(&takion->send_buffer, cumulative_seq_num, acked_seq_nums, &acked_seq_nums_count);
+	chiaki_takion_send_buffer_ack(&takion->send_buffer, cumulative_seq_num, gap_ack_blocks, gap_ack_blocks_used, acked_seq_nums, &acked_seq_nums_count);
 
 	for(size_t i=0; i<acked_seq_nums_count; i++)
 	{
@@ -1360,7 +2020,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *
 
 	*(chiaki_unaligned_uint32_t *)(buf + 0xa) = 0; // unknown
 
-	*(chiaki_unaligned_uint32_t *)(buf + 0xe) = (uint32_t)packet->key_pos;
+	*(chiaki_unaligned_uint32_t *)(buf + 0xe) = htonl((uint32_t)packet->key_pos);
 
 	uint8_t *cur = buf + 0x12;
 	if(packet->is_video)
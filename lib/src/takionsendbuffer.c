@@ -9,35 +9,65 @@
 #include <string.h>
 #include <assert.h>
 
-#define TAKION_DATA_RESEND_TIMEOUT_MS 200
-#define TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS (TAKION_DATA_RESEND_TIMEOUT_MS/2)
+// until the first rtt is known
+#define TAKION_DATA_RESEND_TIMEOUT_INITIAL_MS 200
+#define TAKION_DATA_RESEND_TIMEOUT_MIN_MS 10
+#define TAKION_DATA_RESEND_TIMEOUT_MAX_MS 1000
+#define TAKION_DATA_RESEND_CLOCK_GRANULARITY_US 1000
 #define TAKION_DATA_RESEND_TRIES_MAX 10
+// like SCTP, re-send a packet immediately when this many acks reported later ones but not it
+#define TAKION_DATA_FAST_RESEND_MISS_INDICATIONS 3
 
 #endif
 
 struct chiaki_takion_send_buffer_packet_t
 {
+	bool used;
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
-	uint8_t *buf;
+	uint64_t first_send_us; // chiaki_time_now_monotonic_us()
+	uint64_t last_send_us;
+	unsigned int miss_indications;
+	bool fast_resend;
+	uint8_t *buf; // slot storage in send_buffer->bufs or allocated if larger than CHIAKI_PACKET_BUF_SIZE
 	size_t buf_size;
 }; // ChiakiTakionSendBufferPacket
 
 #ifndef CHIAKI_UNIT_TEST
 
 static void *takion_send_buffer_thread_func(void *user);
+static void takion_send_buffer_timer_cb(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, ChiakiEventLoop *loop,
+		ChiakiSeqNum32 seq_num_initial, size_t size)
 {
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
+	send_buffer->loop = loop;
 
 	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
+	send_buffer->bufs = malloc(size * CHIAKI_PACKET_BUF_SIZE);
+	if(!send_buffer->bufs)
+	{
+		free(send_buffer->packets);
+		return CHIAKI_ERR_MEMORY;
+	}
 	send_buffer->packets_count = 0;
+	send_buffer->seq_num_first = seq_num_initial;
+	send_buffer->seq_num_first_index = 0;
+	send_buffer->seq_nums_span = 0;
+	send_buffer->wakeup_pending = false;
+	// the timer is only armed when packets become due earlier than this
+	send_buffer->wakeup_us = loop ? UINT64_MAX : 0;
+
+	send_buffer->rtt_sampled = false;
+	send_buffer->srtt_us = 0;
+	send_buffer->rttvar_us = 0;
+	send_buffer->rto_us = TAKION_DATA_RESEND_TIMEOUT_INITIAL_MS * 1000;
+	memset(&send_buffer->stats, 0, sizeof(send_buffer->stats));
 
 	send_buffer->should_stop = false;
 
@@ -49,6 +79,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuf
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
+	if(loop)
+	{
+		chiaki_event_loop_timer_init(&send_buffer->timer, loop, takion_send_buffer_timer_cb, send_buffer);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
@@ -61,75 +97,219 @@ error_cond:
 error_mutex:
 	chiaki_mutex_fini(&send_buffer->mutex);
 error_packets:
+	free(send_buffer->bufs);
 	free(send_buffer->packets);
 	return err;
 }
 
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	send_buffer->should_stop = true;
-	chiaki_mutex_unlock(&send_buffer->mutex);
-	err = chiaki_cond_signal(&send_buffer->cond);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_thread_join(&send_buffer->thread, NULL);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	if(send_buffer->loop)
+		chiaki_event_loop_timer_fini(&send_buffer->timer);
+	else
+	{
+		ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		send_buffer->should_stop = true;
+		chiaki_mutex_unlock(&send_buffer->mutex);
+		err = chiaki_cond_signal(&send_buffer->cond);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		err = chiaki_thread_join(&send_buffer->thread, NULL);
+		assert(err == CHIAKI_ERR_SUCCESS);
+	}
+
+	if(send_buffer->stats.packets_resent || send_buffer->stats.packets_fast_resent)
+	{
+		CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sent %llu packets on timeout and %llu fast, srtt %.1f ms, rto %.1f ms",
+				(unsigned long long)send_buffer->stats.packets_resent, (unsigned long long)send_buffer->stats.packets_fast_resent,
+				(double)send_buffer->srtt_us / 1000.0, (double)send_buffer->rto_us / 1000.0);
+	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
-		free(send_buffer->packets[i].buf);
+	for(size_t i=0; i<send_buffer->packets_size; i++)
+	{
+		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
+		if(packet->used && packet->buf_size > CHIAKI_PACKET_BUF_SIZE)
+			free(packet->buf);
+	}
 
 	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
+	free(send_buffer->bufs);
 	free(send_buffer->packets);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
+static void takion_send_buffer_rto_update(ChiakiTakionSendBuffer *send_buffer)
+{
+	uint64_t var = 4 * send_buffer->rttvar_us;
+	if(var < TAKION_DATA_RESEND_CLOCK_GRANULARITY_US)
+		var = TAKION_DATA_RESEND_CLOCK_GRANULARITY_US;
+	uint64_t rto = send_buffer->srtt_us + var;
+	if(rto < TAKION_DATA_RESEND_TIMEOUT_MIN_MS * 1000)
+		rto = TAKION_DATA_RESEND_TIMEOUT_MIN_MS * 1000;
+	else if(rto > TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000)
+		rto = TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000;
+	send_buffer->rto_us = rto;
+}
+
+/**
+ * RFC 6298 section 2
+ */
+static void takion_send_buffer_rtt_sample(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	if(!send_buffer->rtt_sampled)
+	{
+		send_buffer->srtt_us = rtt_us;
+		send_buffer->rttvar_us = rtt_us / 2;
+		send_buffer->rtt_sampled = true;
+	}
+	else
+	{
+		uint64_t err = rtt_us > send_buffer->srtt_us ? rtt_us - send_buffer->srtt_us : send_buffer->srtt_us - rtt_us;
+		send_buffer->rttvar_us = (3 * send_buffer->rttvar_us + err) / 4;
+		send_buffer->srtt_us = (7 * send_buffer->srtt_us + rtt_us) / 8;
+	}
+	takion_send_buffer_rto_update(send_buffer);
+}
+
+CHIAKI_EXPORT void chiaki_takion_send_buffer_set_rtt(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	if(chiaki_mutex_lock(&send_buffer->mutex) != CHIAKI_ERR_SUCCESS)
+		return;
+	if(!send_buffer->rtt_sampled)
+	{
+		send_buffer->srtt_us = rtt_us;
+		send_buffer->rttvar_us = rtt_us / 2;
+		takion_send_buffer_rto_update(send_buffer);
+		CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer starting with rtt %.1f ms, rto %.1f ms",
+				(double)rtt_us / 1000.0, (double)send_buffer->rto_us / 1000.0);
+	}
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
+
+static uint64_t takion_send_buffer_packet_due_us(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet)
+{
+	// exponential backoff for every further try
+	uint64_t timeout_us = send_buffer->rto_us << (packet->tries < 7 ? packet->tries : 7);
+	if(timeout_us > TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000)
+		timeout_us = TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000;
+	return packet->last_send_us + timeout_us;
+}
+
+static ChiakiTakionSendBufferPacket *takion_send_buffer_slot(ChiakiTakionSendBuffer *send_buffer, size_t offset)
+{
+	return &send_buffer->packets[(send_buffer->seq_num_first_index + offset) % send_buffer->packets_size];
+}
+
+/**
+ * Make the timer check packets at due_us at the latest. mutex must be locked.
+ */
+static void takion_send_buffer_schedule(ChiakiTakionSendBuffer *send_buffer, uint64_t due_us)
+{
+	if(due_us >= send_buffer->wakeup_us)
+		return;
+	send_buffer->wakeup_us = due_us;
+	chiaki_event_loop_timer_start(&send_buffer->timer, due_us, 0);
+}
+
+static void takion_send_buffer_packet_release(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet)
+{
+	if(packet->buf_size > CHIAKI_PACKET_BUF_SIZE)
+		free(packet->buf);
+	packet->buf = NULL;
+	packet->used = false;
+	send_buffer->packets_count--;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, const uint8_t *buf, size_t buf_size)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+	if(chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_first))
+	{
+		CHIAKI_LOGE(send_buffer->log, "Tried to push already acked seqnum into Takion Send Buffer");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
+	}
+
+	size_t offset = (size_t)(ChiakiSeqNum32)(seq_num - send_buffer->seq_num_first);
+	if(offset >= send_buffer->packets_size)
 	{
 		CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
 		err = CHIAKI_ERR_OVERFLOW;
 		goto beach;
 	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, offset);
+	if(packet->used)
+	{
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
+	}
+
+	if(buf_size > CHIAKI_PACKET_BUF_SIZE)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
+		packet->buf = malloc(buf_size);
+		if(!packet->buf)
 		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
+			err = CHIAKI_ERR_MEMORY;
 			goto beach;
 		}
 	}
+	else
+		packet->buf = send_buffer->bufs + (size_t)(packet - send_buffer->packets) * CHIAKI_PACKET_BUF_SIZE;
+	memcpy(packet->buf, buf, buf_size);
 
-	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
+	uint64_t now = chiaki_time_now_monotonic_us();
+	packet->used = true;
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
-	packet->buf = buf;
+	packet->first_send_us = now;
+	packet->last_send_us = now;
+	packet->miss_indications = 0;
+	packet->fast_resend = false;
 	packet->buf_size = buf_size;
+	send_buffer->packets_count++;
+	if(offset >= send_buffer->seq_nums_span)
+		send_buffer->seq_nums_span = offset + 1;
 
 	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
 
-	if(send_buffer->packets_count == 1)
+	if(send_buffer->loop)
+		takion_send_buffer_schedule(send_buffer, takion_send_buffer_packet_due_us(send_buffer, packet));
+	else if(send_buffer->packets_count == 1)
 	{
 		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
 		chiaki_cond_signal(&send_buffer->cond);
 	}
+	else if(takion_send_buffer_packet_due_us(send_buffer, packet) < send_buffer->wakeup_us)
+	{
+		// the others are backing off, so it would sleep too long
+		send_buffer->wakeup_pending = true;
+		chiaki_cond_signal(&send_buffer->cond);
+	}
 
 beach:
-	if(err != CHIAKI_ERR_SUCCESS)
-		free(buf);
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
+static void takion_send_buffer_ack_packet(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet,
+		ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count, uint64_t *rtt_sample_send_us)
+{
+	if(acked_seq_nums)
+		acked_seq_nums[(*acked_seq_nums_count)++] = packet->seq_num;
+	// Karn's algorithm: only packets that were sent once tell the rtt unambiguously, prefer the latest one
+	if(!packet->tries && (!*rtt_sample_send_us || packet->first_send_us > *rtt_sample_send_us))
+		*rtt_sample_send_us = packet->first_send_us;
+	takion_send_buffer_packet_release(send_buffer, packet);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num,
+		const ChiakiTakionSendBufferGapAckBlock *gap_ack_blocks, size_t gap_ack_blocks_count,
+		ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -138,65 +318,103 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 	if(acked_seq_nums_count)
 		*acked_seq_nums_count = 0;
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
+	uint64_t rtt_sample_send_us = 0;
+
+	if(!chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_first) && send_buffer->seq_nums_span)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_32_lt(send_buffer->packets[i].seq_num, seq_num))
+		// cumulative ack, everything up to seq_num, but never beyond what was pushed because packets are pushed before they are sent
+		size_t acked = (size_t)(ChiakiSeqNum32)(seq_num - send_buffer->seq_num_first) + 1;
+		size_t release = acked < send_buffer->seq_nums_span ? acked : send_buffer->seq_nums_span;
+		for(size_t i=0; i<release; i++)
 		{
-			if(acked_seq_nums)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
+			ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, i);
+			if(packet->used)
+				takion_send_buffer_ack_packet(send_buffer, packet, acked_seq_nums, acked_seq_nums_count, &rtt_sample_send_us);
+		}
+		send_buffer->seq_num_first_index = (send_buffer->seq_num_first_index + release) % send_buffer->packets_size;
+		send_buffer->seq_nums_span -= release;
+		send_buffer->seq_num_first += (ChiakiSeqNum32)release;
+	}
 
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
+	// selective acks after the cumulative one
+	bool gap_acked = false;
+	size_t gap_acked_max = 0; // offset after the highest gap acked seq num
+	for(size_t i=0; i<gap_ack_blocks_count; i++)
+	{
+		const ChiakiTakionSendBufferGapAckBlock *block = &gap_ack_blocks[i];
+		if(block->start > block->end)
+			continue;
+		for(uint32_t o=block->start; o<=block->end; o++)
+		{
+			ChiakiSeqNum32 acked_seq_num = seq_num + o;
+			if(chiaki_seq_num_32_lt(acked_seq_num, send_buffer->seq_num_first))
+				continue;
+			size_t offset = (size_t)(ChiakiSeqNum32)(acked_seq_num - send_buffer->seq_num_first);
+			if(offset >= send_buffer->seq_nums_span)
+				break;
+			ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, offset);
+			if(packet->used)
 			{
-				// first shift
-				shift_start = i;
-				shift = 1;
+				takion_send_buffer_ack_packet(send_buffer, packet, acked_seq_nums, acked_seq_nums_count, &rtt_sample_send_us);
+				send_buffer->stats.packets_gap_acked++;
 			}
-			else if(shift_start + shift == i)
+			gap_acked = true;
+			if(offset + 1 > gap_acked_max)
+				gap_acked_max = offset + 1;
+		}
+	}
+
+	if(gap_acked)
+	{
+		// everything still missing before a gap acked packet is probably lost
+		for(size_t i=0; i<gap_acked_max; i++)
+		{
+			ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, i);
+			if(!packet->used || packet->fast_resend)
+				continue;
+			if(++packet->miss_indications == TAKION_DATA_FAST_RESEND_MISS_INDICATIONS)
 			{
-				// still in the same gap
-				shift++;
+				packet->fast_resend = true;
+				send_buffer->wakeup_pending = true;
 			}
+		}
+		if(send_buffer->wakeup_pending)
+		{
+			if(send_buffer->loop)
+				takion_send_buffer_schedule(send_buffer, chiaki_time_now_monotonic_us());
 			else
-			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
-			}
+				chiaki_cond_signal(&send_buffer->cond);
 		}
 	}
 
-	if(shift_start != SIZE_MAX)
+	if(rtt_sample_send_us)
 	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
-		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-		}
-		send_buffer->packets_count -= shift;
+		uint64_t now = chiaki_time_now_monotonic_us();
+		takion_send_buffer_rtt_sample(send_buffer, now > rtt_sample_send_us ? now - rtt_sample_send_us : 0);
 	}
 
-	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
+	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx with %llu gap ack blocks from Takion Send Buffer",
+			(unsigned long long)seq_num, (unsigned long long)gap_ack_blocks_count);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
+CHIAKI_EXPORT void chiaki_takion_send_buffer_get_stats(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferStats *stats)
+{
+	chiaki_mutex_lock(&send_buffer->mutex);
+	*stats = send_buffer->stats;
+	stats->srtt_us = send_buffer->srtt_us;
+	stats->rto_us = send_buffer->rto_us;
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
+
 static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
 
 static bool takion_send_buffer_check_pred_packets(void *user)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop;
+	return send_buffer->should_stop || send_buffer->wakeup_pending;
 }
 
 static bool takion_send_buffer_check_pred_no_packets(void *user)
@@ -215,8 +433,14 @@ static void *takion_send_buffer_thread_func(void *user)
 
 	while(true)
 	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
+		if(send_buffer->packets_count) // if there are packets, wait until the next one is due
+		{
+			uint64_t now = chiaki_time_now_monotonic_us();
+			uint64_t timeout_ms = send_buffer->wakeup_us > now ? (send_buffer->wakeup_us - now + 999) / 1000 : 0;
+			if(timeout_ms > TAKION_DATA_RESEND_TIMEOUT_MAX_MS)
+				timeout_ms = TAKION_DATA_RESEND_TIMEOUT_MAX_MS;
+			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, timeout_ms, takion_send_buffer_check_pred_packets, send_buffer);
+		}
 		else // if not, wait without timeout, but also wakeup if packets become available
 			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
 
@@ -234,24 +458,60 @@ static void *takion_send_buffer_thread_func(void *user)
 	return NULL;
 }
 
+static void takion_send_buffer_timer_cb(void *user)
+{
+	ChiakiTakionSendBuffer *send_buffer = user;
+	chiaki_mutex_lock(&send_buffer->mutex);
+	takion_send_buffer_resend(send_buffer);
+	if(send_buffer->wakeup_us != UINT64_MAX)
+	{
+		uint64_t due_max_us = chiaki_time_now_monotonic_us() + TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000;
+		uint64_t due_us = send_buffer->wakeup_us < due_max_us ? send_buffer->wakeup_us : due_max_us;
+		send_buffer->wakeup_us = UINT64_MAX;
+		takion_send_buffer_schedule(send_buffer, due_us);
+	}
+	chiaki_mutex_unlock(&send_buffer->mutex);
+}
+
+/**
+ * Re-send everything that is due and set wakeup_us to when the next packet will be.
+ */
 static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
 {
+	send_buffer->wakeup_pending = false;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	send_buffer->wakeup_us = UINT64_MAX;
 	if(!send_buffer->takion)
 		return;
 
-	uint64_t now = chiaki_time_now_monotonic_ms();
-
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	for(size_t i=0; i<send_buffer->seq_nums_span; i++)
 	{
-		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > TAKION_DATA_RESEND_TIMEOUT_MS)
+		ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, i);
+		if(!packet->used)
+			continue;
+
+		if(packet->fast_resend || now >= takion_send_buffer_packet_due_us(send_buffer, packet))
 		{
-			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
+			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx%s, tries: %llu",
+					(unsigned long long)packet->seq_num, packet->fast_resend ? " reported missing" : "", (unsigned long long)packet->tries);
+			if(packet->fast_resend)
+				send_buffer->stats.packets_fast_resent++;
+			else
+				send_buffer->stats.packets_resent++;
+			packet->fast_resend = false;
+			packet->miss_indications = 0;
+			packet->last_send_us = now;
 			chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
 			packet->tries++;
-			// TODO: check tries and disconnect if necessary
+			// the stream connection notices a dead peer by its heartbeat, so keep trying at the max timeout
+			if(packet->tries == TAKION_DATA_RESEND_TRIES_MAX)
+				CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer packet with seqnum %#llx is still not acked after %u tries",
+						(unsigned long long)packet->seq_num, (unsigned int)TAKION_DATA_RESEND_TRIES_MAX);
 		}
+
+		uint64_t due_us = takion_send_buffer_packet_due_us(send_buffer, packet);
+		if(due_us < send_buffer->wakeup_us)
+			send_buffer->wakeup_us = due_us;
 	}
 }
 
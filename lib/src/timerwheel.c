@@ -0,0 +1,251 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/timerwheel.h>
+
+#include <string.h>
+
+#define SLOT_MASK (CHIAKI_TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * CHIAKI_TIMER_WHEEL_LEVEL_BITS)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ctz64(x) ((unsigned int)__builtin_ctzll(x))
+#define clz64(x) ((unsigned int)__builtin_clzll(x))
+#else
+static inline unsigned int ctz64(uint64_t x)
+{
+	unsigned int r = 0;
+	while(!(x & 1))
+	{
+		x >>= 1;
+		r++;
+	}
+	return r;
+}
+
+static inline unsigned int clz64(uint64_t x)
+{
+	unsigned int r = 0;
+	while(!(x & (UINT64_C(1) << 63)))
+	{
+		x <<= 1;
+		r++;
+	}
+	return r;
+}
+#endif
+
+static inline uint64_t rotr64(uint64_t x, unsigned int n)
+{
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_init(ChiakiTimerWheel *wheel, uint64_t now_us)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now_us = now_us;
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_timer_init(ChiakiTimerWheelTimer *timer, ChiakiTimerWheelCallback cb, void *user)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->cb = cb;
+	timer->user = user;
+}
+
+/**
+ * Latest time in [due_us, due_us + slack_us] with as many low bits cleared as possible,
+ * so timers with overlapping slack end up at the same time.
+ */
+static uint64_t timer_wheel_apply_slack(uint64_t due_us, uint64_t slack_us)
+{
+	if(!slack_us || due_us > UINT64_MAX - slack_us)
+		return due_us;
+	uint64_t limit_us = due_us + slack_us;
+	unsigned int bit = 63 - clz64(limit_us ^ due_us);
+	return limit_us & ~((UINT64_C(1) << bit) - 1);
+}
+
+static void timer_wheel_insert(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer)
+{
+	uint64_t expires_us = timer->expires_us > wheel->now_us ? timer->expires_us : wheel->now_us;
+
+	// lowest level where the expiry is less than a full turn ahead
+	unsigned int level = 0;
+	uint64_t ahead;
+	while(true)
+	{
+		ahead = (expires_us >> LEVEL_SHIFT(level)) - (wheel->now_us >> LEVEL_SHIFT(level));
+		if(ahead < CHIAKI_TIMER_WHEEL_SLOTS)
+			break;
+		if(level == CHIAKI_TIMER_WHEEL_LEVELS - 1)
+		{
+			// too far out, wait in the last slot and be put back from there
+			ahead = CHIAKI_TIMER_WHEEL_SLOTS - 1;
+			break;
+		}
+		level++;
+	}
+	unsigned int slot = (unsigned int)(((wheel->now_us >> LEVEL_SHIFT(level)) + ahead) & SLOT_MASK);
+
+	ChiakiTimerWheelTimer **head = &wheel->slots[level][slot];
+	timer->level = (uint8_t)level;
+	timer->slot = (uint8_t)slot;
+	timer->next = *head;
+	if(*head)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+	wheel->occupied[level] |= UINT64_C(1) << slot;
+}
+
+static void timer_wheel_unlink(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer)
+{
+	*timer->pprev = timer->next;
+	if(timer->next)
+		timer->next->pprev = timer->pprev;
+	if(!wheel->slots[timer->level][timer->slot])
+		wheel->occupied[timer->level] &= ~(UINT64_C(1) << timer->slot);
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_schedule(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer, uint64_t due_us, uint64_t interval_us, uint64_t slack_us)
+{
+	if(timer->pprev)
+		timer_wheel_unlink(wheel, timer);
+	else
+		wheel->count++;
+	timer->due_us = due_us;
+	timer->interval_us = interval_us;
+	timer->slack_us = slack_us;
+	timer->expires_us = timer_wheel_apply_slack(due_us, slack_us);
+	timer_wheel_insert(wheel, timer);
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_cancel(ChiakiTimerWheel *wheel, ChiakiTimerWheelTimer *timer)
+{
+	if(!timer->pprev)
+		return;
+	timer_wheel_unlink(wheel, timer);
+	wheel->count--;
+}
+
+/**
+ * Index of the first non-empty slot of level, counted from the one now_us is in.
+ * Level must not be empty.
+ */
+static unsigned int timer_wheel_level_ahead(ChiakiTimerWheel *wheel, unsigned int level)
+{
+	unsigned int pos = (unsigned int)((wheel->now_us >> LEVEL_SHIFT(level)) & SLOT_MASK);
+	return ctz64(rotr64(wheel->occupied[level], pos));
+}
+
+CHIAKI_EXPORT uint64_t chiaki_timer_wheel_next_expiry(ChiakiTimerWheel *wheel)
+{
+	uint64_t next_us = UINT64_MAX;
+	for(unsigned int level=0; level<CHIAKI_TIMER_WHEEL_LEVELS; level++)
+	{
+		if(!wheel->occupied[level])
+			continue;
+		// later slots of a level only hold later timers
+		unsigned int pos = (unsigned int)((wheel->now_us >> LEVEL_SHIFT(level)) & SLOT_MASK);
+		unsigned int slot = (pos + timer_wheel_level_ahead(wheel, level)) & SLOT_MASK;
+		for(ChiakiTimerWheelTimer *timer = wheel->slots[level][slot]; timer; timer = timer->next)
+		{
+			if(timer->expires_us < next_us)
+				next_us = timer->expires_us;
+		}
+	}
+	return next_us;
+}
+
+/**
+ * Next time after now_us at which a level 0 slot has to be expired or a higher one moved down.
+ */
+static uint64_t timer_wheel_next_step(ChiakiTimerWheel *wheel)
+{
+	uint64_t step_us = UINT64_MAX;
+	for(unsigned int level=0; level<CHIAKI_TIMER_WHEEL_LEVELS; level++)
+	{
+		if(!wheel->occupied[level])
+			continue;
+		unsigned int shift = LEVEL_SHIFT(level);
+		uint64_t slot_start_us = ((wheel->now_us >> shift) + timer_wheel_level_ahead(wheel, level)) << shift;
+		if(slot_start_us < wheel->now_us)
+			slot_start_us = wheel->now_us;
+		if(slot_start_us < step_us)
+			step_us = slot_start_us;
+	}
+	return step_us;
+}
+
+/**
+ * Move all timers of the slots that now_us has just reached down to lower levels.
+ */
+static void timer_wheel_cascade(ChiakiTimerWheel *wheel)
+{
+	for(unsigned int level=CHIAKI_TIMER_WHEEL_LEVELS-1; level>0; level--)
+	{
+		unsigned int slot = (unsigned int)((wheel->now_us >> LEVEL_SHIFT(level)) & SLOT_MASK);
+		ChiakiTimerWheelTimer *timer = wheel->slots[level][slot];
+		if(!timer)
+			continue;
+		wheel->slots[level][slot] = NULL;
+		wheel->occupied[level] &= ~(UINT64_C(1) << slot);
+		while(timer)
+		{
+			ChiakiTimerWheelTimer *next = timer->next;
+			timer_wheel_insert(wheel, timer);
+			timer = next;
+		}
+	}
+}
+
+CHIAKI_EXPORT ChiakiTimerWheelTimer *chiaki_timer_wheel_pop_expired(ChiakiTimerWheel *wheel, uint64_t now_us, uint64_t *expires_us)
+{
+	while(true)
+	{
+		// everything in the current level 0 slot is due
+		ChiakiTimerWheelTimer *timer = wheel->slots[0][wheel->now_us & SLOT_MASK];
+		if(timer)
+		{
+			timer_wheel_unlink(wheel, timer);
+			if(expires_us)
+				*expires_us = timer->expires_us;
+			if(timer->interval_us)
+			{
+				// skip intervals that have been missed completely instead of firing for each of them
+				timer->due_us += timer->interval_us;
+				if(timer->due_us <= now_us)
+					timer->due_us = now_us + timer->interval_us;
+				timer->expires_us = timer_wheel_apply_slack(timer->due_us, timer->slack_us);
+				timer_wheel_insert(wheel, timer);
+			}
+			else
+				wheel->count--;
+			return timer;
+		}
+
+		uint64_t step_us = timer_wheel_next_step(wheel);
+		if(step_us > now_us)
+		{
+			if(now_us > wheel->now_us)
+				wheel->now_us = now_us;
+			return NULL;
+		}
+		wheel->now_us = step_us;
+		timer_wheel_cascade(wheel);
+	}
+}
+
+CHIAKI_EXPORT size_t chiaki_timer_wheel_advance(ChiakiTimerWheel *wheel, uint64_t now_us)
+{
+	size_t fired = 0;
+	ChiakiTimerWheelTimer *timer;
+	while((timer = chiaki_timer_wheel_pop_expired(wheel, now_us, NULL)))
+	{
+		timer->cb(timer->user);
+		fired++;
+	}
+	return fired;
+}
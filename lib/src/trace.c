@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/trace.h>
+#include <chiaki/atomic.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+#define TRACE_RING_MASK (CHIAKI_TRACE_RING_SIZE - 1)
+
+// ring owner values besides generations
+#define TRACE_RING_FREE 0
+#define TRACE_RING_CLAIMING UINT32_MAX
+
+// stamps of the same frame index further apart than this belong to different frames after a wrap-around
+#define TRACE_FRAME_SPAN_MAX_US 5000000
+
+typedef struct trace_ring_t
+{
+	ChiakiAtomicU32 owner; // generation it was claimed in
+	ChiakiAtomicU64 head; // total number of events written, only by the owner
+	ChiakiTraceEvent *events;
+} TraceRing;
+
+static struct
+{
+	ChiakiAtomicU32 enabled;
+	ChiakiAtomicU32 generation; // never TRACE_RING_FREE or TRACE_RING_CLAIMING
+	ChiakiAtomicU32 dropped; // stamps of threads that found no free ring
+	ChiakiTraceEvent *events;
+	TraceRing rings[CHIAKI_TRACE_THREADS_MAX];
+} trace = { .generation = { 1 } };
+
+static TRACE_THREAD_LOCAL TraceRing *trace_thread_ring;
+static TRACE_THREAD_LOCAL uint32_t trace_thread_generation;
+
+CHIAKI_EXPORT const char *chiaki_trace_stage_string(ChiakiTraceStage stage)
+{
+	switch(stage)
+	{
+		case CHIAKI_TRACE_STAGE_FIRST_UNIT:
+			return "first unit";
+		case CHIAKI_TRACE_STAGE_LAST_UNIT:
+			return "last unit";
+		case CHIAKI_TRACE_STAGE_FEC_START:
+			return "fec start";
+		case CHIAKI_TRACE_STAGE_FEC_END:
+			return "fec end";
+		case CHIAKI_TRACE_STAGE_FLUSH:
+			return "flush";
+		case CHIAKI_TRACE_STAGE_DECODE_SUBMIT:
+			return "decode submit";
+		case CHIAKI_TRACE_STAGE_DECODE_OUTPUT:
+			return "decode output";
+		case CHIAKI_TRACE_STAGE_UPLOAD:
+			return "upload";
+		case CHIAKI_TRACE_STAGE_PRESENT:
+			return "present";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_enable(void)
+{
+	if(!trace.events)
+	{
+		trace.events = calloc(CHIAKI_TRACE_THREADS_MAX * CHIAKI_TRACE_RING_SIZE, sizeof(ChiakiTraceEvent));
+		if(!trace.events)
+			return CHIAKI_ERR_MEMORY;
+		for(size_t i=0; i<CHIAKI_TRACE_THREADS_MAX; i++)
+			trace.rings[i].events = trace.events + i * CHIAKI_TRACE_RING_SIZE;
+	}
+	chiaki_atomic_u32_store(&trace.enabled, 1);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_trace_disable(void)
+{
+	chiaki_atomic_u32_store(&trace.enabled, 0);
+}
+
+CHIAKI_EXPORT bool chiaki_trace_enabled(void)
+{
+	return chiaki_atomic_u32_load_relaxed(&trace.enabled) != 0;
+}
+
+CHIAKI_EXPORT bool chiaki_trace_clear(void)
+{
+	// a thread stamping into its ring must not find it claimed by another one
+	if(chiaki_atomic_u32_load(&trace.enabled))
+		return false;
+	uint32_t generation = chiaki_atomic_u32_load(&trace.generation) + 1;
+	if(generation == TRACE_RING_CLAIMING)
+		generation = TRACE_RING_FREE + 1;
+	// rings of older generations count as free, every thread claims a new one with its next stamp
+	chiaki_atomic_u32_store(&trace.generation, generation);
+	chiaki_atomic_u32_store(&trace.dropped, 0);
+	return true;
+}
+
+static TraceRing *trace_ring_claim(uint32_t generation)
+{
+	for(size_t i=0; i<CHIAKI_TRACE_THREADS_MAX; i++)
+	{
+		TraceRing *ring = &trace.rings[i];
+		uint32_t owner = chiaki_atomic_u32_load(&ring->owner);
+		if(owner == generation || owner == TRACE_RING_CLAIMING)
+			continue;
+		if(!chiaki_atomic_u32_compare_exchange(&ring->owner, owner, TRACE_RING_CLAIMING))
+			continue;
+		// readers skip the ring until it is published with the current generation
+		chiaki_atomic_u64_store(&ring->head, 0);
+		chiaki_atomic_u32_store_release(&ring->owner, generation);
+		return ring;
+	}
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_trace_stamp_at(ChiakiTraceStage stage, int32_t frame_index, uint64_t time_us)
+{
+	if(!chiaki_atomic_u32_load_relaxed(&trace.enabled) || frame_index < 0)
+		return;
+	uint32_t generation = chiaki_atomic_u32_load_acquire(&trace.generation);
+	TraceRing *ring = trace_thread_ring;
+	if(!ring || trace_thread_generation != generation)
+	{
+		ring = trace_ring_claim(generation);
+		if(!ring)
+		{
+			chiaki_atomic_u32_fetch_add(&trace.dropped, 1);
+			return;
+		}
+		trace_thread_ring = ring;
+		trace_thread_generation = generation;
+	}
+
+	// single writer, so only publishing the new head needs ordering
+	uint64_t head = chiaki_atomic_u64_load_relaxed(&ring->head);
+	ChiakiTraceEvent *event = &ring->events[head & TRACE_RING_MASK];
+	event->time_us = time_us;
+	event->frame_index = frame_index;
+	event->stage = (uint16_t)stage;
+	event->thread = (uint16_t)(ring - trace.rings);
+	chiaki_atomic_u64_store_release(&ring->head, head + 1);
+}
+
+CHIAKI_EXPORT void chiaki_trace_stamp(ChiakiTraceStage stage, int32_t frame_index)
+{
+	if(!chiaki_atomic_u32_load_relaxed(&trace.enabled) || frame_index < 0)
+		return;
+	chiaki_trace_stamp_at(stage, frame_index, chiaki_time_now_monotonic_us());
+}
+
+static int event_cmp_time(const void *a, const void *b)
+{
+	const ChiakiTraceEvent *ea = a, *eb = b;
+	if(ea->time_us != eb->time_us)
+		return ea->time_us < eb->time_us ? -1 : 1;
+	return ea->stage < eb->stage ? -1 : (ea->stage > eb->stage ? 1 : 0);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_snapshot(ChiakiTraceEvent **events, size_t *count)
+{
+	*events = NULL;
+	*count = 0;
+	if(!trace.events)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiTraceEvent *r = malloc(CHIAKI_TRACE_THREADS_MAX * CHIAKI_TRACE_RING_SIZE * sizeof(ChiakiTraceEvent));
+	if(!r)
+		return CHIAKI_ERR_MEMORY;
+
+	uint32_t generation = chiaki_atomic_u32_load_acquire(&trace.generation);
+	size_t r_count = 0;
+	for(size_t i=0; i<CHIAKI_TRACE_THREADS_MAX; i++)
+	{
+		TraceRing *ring = &trace.rings[i];
+		if(chiaki_atomic_u32_load_acquire(&ring->owner) != generation)
+			continue;
+		uint64_t head = chiaki_atomic_u64_load_acquire(&ring->head);
+		uint64_t tail = head > CHIAKI_TRACE_RING_SIZE ? head - CHIAKI_TRACE_RING_SIZE : 0;
+		size_t start = r_count;
+		for(uint64_t j=tail; j<head; j++)
+			r[r_count++] = ring->events[j & TRACE_RING_MASK];
+
+		// the owner kept writing while copying, drop what it may have overwritten in the meantime
+		uint64_t head_after = chiaki_atomic_u64_load_acquire(&ring->head);
+		if(head_after > CHIAKI_TRACE_RING_SIZE && head_after - CHIAKI_TRACE_RING_SIZE > tail)
+		{
+			uint64_t overwritten = head_after - CHIAKI_TRACE_RING_SIZE - tail;
+			if(overwritten > head - tail)
+				overwritten = head - tail;
+			memmove(r + start, r + start + overwritten, (size_t)(head - tail - overwritten) * sizeof(ChiakiTraceEvent));
+			r_count -= (size_t)overwritten;
+		}
+	}
+
+	if(!r_count)
+	{
+		free(r);
+		return CHIAKI_ERR_SUCCESS;
+	}
+	qsort(r, r_count, sizeof(ChiakiTraceEvent), event_cmp_time);
+	*events = r;
+	*count = r_count;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static int event_cmp_frame(const void *a, const void *b)
+{
+	const ChiakiTraceEvent *ea = a, *eb = b;
+	if(ea->frame_index != eb->frame_index)
+		return ea->frame_index < eb->frame_index ? -1 : 1;
+	return event_cmp_time(a, b);
+}
+
+/**
+ * @return a copy of events ordered by frame, then time, to be freed with free()
+ */
+static ChiakiTraceEvent *events_by_frame(const ChiakiTraceEvent *events, size_t count)
+{
+	ChiakiTraceEvent *r = malloc(count * sizeof(ChiakiTraceEvent));
+	if(!r)
+		return NULL;
+	memcpy(r, events, count * sizeof(ChiakiTraceEvent));
+	qsort(r, count, sizeof(ChiakiTraceEvent), event_cmp_frame);
+	return r;
+}
+
+/**
+ * @return number of events from first on that belong to the same frame in events ordered by events_by_frame()
+ */
+static size_t frame_events_count(const ChiakiTraceEvent *first, const ChiakiTraceEvent *end)
+{
+	const ChiakiTraceEvent *cur = first + 1;
+	while(cur < end && cur->frame_index == first->frame_index && cur->time_us - first->time_us <= TRACE_FRAME_SPAN_MAX_US)
+		cur++;
+	return (size_t)(cur - first);
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+static void stage_summary(ChiakiTraceStageSummary *summary, uint64_t *values, size_t count)
+{
+	memset(summary, 0, sizeof(*summary));
+	if(!count)
+		return;
+	qsort(values, count, sizeof(uint64_t), u64_cmp);
+	summary->count = count;
+	// nearest rank
+	summary->p50_us = values[(count * 50 + 99) / 100 - 1];
+	summary->p90_us = values[(count * 90 + 99) / 100 - 1];
+	summary->p99_us = values[(count * 99 + 99) / 100 - 1];
+	summary->max_us = values[count - 1];
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_summarize(const ChiakiTraceEvent *events, size_t count, ChiakiTraceSummary *summary)
+{
+	memset(summary, 0, sizeof(*summary));
+	if(!count)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiTraceEvent *by_frame = events_by_frame(events, count);
+	// one value per frame and stage at most, plus the totals
+	uint64_t *values = malloc((CHIAKI_TRACE_STAGE_COUNT + 1) * count * sizeof(uint64_t));
+	if(!by_frame || !values)
+	{
+		free(by_frame);
+		free(values);
+		return CHIAKI_ERR_MEMORY;
+	}
+	uint64_t *stage_values[CHIAKI_TRACE_STAGE_COUNT + 1];
+	size_t stage_counts[CHIAKI_TRACE_STAGE_COUNT + 1] = { 0 };
+	for(size_t i=0; i<=CHIAKI_TRACE_STAGE_COUNT; i++)
+		stage_values[i] = values + i * count;
+
+	const ChiakiTraceEvent *end = by_frame + count;
+	for(const ChiakiTraceEvent *cur = by_frame; cur < end;)
+	{
+		size_t n = frame_events_count(cur, end);
+		uint64_t stamps[CHIAKI_TRACE_STAGE_COUNT] = { 0 };
+		bool stamped[CHIAKI_TRACE_STAGE_COUNT] = { 0 };
+		// ordered by time, so the first stamp of each stage is the earliest
+		for(size_t i=0; i<n; i++)
+		{
+			uint16_t stage = cur[i].stage;
+			if(stage < CHIAKI_TRACE_STAGE_COUNT && !stamped[stage])
+			{
+				stamped[stage] = true;
+				stamps[stage] = cur[i].time_us;
+			}
+		}
+		cur += n;
+		summary->frames++;
+
+		int prev = -1;
+		for(int stage=0; stage<CHIAKI_TRACE_STAGE_COUNT; stage++)
+		{
+			if(!stamped[stage])
+				continue;
+			if(prev >= 0)
+				stage_values[stage][stage_counts[stage]++] = stamps[stage] > stamps[prev] ? stamps[stage] - stamps[prev] : 0;
+			prev = stage;
+		}
+		if(stamped[CHIAKI_TRACE_STAGE_FIRST_UNIT] && prev > CHIAKI_TRACE_STAGE_FIRST_UNIT)
+			stage_values[CHIAKI_TRACE_STAGE_COUNT][stage_counts[CHIAKI_TRACE_STAGE_COUNT]++] =
+				stamps[prev] - stamps[CHIAKI_TRACE_STAGE_FIRST_UNIT];
+	}
+
+	for(size_t i=0; i<CHIAKI_TRACE_STAGE_COUNT; i++)
+		stage_summary(&summary->stages[i], stage_values[i], stage_counts[i]);
+	stage_summary(&summary->total, stage_values[CHIAKI_TRACE_STAGE_COUNT], stage_counts[CHIAKI_TRACE_STAGE_COUNT]);
+
+	free(values);
+	free(by_frame);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void stage_summary_log(ChiakiLog *log, const char *name, const ChiakiTraceStageSummary *summary)
+{
+	CHIAKI_LOGI(log, "  %-14s %7llu %9.2f %9.2f %9.2f %9.2f", name, (unsigned long long)summary->count,
+			(double)summary->p50_us / 1000.0, (double)summary->p90_us / 1000.0,
+			(double)summary->p99_us / 1000.0, (double)summary->max_us / 1000.0);
+}
+
+CHIAKI_EXPORT void chiaki_trace_summary_log(const ChiakiTraceSummary *summary, ChiakiLog *log)
+{
+	CHIAKI_LOGI(log, "Trace of %llu frames, ms since the previous stage:", (unsigned long long)summary->frames);
+	CHIAKI_LOGI(log, "  %-14s %7s %9s %9s %9s %9s", "stage", "frames", "p50", "p90", "p99", "max");
+	for(int i=CHIAKI_TRACE_STAGE_FIRST_UNIT + 1; i<CHIAKI_TRACE_STAGE_COUNT; i++)
+	{
+		if(summary->stages[i].count)
+			stage_summary_log(log, chiaki_trace_stage_string(i), &summary->stages[i]);
+	}
+	stage_summary_log(log, "total", &summary->total);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_write_chrome_json(const ChiakiTraceEvent *events, size_t count, const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if(!f)
+		return CHIAKI_ERR_UNKNOWN;
+
+	ChiakiTraceEvent *by_frame = NULL;
+	if(count)
+	{
+		by_frame = events_by_frame(events, count);
+		if(!by_frame)
+		{
+			fclose(f);
+			return CHIAKI_ERR_MEMORY;
+		}
+	}
+
+	uint64_t base_us = count ? events[0].time_us : 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"chiaki\"}}");
+
+	bool thread_named[CHIAKI_TRACE_THREADS_MAX] = { 0 };
+	for(size_t i=0; i<count; i++)
+	{
+		const ChiakiTraceEvent *event = &events[i];
+		if(event->thread < CHIAKI_TRACE_THREADS_MAX && !thread_named[event->thread])
+		{
+			thread_named[event->thread] = true;
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+					(unsigned int)event->thread, (unsigned int)event->thread);
+		}
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"frame\":%d}}",
+				chiaki_trace_stage_string(event->stage), (unsigned long long)(event->time_us - base_us),
+				(unsigned int)event->thread, (int)event->frame_index);
+	}
+
+	const ChiakiTraceEvent *end = by_frame + count;
+	uint64_t span_id = 0;
+	for(const ChiakiTraceEvent *cur = by_frame; cur < end;)
+	{
+		size_t n = frame_events_count(cur, end);
+		const ChiakiTraceEvent *last = cur + n - 1;
+		fprintf(f, ",\n{\"name\":\"frame %d\",\"cat\":\"frame\",\"ph\":\"b\",\"id\":%llu,\"ts\":%llu,\"pid\":1,\"tid\":%u}"
+				",\n{\"name\":\"frame %d\",\"cat\":\"frame\",\"ph\":\"e\",\"id\":%llu,\"ts\":%llu,\"pid\":1,\"tid\":%u}",
+				(int)cur->frame_index, (unsigned long long)span_id, (unsigned long long)(cur->time_us - base_us), (unsigned int)cur->thread,
+				(int)cur->frame_index, (unsigned long long)span_id, (unsigned long long)(last->time_us - base_us), (unsigned int)cur->thread);
+		span_id++;
+		cur += n;
+	}
+	fprintf(f, "\n]}\n");
+	free(by_frame);
+
+	bool failed = ferror(f) != 0;
+	if(fclose(f) != 0)
+		failed = true;
+	return failed ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_report(const char *filename, ChiakiLog *log)
+{
+	ChiakiTraceEvent *events;
+	size_t count;
+	ChiakiErrorCode err = chiaki_trace_snapshot(&events, &count);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	uint32_t dropped = chiaki_atomic_u32_load(&trace.dropped);
+	if(dropped)
+		CHIAKI_LOGW(log, "Trace dropped %u stamps because more than %d threads recorded", (unsigned int)dropped, CHIAKI_TRACE_THREADS_MAX);
+
+	if(filename)
+	{
+		err = chiaki_trace_write_chrome_json(events, count, filename);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGE(log, "Failed to write trace to %s", filename);
+		else
+			CHIAKI_LOGI(log, "Wrote %llu trace events to %s", (unsigned long long)count, filename);
+	}
+
+	ChiakiTraceSummary summary;
+	ChiakiErrorCode summary_err = chiaki_trace_summarize(events, count, &summary);
+	if(summary_err == CHIAKI_ERR_SUCCESS)
+		chiaki_trace_summary_log(&summary, log);
+	else if(err == CHIAKI_ERR_SUCCESS)
+		err = summary_err;
+	free(events);
+	return err;
+}
@@ -104,6 +104,15 @@ static inline void xor_bytes(uint8_t *dst, uint8_t *src, size_t sz)
 	}
 }
 
+/**
+ * dst = a ^ b, dst may be the same as a or b
+ */
+static inline void xor_bytes_to(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t sz)
+{
+	for(size_t i=0; i<sz; i++)
+		dst[i] = a[i] ^ b[i];
+}
+
 static inline int8_t nibble_value(char c)
 {
 	if(c >= '0' && c <= '9')
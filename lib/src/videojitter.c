@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videojitter.h>
+
+#include <string.h>
+
+// per-frame weight of the reorder rate and decay of the lateness peak, both as shifts
+#define REORDER_RATE_SHIFT 6
+#define LATENESS_DECAY_SHIFT 6
+
+CHIAKI_EXPORT void chiaki_video_jitter_init(ChiakiVideoJitter *jitter, uint64_t hold_max_us)
+{
+	memset(jitter, 0, sizeof(*jitter));
+	jitter->hold_max_us = hold_max_us;
+}
+
+CHIAKI_EXPORT void chiaki_video_jitter_frame_start(ChiakiVideoJitter *jitter, uint64_t now_us)
+{
+	if(jitter->frame_start_prev_us && now_us >= jitter->frame_start_prev_us)
+	{
+		uint64_t interval = now_us - jitter->frame_start_prev_us;
+		if(jitter->frame_interval_prev_us)
+		{
+			uint64_t d = interval > jitter->frame_interval_prev_us
+				? interval - jitter->frame_interval_prev_us
+				: jitter->frame_interval_prev_us - interval;
+			// J += (|D| - J) / 16
+			jitter->jitter_us_q4 += d - (jitter->jitter_us_q4 >> 4);
+		}
+		jitter->frame_interval_prev_us = interval;
+	}
+	jitter->frame_start_prev_us = now_us;
+
+	jitter->reorder_rate_q16 -= jitter->reorder_rate_q16 >> REORDER_RATE_SHIFT;
+	if(jitter->frame_had_late_packets)
+		jitter->reorder_rate_q16 += 65536 >> REORDER_RATE_SHIFT;
+	jitter->frame_had_late_packets = false;
+
+	jitter->lateness_us -= jitter->lateness_us >> LATENESS_DECAY_SHIFT;
+}
+
+CHIAKI_EXPORT void chiaki_video_jitter_late_packet(ChiakiVideoJitter *jitter, uint64_t lateness_us, bool rescued)
+{
+	jitter->stats.packets_late++;
+	if(rescued)
+		jitter->stats.packets_rescued++;
+	jitter->frame_had_late_packets = true;
+	if(lateness_us > jitter->lateness_us)
+		jitter->lateness_us = lateness_us;
+}
+
+CHIAKI_EXPORT void chiaki_video_jitter_frame_held(ChiakiVideoJitter *jitter, uint64_t held_us, bool completed)
+{
+	jitter->stats.frames_held++;
+	if(completed)
+		jitter->stats.frames_completed_while_held++;
+	jitter->stats.hold_us_sum += held_us;
+	if(held_us > jitter->stats.hold_us_max)
+		jitter->stats.hold_us_max = held_us;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_video_jitter_hold_us(ChiakiVideoJitter *jitter)
+{
+	if(!jitter->hold_max_us || jitter->reorder_rate_q16 < CHIAKI_VIDEO_JITTER_REORDER_RATE_THRESHOLD)
+		return 0;
+	uint64_t hold = jitter->lateness_us + 2 * chiaki_video_jitter_us(jitter);
+	if(hold < CHIAKI_VIDEO_JITTER_HOLD_MIN_US)
+		hold = CHIAKI_VIDEO_JITTER_HOLD_MIN_US;
+	if(hold > jitter->hold_max_us)
+		hold = jitter->hold_max_us;
+	return hold;
+}
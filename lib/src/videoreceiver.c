@@ -2,12 +2,16 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
+#include <chiaki/trace.h>
 
 #include <string.h>
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiFrameProcessor *frame_processor, int32_t frame_index, uint64_t last_unit_us);
+static bool chiaki_video_receiver_sample(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrame *frame);
+static void video_receiver_send_corrupt_frame(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user);
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	video_receiver->session = session;
 	video_receiver->log = session->log;
@@ -19,8 +23,27 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->frame_index_prev = -1;
 	video_receiver->frame_index_prev_complete = 0;
 
+	video_receiver->frame_pool = chiaki_frame_pool_new(video_receiver->log, CHIAKI_FRAME_POOL_FRAMES_MAX);
+	if(!video_receiver->frame_pool)
+		return CHIAKI_ERR_MEMORY;
+
 	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
+	chiaki_frame_processor_set_frame_pool(&video_receiver->frame_processor, video_receiver->frame_pool);
+	chiaki_frame_processor_init(&video_receiver->frame_processor_held, video_receiver->log);
+	chiaki_frame_processor_set_frame_pool(&video_receiver->frame_processor_held, video_receiver->frame_pool);
+	video_receiver->frame_index_held = -1;
+	video_receiver->held_since_us = 0;
+	video_receiver->held_last_unit_us = 0;
+	video_receiver->held_deadline_us = 0;
+	video_receiver->frame_start_us = 0;
+	video_receiver->frame_last_unit_us = 0;
+	chiaki_video_jitter_init(&video_receiver->jitter, (uint64_t)session->connect_info.video_jitter_buffer_max_ms * 1000);
 	video_receiver->packet_stats = packet_stats;
+	video_receiver->av_pipeline = NULL;
+	video_receiver->corrupt_frame_cb = video_receiver_send_corrupt_frame;
+	video_receiver->corrupt_frame_cb_user = &session->stream_connection;
+	memset(&video_receiver->stats, 0, sizeof(video_receiver->stats));
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
@@ -28,6 +51,24 @@ CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receive
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
 	chiaki_frame_processor_fini(&video_receiver->frame_processor);
+	chiaki_frame_processor_fini(&video_receiver->frame_processor_held);
+
+	ChiakiVideoReceiverStats *stats = &video_receiver->stats;
+	CHIAKI_LOGI(video_receiver->log, "Video Receiver: %llu frames, %llu recovered by FEC, %llu incomplete, %llu failed",
+			(unsigned long long)stats->frames, (unsigned long long)stats->frames_fec_recovered,
+			(unsigned long long)stats->frames_fec_failed, (unsigned long long)stats->frames_failed);
+
+	ChiakiVideoJitterStats *jitter_stats = &video_receiver->jitter.stats;
+	if(video_receiver->jitter.hold_max_us)
+		CHIAKI_LOGI(video_receiver->log, "Video Jitter Buffer: %llu late packets, %llu rescued, %llu frames held, %llu completed while held, added latency avg %llu us, max %llu us",
+				(unsigned long long)jitter_stats->packets_late,
+				(unsigned long long)jitter_stats->packets_rescued,
+				(unsigned long long)jitter_stats->frames_held,
+				(unsigned long long)jitter_stats->frames_completed_while_held,
+				(unsigned long long)(jitter_stats->frames_held ? jitter_stats->hold_us_sum / jitter_stats->frames_held : 0),
+				(unsigned long long)jitter_stats->hold_us_max);
+
+	chiaki_frame_pool_free(video_receiver->frame_pool);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
@@ -50,13 +91,74 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	}
 }
 
-CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+static void video_receiver_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
 {
-	// old frame?
+	if(gkcrypt)
+		chiaki_frame_processor_put_unit_encrypted(frame_processor, packet, gkcrypt, key_pos);
+	else
+		chiaki_frame_processor_put_unit(frame_processor, packet);
+}
+
+/**
+ * Request a new keyframe if frames before frame_index have been lost or could not be completed.
+ */
+static void video_receiver_check_missing(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
+	if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
+		&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
+	{
+		CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+		video_receiver->corrupt_frame_cb(next_frame_expected, frame_index - 1, video_receiver->corrupt_frame_cb_user);
+	}
+}
+
+static void video_receiver_send_corrupt_frame(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user)
+{
+	stream_connection_send_corrupt_frame(user, start, end);
+}
+
+static void video_receiver_flush_held(ChiakiVideoReceiver *video_receiver, uint64_t now_us, bool completed)
+{
+	int32_t frame_index = video_receiver->frame_index_held;
+	video_receiver->frame_index_held = -1;
+	if(video_receiver->packet_stats)
+		chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor_held, video_receiver->packet_stats);
+	chiaki_video_receiver_flush_frame(video_receiver, &video_receiver->frame_processor_held, frame_index, video_receiver->held_last_unit_us);
+	chiaki_video_jitter_frame_held(&video_receiver->jitter, now_us - video_receiver->held_since_us, completed);
+	video_receiver_check_missing(video_receiver, (ChiakiSeqNum16)(frame_index + 1));
+}
+
+/**
+ * @param gkcrypt if not NULL, packet->data is encrypted at key_pos
+ */
+static void video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
 	ChiakiSeqNum16 frame_index = packet->frame_index;
+
+	// late packet for the frame that is being held back for it?
+	if(video_receiver->frame_index_held >= 0 && frame_index == (ChiakiSeqNum16)video_receiver->frame_index_held)
+	{
+		chiaki_video_jitter_late_packet(&video_receiver->jitter, now - video_receiver->held_since_us, true);
+		video_receiver_put_unit(&video_receiver->frame_processor_held, packet, gkcrypt, key_pos);
+		video_receiver->held_last_unit_us = now;
+		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor_held))
+			video_receiver_flush_held(video_receiver, now, true);
+		return;
+	}
+
+	if(video_receiver->frame_index_held >= 0 && now >= video_receiver->held_deadline_us)
+		video_receiver_flush_held(video_receiver, now, false);
+
+	// old frame?
 	if(video_receiver->frame_index_cur >= 0
 		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
 	{
+		// only reordering that actually cost a frame matters for holding
+		if(frame_index == (ChiakiSeqNum16)(video_receiver->frame_index_cur - 1)
+			&& frame_index != (ChiakiSeqNum16)video_receiver->frame_index_prev_complete)
+			chiaki_video_jitter_late_packet(&video_receiver->jitter, now - video_receiver->frame_start_us, false);
 		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
 		return;
 	}
@@ -73,53 +175,139 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 		}
 		video_receiver->profile_cur = packet->adaptive_stream_index;
 
+		if(video_receiver->frame_index_held >= 0)
+			video_receiver_flush_held(video_receiver, now, false);
+
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, video_receiver->session->video_sample_cb_user);
+		ChiakiVideoFrame *header = chiaki_frame_pool_acquire(video_receiver->frame_pool, profile->header_sz);
+		if(header)
+		{
+			memcpy(header->buf, profile->header, profile->header_sz);
+			header->frame_index = -1;
+			chiaki_video_receiver_sample(video_receiver, header);
+			chiaki_video_frame_unref(header);
+		}
 	}
 
 	// next frame?
 	if(video_receiver->frame_index_cur < 0 ||
 		chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
 	{
-		if(video_receiver->packet_stats)
-			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+		chiaki_video_jitter_frame_start(&video_receiver->jitter, now);
+		video_receiver->frame_start_us = now;
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FIRST_UNIT, frame_index, now);
+
+		// frames must be handed out in order
+		if(video_receiver->frame_index_held >= 0)
+			video_receiver_flush_held(video_receiver, now, false);
 
+		bool hold = false;
 		// last frame not flushed yet?
 		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
-			chiaki_video_receiver_flush_frame(video_receiver);
-
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
-			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
 		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
+			// hold it back for its late packets instead, if reordering has been observed recently
+			uint64_t hold_us = chiaki_video_jitter_hold_us(&video_receiver->jitter);
+			if(hold_us && frame_index == (ChiakiSeqNum16)(video_receiver->frame_index_cur + 1))
+			{
+				ChiakiFrameProcessor tmp = video_receiver->frame_processor_held;
+				video_receiver->frame_processor_held = video_receiver->frame_processor;
+				video_receiver->frame_processor = tmp;
+				video_receiver->frame_index_held = video_receiver->frame_index_cur;
+				video_receiver->held_since_us = now;
+				video_receiver->held_last_unit_us = video_receiver->frame_last_unit_us;
+				video_receiver->held_deadline_us = now + hold_us;
+				hold = true;
+			}
+			else
+			{
+				if(video_receiver->packet_stats)
+					chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+				chiaki_video_receiver_flush_frame(video_receiver, &video_receiver->frame_processor, video_receiver->frame_index_cur,
+						video_receiver->frame_last_unit_us);
+			}
 		}
+		else if(video_receiver->packet_stats)
+			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+
+		// a held frame is checked once it is flushed
+		video_receiver_check_missing(video_receiver, hold ? (ChiakiSeqNum16)video_receiver->frame_index_held : frame_index);
 
 		video_receiver->frame_index_cur = frame_index;
-		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
+		if(gkcrypt)
+			chiaki_frame_processor_alloc_frame_encrypted(&video_receiver->frame_processor, packet, gkcrypt, key_pos);
+		else
+			chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
 	}
 
-	chiaki_frame_processor_put_unit(&video_receiver->frame_processor, packet);
+	video_receiver_put_unit(&video_receiver->frame_processor, packet, gkcrypt, key_pos);
+	video_receiver->frame_last_unit_us = now;
 
 	// if we are currently building up a frame
 	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
 	{
 		// if we already have enough for the whole frame, flush it already
 		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor))
-			chiaki_video_receiver_flush_frame(video_receiver);
+		{
+			if(video_receiver->frame_index_held >= 0)
+				video_receiver_flush_held(video_receiver, now, false);
+			chiaki_video_receiver_flush_frame(video_receiver, &video_receiver->frame_processor, video_receiver->frame_index_cur,
+					video_receiver->frame_last_unit_us);
+		}
 	}
 }
 
+CHIAKI_EXPORT uint64_t chiaki_video_receiver_deadline_us(ChiakiVideoReceiver *video_receiver)
+{
+	return video_receiver->frame_index_held >= 0 ? video_receiver->held_deadline_us : UINT64_MAX;
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_expire(ChiakiVideoReceiver *video_receiver)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	if(video_receiver->frame_index_held >= 0 && now >= video_receiver->held_deadline_us)
+		video_receiver_flush_held(video_receiver, now, false);
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+{
+	video_receiver_av_packet(video_receiver, packet, NULL, 0);
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_av_packet_encrypted(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet, ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	video_receiver_av_packet(video_receiver, packet, gkcrypt, key_pos);
+}
+
 #define FLUSH_CORRUPT_FRAMES
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiFrameProcessor *frame_processor, int32_t frame_index, uint64_t last_unit_us)
 {
-	uint8_t *frame;
-	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	bool trace = chiaki_trace_enabled();
+	uint64_t flush_start_us = 0;
+	if(trace)
+	{
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_LAST_UNIT, frame_index, last_unit_us);
+		flush_start_us = chiaki_time_now_monotonic_us();
+	}
+
+	// the frame processor assembles the frame in a pooled frame, which can be passed on without copying
+	ChiakiVideoFrame *frame = NULL;
+	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush_frame(frame_processor, &frame);
+
+	if(trace && (flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS || flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED))
+	{
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FEC_START, frame_index, flush_start_us);
+		chiaki_trace_stamp(CHIAKI_TRACE_STAGE_FEC_END, frame_index);
+	}
+
+	video_receiver->stats.frames++;
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+		video_receiver->stats.frames_fec_recovered++;
+	else if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+		video_receiver->stats.frames_fec_failed++;
+	else if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		video_receiver->stats.frames_failed++;
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 #ifndef FLUSH_CORRUPT_FRAMES
@@ -127,7 +315,9 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 #endif
 		)
 	{
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
+		if(frame)
+			chiaki_video_frame_unref(frame);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
@@ -135,20 +325,41 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 
-	if(video_receiver->session->video_sample_cb)
+	frame->frame_index = frame_index;
+	chiaki_trace_stamp(CHIAKI_TRACE_STAGE_FLUSH, frame_index);
+	bool sample_succ = chiaki_video_receiver_sample(video_receiver, frame);
+	chiaki_video_frame_unref(frame);
+	if(!sample_succ)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->session->video_sample_cb_user);
-		if(!cb_succ)
-		{
-			succ = false;
-			CHIAKI_LOGW(video_receiver->log, "Video callback did not process frame successfully.");
-		}
+		succ = false;
+		CHIAKI_LOGW(video_receiver->log, "Video callback did not process frame successfully.");
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+	video_receiver->frame_index_prev = frame_index;
 
 	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
+		video_receiver->frame_index_prev_complete = frame_index;
 
 	return CHIAKI_ERR_SUCCESS;
 }
+
+/**
+ * Pass a frame on to the session's video sink, either directly or through the decode stage of the pipeline.
+ * In the latter case, decoding failures are reported asynchronously by the decode stage.
+ */
+static bool chiaki_video_receiver_sample(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrame *frame)
+{
+	if(video_receiver->av_pipeline)
+		return chiaki_av_pipeline_push_frame(video_receiver->av_pipeline, frame);
+	return chiaki_video_receiver_sink_frame(video_receiver, frame);
+}
+
+CHIAKI_EXPORT bool chiaki_video_receiver_sink_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrame *frame)
+{
+	ChiakiSession *session = video_receiver->session;
+	if(session->video_frame_cb)
+		return session->video_frame_cb(frame, session->video_frame_cb_user);
+	if(session->video_sample_cb)
+		return session->video_sample_cb(frame->buf, frame->buf_size, session->video_sample_cb_user);
+	return true;
+}
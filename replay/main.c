@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/session.h>
+#include <chiaki/capture.h>
+#include <chiaki/time.h>
+#include <chiaki/trace.h>
+#include <chiaki/config.h>
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+#include <chiaki/ffmpegdecoder.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+typedef struct replay_t
+{
+	ChiakiLog log;
+	bool realtime;
+	uint64_t frames;
+	uint64_t frames_bytes;
+	uint64_t frames_rejected;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	bool decode;
+	ChiakiFfmpegDecoder decoder;
+#endif
+} Replay;
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options] <capture file>\n"
+			"Play back a stream captured with --capture through Takion, StreamConnection and the frame processor.\n\n"
+			"  --realtime   deliver datagrams with their captured timing instead of as fast as possible\n"
+			"  --pipeline   process AV packets on the AV pipeline threads instead of inline on the Takion thread\n"
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+			"  --decode     decode the video with FFmpeg\n"
+#endif
+			"  --trace FILE record per-frame latency, print a summary and write a Chrome trace to FILE\n"
+			"  --verbose    log everything\n", argv0);
+}
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+static void replay_decoder_frame_available(ChiakiFfmpegDecoder *decoder, void *user)
+{
+	AVFrame *frame;
+	while((frame = chiaki_ffmpeg_decoder_pull_frame(decoder)))
+		av_frame_free(&frame);
+}
+#endif
+
+static bool replay_video_frame(ChiakiVideoFrame *frame, void *user)
+{
+	Replay *replay = user;
+	replay->frames++;
+	replay->frames_bytes += frame->buf_size;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(replay->decode)
+	{
+		if(!chiaki_ffmpeg_decoder_video_frame_cb(frame, &replay->decoder))
+		{
+			replay->frames_rejected++;
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+static void replay_event(ChiakiEvent *event, void *user)
+{
+	Replay *replay = user;
+	if(event->type == CHIAKI_EVENT_CONNECTED)
+		CHIAKI_LOGI(&replay->log, "Replay reached the streaming state");
+}
+
+int main(int argc, char *argv[])
+{
+	Replay replay;
+	memset(&replay, 0, sizeof(replay));
+	bool pipeline = false;
+	bool verbose = false;
+	const char *filename = NULL;
+	const char *trace_filename = NULL;
+	for(int i=1; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "--realtime"))
+			replay.realtime = true;
+		else if(!strcmp(argv[i], "--pipeline"))
+			pipeline = true;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+		else if(!strcmp(argv[i], "--decode"))
+			replay.decode = true;
+#endif
+		else if(!strcmp(argv[i], "--trace") && i + 1 < argc)
+			trace_filename = argv[++i];
+		else if(!strcmp(argv[i], "--verbose"))
+			verbose = true;
+		else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else if(argv[i][0] != '-' && !filename)
+			filename = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!filename)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	chiaki_log_init(&replay.log, verbose ? CHIAKI_LOG_ALL : (CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG)), chiaki_log_cb_print, NULL);
+
+	ChiakiCaptureReader reader;
+	ChiakiErrorCode err = chiaki_capture_reader_init(&reader, &replay.log, filename);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return 1;
+	printf("Capture: %s, target %d, codec %d, %llu datagrams, %llu bytes, %.3f s\n",
+			filename, (int)reader.info.target, (int)reader.info.codec,
+			(unsigned long long)reader.datagrams_count, (unsigned long long)reader.datagrams_bytes,
+			(double)reader.duration_us / 1000000.0);
+
+	int ret = 1;
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.ps5 = chiaki_target_is_ps5(reader.info.target);
+	connect_info.host = "127.0.0.1"; // never connected to
+	connect_info.video_profile.codec = reader.info.codec;
+	connect_info.disable_av_pipeline = !pipeline;
+
+	ChiakiSession session;
+	err = chiaki_session_init(&session, &connect_info, &replay.log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Session init failed: %s\n", chiaki_error_string(err));
+		goto error_reader;
+	}
+	session.target = reader.info.target;
+	chiaki_session_set_event_cb(&session, replay_event, &replay);
+	chiaki_session_set_video_frame_cb(&session, replay_video_frame, &replay);
+
+	if(trace_filename)
+	{
+		chiaki_trace_clear();
+		err = chiaki_trace_enable();
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			fprintf(stderr, "Failed to enable tracing: %s\n", chiaki_error_string(err));
+			goto error_session;
+		}
+	}
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(replay.decode)
+	{
+		err = chiaki_ffmpeg_decoder_init(&replay.decoder, &replay.log, reader.info.codec, NULL,
+				CHIAKI_FFMPEG_DECODER_PROFILE_DEFAULT, replay_decoder_frame_available, &replay);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			fprintf(stderr, "FFmpeg decoder init failed: %s\n", chiaki_error_string(err));
+			goto error_trace;
+		}
+		// flat-out, frames come in much faster than they can be decoded, so wait instead of dropping them
+		if(!replay.realtime)
+			chiaki_ffmpeg_decoder_set_submit_timeout(&replay.decoder, UINT64_MAX);
+	}
+#endif
+
+	chiaki_stream_connection_set_replay(&session.stream_connection, &reader, replay.realtime);
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_stream_connection_run(&session.stream_connection);
+	uint64_t elapsed_us = chiaki_time_now_monotonic_us() - start_us;
+
+	ChiakiTakionRecvStats recv_stats;
+	chiaki_takion_get_recv_stats(&session.stream_connection.takion, &recv_stats);
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(replay.decode)
+	{
+		// fini drains the packet queue, so all frames are decoded when it returns
+		chiaki_ffmpeg_decoder_fini(&replay.decoder);
+		elapsed_us = chiaki_time_now_monotonic_us() - start_us;
+	}
+#endif
+
+	if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_DISCONNECTED)
+	{
+		fprintf(stderr, "Replay failed: %s\n", chiaki_error_string(err));
+		goto error_trace;
+	}
+
+	double elapsed_s = (double)elapsed_us / 1000000.0;
+	printf("Replayed %llu datagrams in %.3f s (%.2fx capture speed): %.0f packets/s, %.1f Mbit/s\n",
+			(unsigned long long)recv_stats.packets, elapsed_s,
+			elapsed_us ? (double)reader.duration_us / (double)elapsed_us : 0.0,
+			elapsed_s > 0.0 ? (double)recv_stats.packets / elapsed_s : 0.0,
+			elapsed_s > 0.0 ? (double)reader.datagrams_bytes * 8.0 / elapsed_s / 1000000.0 : 0.0);
+	printf("Frames: %llu, %llu bytes, %.1f frames/s, %llu rejected by the sink\n",
+			(unsigned long long)replay.frames, (unsigned long long)replay.frames_bytes,
+			elapsed_s > 0.0 ? (double)replay.frames / elapsed_s : 0.0,
+			(unsigned long long)replay.frames_rejected);
+	ret = 0;
+
+error_trace:
+	if(trace_filename)
+	{
+		chiaki_trace_disable();
+		chiaki_trace_report(trace_filename, &replay.log);
+	}
+error_session:
+	chiaki_session_fini(&session);
+error_reader:
+	chiaki_capture_reader_fini(&reader);
+	return ret;
+}
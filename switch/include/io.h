@@ -46,6 +46,7 @@ extern "C"
 
 #include <chiaki/controller.h>
 #include <chiaki/log.h>
+#include <chiaki/ffmpegdecoder.h>
 
 #include "exception.h"
 
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/audioreceiver.h>
+#include <chiaki/session.h>
+
+#include "test_log.h"
+
+#define UNIT_SIZE 4
+#define FEC_UNITS 2
+#define SINK_FRAMES_MAX 64
+
+typedef struct audio_sink_record_t
+{
+	uint8_t frames[SINK_FRAMES_MAX]; // first byte of each frame, 0 for a lost one
+	size_t frames_count;
+	size_t lost_calls;
+} AudioSinkRecord;
+
+static void sink_frame(uint8_t *buf, size_t buf_size, void *user)
+{
+	AudioSinkRecord *record = user;
+	munit_assert_size(buf_size, ==, UNIT_SIZE);
+	munit_assert_size(record->frames_count, <, SINK_FRAMES_MAX);
+	record->frames[record->frames_count++] = buf[0];
+}
+
+static void sink_frame_lost(size_t frames_count, uint8_t *next_buf, size_t next_buf_size, void *user)
+{
+	AudioSinkRecord *record = user;
+	munit_assert_size(next_buf_size, ==, UNIT_SIZE);
+	munit_assert_size(frames_count, <=, CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX);
+	record->lost_calls++;
+	for(size_t i=0; i<frames_count; i++)
+	{
+		munit_assert_size(record->frames_count, <, SINK_FRAMES_MAX);
+		record->frames[record->frames_count++] = 0;
+	}
+}
+
+/**
+ * Send the packet for frame_index, containing it as source unit and the FEC_UNITS frames before it.
+ */
+static void send_packet(ChiakiAudioReceiver *receiver, ChiakiSeqNum16 frame_index)
+{
+	uint8_t data[UNIT_SIZE * (1 + FEC_UNITS)];
+	data[0] = (uint8_t)frame_index;
+	for(size_t i=0; i<FEC_UNITS; i++)
+		data[UNIT_SIZE * (1 + i)] = (uint8_t)(frame_index - FEC_UNITS + i);
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.codec = 5;
+	packet.frame_index = frame_index;
+	packet.units_in_frame_total = 1 + FEC_UNITS;
+	packet.units_in_frame_fec = (UNIT_SIZE << 8) | (FEC_UNITS << 4) | 1;
+	packet.data = data;
+	packet.data_size = sizeof(data);
+	chiaki_audio_receiver_av_packet(receiver, &packet);
+}
+
+static MunitResult test_audio_receiver_gaps(const MunitParameter params[], void *user)
+{
+	static ChiakiSession session;
+	memset(&session, 0, sizeof(session));
+	session.log = get_test_log();
+	AudioSinkRecord record = { 0 };
+	ChiakiAudioSink sink = { &record, NULL, sink_frame, sink_frame_lost };
+	chiaki_session_set_audio_sink(&session, &sink);
+
+	ChiakiAudioReceiver receiver;
+	ChiakiErrorCode err = chiaki_audio_receiver_init(&receiver, &session, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// packets 4 and 7, 8 are lost, their frames come from the fec units of the following packets
+	// 12, 13, 14 are lost, 12 can not be recovered anymore
+	// 18 arrives late, after 19 has already filled it in
+	static const ChiakiSeqNum16 packets[] = { 1, 2, 3, 5, 6, 9, 10, 11, 15, 16, 17, 19, 18, 20 };
+	for(size_t i=0; i<sizeof(packets) / sizeof(packets[0]); i++)
+		send_packet(&receiver, packets[i]);
+
+	munit_assert_size(record.frames_count, ==, 20);
+	for(size_t i=0; i<20; i++)
+		munit_assert_uint8(record.frames[i], ==, i + 1 == 12 ? 0 : i + 1);
+	munit_assert_size(record.lost_calls, ==, 1);
+	munit_assert_uint64(receiver.frames_lost, ==, 1);
+
+	// long gaps are reported as a limited number of lost frames
+	send_packet(&receiver, 100);
+	munit_assert_size(record.frames_count, ==, 20 + CHIAKI_AUDIO_RECEIVER_LOST_FRAMES_MAX + FEC_UNITS + 1);
+	munit_assert_uint8(record.frames[record.frames_count - 1], ==, 100);
+	munit_assert_uint64(receiver.frames_lost, ==, 1 + (100 - FEC_UNITS) - 21);
+
+	chiaki_audio_receiver_fini(&receiver);
+	return MUNIT_OK;
+}
+
+MunitTest tests_audio_receiver[] = {
+	{
+		"/gaps",
+		test_audio_receiver_gaps,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
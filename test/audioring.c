@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/audioring.h>
+
+#define CHANNELS 2
+#define RATE 48000
+#define TARGET_MS 40
+#define TARGET_FRAMES (RATE * TARGET_MS / 1000)
+
+static void fill_ramp(int16_t *pcm, size_t frames_count, int16_t start)
+{
+	for(size_t i=0; i<frames_count; i++)
+	{
+		pcm[i * CHANNELS] = (int16_t)(start + i);
+		pcm[i * CHANNELS + 1] = (int16_t)-(start + i);
+	}
+}
+
+static MunitResult test_audio_ring_basic(const MunitParameter params[], void *user)
+{
+	ChiakiAudioRing ring;
+	ChiakiErrorCode err = chiaki_audio_ring_init(&ring, CHANNELS, RATE, TARGET_MS);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	static int16_t in[TARGET_FRAMES * 8 * CHANNELS];
+	static int16_t out[TARGET_FRAMES * CHANNELS];
+
+	// nothing is played until the target is reached
+	fill_ramp(in, TARGET_FRAMES, 1);
+	munit_assert_size(chiaki_audio_ring_write(&ring, in, TARGET_FRAMES / 2), ==, TARGET_FRAMES / 2);
+	memset(out, 0x42, sizeof(out));
+	chiaki_audio_ring_read(&ring, out, 100);
+	for(size_t i=0; i<100 * CHANNELS; i++)
+		munit_assert_int16(out[i], ==, 0);
+
+	// exactly at the target, the data passes through unchanged
+	munit_assert_size(chiaki_audio_ring_write(&ring, in + TARGET_FRAMES / 2 * CHANNELS, TARGET_FRAMES / 2 + 1), ==, TARGET_FRAMES / 2 + 1);
+	chiaki_audio_ring_read(&ring, out, 100);
+	munit_assert_memory_equal(100 * CHANNELS * sizeof(int16_t), out, in);
+
+	// running empty pads with silence and waits for the target again
+	chiaki_audio_ring_read(&ring, out, TARGET_FRAMES);
+	munit_assert_int16(out[(TARGET_FRAMES - 1) * CHANNELS], ==, 0);
+	ChiakiAudioRingStats stats;
+	chiaki_audio_ring_get_stats(&ring, &stats);
+	munit_assert_uint64(stats.underruns, ==, 1);
+	munit_assert_uint64(stats.fill_frames, ==, 0);
+
+	// capacity is bounded, excess is dropped
+	fill_ramp(in, TARGET_FRAMES * 8, 0);
+	size_t written = chiaki_audio_ring_write(&ring, in, TARGET_FRAMES * 8);
+	munit_assert_size(written, <, TARGET_FRAMES * 8);
+	munit_assert_size(written, >=, TARGET_FRAMES * 4);
+	chiaki_audio_ring_get_stats(&ring, &stats);
+	munit_assert_uint64(stats.overruns, ==, 1);
+	munit_assert_uint64(stats.fill_frames, ==, written);
+
+	chiaki_audio_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+#define DRIFT_PPM 300
+#define SOURCE_CHUNK 480 // 10ms opus frames
+#define SINK_CHUNK 256
+#define SIM_SECONDS 120
+
+static MunitResult test_audio_ring_drift(const MunitParameter params[], void *user)
+{
+	ChiakiAudioRing ring;
+	ChiakiErrorCode err = chiaki_audio_ring_init(&ring, CHANNELS, RATE, TARGET_MS);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	static int16_t in[SOURCE_CHUNK * CHANNELS];
+	static int16_t out[SINK_CHUNK * CHANNELS];
+	fill_ramp(in, SOURCE_CHUNK, 0);
+
+	// the source clock runs faster than the sink's, without compensation the fill level would grow by
+	// DRIFT_PPM * SIM_SECONDS * RATE / 1000000 frames, far beyond the capacity
+	double source_interval = (double)SOURCE_CHUNK / (RATE * (1.0 + DRIFT_PPM / 1000000.0));
+	double sink_interval = (double)SINK_CHUNK / RATE;
+	double source_next = 0.0;
+	double sink_next = 0.0;
+	uint64_t underruns_settled = 0;
+	while(sink_next < SIM_SECONDS)
+	{
+		if(source_next <= sink_next)
+		{
+			chiaki_audio_ring_write(&ring, in, SOURCE_CHUNK);
+			source_next += source_interval;
+		}
+		else
+		{
+			chiaki_audio_ring_read(&ring, out, SINK_CHUNK);
+			sink_next += sink_interval;
+			if(sink_next < 1.0)
+			{
+				ChiakiAudioRingStats stats;
+				chiaki_audio_ring_get_stats(&ring, &stats);
+				underruns_settled = stats.underruns;
+			}
+		}
+	}
+
+	ChiakiAudioRingStats stats;
+	chiaki_audio_ring_get_stats(&ring, &stats);
+	munit_assert_uint64(stats.overruns, ==, 0);
+	munit_assert_uint64(stats.underruns, ==, underruns_settled);
+	munit_assert_int32(stats.drift_ppm, >=, DRIFT_PPM - 50);
+	munit_assert_int32(stats.drift_ppm, <=, DRIFT_PPM + 50);
+	munit_assert_uint64(stats.fill_frames, >=, TARGET_FRAMES - SINK_CHUNK - SOURCE_CHUNK);
+	munit_assert_uint64(stats.fill_frames, <=, TARGET_FRAMES + SINK_CHUNK + SOURCE_CHUNK);
+
+	chiaki_audio_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+MunitTest tests_audio_ring[] = {
+	{
+		"/basic",
+		test_audio_ring_basic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/drift",
+		test_audio_ring_drift,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/bandwidthestimator.h>
+
+#include <string.h>
+
+#define FRAME_INTERVAL_US 16667
+#define FRAME_PACKETS 10
+#define PACKET_SIZE 1200
+#define PACKET_SPACING_US 20
+#define UPDATE_INTERVAL_US 200000
+
+/**
+ * Simulated path from the console: packets of a frame are sent back to back every FRAME_INTERVAL_US
+ * and pass a bottleneck link of capacity_bps with an unlimited queue plus a constant delay.
+ */
+typedef struct sim_t
+{
+	ChiakiBandwidthEstimator estimator;
+	uint64_t frame;
+	uint64_t link_free_us;
+	uint64_t update_next_us;
+	uint64_t packets;
+	bool overuse_seen;
+	uint64_t report_lost;
+} Sim;
+
+static void sim_init(Sim *sim)
+{
+	memset(sim, 0, sizeof(*sim));
+	munit_assert_int(chiaki_bandwidth_estimator_init(&sim->estimator, FRAME_INTERVAL_US), ==, CHIAKI_ERR_SUCCESS);
+	sim->update_next_us = UPDATE_INTERVAL_US;
+}
+
+static void sim_update(Sim *sim, uint64_t now_us, uint64_t lost)
+{
+	uint16_t report_received, report_lost;
+	chiaki_bandwidth_estimator_update(&sim->estimator, now_us, sim->packets, lost, &report_received, &report_lost);
+	munit_assert_uint64(report_received, ==, sim->packets);
+	munit_assert_uint64(report_lost, >=, lost);
+	sim->report_lost += report_lost;
+	sim->packets = 0;
+}
+
+static void sim_run(Sim *sim, uint64_t frames, uint64_t capacity_bps)
+{
+	for(uint64_t end = sim->frame + frames; sim->frame < end; sim->frame++)
+	{
+		uint64_t send_us = 1000000 + sim->frame * FRAME_INTERVAL_US;
+		for(unsigned int i=0; i<FRAME_PACKETS; i++, send_us += PACKET_SPACING_US)
+		{
+			uint64_t start_us = send_us > sim->link_free_us ? send_us : sim->link_free_us;
+			sim->link_free_us = start_us + (uint64_t)PACKET_SIZE * 8 * 1000000 / capacity_bps;
+			uint64_t arrival_us = sim->link_free_us + 5000;
+			if(arrival_us >= sim->update_next_us)
+			{
+				sim_update(sim, sim->update_next_us, 0);
+				sim->update_next_us += UPDATE_INTERVAL_US;
+			}
+			chiaki_bandwidth_estimator_packet(&sim->estimator, arrival_us, (ChiakiSeqNum16)sim->frame, PACKET_SIZE);
+			sim->packets++;
+		}
+		ChiakiBandwidthEstimate estimate;
+		chiaki_bandwidth_estimator_get(&sim->estimator, &estimate);
+		if(estimate.usage == CHIAKI_BANDWIDTH_USAGE_OVERUSE)
+			sim->overuse_seen = true;
+	}
+}
+
+// 10 packets of 1200 bytes at 60 fps
+#define STREAM_BPS (FRAME_PACKETS * PACKET_SIZE * 8 * 60)
+
+static MunitResult test_bandwidth_estimator_steady(const MunitParameter params[], void *user)
+{
+	Sim sim;
+	sim_init(&sim);
+	sim_run(&sim, 600, 100000000); // 10s, longer than the window of the min delay
+
+	ChiakiBandwidthEstimate estimate;
+	chiaki_bandwidth_estimator_get(&sim.estimator, &estimate);
+	munit_assert_int(estimate.usage, ==, CHIAKI_BANDWIDTH_USAGE_NORMAL);
+	munit_assert_false(sim.overuse_seen);
+	munit_assert_uint64(estimate.queue_delay_us, <, 1000);
+	munit_assert_uint64(estimate.receive_bitrate, >, STREAM_BPS * 9 / 10);
+	munit_assert_uint64(estimate.receive_bitrate, <, STREAM_BPS * 11 / 10);
+	munit_assert_uint64(estimate.bitrate, >, estimate.receive_bitrate);
+	munit_assert_uint64(estimate.bottleneck_bitrate, >, STREAM_BPS);
+	munit_assert_uint64(sim.report_lost, ==, 0);
+
+	chiaki_bandwidth_estimator_fini(&sim.estimator);
+	return MUNIT_OK;
+}
+
+static MunitResult test_bandwidth_estimator_overuse(const MunitParameter params[], void *user)
+{
+	Sim sim;
+	sim_init(&sim);
+	sim_run(&sim, 180, 100000000);
+	munit_assert_false(sim.overuse_seen);
+
+	// the path drops to 80% of the stream, so the queue grows steadily
+	sim_run(&sim, 60, STREAM_BPS * 8 / 10);
+	munit_assert_true(sim.overuse_seen);
+	munit_assert_uint64(sim.report_lost, >, 0);
+
+	ChiakiBandwidthEstimate estimate;
+	chiaki_bandwidth_estimator_get(&sim.estimator, &estimate);
+	munit_assert_uint64(estimate.queue_delay_us, >, 10000);
+	munit_assert_uint64(estimate.bitrate, <, STREAM_BPS);
+
+	// frame index wraps around without disturbing anything
+	chiaki_bandwidth_estimator_reset(&sim.estimator, FRAME_INTERVAL_US);
+	sim.frame = 0xffff - 300;
+	sim.link_free_us = 0;
+	sim.overuse_seen = false;
+	sim.report_lost = 0;
+	sim.update_next_us = 1000000 + sim.frame * FRAME_INTERVAL_US;
+	sim_run(&sim, 600, 100000000);
+	munit_assert_false(sim.overuse_seen);
+	munit_assert_uint64(sim.report_lost, ==, 0);
+
+	chiaki_bandwidth_estimator_fini(&sim.estimator);
+	return MUNIT_OK;
+}
+
+static MunitResult test_bandwidth_estimator_loss(const MunitParameter params[], void *user)
+{
+	ChiakiBandwidthEstimator estimator;
+	munit_assert_int(chiaki_bandwidth_estimator_init(&estimator, FRAME_INTERVAL_US), ==, CHIAKI_ERR_SUCCESS);
+
+	uint64_t now_us = 1000000;
+	uint16_t report_received, report_lost;
+	for(unsigned int i=0; i<10; i++, now_us += UPDATE_INTERVAL_US)
+	{
+		chiaki_bandwidth_estimator_packet(&estimator, now_us, (ChiakiSeqNum16)i, 250000);
+		chiaki_bandwidth_estimator_update(&estimator, now_us, 1000, 0, &report_received, &report_lost);
+	}
+	ChiakiBandwidthEstimate before;
+	chiaki_bandwidth_estimator_get(&estimator, &before);
+	munit_assert_double(before.loss_rate, ==, 0.0);
+
+	for(unsigned int i=10; i<20; i++, now_us += UPDATE_INTERVAL_US)
+	{
+		chiaki_bandwidth_estimator_packet(&estimator, now_us, (ChiakiSeqNum16)i, 250000);
+		chiaki_bandwidth_estimator_update(&estimator, now_us, 800, 200, &report_received, &report_lost);
+		munit_assert_uint16(report_received, ==, 800);
+		munit_assert_uint16(report_lost, >=, 200);
+	}
+	ChiakiBandwidthEstimate after;
+	chiaki_bandwidth_estimator_get(&estimator, &after);
+	munit_assert_double(after.loss_rate, >, 0.15);
+	munit_assert_double(after.loss_rate, <, 0.25);
+	munit_assert_uint64(after.bitrate, <, before.bitrate);
+
+	// more than fits into the packet is scaled down, keeping the ratio
+	chiaki_bandwidth_estimator_reset(&estimator, FRAME_INTERVAL_US);
+	chiaki_bandwidth_estimator_update(&estimator, now_us, 200000, 100000, &report_received, &report_lost);
+	munit_assert_uint16(report_received, ==, UINT16_MAX);
+	munit_assert_uint16(report_lost, ==, UINT16_MAX / 2);
+
+	chiaki_bandwidth_estimator_fini(&estimator);
+	return MUNIT_OK;
+}
+
+MunitTest tests_bandwidth_estimator[] = {
+	{
+		"/steady",
+		test_bandwidth_estimator_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/overuse",
+		test_bandwidth_estimator_overuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_bandwidth_estimator_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/capture.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test_log.h"
+
+#define CAPTURE_FILENAME "chiaki-unit-capture.bin"
+
+static void write_capture(void)
+{
+	ChiakiCaptureInfo info;
+	info.target = CHIAKI_TARGET_PS5_1;
+	info.codec = CHIAKI_CODEC_H265;
+	ChiakiCaptureWriter writer;
+	ChiakiErrorCode err = chiaki_capture_writer_init(&writer, get_test_log(), CAPTURE_FILENAME, &info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint64_t t = writer.time_prev_us;
+	const uint8_t tag[] = { 0x12, 0x34, 0x56, 0x78 };
+	chiaki_capture_writer_record(&writer, CHIAKI_CAPTURE_RECORD_TAKION_TAG, t, tag, sizeof(tag));
+
+	uint8_t datagram[CHIAKI_CAPTURE_RECORD_SIZE_MAX];
+	for(size_t i=0; i<sizeof(datagram); i++)
+		datagram[i] = (uint8_t)i;
+	chiaki_capture_writer_record(&writer, CHIAKI_CAPTURE_RECORD_DATAGRAM, t + 1000, datagram, 100);
+
+	uint8_t handshake_key[CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE];
+	memset(handshake_key, 0xaa, sizeof(handshake_key));
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	memset(ecdh_secret, 0xbb, sizeof(ecdh_secret));
+	chiaki_capture_writer_keys(&writer, t + 1500, handshake_key, ecdh_secret);
+
+	// timestamps going backwards are recorded as simultaneous
+	chiaki_capture_writer_record(&writer, CHIAKI_CAPTURE_RECORD_DATAGRAM, t + 1200, datagram, sizeof(datagram));
+	chiaki_capture_writer_record(&writer, CHIAKI_CAPTURE_RECORD_DATAGRAM, t + 2500, datagram, 1);
+
+	munit_assert_uint64(writer.records, ==, 5);
+	munit_assert_false(writer.failed);
+	chiaki_capture_writer_fini(&writer);
+}
+
+static MunitResult test_capture_roundtrip(const MunitParameter params[], void *user)
+{
+	write_capture();
+
+	ChiakiCaptureReader reader;
+	ChiakiErrorCode err = chiaki_capture_reader_init(&reader, get_test_log(), CAPTURE_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_int(reader.info.target, ==, CHIAKI_TARGET_PS5_1);
+	munit_assert_int(reader.info.codec, ==, CHIAKI_CODEC_H265);
+	munit_assert_true(reader.takion_tag_valid);
+	munit_assert_uint32(reader.takion_tag, ==, 0x12345678);
+	munit_assert_true(reader.keys_valid);
+	munit_assert_uint8(reader.handshake_key[0], ==, 0xaa);
+	munit_assert_uint8(reader.handshake_key[CHIAKI_CAPTURE_HANDSHAKE_KEY_SIZE - 1], ==, 0xaa);
+	munit_assert_uint8(reader.ecdh_secret[0], ==, 0xbb);
+	munit_assert_uint8(reader.ecdh_secret[CHIAKI_ECDH_SECRET_SIZE - 1], ==, 0xbb);
+	munit_assert_uint64(reader.datagrams_count, ==, 3);
+	munit_assert_uint64(reader.datagrams_bytes, ==, 100 + CHIAKI_CAPTURE_RECORD_SIZE_MAX + 1);
+	munit_assert_uint64(reader.duration_us, ==, 2500);
+
+	static ChiakiCaptureRecord record;
+	const struct
+	{
+		ChiakiCaptureRecordType type;
+		uint64_t time_us;
+		size_t size;
+	} expected[] = {
+		{ CHIAKI_CAPTURE_RECORD_TAKION_TAG, 0, 4 },
+		{ CHIAKI_CAPTURE_RECORD_DATAGRAM, 1000, 100 },
+		{ CHIAKI_CAPTURE_RECORD_KEYS, 1500, CHIAKI_CAPTURE_KEYS_SIZE },
+		{ CHIAKI_CAPTURE_RECORD_DATAGRAM, 1500, CHIAKI_CAPTURE_RECORD_SIZE_MAX },
+		{ CHIAKI_CAPTURE_RECORD_DATAGRAM, 2500, 1 }
+	};
+
+	// reading twice must give the same result
+	for(int pass=0; pass<2; pass++)
+	{
+		for(size_t i=0; i<sizeof(expected) / sizeof(expected[0]); i++)
+		{
+			err = chiaki_capture_reader_next(&reader, &record);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			munit_assert_int(record.type, ==, expected[i].type);
+			munit_assert_uint64(record.time_us, ==, expected[i].time_us);
+			munit_assert_size(record.size, ==, expected[i].size);
+			if(record.type == CHIAKI_CAPTURE_RECORD_DATAGRAM)
+			{
+				for(size_t j=0; j<record.size; j++)
+					munit_assert_uint8(record.data[j], ==, (uint8_t)j);
+			}
+		}
+		err = chiaki_capture_reader_next(&reader, &record);
+		munit_assert_int(err, ==, CHIAKI_ERR_DISCONNECTED);
+		err = chiaki_capture_reader_rewind(&reader);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	chiaki_capture_reader_fini(&reader);
+	remove(CAPTURE_FILENAME);
+	return MUNIT_OK;
+}
+
+static MunitResult test_capture_corrupt(const MunitParameter params[], void *user)
+{
+	write_capture();
+
+	// cut off in the middle of the last record
+	FILE *f = fopen(CAPTURE_FILENAME, "rb");
+	munit_assert_not_null(f);
+	static uint8_t buf[0x1000];
+	size_t size = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	munit_assert_size(size, >, 8);
+
+	f = fopen(CAPTURE_FILENAME, "wb");
+	munit_assert_not_null(f);
+	munit_assert_size(fwrite(buf, 1, size - 3, f), ==, size - 3);
+	fclose(f);
+
+	ChiakiCaptureReader reader;
+	ChiakiErrorCode err = chiaki_capture_reader_init(&reader, get_test_log(), CAPTURE_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	// not a capture at all
+	memset(buf, 0, 0x10);
+	f = fopen(CAPTURE_FILENAME, "wb");
+	munit_assert_not_null(f);
+	munit_assert_size(fwrite(buf, 1, size, f), ==, size);
+	fclose(f);
+
+	err = chiaki_capture_reader_init(&reader, get_test_log(), CAPTURE_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	remove(CAPTURE_FILENAME);
+	return MUNIT_OK;
+}
+
+MunitTest tests_capture[] = {
+	{
+		"/roundtrip",
+		test_capture_roundtrip,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/corrupt",
+		test_capture_corrupt,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/eventloop.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "test_log.h"
+
+typedef struct timers_test_t TimersTest;
+
+typedef struct once_timer_t
+{
+	ChiakiEventLoopTimer timer;
+	TimersTest *test;
+	int index;
+} OnceTimer;
+
+struct timers_test_t
+{
+	ChiakiEventLoop loop;
+	OnceTimer once[3];
+	ChiakiEventLoopTimer periodic;
+	int order[3];
+	size_t order_count;
+	unsigned int periodic_fired;
+};
+
+static void once_cb(void *user)
+{
+	OnceTimer *once = user;
+	TimersTest *test = once->test;
+	test->order[test->order_count++] = once->index;
+	if(test->order_count == 3)
+		chiaki_event_loop_stop(&test->loop);
+}
+
+static void periodic_cb(void *user)
+{
+	TimersTest *test = user;
+	if(++test->periodic_fired == 5)
+		chiaki_event_loop_timer_stop(&test->periodic);
+}
+
+static MunitResult test_timers(const MunitParameter params[], void *user)
+{
+	TimersTest test;
+	memset(&test, 0, sizeof(test));
+	munit_assert_int(chiaki_event_loop_init(&test.loop, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+
+	for(int i=0; i<3; i++)
+	{
+		test.once[i].test = &test;
+		test.once[i].index = i;
+		chiaki_event_loop_timer_init(&test.once[i].timer, &test.loop, once_cb, &test.once[i]);
+	}
+	chiaki_event_loop_timer_init(&test.periodic, &test.loop, periodic_cb, &test);
+
+	uint64_t now = chiaki_time_now_monotonic_us();
+	chiaki_event_loop_timer_start(&test.once[0].timer, now + 60000, 0);
+	chiaki_event_loop_timer_start(&test.once[1].timer, now + 20000, 0);
+	chiaki_event_loop_timer_start(&test.once[2].timer, now + 40000, 0);
+	chiaki_event_loop_timer_start(&test.periodic, now, 2000);
+
+	munit_assert_int(chiaki_event_loop_run(&test.loop), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(chiaki_time_now_monotonic_us() - now, >=, 60000);
+
+	munit_assert_size(test.order_count, ==, 3);
+	munit_assert_int(test.order[0], ==, 1);
+	munit_assert_int(test.order[1], ==, 2);
+	munit_assert_int(test.order[2], ==, 0);
+	munit_assert_uint(test.periodic_fired, ==, 5);
+
+	ChiakiEventLoopStats stats;
+	chiaki_event_loop_get_stats(&test.loop, &stats);
+	munit_assert_uint64(stats.timers_fired, ==, 8);
+
+	for(size_t i=0; i<3; i++)
+		chiaki_event_loop_timer_fini(&test.once[i].timer);
+	chiaki_event_loop_timer_fini(&test.periodic);
+	chiaki_event_loop_fini(&test.loop);
+	return MUNIT_OK;
+}
+
+typedef struct io_test_t
+{
+	ChiakiEventLoop loop;
+	ChiakiEventLoopIo io;
+	ChiakiEventLoopTimer timer;
+	chiaki_socket_t sock;
+	struct sockaddr_in addr;
+	unsigned int received;
+	bool timer_fired;
+} IoTest;
+
+static void io_cb(chiaki_socket_t fd, unsigned int events, void *user)
+{
+	IoTest *test = user;
+	munit_assert_uint(events, ==, CHIAKI_EVENT_LOOP_IO_READ);
+	uint8_t buf[16];
+	int r = recv(fd, (char *)buf, sizeof(buf), 0);
+	munit_assert_int(r, ==, 1);
+	munit_assert_uint8(buf[0], ==, test->received);
+	if(++test->received == 3)
+		chiaki_event_loop_stop(&test->loop);
+}
+
+static void io_timer_cb(void *user)
+{
+	IoTest *test = user;
+	test->timer_fired = true;
+	for(uint8_t i=0; i<3; i++)
+	{
+		chiaki_socket_t send_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		munit_assert_false(CHIAKI_SOCKET_IS_INVALID(send_sock));
+		munit_assert_int(sendto(send_sock, (const char *)&i, 1, 0, (struct sockaddr *)&test->addr, sizeof(test->addr)), ==, 1);
+		CHIAKI_SOCKET_CLOSE(send_sock);
+	}
+}
+
+static void *io_thread_func(void *user)
+{
+	IoTest *test = user;
+	chiaki_event_loop_run(&test->loop);
+	return NULL;
+}
+
+static MunitResult test_io(const MunitParameter params[], void *user)
+{
+	IoTest test;
+	memset(&test, 0, sizeof(test));
+	munit_assert_int(chiaki_event_loop_init(&test.loop, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_event_loop_timer_init(&test.timer, &test.loop, io_timer_cb, &test);
+
+	test.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(test.sock));
+	test.addr.sin_family = AF_INET;
+	test.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	test.addr.sin_port = 0;
+	munit_assert_int(bind(test.sock, (struct sockaddr *)&test.addr, sizeof(test.addr)), ==, 0);
+	socklen_t addr_len = sizeof(test.addr);
+	munit_assert_int(getsockname(test.sock, (struct sockaddr *)&test.addr, &addr_len), ==, 0);
+
+	munit_assert_int(chiaki_event_loop_io_add(&test.loop, &test.io, test.sock, CHIAKI_EVENT_LOOP_IO_READ, io_cb, &test), ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread thread;
+	munit_assert_int(chiaki_thread_create(&thread, io_thread_func, &test), ==, CHIAKI_ERR_SUCCESS);
+
+	// the loop is waiting without any timer, the timer sends the datagrams from the loop thread
+	chiaki_event_loop_timer_start(&test.timer, chiaki_time_now_monotonic_us() + 1000, 0);
+
+	munit_assert_int(chiaki_thread_join(&thread, NULL), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_true(test.timer_fired);
+	munit_assert_uint(test.received, ==, 3);
+
+	chiaki_event_loop_io_remove(&test.io);
+	chiaki_event_loop_timer_fini(&test.timer);
+	CHIAKI_SOCKET_CLOSE(test.sock);
+	chiaki_event_loop_fini(&test.loop);
+	return MUNIT_OK;
+}
+
+typedef struct wake_test_t
+{
+	ChiakiEventLoop loop;
+	ChiakiEventLoopTimer timer;
+	uint64_t fired_us;
+} WakeTest;
+
+static void wake_timer_cb(void *user)
+{
+	WakeTest *test = user;
+	test->fired_us = chiaki_time_now_monotonic_us();
+	chiaki_event_loop_stop(&test->loop);
+}
+
+static void *wake_thread_func(void *user)
+{
+	WakeTest *test = user;
+	chiaki_event_loop_run(&test->loop);
+	return NULL;
+}
+
+static MunitResult test_wake(const MunitParameter params[], void *user)
+{
+	WakeTest test;
+	memset(&test, 0, sizeof(test));
+	munit_assert_int(chiaki_event_loop_init(&test.loop, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_event_loop_timer_init(&test.timer, &test.loop, wake_timer_cb, &test);
+
+	// armed far in the future first, then moved closer from another thread while the loop waits
+	chiaki_event_loop_timer_start(&test.timer, chiaki_time_now_monotonic_us() + 60000000, 0);
+	ChiakiThread thread;
+	munit_assert_int(chiaki_thread_create(&thread, wake_thread_func, &test), ==, CHIAKI_ERR_SUCCESS);
+	uint64_t due_us = chiaki_time_now_monotonic_us() + 5000;
+	chiaki_event_loop_timer_start(&test.timer, due_us, 0);
+	munit_assert_int(chiaki_thread_join(&thread, NULL), ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_uint64(test.fired_us, >=, due_us);
+	munit_assert_uint64(test.fired_us, <, due_us + 1000000);
+
+	// stopping before running returns right away
+	chiaki_event_loop_stop(&test.loop);
+	munit_assert_int(chiaki_event_loop_run(&test.loop), ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_event_loop_timer_fini(&test.timer);
+	chiaki_event_loop_fini(&test.loop);
+	return MUNIT_OK;
+}
+
+MunitTest tests_event_loop[] = {
+	{
+		"/timers",
+		test_timers,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/io",
+		test_io,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/wake",
+		test_wake,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -3,8 +3,11 @@
 #include <munit.h>
 
 #include <chiaki/fec.h>
+#include <chiaki/gf8.h>
 #include <chiaki/base64.h>
 
+#include <galois.h>
+
 typedef struct fec_test_case_t
 {
 	unsigned int k;
@@ -16,7 +19,7 @@ typedef struct fec_test_case_t
 
 #include "fec_test_cases.inl"
 
-static MunitResult test_fec_case(FECTestCase *test_case)
+static MunitResult test_fec_case(FECTestCase *test_case, ChiakiFecCache *cache)
 {
 	size_t b64len = strlen(test_case->frame_buffer_b64);
 	uint8_t *frame_buffer_ref = malloc(b64len);
@@ -45,7 +48,10 @@ static MunitResult test_fec_case(FECTestCase *test_case)
 		memset(frame_buffer + stride * e, 0x42, test_case->unit_size);
 	}
 
-	err = chiaki_fec_decode(frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
+	if(cache)
+		err = chiaki_fec_decode_cached(cache, frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
+	else
+		err = chiaki_fec_decode(frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 
 	for(size_t i=0; i<test_case->k; i++)
@@ -64,7 +70,162 @@ static MunitParameterEnum fec_params[] = {
 static MunitResult test_fec(const MunitParameter params[], void *test_user)
 {
 	unsigned long test_case_id = strtoul(params[0].value, NULL, 0);
-	return test_fec_case(&fec_test_cases[test_case_id]);
+	return test_fec_case(&fec_test_cases[test_case_id], NULL);
+}
+
+static MunitResult test_fec_cached(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache, CHIAKI_FEC_CACHE_MEM_BUDGET_DEFAULT);
+
+	// second round must be served from the cache and give the same result
+	size_t cases_count = sizeof(fec_test_cases) / sizeof(fec_test_cases[0]);
+	uint64_t misses_first = 0;
+	for(size_t round=0; round<2; round++)
+	{
+		for(size_t i=0; i<cases_count; i++)
+		{
+			MunitResult r = test_fec_case(&fec_test_cases[i], &cache);
+			if(r != MUNIT_OK)
+				return r;
+		}
+		if(round == 0)
+			misses_first = cache.misses;
+	}
+	munit_assert_uint64(cache.misses, ==, misses_first);
+
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_cache_evict(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache, 0);
+
+	// with no budget, only the most recently used matrix survives
+	for(size_t i=0; i<sizeof(fec_test_cases) / sizeof(fec_test_cases[0]); i++)
+	{
+		MunitResult r = test_fec_case(&fec_test_cases[i], &cache);
+		if(r != MUNIT_OK)
+			return r;
+		munit_assert_not_null(cache.lru_first);
+		munit_assert_ptr_equal(cache.lru_first, cache.lru_last);
+	}
+
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_encode(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache, CHIAKI_FEC_CACHE_MEM_BUDGET_DEFAULT);
+
+	// the received fec units of the captured frames must be reproduced exactly
+	for(size_t c=0; c<sizeof(fec_test_cases) / sizeof(fec_test_cases[0]); c++)
+	{
+		FECTestCase *test_case = &fec_test_cases[c];
+		size_t b64len = strlen(test_case->frame_buffer_b64);
+		uint8_t *frame_buffer_ref = malloc(b64len);
+		munit_assert_not_null(frame_buffer_ref);
+		ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame_buffer_ref, &b64len);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		size_t units_size = test_case->unit_size * (test_case->k + test_case->m);
+		uint8_t *frame_buffer = malloc(units_size);
+		munit_assert_not_null(frame_buffer);
+		memcpy(frame_buffer, frame_buffer_ref, test_case->unit_size * test_case->k);
+		memset(frame_buffer + test_case->unit_size * test_case->k, 0x42, test_case->unit_size * test_case->m);
+
+		err = chiaki_fec_encode_cached(&cache, frame_buffer, test_case->unit_size, test_case->unit_size, test_case->k, test_case->m);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		// erased units were never received, so only the others can be compared
+		for(size_t i=0; i<test_case->k + test_case->m; i++)
+		{
+			bool erased = false;
+			for(const int *e = test_case->erasures; *e >= 0; e++)
+				erased = erased || (size_t)*e == i;
+			if(!erased)
+				munit_assert_memory_equal(test_case->unit_size, frame_buffer + i * test_case->unit_size, frame_buffer_ref + i * test_case->unit_size);
+		}
+
+		free(frame_buffer);
+		free(frame_buffer_ref);
+	}
+
+	// encode -> erase -> decode with a padded stride
+	const unsigned int k = 20;
+	const unsigned int m = 4;
+	const size_t unit_size = 0x123;
+	const size_t stride = 0x130;
+	uint8_t *frame_buffer_ref = malloc(stride * (k + m));
+	uint8_t *frame_buffer = malloc(stride * (k + m));
+	munit_assert_not_null(frame_buffer_ref);
+	munit_assert_not_null(frame_buffer);
+	munit_rand_memory(stride * k, frame_buffer_ref);
+	ChiakiErrorCode err = chiaki_fec_encode(frame_buffer_ref, unit_size, stride, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	memcpy(frame_buffer, frame_buffer_ref, stride * (k + m));
+	const unsigned int erasures[] = { 0, 7, 19, 21 };
+	for(size_t i=0; i<sizeof(erasures) / sizeof(erasures[0]); i++)
+		memset(frame_buffer + stride * erasures[i], 0x42, unit_size);
+	err = chiaki_fec_decode_cached(&cache, frame_buffer, unit_size, stride, k, m, erasures, sizeof(erasures) / sizeof(erasures[0]));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<k; i++)
+		munit_assert_memory_equal(unit_size, frame_buffer + stride * i, frame_buffer_ref + stride * i);
+
+	free(frame_buffer);
+	free(frame_buffer_ref);
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_gf8_region_mul(const MunitParameter params[], void *test_user)
+{
+	// multiplication table against jerasure's field
+	for(unsigned int a=0; a<0x100; a++)
+	{
+		for(unsigned int b=0; b<0x100; b++)
+			munit_assert_uint8(chiaki_gf8_mul(a, b), ==, galois_single_multiply(a, b, CHIAKI_FEC_WORDSIZE));
+	}
+
+	// all implementations must give the same result as the scalar one, also for odd sizes and offsets
+#define GF8_TEST_SIZE_MAX 0x203
+	const size_t size_max = GF8_TEST_SIZE_MAX;
+	uint8_t src[GF8_TEST_SIZE_MAX + 1];
+	uint8_t dst_init[GF8_TEST_SIZE_MAX + 1];
+	uint8_t dst_ref[GF8_TEST_SIZE_MAX + 1];
+	uint8_t dst[GF8_TEST_SIZE_MAX + 1];
+	munit_rand_memory(sizeof(src), src);
+	munit_rand_memory(sizeof(dst_init), dst_init);
+
+	for(ChiakiGF8Impl impl=0; impl<CHIAKI_GF8_IMPL_COUNT; impl++)
+	{
+		if(!chiaki_gf8_impl_supported(impl))
+			continue;
+		for(unsigned int c=0; c<0x100; c++)
+		{
+			for(size_t size=size_max-0x40; size<=size_max; size+=0x1f)
+			{
+				for(int add=0; add<2; add++)
+				{
+					memcpy(dst_ref, dst_init, sizeof(dst_ref));
+					for(size_t i=0; i<size; i++)
+					{
+						uint8_t p = chiaki_gf8_mul(src[i + 1], c);
+						dst_ref[i + 1] = add ? dst_ref[i + 1] ^ p : p;
+					}
+					memcpy(dst, dst_init, sizeof(dst));
+					chiaki_gf8_region_mul_impl(impl, dst + 1, src + 1, c, size, add);
+					munit_assert_memory_equal(sizeof(dst), dst, dst_ref);
+				}
+			}
+		}
+	}
+
+	return MUNIT_OK;
 }
 
 MunitTest tests_fec[] = {
@@ -76,5 +237,37 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/fec_cached",
+		test_fec_cached,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_encode",
+		test_fec_encode,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gf8_region_mul",
+		test_gf8_region_mul,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_cache_evict",
+		test_fec_cache_evict,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/feedbacksender.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "test_log.h"
+
+#define PACKET_TYPE_FEEDBACK_HISTORY 1
+#define PACKET_TYPE_FEEDBACK_STATE 6
+
+// more than chiaki_takion_connect() allocates
+#define SEND_QUEUE_SIZE 64
+
+typedef struct feedback_test_t
+{
+	ChiakiGKCrypt gkcrypt;
+	ChiakiTakion takion;
+	ChiakiEventLoop loop;
+	bool loop_running;
+	ChiakiFeedbackSender sender;
+	ChiakiStopPipe stop_pipe;
+	chiaki_socket_t recv_sock;
+	ChiakiControllerState state;
+} FeedbackTest;
+
+/**
+ * Set up just enough of a Takion to send feedback packets to recv_sock.
+ */
+static void feedback_test_init(FeedbackTest *test, uint32_t interval_min_ms, bool event_loop)
+{
+	static const uint8_t handshake_key[] = { 0x83, 0xcf, 0x93, 0x1a, 0x6a, 0xa7, 0x69, 0xa6, 0xc4, 0x48, 0x5d, 0x19, 0xc1, 0x5c, 0xcc, 0x52 };
+	static const uint8_t ecdh_secret[] = { 0x73, 0xc8, 0xd5, 0x49, 0xc4, 0xd9, 0xdb, 0x50, 0x2e, 0xc0, 0x44, 0xea, 0x33, 0x64, 0x8c, 0x6a, 0xc9, 0xf3, 0x6c, 0x41, 0xb6, 0xa0, 0x50, 0x4f, 0xe0, 0x93, 0xde, 0xfb, 0x61, 0x9b, 0x9, 0x73 };
+
+	memset(test, 0, sizeof(*test));
+	ChiakiLog *log = get_test_log();
+	munit_assert_int(chiaki_gkcrypt_init(&test->gkcrypt, log, 0, 42, handshake_key, ecdh_secret), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_stop_pipe_init(&test->stop_pipe), ==, CHIAKI_ERR_SUCCESS);
+
+	test->recv_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(test->recv_sock));
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	munit_assert_int(bind(test->recv_sock, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+	socklen_t addr_len = sizeof(addr);
+	munit_assert_int(getsockname(test->recv_sock, (struct sockaddr *)&addr, &addr_len), ==, 0);
+
+	ChiakiTakion *takion = &test->takion;
+	takion->log = log;
+	takion->version = 12;
+	takion->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(takion->sock));
+	munit_assert_int(connect(takion->sock, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+	takion->send_queue = calloc(SEND_QUEUE_SIZE, sizeof(ChiakiPacketBuf));
+	munit_assert_not_null(takion->send_queue);
+	takion->send_queue_macs = calloc(SEND_QUEUE_SIZE, sizeof(ChiakiTakionSendQueueMac));
+	munit_assert_not_null(takion->send_queue_macs);
+	munit_assert_int(chiaki_mutex_init(&takion->gkcrypt_local_mutex, false), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_takion_set_crypt(takion, &test->gkcrypt, NULL);
+
+	if(event_loop)
+	{
+		munit_assert_int(chiaki_event_loop_init(&test->loop, log), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_int(chiaki_event_loop_start(&test->loop, "Test Event Loop"), ==, CHIAKI_ERR_SUCCESS);
+		test->loop_running = true;
+	}
+
+	chiaki_controller_state_set_idle(&test->state);
+	munit_assert_int(chiaki_feedback_sender_init(&test->sender, takion, interval_min_ms, event_loop ? &test->loop : NULL), ==, CHIAKI_ERR_SUCCESS);
+}
+
+static void feedback_test_fini(FeedbackTest *test)
+{
+	chiaki_feedback_sender_fini(&test->sender);
+	if(test->loop_running)
+	{
+		chiaki_event_loop_stop(&test->loop);
+		chiaki_event_loop_join(&test->loop);
+		chiaki_event_loop_fini(&test->loop);
+	}
+	chiaki_mutex_fini(&test->takion.gkcrypt_local_mutex);
+	free(test->takion.send_queue_macs);
+	free(test->takion.send_queue);
+	CHIAKI_SOCKET_CLOSE(test->takion.sock);
+	CHIAKI_SOCKET_CLOSE(test->recv_sock);
+	chiaki_stop_pipe_fini(&test->stop_pipe);
+	chiaki_gkcrypt_fini(&test->gkcrypt);
+}
+
+static void feedback_test_toggle(FeedbackTest *test, uint32_t buttons)
+{
+	test->state.buttons ^= buttons;
+	munit_assert_int(chiaki_feedback_sender_set_controller_state(&test->sender, &test->state), ==, CHIAKI_ERR_SUCCESS);
+}
+
+/**
+ * Wait up to timeout_ms for the next history packet, skipping state packets.
+ *
+ * @return whether a history packet arrived
+ */
+static bool feedback_test_recv_history(FeedbackTest *test, uint64_t timeout_ms, ChiakiSeqNum16 *seq_num)
+{
+	uint64_t deadline_us = chiaki_time_now_monotonic_us() + timeout_ms * 1000;
+	while(true)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(now_us >= deadline_us)
+			return false;
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&test->stop_pipe, test->recv_sock, false, (deadline_us - now_us + 999) / 1000);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			return false;
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		uint8_t buf[0x400];
+		int r = recv(test->recv_sock, (char *)buf, sizeof(buf), 0);
+		munit_assert_int(r, >=, 0xc);
+
+		// MACed over the packet with the MAC zeroed, but the key pos in place
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		memcpy(gmac, buf + 8, sizeof(gmac));
+		memset(buf + 8, 0, sizeof(gmac));
+		uint8_t gmac_expected[CHIAKI_GKCRYPT_GMAC_SIZE];
+		uint64_t key_pos = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 4)));
+		munit_assert_int(chiaki_gkcrypt_gmac(&test->gkcrypt, key_pos, buf, r, gmac_expected), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+
+		if(buf[0] == PACKET_TYPE_FEEDBACK_STATE)
+			continue;
+		munit_assert_uint8(buf[0], ==, PACKET_TYPE_FEEDBACK_HISTORY);
+		if(seq_num)
+			*seq_num = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 1)));
+		return true;
+	}
+}
+
+static ChiakiFeedbackSenderStats feedback_test_stats(FeedbackTest *test)
+{
+	chiaki_mutex_lock(&test->sender.state_mutex);
+	ChiakiFeedbackSenderStats stats = test->sender.stats;
+	chiaki_mutex_unlock(&test->sender.state_mutex);
+	return stats;
+}
+
+static MunitResult feedback_sender_coalesce(bool event_loop)
+{
+	static FeedbackTest test;
+	feedback_test_init(&test, 0, event_loop);
+
+	// several buttons at once make several history events, but only one packet
+	for(ChiakiSeqNum16 i=0; i<3; i++)
+	{
+		feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_CROSS | CHIAKI_CONTROLLER_BUTTON_MOON | CHIAKI_CONTROLLER_BUTTON_L1);
+		ChiakiSeqNum16 seq_num;
+		munit_assert_true(feedback_test_recv_history(&test, 150, &seq_num));
+		munit_assert_uint16(seq_num, ==, i);
+		munit_assert_false(feedback_test_recv_history(&test, 30, NULL));
+	}
+
+	ChiakiFeedbackSenderStats stats = feedback_test_stats(&test);
+	munit_assert_uint64(stats.state_changes, ==, 3);
+	munit_assert_uint64(stats.history_packets, ==, 3);
+
+	feedback_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_coalesce(const MunitParameter params[], void *user)
+{
+	return feedback_sender_coalesce(false);
+}
+
+static MunitResult test_coalesce_event_loop(const MunitParameter params[], void *user)
+{
+	return feedback_sender_coalesce(true);
+}
+
+static MunitResult test_interval(const MunitParameter params[], void *user)
+{
+	static FeedbackTest test;
+	feedback_test_init(&test, 100, false);
+
+	// the first change goes out right away
+	feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_CROSS);
+	munit_assert_true(feedback_test_recv_history(&test, 50, NULL));
+	uint64_t first_us = chiaki_time_now_monotonic_us();
+
+	// the ones right after it wait for the interval and leave together
+	feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_CROSS);
+	feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_MOON);
+	munit_assert_true(feedback_test_recv_history(&test, 300, NULL));
+	munit_assert_uint64(chiaki_time_now_monotonic_us() - first_us, >=, 80000);
+	munit_assert_false(feedback_test_recv_history(&test, 150, NULL));
+
+	ChiakiFeedbackSenderStats stats = feedback_test_stats(&test);
+	munit_assert_uint64(stats.state_changes, ==, 3);
+	munit_assert_uint64(stats.history_packets, ==, 2);
+
+	feedback_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_history_full(const MunitParameter params[], void *user)
+{
+	static FeedbackTest test;
+	feedback_test_init(&test, 10000, false);
+
+	feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_CROSS);
+	munit_assert_true(feedback_test_recv_history(&test, 50, NULL));
+
+	// one event per change, sent long before the interval is over, but before the buffer would have to drop any
+	size_t changes = 0;
+	bool sent = false;
+	while(!sent)
+	{
+		munit_assert_size(changes, <, test.sender.history_buf.size);
+		feedback_test_toggle(&test, CHIAKI_CONTROLLER_BUTTON_CROSS);
+		changes++;
+		sent = feedback_test_recv_history(&test, 20, NULL);
+	}
+	munit_assert_size(changes, >, 1);
+
+	ChiakiFeedbackSenderStats stats = feedback_test_stats(&test);
+	munit_assert_uint64(stats.history_packets, ==, 2);
+
+	feedback_test_fini(&test);
+	return MUNIT_OK;
+}
+
+MunitTest tests_feedback_sender[] = {
+	{
+		"/coalesce",
+		test_coalesce,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/coalesce_event_loop",
+		test_coalesce_event_loop,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/interval",
+		test_interval,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/history_full",
+		test_history_full,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
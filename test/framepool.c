@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/framepool.h>
+#include <chiaki/video.h>
+
+#include "test_log.h"
+
+static void assert_padding_zero(ChiakiVideoFrame *frame)
+{
+	static const uint8_t zero[CHIAKI_VIDEO_BUFFER_PADDING_SIZE] = { 0 };
+	munit_assert_memory_equal(sizeof(zero), frame->buf + frame->buf_size, zero);
+}
+
+static MunitResult test_frame_pool_reuse(const MunitParameter params[], void *user)
+{
+	ChiakiFramePool *pool = chiaki_frame_pool_new(get_test_log(), 2);
+	munit_assert_not_null(pool);
+
+	ChiakiVideoFrame *a = chiaki_frame_pool_acquire(pool, 1000);
+	munit_assert_not_null(a);
+	munit_assert_size(a->buf_size, ==, 1000);
+	assert_padding_zero(a);
+	memset(a->buf, 0x42, a->buf_size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+	ChiakiVideoFrame *b = chiaki_frame_pool_acquire(pool, 100000);
+	munit_assert_not_null(b);
+	munit_assert_ptr_not_equal(a, b);
+
+	// frames_max in use
+	munit_assert_null(chiaki_frame_pool_acquire(pool, 10));
+
+	// a is still referenced by someone else, so it must not come back
+	chiaki_video_frame_ref(a);
+	chiaki_video_frame_unref(a);
+	munit_assert_null(chiaki_frame_pool_acquire(pool, 10));
+
+	// now a is free again and reused, with its padding cleared
+	chiaki_video_frame_unref(a);
+	ChiakiVideoFrame *c = chiaki_frame_pool_acquire(pool, 500);
+	munit_assert_ptr_equal(c, a);
+	munit_assert_size(c->buf_size, ==, 500);
+	assert_padding_zero(c);
+
+	// both free, the one that is large enough already is preferred
+	chiaki_video_frame_unref(b);
+	chiaki_video_frame_unref(c);
+	ChiakiVideoFrame *d = chiaki_frame_pool_acquire(pool, 90000);
+	munit_assert_ptr_equal(d, b);
+
+	ChiakiFramePoolStats stats;
+	chiaki_frame_pool_get_stats(pool, &stats);
+	munit_assert_uint64(stats.frames_allocated, ==, 2);
+	munit_assert_uint64(stats.frames_in_use, ==, 1);
+	munit_assert_uint64(stats.frames_in_use_max, ==, 2);
+	munit_assert_uint64(stats.frame_size_max, ==, 100000);
+	munit_assert_uint64(stats.bytes_allocated, >=, 101000);
+	munit_assert_uint64(stats.bytes_allocated_max, ==, stats.bytes_allocated);
+	munit_assert_uint64(stats.exhausted, ==, 2);
+
+	// the pool must stay valid until the last frame is gone
+	chiaki_frame_pool_free(pool);
+	memset(d->buf, 0x42, d->buf_size);
+	chiaki_video_frame_unref(d);
+	return MUNIT_OK;
+}
+
+MunitTest tests_frame_pool[] = {
+	{
+		"/reuse",
+		test_frame_pool_reuse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/video.h>
+
+#include <jerasure.h>
+#include <cauchy.h>
+
+#include "test_log.h"
+
+#define UNITS_SOURCE 5
+#define UNITS_FEC 2
+#define UNITS_TOTAL (UNITS_SOURCE + UNITS_FEC)
+#define UNIT_SIZE 200
+
+// size of each unit as sent, source units are shorter by the padding announced in their first 2 bytes
+static const size_t unit_data_sizes[UNITS_SOURCE] = { 200, 190, 200, 150, 173 };
+
+// only the last unit is short, as sent by the console
+static const size_t unit_data_sizes_full[UNITS_SOURCE] = { 200, 200, 200, 200, 173 };
+
+typedef struct frame_test_data_t
+{
+	uint8_t units[UNITS_TOTAL][UNIT_SIZE]; // plaintext, zero-padded to UNIT_SIZE
+	uint8_t units_enc[UNITS_TOTAL][UNIT_SIZE];
+	size_t data_sizes[UNITS_TOTAL];
+	uint8_t frame[UNITS_SOURCE * UNIT_SIZE];
+	size_t frame_size;
+	ChiakiGKCrypt gkcrypt;
+} FrameTestData;
+
+static uint64_t unit_key_pos(size_t i)
+{
+	return 0x1000 * i + 0x10;
+}
+
+static void frame_test_data_init(FrameTestData *data, const size_t *unit_data_sizes)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	memset(data->units, 0, sizeof(data->units));
+	data->frame_size = 0;
+	for(size_t i=0; i<UNITS_SOURCE; i++)
+	{
+		size_t size = unit_data_sizes[i];
+		uint16_t padding = (uint16_t)(UNIT_SIZE - size);
+		data->units[i][0] = (uint8_t)(padding >> 8);
+		data->units[i][1] = (uint8_t)(padding & 0xff);
+		munit_rand_memory(size - 2, data->units[i] + 2);
+		data->data_sizes[i] = size;
+		memcpy(data->frame + data->frame_size, data->units[i] + 2, size - 2);
+		data->frame_size += size - 2;
+	}
+
+	int *matrix = cauchy_original_coding_matrix(UNITS_SOURCE, UNITS_FEC, CHIAKI_FEC_WORDSIZE);
+	munit_assert_not_null(matrix);
+	char *data_ptrs[UNITS_SOURCE];
+	char *coding_ptrs[UNITS_FEC];
+	for(size_t i=0; i<UNITS_SOURCE; i++)
+		data_ptrs[i] = (char *)data->units[i];
+	for(size_t i=0; i<UNITS_FEC; i++)
+	{
+		coding_ptrs[i] = (char *)data->units[UNITS_SOURCE + i];
+		data->data_sizes[UNITS_SOURCE + i] = UNIT_SIZE;
+	}
+	jerasure_matrix_encode(UNITS_SOURCE, UNITS_FEC, CHIAKI_FEC_WORDSIZE, matrix, data_ptrs, coding_ptrs, UNIT_SIZE);
+	free(matrix);
+
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&data->gkcrypt, get_test_log(), 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<UNITS_TOTAL; i++)
+	{
+		memcpy(data->units_enc[i], data->units[i], UNIT_SIZE);
+		err = chiaki_gkcrypt_encrypt(&data->gkcrypt, unit_key_pos(i), data->units_enc[i], data->data_sizes[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+}
+
+static void put_unit(ChiakiFrameProcessor *frame_processor, FrameTestData *data, size_t i, bool encrypted, bool first)
+{
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.unit_index = (ChiakiSeqNum16)i;
+	packet.units_in_frame_total = UNITS_TOTAL;
+	packet.units_in_frame_fec = UNITS_FEC;
+	packet.data = encrypted ? data->units_enc[i] : data->units[i];
+	packet.data_size = data->data_sizes[i];
+	uint8_t data_enc_copy[UNIT_SIZE];
+	memcpy(data_enc_copy, data->units_enc[i], sizeof(data_enc_copy));
+
+	ChiakiErrorCode err;
+	if(first)
+	{
+		if(encrypted)
+			err = chiaki_frame_processor_alloc_frame_encrypted(frame_processor, &packet, &data->gkcrypt, unit_key_pos(i));
+		else
+			err = chiaki_frame_processor_alloc_frame(frame_processor, &packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	if(encrypted)
+		err = chiaki_frame_processor_put_unit_encrypted(frame_processor, &packet, &data->gkcrypt, unit_key_pos(i));
+	else
+		err = chiaki_frame_processor_put_unit(frame_processor, &packet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// encrypted input is decrypted into the frame buffer, not in place
+	if(encrypted)
+		munit_assert_memory_equal(packet.data_size, packet.data, data_enc_copy);
+}
+
+static void assert_frame(ChiakiFrameProcessor *frame_processor, FrameTestData *data, ChiakiFrameProcessorFlushResult result_expected)
+{
+	uint8_t *frame;
+	size_t frame_size;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(frame_processor, &frame, &frame_size);
+	munit_assert_int(result, ==, result_expected);
+	munit_assert_size(frame_size, ==, data->frame_size);
+	munit_assert_memory_equal(frame_size, frame, data->frame);
+	static const uint8_t zero[CHIAKI_VIDEO_BUFFER_PADDING_SIZE] = { 0 };
+	munit_assert_memory_equal(sizeof(zero), frame + frame_size, zero);
+}
+
+static MunitResult test_frame_processor(const MunitParameter params[], void *user)
+{
+	static FrameTestData data;
+	frame_test_data_init(&data, unit_data_sizes);
+
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	for(int encrypted=0; encrypted<2; encrypted++)
+	{
+		// all source units, in order
+		for(size_t i=0; i<UNITS_SOURCE; i++)
+			put_unit(&frame_processor, &data, i, encrypted, i == 0);
+		munit_assert(chiaki_frame_processor_flush_possible(&frame_processor));
+		assert_frame(&frame_processor, &data, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+
+		// scatter-gather output must give the same frame
+		for(size_t i=0; i<UNITS_SOURCE; i++)
+			put_unit(&frame_processor, &data, UNITS_SOURCE - 1 - i, encrypted, i == 0);
+		ChiakiFrameIOVec *iov;
+		size_t iov_count;
+		size_t frame_size;
+		ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush_iov(&frame_processor, &iov, &iov_count, &frame_size);
+		munit_assert_int(result, ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+		munit_assert_size(iov_count, ==, UNITS_SOURCE);
+		munit_assert_size(frame_size, ==, data.frame_size);
+		size_t cur = 0;
+		for(size_t i=0; i<iov_count; i++)
+		{
+			munit_assert_size(cur + iov[i].size, <=, data.frame_size);
+			munit_assert_memory_equal(iov[i].size, iov[i].buf, data.frame + cur);
+			cur += iov[i].size;
+		}
+		munit_assert_size(cur, ==, data.frame_size);
+
+		// two source units lost, recovered by FEC.
+		// The frame buffer is not cleared for a new frame, so garbage in it must not matter.
+		memset(frame_processor.frame_buf, 0x42, frame_processor.frame_buf_size);
+		bool first = true;
+		for(size_t i=0; i<UNITS_TOTAL; i++)
+		{
+			if(i == 1 || i == 3)
+				continue;
+			put_unit(&frame_processor, &data, i, encrypted, first);
+			first = false;
+		}
+		assert_frame(&frame_processor, &data, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	}
+
+	chiaki_frame_processor_fini(&frame_processor);
+	chiaki_gkcrypt_fini(&data.gkcrypt);
+	return MUNIT_OK;
+}
+
+static void assert_pooled_frame(ChiakiFrameProcessor *frame_processor, FrameTestData *data, ChiakiFrameProcessorFlushResult result_expected)
+{
+	// assembled right where the units were put
+	uint8_t *frame_buf = frame_processor->frame_buf;
+	ChiakiVideoFrame *frame = NULL;
+	ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush_frame(frame_processor, &frame);
+	munit_assert_int(result, ==, result_expected);
+	munit_assert_not_null(frame);
+	munit_assert_ptr_equal(frame->buf, frame_buf);
+	munit_assert_size(frame->buf_size, ==, data->frame_size);
+	munit_assert_memory_equal(frame->buf_size, frame->buf, data->frame);
+	static const uint8_t zero[CHIAKI_VIDEO_BUFFER_PADDING_SIZE] = { 0 };
+	munit_assert_memory_equal(sizeof(zero), frame->buf + frame->buf_size, zero);
+	chiaki_video_frame_unref(frame);
+
+	// the frame is gone, late units only count
+	munit_assert_int(chiaki_frame_processor_flush_frame(frame_processor, &frame), ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED);
+}
+
+static MunitResult test_frame_processor_pool(const MunitParameter params[], void *user)
+{
+	static FrameTestData data;
+	frame_test_data_init(&data, unit_data_sizes_full);
+
+	ChiakiFramePool *pool = chiaki_frame_pool_new(get_test_log(), 2);
+	munit_assert_not_null(pool);
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+	chiaki_frame_processor_set_frame_pool(&frame_processor, pool);
+
+	for(int encrypted=0; encrypted<2; encrypted++)
+	{
+		for(size_t i=0; i<UNITS_SOURCE; i++)
+			put_unit(&frame_processor, &data, UNITS_SOURCE - 1 - i, encrypted, i == 0);
+		assert_pooled_frame(&frame_processor, &data, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+
+		// unit 4 is short and last, unit 0 is moved around
+		bool first = true;
+		for(size_t i=0; i<UNITS_TOTAL; i++)
+		{
+			if(i == 2 || i == 4)
+				continue;
+			put_unit(&frame_processor, &data, i, encrypted, first);
+			first = false;
+		}
+		assert_pooled_frame(&frame_processor, &data, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	}
+
+	// a frame that is never flushed goes back to the pool with the frame processor
+	put_unit(&frame_processor, &data, 0, false, true);
+	chiaki_frame_processor_fini(&frame_processor);
+	ChiakiFramePoolStats stats;
+	chiaki_frame_pool_get_stats(pool, &stats);
+	munit_assert_uint64(stats.frames_in_use, ==, 0);
+	chiaki_frame_pool_free(pool);
+	chiaki_gkcrypt_fini(&data.gkcrypt);
+	return MUNIT_OK;
+}
+
+MunitTest tests_frame_processor[] = {
+	{
+		"/assemble",
+		test_frame_processor,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/assemble_pool",
+		test_frame_processor_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -5,6 +5,8 @@
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
 
+#include "test_log.h"
+
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0xfc, 0x5d, 0x4b, 0xa0, 0x3a, 0x35, 0x3a, 0xbb, 0x6a, 0x7f, 0xac, 0x79, 0x1b, 0x17, 0xbb, 0x34 };
@@ -96,6 +98,38 @@ static MunitResult test_key_stream(const MunitParameter params[], void *user)
 }
 
 
+static MunitResult test_key_stream_counter_wrap(const MunitParameter params[], void *user)
+{
+	ChiakiGKCrypt gkcrypt;
+	memset(&gkcrypt, 0, sizeof(gkcrypt));
+	munit_rand_memory(sizeof(gkcrypt.key_base), gkcrypt.key_base);
+	munit_rand_memory(sizeof(gkcrypt.iv), gkcrypt.iv);
+	// low 64 bits of the little endian counter are 3 blocks away from wrapping around
+	memset(gkcrypt.iv, 0xff, 8);
+	gkcrypt.iv[0] = 0xfd;
+	gkcrypt.iv[15] = 0xff;
+
+	uint8_t batch[0x10 * CHIAKI_GKCRYPT_BLOCK_SIZE];
+	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(&gkcrypt, 0, batch, sizeof(batch));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(size_t i=0; i<sizeof(batch) / CHIAKI_GKCRYPT_BLOCK_SIZE; i++)
+	{
+		uint8_t block[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		err = chiaki_gkcrypt_gen_key_stream(&gkcrypt, i * CHIAKI_GKCRYPT_BLOCK_SIZE, block, sizeof(block));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(block), block, batch + i * CHIAKI_GKCRYPT_BLOCK_SIZE);
+	}
+
+	// blocks before and after the wrap must all be different
+	for(size_t i=1; i<sizeof(batch) / CHIAKI_GKCRYPT_BLOCK_SIZE; i++)
+		munit_assert_memory_not_equal(CHIAKI_GKCRYPT_BLOCK_SIZE, batch + (i - 1) * CHIAKI_GKCRYPT_BLOCK_SIZE, batch + i * CHIAKI_GKCRYPT_BLOCK_SIZE);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	return MUNIT_OK;
+}
+
+
 static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
@@ -169,6 +203,71 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	return MUNIT_OK;
 }
 
+static MunitResult test_key_buf(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	ChiakiLog *log = get_test_log();
+
+	// reference without key buf
+	ChiakiGKCrypt gkcrypt_direct;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt_direct, log, 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// small ring, so it wraps around a lot while the producer thread is running
+	ChiakiGKCrypt gkcrypt;
+	err = chiaki_gkcrypt_init(&gkcrypt, log, 4, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t data[0x5a7];
+	uint8_t enc[sizeof(data)];
+	uint8_t enc_expected[sizeof(data)];
+	uint64_t key_pos = 0x11;
+	for(size_t i=0; i<0x400; i++)
+	{
+		size_t size = (size_t)munit_rand_int_range(1, sizeof(data));
+		munit_rand_memory(size, data);
+
+		// every now and then, go back to an earlier (maybe already dropped) position
+		uint64_t pos = key_pos;
+		if(i % 0x20 == 0x1f && key_pos > 0x3000)
+			pos -= (uint64_t)munit_rand_int_range(1, 0x3000);
+
+		memcpy(enc_expected, data, size);
+		err = chiaki_gkcrypt_encrypt(&gkcrypt_direct, pos, enc_expected, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		memcpy(enc, data, size);
+		err = chiaki_gkcrypt_encrypt(&gkcrypt, pos, enc, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(size, enc, enc_expected);
+
+		err = chiaki_gkcrypt_get_key_stream(&gkcrypt, pos, enc, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		for(size_t j=0; j<size; j++)
+			enc[j] ^= data[j];
+		munit_assert_memory_equal(size, enc, enc_expected);
+
+		if(pos == key_pos)
+			key_pos += size;
+	}
+
+	// far ahead of the ring
+	key_pos += 0x100000;
+	memcpy(enc_expected, data, sizeof(data));
+	err = chiaki_gkcrypt_decrypt(&gkcrypt_direct, key_pos, enc_expected, sizeof(data));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	memcpy(enc, data, sizeof(data));
+	err = chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, enc, sizeof(data));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_memory_equal(sizeof(data), enc, enc_expected);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	chiaki_gkcrypt_fini(&gkcrypt_direct);
+	return MUNIT_OK;
+}
+
 static MunitResult test_gmac(const MunitParameter params[], void *user)
 {
 	static const uint8_t gkcrypt_key[] = {	0xb6, 0x4b, 0x1e, 0x65, 0x3f, 0xbb, 0xa7, 0xab, 0x80, 0xb3, 0x1e, 0x5a, 0x32, 0x4d, 0xec, 0xc0 };
@@ -216,6 +315,8 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
 
+	chiaki_gkcrypt_fini(&gkcrypt);
+
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
 	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
@@ -231,6 +332,7 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
 
+	chiaki_gkcrypt_fini(&gkcrypt);
 	return MUNIT_OK;
 }
 
@@ -317,6 +419,8 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
 
+	chiaki_gkcrypt_fini(&gkcrypt);
+
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
 
@@ -332,6 +436,7 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
 
+	chiaki_gkcrypt_fini(&gkcrypt);
 	return MUNIT_OK;
 }
 
@@ -379,6 +484,81 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	return MUNIT_OK;
 }
 
+static MunitResult test_gmac_batch(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+	static const uint8_t crypt_index = 3;
+
+	// mix of key indices, including going back to older ones after the current one has advanced
+	static const uint64_t key_pos[] = {
+		0x10,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x20,
+		0x30,
+		3 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x40,
+		2 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x50,
+		0x60,
+		3 * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x70
+	};
+#define GMAC_BATCH_COUNT (sizeof(key_pos) / sizeof(key_pos[0]))
+
+	uint8_t data[GMAC_BATCH_COUNT][0x80];
+	uint8_t gmac_ref[GMAC_BATCH_COUNT][CHIAKI_GKCRYPT_GMAC_SIZE];
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt;
+	for(size_t i=0; i<GMAC_BATCH_COUNT; i++)
+	{
+		munit_rand_memory(sizeof(data[i]), data[i]);
+
+		// reference from a fresh GKCrypt, so no cipher context is reused
+		ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos[i], data[i], sizeof(data[i]), gmac_ref[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		chiaki_gkcrypt_fini(&gkcrypt);
+	}
+
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// single calls on the same GKCrypt must match too
+	for(size_t i=0; i<GMAC_BATCH_COUNT; i++)
+	{
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos[i], data[i], sizeof(data[i]), gmac);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(gmac), gmac, gmac_ref[i]);
+	}
+
+	uint8_t gmac_wrong[CHIAKI_GKCRYPT_GMAC_SIZE];
+	memcpy(gmac_wrong, gmac_ref[2], sizeof(gmac_wrong));
+	gmac_wrong[0] ^= 1;
+
+	ChiakiGKCryptGmacRequest reqs[GMAC_BATCH_COUNT];
+	for(size_t i=0; i<GMAC_BATCH_COUNT; i++)
+	{
+		reqs[i].key_pos = key_pos[i];
+		reqs[i].buf = data[i];
+		reqs[i].buf_size = sizeof(data[i]);
+		reqs[i].gmac_expected = i == 2 ? gmac_wrong : gmac_ref[i];
+	}
+	reqs[5].gmac_expected = NULL;
+
+	err = chiaki_gkcrypt_gmac_batch(&gkcrypt, reqs, GMAC_BATCH_COUNT);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(size_t i=0; i<GMAC_BATCH_COUNT; i++)
+	{
+		munit_assert_memory_equal(sizeof(reqs[i].gmac), reqs[i].gmac, gmac_ref[i]);
+		munit_assert(reqs[i].valid == (i != 2));
+	}
+#undef GMAC_BATCH_COUNT
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	return MUNIT_OK;
+}
+
 
 MunitTest tests_gkcrypt[] = {
 	{
@@ -397,6 +577,14 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/key_stream_counter_wrap",
+		test_key_stream_counter_wrap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/en_decrypt",
 		test_endecrypt,
@@ -405,6 +593,14 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/key_buf",
+		test_key_buf,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/gmac",
 		test_gmac,
@@ -437,5 +633,13 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_batch",
+		test_gmac_batch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
@@ -11,6 +11,20 @@ extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
+extern MunitTest tests_packet_pool[];
+extern MunitTest tests_spsc_queue[];
+extern MunitTest tests_frame_processor[];
+extern MunitTest tests_frame_pool[];
+extern MunitTest tests_video_jitter[];
+extern MunitTest tests_audio_receiver[];
+extern MunitTest tests_audio_ring[];
+extern MunitTest tests_capture[];
+extern MunitTest tests_net_impair[];
+extern MunitTest tests_bandwidth_estimator[];
+extern MunitTest tests_trace[];
+extern MunitTest tests_event_loop[];
+extern MunitTest tests_timer_wheel[];
+extern MunitTest tests_feedback_sender[];
 
 static MunitSuite suites[] = {
 	{
@@ -76,6 +90,104 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/packet_pool",
+		tests_packet_pool,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/spsc_queue",
+		tests_spsc_queue,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_processor",
+		tests_frame_processor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_pool",
+		tests_frame_pool,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_jitter",
+		tests_video_jitter,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/audio_receiver",
+		tests_audio_receiver,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/audio_ring",
+		tests_audio_ring,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/capture",
+		tests_capture,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/net_impair",
+		tests_net_impair,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/bandwidth_estimator",
+		tests_bandwidth_estimator,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/trace",
+		tests_trace,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/event_loop",
+		tests_event_loop,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/timer_wheel",
+		tests_timer_wheel,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/feedback_sender",
+		tests_feedback_sender,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
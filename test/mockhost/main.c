@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "mockhost.h"
+
+#include <chiaki/common.h>
+#include <chiaki/random.h>
+#include <chiaki/time.h>
+#include <chiaki/netimpair.h>
+#include <chiaki/trace.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct mock_client_t
+{
+	ChiakiLog log;
+	uint64_t start_us;
+	ChiakiBoolPredCond quit_cond;
+
+	ChiakiMutex mutex;
+	uint64_t connected_us;
+	uint64_t first_frame_us;
+	uint64_t frames;
+	uint64_t frames_bytes;
+	ChiakiQuitReason quit_reason;
+} MockClient;
+
+typedef struct mock_run_result_t
+{
+	ChiakiQuitReason quit_reason;
+	uint64_t connected_us; // relative to the start, 0 if never connected
+	uint64_t first_frame_us; // relative to the start
+	uint64_t stream_us; // from the first frame to the end
+	uint64_t frames;
+	uint64_t frames_bytes;
+	ChiakiVideoReceiverStats video;
+	ChiakiNetImpairStats impair;
+	ChiakiBandwidthEstimate estimate;
+} MockRunResult;
+
+typedef struct mock_impair_profile_t
+{
+	const char *name;
+	const char *spec;
+} MockImpairProfile;
+
+static const MockImpairProfile impair_profiles[] = {
+	{ "clean", "" },
+	{ "loss 1%", "seed=1,loss=1" },
+	{ "loss 5% bursty", "seed=1,loss=5,burst=4" },
+	{ "reorder", "seed=1,reorder=5,reorder_delay=5" },
+	{ "duplicate", "seed=1,dup=5" },
+	{ "jitter", "seed=1,delay=20,jitter=10" },
+	{ "wifi", "seed=1,loss=2,burst=3,delay=5,jitter=8,reorder=1" },
+	{ "rate cap", "seed=1,rate=8000,queue=50" }
+};
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n"
+			"Run a session against a mock console on 127.0.0.1 and measure the client side of streaming.\n\n"
+			"  --ps5              act as a PS5 instead of a PS4\n"
+			"  --fps N            frames per second to send, default from the launch spec\n"
+			"  --bitrate KBPS     video bitrate to send, default from the launch spec\n"
+			"  --fec PERCENT      fec units per frame relative to the source units, default 5\n"
+			"  --h264 FILE        loop an annex b H264 stream instead of synthetic frames\n"
+			"  --resolution P     360, 540, 720 or 1080, default 720\n"
+			"  --duration S       seconds to stream, default 5\n"
+			"  --impair SPEC      impair received stream packets, see chiaki_net_impair_config_parse()\n"
+			"  --impair-profiles  run one session per built-in impairment profile and compare them\n"
+			"  --pipeline         process AV packets on the AV pipeline threads\n"
+			"  --event-loop       run timers of the session on one event loop thread\n"
+			"  --stall-stream     never let the stream connect, the session is stopped while connecting\n"
+			"  --trace FILE       record per-frame latency, print a summary and write a Chrome trace to FILE\n"
+			"  --verbose          log everything\n", argv0);
+}
+
+static uint64_t process_cpu_us(void)
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static bool mock_client_video_frame(ChiakiVideoFrame *frame, void *user)
+{
+	MockClient *client = user;
+	if(frame->frame_index < 0) // codec headers
+		return true;
+	chiaki_mutex_lock(&client->mutex);
+	if(!client->frames)
+		client->first_frame_us = chiaki_time_now_monotonic_us();
+	client->frames++;
+	client->frames_bytes += frame->buf_size;
+	chiaki_mutex_unlock(&client->mutex);
+	return true;
+}
+
+static void mock_client_event(ChiakiEvent *event, void *user)
+{
+	MockClient *client = user;
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			chiaki_mutex_lock(&client->mutex);
+			client->connected_us = chiaki_time_now_monotonic_us();
+			chiaki_mutex_unlock(&client->mutex);
+			break;
+		case CHIAKI_EVENT_QUIT:
+			chiaki_mutex_lock(&client->mutex);
+			client->quit_reason = event->quit.reason;
+			chiaki_mutex_unlock(&client->mutex);
+			chiaki_bool_pred_cond_signal(&client->quit_cond);
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Run one session against the already started host until it quits or duration_s has passed.
+ */
+static ChiakiErrorCode mock_client_run(MockClient *client, ChiakiConnectInfo *connect_info, double duration_s, MockRunResult *result)
+{
+	memset(result, 0, sizeof(*result));
+	chiaki_mutex_lock(&client->mutex);
+	client->connected_us = 0;
+	client->first_frame_us = 0;
+	client->frames = 0;
+	client->frames_bytes = 0;
+	client->quit_reason = CHIAKI_QUIT_REASON_NONE;
+	chiaki_mutex_unlock(&client->mutex);
+	chiaki_bool_pred_cond_lock(&client->quit_cond);
+	client->quit_cond.pred = false;
+	chiaki_bool_pred_cond_unlock(&client->quit_cond);
+
+	ChiakiSession session;
+	ChiakiErrorCode err = chiaki_session_init(&session, connect_info, &client->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Session init failed: %s\n", chiaki_error_string(err));
+		return err;
+	}
+	chiaki_session_set_event_cb(&session, mock_client_event, client);
+	chiaki_session_set_video_frame_cb(&session, mock_client_video_frame, client);
+
+	client->start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_session_start(&session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Session start failed: %s\n", chiaki_error_string(err));
+		chiaki_session_fini(&session);
+		return err;
+	}
+
+	chiaki_bool_pred_cond_lock(&client->quit_cond);
+	chiaki_bool_pred_cond_timedwait(&client->quit_cond, (uint64_t)(duration_s * 1000.0));
+	chiaki_bool_pred_cond_unlock(&client->quit_cond);
+	uint64_t end_us = chiaki_time_now_monotonic_us();
+
+	chiaki_session_stop(&session);
+	chiaki_session_join(&session);
+
+	chiaki_mutex_lock(&client->mutex);
+	result->quit_reason = client->quit_reason;
+	if(client->connected_us)
+		result->connected_us = client->connected_us - client->start_us;
+	result->frames = client->frames;
+	result->frames_bytes = client->frames_bytes;
+	if(client->frames)
+	{
+		result->first_frame_us = client->first_frame_us - client->start_us;
+		result->stream_us = end_us - client->first_frame_us;
+	}
+	chiaki_mutex_unlock(&client->mutex);
+	result->video = session.stream_connection.video_receiver_stats;
+	result->impair = session.stream_connection.takion.net_impair.stats;
+	chiaki_session_get_bandwidth_estimate(&session, &result->estimate);
+
+	chiaki_session_fini(&session);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void print_impair_report(MockHost *host, ChiakiConnectInfo *connect_info, MockClient *client, double duration_s)
+{
+	printf("%-16s %8s %8s %10s %10s %10s %8s %9s %10s %8s %9s\n",
+			"profile", "frames", "fps", "fec ok", "incomplete", "corrupt", "lost", "duplicated", "est Mbit/s", "qdelay", "usage");
+	for(size_t i=0; i<sizeof(impair_profiles) / sizeof(impair_profiles[0]); i++)
+	{
+		ChiakiNetImpairConfig impair;
+		ChiakiErrorCode err = chiaki_net_impair_config_parse(&impair, impair_profiles[i].spec);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		connect_info->net_impair = &impair;
+
+		MockHostStats stats_before;
+		mock_host_get_stats(host, &stats_before);
+		MockRunResult result;
+		err = mock_client_run(client, connect_info, duration_s, &result);
+		connect_info->net_impair = NULL;
+		if(err != CHIAKI_ERR_SUCCESS)
+			continue;
+		MockHostStats stats;
+		mock_host_get_stats(host, &stats);
+
+		double stream_s = (double)result.stream_us / 1000000.0;
+		printf("%-16s %8llu %8.1f %10llu %10llu %10llu %8llu %9llu %10.2f %6.1fms %9s\n",
+				impair_profiles[i].name, (unsigned long long)result.frames,
+				stream_s > 0.0 ? (double)result.frames / stream_s : 0.0,
+				(unsigned long long)result.video.frames_fec_recovered,
+				(unsigned long long)(result.video.frames_fec_failed + result.video.frames_failed),
+				(unsigned long long)(stats.corrupt_reports - stats_before.corrupt_reports),
+				(unsigned long long)(result.impair.dropped_loss + result.impair.dropped_queue),
+				(unsigned long long)result.impair.duplicated,
+				(double)result.estimate.bitrate / 1000000.0,
+				(double)result.estimate.queue_delay_us / 1000.0,
+				chiaki_bandwidth_usage_string(result.estimate.usage));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	MockClient client;
+	memset(&client, 0, sizeof(client));
+	MockHostSettings settings;
+	memset(&settings, 0, sizeof(settings));
+	settings.fec_percent = 5;
+	ChiakiVideoResolutionPreset resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+	double duration_s = 5.0;
+	const char *impair_spec = NULL;
+	bool impair_profiles_run = false;
+	bool pipeline = false;
+	bool event_loop = false;
+	bool verbose = false;
+	const char *trace_filename = NULL;
+	for(int i=1; i<argc; i++)
+	{
+		bool has_value = i + 1 < argc;
+		if(!strcmp(argv[i], "--ps5"))
+			settings.ps5 = true;
+		else if(!strcmp(argv[i], "--fps") && has_value)
+			settings.fps = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--bitrate") && has_value)
+			settings.bitrate_kbps = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--fec") && has_value)
+			settings.fec_percent = (unsigned int)atoi(argv[++i]);
+		else if(!strcmp(argv[i], "--h264") && has_value)
+			settings.h264_filename = argv[++i];
+		else if(!strcmp(argv[i], "--duration") && has_value)
+			duration_s = atof(argv[++i]);
+		else if(!strcmp(argv[i], "--resolution") && has_value)
+		{
+			int p = atoi(argv[++i]);
+			if(p == 360)
+				resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+			else if(p == 540)
+				resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+			else if(p == 1080)
+				resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_1080p;
+		}
+		else if(!strcmp(argv[i], "--impair") && has_value)
+			impair_spec = argv[++i];
+		else if(!strcmp(argv[i], "--impair-profiles"))
+			impair_profiles_run = true;
+		else if(!strcmp(argv[i], "--pipeline"))
+			pipeline = true;
+		else if(!strcmp(argv[i], "--event-loop"))
+			event_loop = true;
+		else if(!strcmp(argv[i], "--stall-stream"))
+			settings.stall_stream = true;
+		else if(!strcmp(argv[i], "--trace") && has_value)
+			trace_filename = argv[++i];
+		else if(!strcmp(argv[i], "--verbose"))
+			verbose = true;
+		else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	ChiakiNetImpairConfig impair;
+	if(impair_spec && chiaki_net_impair_config_parse(&impair, impair_spec) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Invalid impairment \"%s\"\n", impair_spec);
+		return 1;
+	}
+
+	chiaki_log_init(&client.log, verbose ? CHIAKI_LOG_ALL : (CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG)), chiaki_log_cb_print, NULL);
+
+	ChiakiErrorCode err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Chiaki lib init failed: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	int ret = 1;
+	if(chiaki_mutex_init(&client.mutex, false) != CHIAKI_ERR_SUCCESS)
+		return 1;
+	if(chiaki_bool_pred_cond_init(&client.quit_cond) != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	chiaki_random_bytes_crypt(settings.morning, sizeof(settings.morning));
+	MockHost host;
+	err = mock_host_start(&host, &client.log, &settings);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Mock host start failed: %s\n", chiaki_error_string(err));
+		goto error_quit_cond;
+	}
+
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.ps5 = settings.ps5;
+	connect_info.host = "127.0.0.1";
+	memcpy(connect_info.morning, settings.morning, sizeof(connect_info.morning));
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, resolution, CHIAKI_VIDEO_FPS_PRESET_60);
+	connect_info.disable_av_pipeline = !pipeline;
+	connect_info.event_loop = event_loop;
+	connect_info.net_impair = impair_spec ? &impair : NULL;
+
+	if(impair_profiles_run)
+	{
+		print_impair_report(&host, &connect_info, &client, duration_s);
+		mock_host_stop(&host);
+		ret = 0;
+		goto error_quit_cond;
+	}
+
+	if(trace_filename)
+	{
+		chiaki_trace_clear();
+		err = chiaki_trace_enable();
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			fprintf(stderr, "Failed to enable tracing: %s\n", chiaki_error_string(err));
+			mock_host_stop(&host);
+			goto error_quit_cond;
+		}
+	}
+
+	uint64_t cpu_start_us = process_cpu_us();
+	MockRunResult result;
+	err = mock_client_run(&client, &connect_info, duration_s, &result);
+	mock_host_stop(&host);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_quit_cond;
+	if(trace_filename)
+	{
+		chiaki_trace_disable();
+		chiaki_trace_report(trace_filename, &client.log);
+	}
+	uint64_t cpu_us = process_cpu_us() - cpu_start_us;
+
+	MockHostStats stats;
+	mock_host_get_stats(&host, &stats);
+	uint64_t client_cpu_us = cpu_us > stats.cpu_us ? cpu_us - stats.cpu_us : 0;
+
+	if(settings.stall_stream)
+	{
+		// all that matters is that the session could be stopped cleanly
+		printf("Session stopped while connecting: %s\n", chiaki_quit_reason_string(result.quit_reason));
+		ret = result.quit_reason == CHIAKI_QUIT_REASON_STOPPED && !result.connected_us ? 0 : 1;
+		goto error_quit_cond;
+	}
+	if(result.quit_reason != CHIAKI_QUIT_REASON_NONE && result.quit_reason != CHIAKI_QUIT_REASON_STOPPED)
+		printf("Session quit early: %s\n", chiaki_quit_reason_string(result.quit_reason));
+	if(result.connected_us)
+		printf("Time to connected: %.1f ms\n", (double)result.connected_us / 1000.0);
+	if(result.frames)
+	{
+		double stream_s = (double)result.stream_us / 1000000.0;
+		printf("Time to first frame: %.1f ms\n", (double)result.first_frame_us / 1000.0);
+		printf("Received %llu frames, %llu bytes: %.1f frames/s, %.2f Mbit/s, %llu recovered by FEC, %llu incomplete\n",
+				(unsigned long long)result.frames, (unsigned long long)result.frames_bytes,
+				stream_s > 0.0 ? (double)result.frames / stream_s : 0.0,
+				stream_s > 0.0 ? (double)result.frames_bytes * 8.0 / stream_s / 1000000.0 : 0.0,
+				(unsigned long long)result.video.frames_fec_recovered,
+				(unsigned long long)(result.video.frames_fec_failed + result.video.frames_failed));
+		printf("Bandwidth estimate: %.2f Mbit/s (receiving %.2f Mbit/s), queue delay %.1f ms, loss %.1f%%, %s\n",
+				(double)result.estimate.bitrate / 1000000.0, (double)result.estimate.receive_bitrate / 1000000.0,
+				(double)result.estimate.queue_delay_us / 1000.0, result.estimate.loss_rate * 100.0,
+				chiaki_bandwidth_usage_string(result.estimate.usage));
+		printf("Client CPU: %.1f us per frame\n", (double)client_cpu_us / (double)result.frames);
+		ret = 0;
+	}
+	else
+		fprintf(stderr, "No frames received\n");
+	printf("Host sent %llu frames in %llu packets (%llu fec), %llu truncated, %llu corrupt frame reports, %.1f us CPU per frame\n",
+			(unsigned long long)stats.frames, (unsigned long long)stats.packets, (unsigned long long)stats.fec_units,
+			(unsigned long long)stats.frames_truncated, (unsigned long long)stats.corrupt_reports,
+			stats.frames ? (double)stats.cpu_us / (double)stats.frames : 0.0);
+
+error_quit_cond:
+	chiaki_bool_pred_cond_fini(&client.quit_cond);
+error_mutex:
+	chiaki_mutex_fini(&client.mutex);
+	return ret;
+}
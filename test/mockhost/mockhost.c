@@ -0,0 +1,1361 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "mockhost.h"
+
+#include <chiaki/takion.h>
+#include <chiaki/gkcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/fec.h>
+#include <chiaki/audio.h>
+#include <chiaki/http.h>
+#include <chiaki/base64.h>
+#include <chiaki/random.h>
+#include <chiaki/time.h>
+
+#include <takion.pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "pb_utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SESSION_PORT 9295
+#define STREAM_CONNECTION_PORT 9296
+#define SENKUSHA_PORT 9297
+
+#define TAKION_PACKET_TYPE_CONTROL 0
+#define TAKION_PACKET_TYPE_VIDEO 2
+#define TAKION_PACKET_TYPE_AUDIO 3
+#define TAKION_PACKET_BASE_TYPE_MASK 0xf
+
+#define TAKION_CHUNK_TYPE_DATA 0
+#define TAKION_CHUNK_TYPE_INIT 1
+#define TAKION_CHUNK_TYPE_INIT_ACK 2
+#define TAKION_CHUNK_TYPE_DATA_ACK 3
+#define TAKION_CHUNK_TYPE_COOKIE 0xa
+#define TAKION_CHUNK_TYPE_COOKIE_ACK 0xb
+
+#define TAKION_MESSAGE_HEADER_SIZE 0x10
+#define TAKION_DATA_HEADER_SIZE 9
+#define TAKION_COOKIE_SIZE 0x20
+#define TAKION_A_RWND 0x19000
+#define TAKION_STREAMS 0x64
+
+#define CTRL_MESSAGE_TYPE_SESSION_ID 0x33
+#define CTRL_EXPECT_TIMEOUT_MS 5000
+
+#define UDP_PACKET_ADD 0x1c // ip and udp header
+#define MTU_DEFAULT 1454
+#define PACKET_BUF_SIZE 1500
+#define RECV_BUF_SIZE 0x800
+
+#define VIDEO_HEADER_SIZE (CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE + CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD)
+#define FRAME_BUF_SIZE (CHIAKI_FEC_UNITS_MAX * PACKET_BUF_SIZE)
+#define IDR_SIZE_FACTOR 3
+
+// the client only accepts the streaminfo after it has finished handling the bang
+#define STREAMINFO_DELAY_US 10000
+#define STREAMINFO_RESEND_US 100000
+
+static uint64_t thread_cpu_us(void)
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void host_add_thread_cpu(MockHost *host)
+{
+	uint64_t cpu_us = thread_cpu_us();
+	chiaki_mutex_lock(&host->state_mutex);
+	host->stats.cpu_us += cpu_us;
+	chiaki_mutex_unlock(&host->state_mutex);
+}
+
+static chiaki_socket_t socket_create_bound(int type, uint16_t port)
+{
+	chiaki_socket_t sock = socket(AF_INET, type, 0);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return CHIAKI_INVALID_SOCKET;
+
+	const int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+			|| (type == SOCK_STREAM && listen(sock, 4) < 0))
+	{
+		CHIAKI_SOCKET_CLOSE(sock);
+		return CHIAKI_INVALID_SOCKET;
+	}
+	return sock;
+}
+
+static bool encode_bang(uint8_t *buf, size_t buf_size, size_t *written, uint32_t server_version, ChiakiPBBuf *ecdh_pub_key, ChiakiPBBuf *ecdh_sig)
+{
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_BANG;
+	msg.has_bang_payload = true;
+	msg.bang_payload.server_version = server_version;
+	msg.bang_payload.token = 0;
+	msg.bang_payload.encrypted_key_accepted = true;
+	msg.bang_payload.version_accepted = true;
+	msg.bang_payload.session_key.arg = "";
+	msg.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	if(ecdh_pub_key)
+	{
+		msg.bang_payload.ecdh_pub_key.arg = ecdh_pub_key;
+		msg.bang_payload.ecdh_pub_key.funcs.encode = chiaki_pb_encode_buf;
+	}
+	if(ecdh_sig)
+	{
+		msg.bang_payload.ecdh_sig.arg = ecdh_sig;
+		msg.bang_payload.ecdh_sig.funcs.encode = chiaki_pb_encode_buf;
+	}
+
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, buf_size);
+	if(!pb_encode(&stream, tkproto_TakionMessage_fields, &msg))
+		return false;
+	*written = stream.bytes_written;
+	return true;
+}
+
+// ---------------- Takion ----------------
+
+/**
+ * The host side of a Takion connection, just enough to answer the handshake and exchange data messages.
+ */
+typedef struct mock_takion_t
+{
+	MockHost *host;
+	const char *name;
+	chiaki_socket_t sock;
+	struct sockaddr_in peer;
+	bool connected;
+	uint32_t tag_local;
+	uint32_t tag_remote;
+	ChiakiSeqNum32 seq_num_local;
+	uint64_t key_pos_local;
+	ChiakiGKCrypt *gkcrypt_local; // messages are MACed with this once set
+} MockTakion;
+
+typedef enum
+{
+	MOCK_TAKION_MESSAGE_NONE,
+	MOCK_TAKION_MESSAGE_INIT, // a new connection has started
+	MOCK_TAKION_MESSAGE_DATA
+} MockTakionMessageType;
+
+static void mock_takion_init(MockTakion *takion, MockHost *host, const char *name, chiaki_socket_t sock)
+{
+	memset(takion, 0, sizeof(*takion));
+	takion->host = host;
+	takion->name = name;
+	takion->sock = sock;
+}
+
+static void mock_takion_reset(MockTakion *takion)
+{
+	chiaki_gkcrypt_free(takion->gkcrypt_local);
+	takion->gkcrypt_local = NULL;
+	takion->key_pos_local = 0;
+	takion->connected = false;
+}
+
+static ChiakiErrorCode mock_takion_recv(MockTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->host->stop_pipe, takion->sock, false, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	ssize_t received = recvfrom(takion->sock, buf, *buf_size, 0, (struct sockaddr *)&addr, &addr_len);
+	if(received <= 0)
+		return CHIAKI_ERR_NETWORK;
+	takion->peer = addr;
+	*buf_size = (size_t)received;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void mock_takion_send_raw(MockTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	if(sendto(takion->sock, buf, buf_size, 0, (struct sockaddr *)&takion->peer, sizeof(takion->peer)) < 0)
+		CHIAKI_LOGW(takion->host->log, "Mock %s failed to send: " CHIAKI_SOCKET_ERROR_FMT, takion->name, CHIAKI_SOCKET_ERROR_VALUE);
+}
+
+static void mock_takion_send(MockTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
+{
+	if(takion->gkcrypt_local)
+		chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, key_pos, NULL, NULL);
+	mock_takion_send_raw(takion, buf, buf_size);
+}
+
+static uint64_t mock_takion_advance_key_pos(MockTakion *takion, size_t data_size)
+{
+	if(!takion->gkcrypt_local)
+		return 0;
+	uint64_t key_pos = takion->key_pos_local;
+	takion->key_pos_local += data_size;
+	return key_pos;
+}
+
+static void mock_takion_send_message(MockTakion *takion, uint8_t chunk_type, uint8_t chunk_flags, const uint8_t *payload, size_t payload_size)
+{
+	uint8_t buf[PACKET_BUF_SIZE];
+	if(1 + TAKION_MESSAGE_HEADER_SIZE + payload_size > sizeof(buf))
+	{
+		CHIAKI_LOGE(takion->host->log, "Mock %s message of %#llx bytes is too large", takion->name, (unsigned long long)payload_size);
+		return;
+	}
+
+	uint64_t key_pos = mock_takion_advance_key_pos(takion, payload_size);
+	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	uint8_t *header = buf + 1;
+	*((chiaki_unaligned_uint32_t *)(header + 0)) = htonl(takion->tag_remote);
+	memset(header + 4, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	*((chiaki_unaligned_uint32_t *)(header + 8)) = htonl((uint32_t)key_pos);
+	header[0xc] = chunk_type;
+	header[0xd] = chunk_flags;
+	*((chiaki_unaligned_uint16_t *)(header + 0xe)) = htons((uint16_t)(payload_size + 4));
+	if(payload_size)
+		memcpy(buf + 1 + TAKION_MESSAGE_HEADER_SIZE, payload, payload_size);
+	mock_takion_send(takion, buf, 1 + TAKION_MESSAGE_HEADER_SIZE + payload_size, key_pos);
+}
+
+static void mock_takion_send_data(MockTakion *takion, uint16_t channel, const uint8_t *buf, size_t buf_size)
+{
+	uint8_t payload[PACKET_BUF_SIZE];
+	if(TAKION_DATA_HEADER_SIZE + buf_size > sizeof(payload))
+	{
+		CHIAKI_LOGE(takion->host->log, "Mock %s data of %#llx bytes is too large", takion->name, (unsigned long long)buf_size);
+		return;
+	}
+	*((chiaki_unaligned_uint32_t *)(payload + 0)) = htonl(takion->seq_num_local++);
+	*((chiaki_unaligned_uint16_t *)(payload + 4)) = htons(channel);
+	*((chiaki_unaligned_uint16_t *)(payload + 6)) = 0;
+	payload[8] = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF;
+	memcpy(payload + TAKION_DATA_HEADER_SIZE, buf, buf_size);
+	mock_takion_send_message(takion, TAKION_CHUNK_TYPE_DATA, 1, payload, TAKION_DATA_HEADER_SIZE + buf_size);
+}
+
+/**
+ * Handle a control packet, answering the handshake and acking data.
+ *
+ * @param data if MOCK_TAKION_MESSAGE_DATA is returned, set to the protobuf payload inside buf
+ */
+static MockTakionMessageType mock_takion_handle(MockTakion *takion, uint8_t *buf, size_t buf_size, uint8_t **data, size_t *data_size)
+{
+	if(buf_size < 1 + TAKION_MESSAGE_HEADER_SIZE || buf[0] != TAKION_PACKET_TYPE_CONTROL)
+		return MOCK_TAKION_MESSAGE_NONE;
+
+	uint8_t *header = buf + 1;
+	uint8_t chunk_type = header[0xc];
+	size_t payload_size = ntohs(*((chiaki_unaligned_uint16_t *)(header + 0xe)));
+	if(payload_size < 4 || payload_size - 4 > buf_size - 1 - TAKION_MESSAGE_HEADER_SIZE)
+	{
+		CHIAKI_LOGW(takion->host->log, "Mock %s received message with invalid size", takion->name);
+		return MOCK_TAKION_MESSAGE_NONE;
+	}
+	payload_size -= 4;
+	uint8_t *payload = header + TAKION_MESSAGE_HEADER_SIZE;
+
+	switch(chunk_type)
+	{
+		case TAKION_CHUNK_TYPE_INIT:
+		{
+			if(payload_size < 0x10)
+				return MOCK_TAKION_MESSAGE_NONE;
+			mock_takion_reset(takion);
+			takion->tag_remote = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+			do
+				takion->tag_local = chiaki_random_32();
+			while(!takion->tag_local);
+			takion->seq_num_local = takion->tag_local;
+
+			uint8_t init_ack[0x10 + TAKION_COOKIE_SIZE];
+			*((chiaki_unaligned_uint32_t *)(init_ack + 0)) = htonl(takion->tag_local);
+			*((chiaki_unaligned_uint32_t *)(init_ack + 4)) = htonl(TAKION_A_RWND);
+			*((chiaki_unaligned_uint16_t *)(init_ack + 8)) = htons(TAKION_STREAMS);
+			*((chiaki_unaligned_uint16_t *)(init_ack + 0xa)) = htons(TAKION_STREAMS);
+			*((chiaki_unaligned_uint32_t *)(init_ack + 0xc)) = htonl(takion->seq_num_local);
+			chiaki_random_bytes_crypt(init_ack + 0x10, TAKION_COOKIE_SIZE);
+			mock_takion_send_message(takion, TAKION_CHUNK_TYPE_INIT_ACK, 0, init_ack, sizeof(init_ack));
+			CHIAKI_LOGI(takion->host->log, "Mock %s received Takion init from tag %#x", takion->name, (unsigned int)takion->tag_remote);
+			return MOCK_TAKION_MESSAGE_INIT;
+		}
+		case TAKION_CHUNK_TYPE_COOKIE:
+			mock_takion_send_message(takion, TAKION_CHUNK_TYPE_COOKIE_ACK, 0, NULL, 0);
+			takion->connected = true;
+			return MOCK_TAKION_MESSAGE_NONE;
+		case TAKION_CHUNK_TYPE_DATA:
+		{
+			if(payload_size < TAKION_DATA_HEADER_SIZE)
+				return MOCK_TAKION_MESSAGE_NONE;
+			uint8_t ack[0xc] = { 0 };
+			memcpy(ack, payload, sizeof(uint32_t)); // cumulative seq num
+			*((chiaki_unaligned_uint32_t *)(ack + 4)) = htonl(TAKION_A_RWND);
+			mock_takion_send_message(takion, TAKION_CHUNK_TYPE_DATA_ACK, 0, ack, sizeof(ack));
+			if(payload[8] != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF)
+				return MOCK_TAKION_MESSAGE_NONE;
+			*data = payload + TAKION_DATA_HEADER_SIZE;
+			*data_size = payload_size - TAKION_DATA_HEADER_SIZE;
+			return MOCK_TAKION_MESSAGE_DATA;
+		}
+		default:
+			return MOCK_TAKION_MESSAGE_NONE;
+	}
+}
+
+// ---------------- Ctrl ----------------
+
+static ChiakiErrorCode ctrl_send_all(chiaki_socket_t sock, const void *buf, size_t buf_size)
+{
+	const uint8_t *cur = buf;
+	while(buf_size)
+	{
+		ssize_t sent = send(sock, cur, buf_size, 0);
+		if(sent <= 0)
+			return CHIAKI_ERR_NETWORK;
+		cur += sent;
+		buf_size -= (size_t)sent;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void ctrl_send_status(chiaki_socket_t sock, const char *status)
+{
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+	ctrl_send_all(sock, buf, (size_t)len);
+}
+
+static void ctrl_serve_session_request(MockHost *host, chiaki_socket_t sock, const char *path, ChiakiHttpHeader *headers)
+{
+	bool ps5 = strstr(path, "/ps5/") != NULL;
+	ChiakiTarget target = CHIAKI_TARGET_PS4_UNKNOWN;
+	for(ChiakiHttpHeader *header=headers; header; header=header->next)
+	{
+		if(strcasecmp(header->key, "RP-Version") == 0)
+			target = chiaki_rp_version_parse(header->value, ps5);
+	}
+	if(chiaki_target_is_unknown(target))
+	{
+		CHIAKI_LOGW(host->log, "Mock session request has no known RP-Version, assuming the latest");
+		target = ps5 ? CHIAKI_TARGET_PS5_1 : CHIAKI_TARGET_PS4_10;
+	}
+
+	uint8_t nonce[CHIAKI_RPCRYPT_KEY_SIZE];
+	char nonce_b64[32];
+	uint8_t id_random[MOCK_HOST_SESSION_ID_SIZE];
+	if(chiaki_random_bytes_crypt(nonce, sizeof(nonce)) != CHIAKI_ERR_SUCCESS
+			|| chiaki_random_bytes_crypt(id_random, sizeof(id_random)) != CHIAKI_ERR_SUCCESS
+			|| chiaki_base64_encode(nonce, sizeof(nonce), nonce_b64, sizeof(nonce_b64)) != CHIAKI_ERR_SUCCESS)
+	{
+		ctrl_send_status(sock, "500 Internal Server Error");
+		return;
+	}
+
+	static const char id_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	chiaki_mutex_lock(&host->state_mutex);
+	chiaki_rpcrypt_init_auth(&host->rpcrypt, target, nonce, host->settings.morning);
+	host->target = target;
+	for(size_t i=0; i<MOCK_HOST_SESSION_ID_SIZE; i++)
+		host->session_id[i] = id_chars[id_random[i] % (sizeof(id_chars) - 1)];
+	host->session_id[MOCK_HOST_SESSION_ID_SIZE] = '\0';
+	host->session_valid = true;
+	chiaki_mutex_unlock(&host->state_mutex);
+
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/html; charset=UTF-8\r\n"
+			"RP-Version: %s\r\n"
+			"RP-Nonce: %s\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n",
+			chiaki_rp_version_string(target), nonce_b64);
+	ctrl_send_all(sock, buf, (size_t)len);
+	CHIAKI_LOGI(host->log, "Mock accepted session request for %s", chiaki_rp_version_string(target));
+}
+
+static void ctrl_serve_ctrl(MockHost *host, chiaki_socket_t sock)
+{
+	chiaki_mutex_lock(&host->state_mutex);
+	bool valid = host->session_valid;
+	ChiakiRPCrypt rpcrypt = host->rpcrypt;
+	ChiakiTarget target = host->target;
+	char session_id[MOCK_HOST_SESSION_ID_SIZE + 1];
+	memcpy(session_id, host->session_id, sizeof(session_id));
+	chiaki_mutex_unlock(&host->state_mutex);
+
+	if(!valid)
+	{
+		CHIAKI_LOGW(host->log, "Mock received ctrl request without a session request before");
+		ctrl_send_status(sock, "403 Forbidden");
+		return;
+	}
+
+	uint8_t server_type[0x10] = { 0 };
+	server_type[0] = chiaki_target_is_ps5(target) ? 2 : 1; // PS5 or PS4 Pro
+	char server_type_b64[32];
+	if(chiaki_rpcrypt_encrypt(&rpcrypt, 0, server_type, server_type, sizeof(server_type)) != CHIAKI_ERR_SUCCESS
+			|| chiaki_base64_encode(server_type, sizeof(server_type), server_type_b64, sizeof(server_type_b64)) != CHIAKI_ERR_SUCCESS)
+	{
+		ctrl_send_status(sock, "500 Internal Server Error");
+		return;
+	}
+
+	char buf[256];
+	int len = snprintf(buf, sizeof(buf),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/html; charset=UTF-8\r\n"
+			"RP-Server-Type: %s\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n",
+			server_type_b64);
+	if(ctrl_send_all(sock, buf, (size_t)len) != CHIAKI_ERR_SUCCESS)
+		return;
+
+	uint8_t msg[8 + 1 + MOCK_HOST_SESSION_ID_SIZE];
+	size_t payload_size = 1 + MOCK_HOST_SESSION_ID_SIZE;
+	*((chiaki_unaligned_uint32_t *)(msg + 0)) = htonl((uint32_t)payload_size);
+	*((chiaki_unaligned_uint16_t *)(msg + 4)) = htons(CTRL_MESSAGE_TYPE_SESSION_ID);
+	*((chiaki_unaligned_uint16_t *)(msg + 6)) = 0;
+	msg[8] = 0x4a;
+	memcpy(msg + 9, session_id, MOCK_HOST_SESSION_ID_SIZE);
+	if(chiaki_rpcrypt_encrypt(&rpcrypt, 1, msg + 8, msg + 8, payload_size) != CHIAKI_ERR_SUCCESS
+			|| ctrl_send_all(sock, msg, sizeof(msg)) != CHIAKI_ERR_SUCCESS)
+		return;
+	CHIAKI_LOGI(host->log, "Mock ctrl sent session id %s", session_id);
+
+	// nothing the client sends on ctrl matters here, just keep the connection until it is closed
+	while(chiaki_stop_pipe_select_single(&host->stop_pipe, sock, false, UINT64_MAX) == CHIAKI_ERR_SUCCESS)
+	{
+		uint8_t drain[0x100];
+		if(recv(sock, drain, sizeof(drain), 0) <= 0)
+			break;
+	}
+	CHIAKI_LOGI(host->log, "Mock ctrl connection closed");
+}
+
+static void ctrl_handle_connection(MockHost *host, chiaki_socket_t sock)
+{
+	char buf[0x1000];
+	size_t header_size;
+	size_t received_size;
+	ChiakiErrorCode err = chiaki_recv_http_header(sock, buf, sizeof(buf) - 1, &header_size, &received_size, &host->stop_pipe, CTRL_EXPECT_TIMEOUT_MS);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+	buf[header_size] = '\0';
+
+	char *line_end = strstr(buf, "\r\n");
+	if(!line_end || strncmp(buf, "GET ", 4) != 0)
+	{
+		ctrl_send_status(sock, "400 Bad Request");
+		return;
+	}
+	*line_end = '\0';
+	char *path = buf + 4;
+	char *path_end = strchr(path, ' ');
+	if(path_end)
+		*path_end = '\0';
+
+	ChiakiHttpHeader *headers;
+	char *headers_buf = line_end + 2;
+	err = chiaki_http_header_parse(&headers, headers_buf, header_size - (size_t)(headers_buf - buf));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		ctrl_send_status(sock, "400 Bad Request");
+		return;
+	}
+
+	size_t path_len = strlen(path);
+	if(path_len >= 5 && strcmp(path + path_len - 5, "/ctrl") == 0)
+		ctrl_serve_ctrl(host, sock);
+	else if(strstr(path, "/rp/sess"))
+		ctrl_serve_session_request(host, sock, path, headers);
+	else
+	{
+		CHIAKI_LOGW(host->log, "Mock received request for unknown path %s", path);
+		ctrl_send_status(sock, "404 Not Found");
+	}
+	chiaki_http_header_free(headers);
+}
+
+static void *ctrl_thread_func(void *user)
+{
+	MockHost *host = user;
+	while(chiaki_stop_pipe_select_single(&host->stop_pipe, host->ctrl_sock, false, UINT64_MAX) == CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_socket_t sock = accept(host->ctrl_sock, NULL, NULL);
+		if(CHIAKI_SOCKET_IS_INVALID(sock))
+			continue;
+		ctrl_handle_connection(host, sock);
+		CHIAKI_SOCKET_CLOSE(sock);
+	}
+	host_add_thread_cpu(host);
+	return NULL;
+}
+
+// ---------------- Senkusha ----------------
+
+static void senkusha_send_mtu_response(MockTakion *takion, uint32_t id, uint32_t mtu_req)
+{
+	uint8_t buf[PACKET_BUF_SIZE] = { 0 };
+	size_t size = mtu_req > UDP_PACKET_ADD ? mtu_req - UDP_PACKET_ADD : 0;
+	if(size > sizeof(buf))
+		size = sizeof(buf);
+	if(size < VIDEO_HEADER_SIZE + 8)
+		size = VIDEO_HEADER_SIZE + 8;
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.frame_index = (ChiakiSeqNum16)id;
+	packet.units_in_frame_total = 1;
+	size_t header_size;
+	chiaki_takion_v7_av_packet_format_header(buf, sizeof(buf), &header_size, &packet);
+	mock_takion_send_raw(takion, buf, size);
+}
+
+static void senkusha_handle_data(MockTakion *takion, uint8_t *buf, size_t buf_size)
+{
+	MockHost *host = takion->host;
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	pb_istream_t stream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGW(host->log, "Mock Senkusha failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+		{
+			uint8_t bang[64];
+			size_t bang_size;
+			if(encode_bang(bang, sizeof(bang), &bang_size, 7, NULL, NULL))
+				mock_takion_send_data(takion, 1, bang, bang_size);
+			break;
+		}
+		case tkproto_TakionMessage_PayloadType_SENKUSHA:
+			if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_MTU_COMMAND && msg.senkusha_payload.has_mtu_command)
+				senkusha_send_mtu_response(takion, msg.senkusha_payload.mtu_command.id, msg.senkusha_payload.mtu_command.mtu_req);
+			else if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_CLIENT_MTU_COMMAND
+					&& msg.senkusha_payload.has_client_mtu_command
+					&& msg.senkusha_payload.client_mtu_command.state)
+			{
+				// confirm by echoing the command, then the client starts its outbound pings
+				uint8_t reply[64];
+				pb_ostream_t ostream = pb_ostream_from_buffer(reply, sizeof(reply));
+				if(pb_encode(&ostream, tkproto_TakionMessage_fields, &msg))
+					mock_takion_send_data(takion, 8, reply, ostream.bytes_written);
+			}
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(host->log, "Mock Senkusha disconnected");
+			mock_takion_reset(takion);
+			break;
+		default:
+			break;
+	}
+}
+
+static void *senkusha_thread_func(void *user)
+{
+	MockHost *host = user;
+	MockTakion takion;
+	mock_takion_init(&takion, host, "Senkusha", host->senkusha_sock);
+
+	uint8_t buf[RECV_BUF_SIZE];
+	while(true)
+	{
+		size_t size = sizeof(buf);
+		ChiakiErrorCode err = mock_takion_recv(&takion, buf, &size, UINT64_MAX);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err != CHIAKI_ERR_SUCCESS || !size)
+			continue;
+
+		uint8_t base_type = buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+		if(base_type == TAKION_PACKET_TYPE_AUDIO)
+		{
+			// echo and mtu pings only need to come back unchanged
+			mock_takion_send_raw(&takion, buf, size);
+			continue;
+		}
+
+		uint8_t *data;
+		size_t data_size;
+		if(mock_takion_handle(&takion, buf, size, &data, &data_size) == MOCK_TAKION_MESSAGE_DATA)
+			senkusha_handle_data(&takion, data, data_size);
+	}
+
+	mock_takion_reset(&takion);
+	host_add_thread_cpu(host);
+	return NULL;
+}
+
+// ---------------- Video source ----------------
+
+typedef struct mock_access_unit_t
+{
+	size_t offset;
+	size_t size;
+	bool idr;
+} MockAccessUnit;
+
+/**
+ * Either a looped annex b file split into access units, or a synthetic stream of filler frames.
+ */
+typedef struct mock_source_t
+{
+	uint8_t *file_buf;
+	MockAccessUnit *units;
+	size_t units_count;
+	size_t unit_next;
+
+	uint8_t *synthetic_buf;
+	size_t synthetic_buf_size;
+
+	uint8_t header[0x100];
+	size_t header_size;
+} MockSource;
+
+// only shaped like sps and pps, the synthetic stream can not be decoded
+static const uint8_t synthetic_header[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x1f,
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80
+};
+
+/**
+ * @return offset of the next start code at or after pos, or size if there is none
+ */
+static size_t find_start_code(const uint8_t *buf, size_t size, size_t pos)
+{
+	for(; pos + 3 <= size; pos++)
+	{
+		if(buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+			return pos > 0 && buf[pos - 1] == 0 ? pos - 1 : pos;
+	}
+	return size;
+}
+
+static ChiakiErrorCode mock_source_load_file(MockSource *source, ChiakiLog *log, const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+	{
+		CHIAKI_LOGE(log, "Mock failed to open \"%s\"", filename);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	fseek(f, 0, SEEK_END);
+	long file_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	source->file_buf = file_size > 0 ? malloc((size_t)file_size) : NULL;
+	if(!source->file_buf || fread(source->file_buf, (size_t)file_size, 1, f) != 1)
+	{
+		CHIAKI_LOGE(log, "Mock failed to read \"%s\"", filename);
+		fclose(f);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	fclose(f);
+
+	const uint8_t *buf = source->file_buf;
+	size_t size = (size_t)file_size;
+	size_t units_size = 0;
+	bool vcl_seen = false;
+	size_t unit_start = find_start_code(buf, size, 0);
+	for(size_t pos = unit_start; pos < size;)
+	{
+		size_t nal = pos + (buf[pos + 2] == 1 ? 3 : 4);
+		size_t next = find_start_code(buf, size, nal);
+		if(nal >= size)
+			break;
+		uint8_t type = buf[nal] & 0x1f;
+		bool vcl = type == 1 || type == 5;
+		bool first_slice = vcl && nal + 1 < size && (buf[nal + 1] & 0x80); // first_mb_in_slice == 0
+
+		if(vcl_seen && (first_slice || type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18)))
+		{
+			if(source->units_count == units_size)
+			{
+				units_size = units_size ? units_size * 2 : 256;
+				MockAccessUnit *units = realloc(source->units, units_size * sizeof(MockAccessUnit));
+				if(!units)
+					return CHIAKI_ERR_MEMORY;
+				source->units = units;
+			}
+			source->units[source->units_count].offset = unit_start;
+			source->units[source->units_count].size = pos - unit_start;
+			source->units[source->units_count].idr = false;
+			source->units_count++;
+			unit_start = pos;
+			vcl_seen = false;
+		}
+
+		if(vcl)
+		{
+			vcl_seen = true;
+			if(type == 5 && source->units_count < units_size)
+				source->units[source->units_count].idr = true;
+		}
+		else if((type == 7 || type == 8) && !source->units_count && source->header_size + (next - pos) <= sizeof(source->header))
+		{
+			memcpy(source->header + source->header_size, buf + pos, next - pos);
+			source->header_size += next - pos;
+		}
+		pos = next;
+	}
+
+	if(!source->units_count || !source->header_size)
+	{
+		CHIAKI_LOGE(log, "Mock found no complete H264 frames with SPS and PPS in \"%s\"", filename);
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	// units only learn that they are idr after they have been started, so mark them now
+	for(size_t i=0; i<source->units_count; i++)
+	{
+		const MockAccessUnit *unit = &source->units[i];
+		source->units[i].idr = false;
+		for(size_t pos = find_start_code(buf, unit->offset + unit->size, unit->offset); pos < unit->offset + unit->size;)
+		{
+			size_t nal = pos + (buf[pos + 2] == 1 ? 3 : 4);
+			if(nal < unit->offset + unit->size && (buf[nal] & 0x1f) == 5)
+			{
+				source->units[i].idr = true;
+				break;
+			}
+			pos = find_start_code(buf, unit->offset + unit->size, nal);
+		}
+	}
+
+	CHIAKI_LOGI(log, "Mock loaded %llu frames from \"%s\"", (unsigned long long)source->units_count, filename);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode mock_source_init(MockSource *source, ChiakiLog *log, const char *h264_filename)
+{
+	memset(source, 0, sizeof(*source));
+	if(h264_filename)
+		return mock_source_load_file(source, log, h264_filename);
+
+	source->synthetic_buf_size = FRAME_BUF_SIZE;
+	source->synthetic_buf = malloc(source->synthetic_buf_size);
+	if(!source->synthetic_buf)
+		return CHIAKI_ERR_MEMORY;
+	// no zeros, so there are never any start codes inside
+	uint32_t x = chiaki_random_32() | 1;
+	for(size_t i=0; i<source->synthetic_buf_size; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		source->synthetic_buf[i] = (uint8_t)x ? (uint8_t)x : 0x5a;
+	}
+	memcpy(source->header, synthetic_header, sizeof(synthetic_header));
+	source->header_size = sizeof(synthetic_header);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void mock_source_fini(MockSource *source)
+{
+	free(source->file_buf);
+	free(source->units);
+	free(source->synthetic_buf);
+}
+
+/**
+ * @param size_hint size of a regular synthetic frame, idr frames are larger
+ */
+static void mock_source_next_frame(MockSource *source, bool idr, size_t size_hint, const uint8_t **frame, size_t *frame_size)
+{
+	if(source->units_count)
+	{
+		if(idr)
+		{
+			for(size_t i=0; i<source->units_count; i++)
+			{
+				if(source->units[source->unit_next].idr)
+					break;
+				source->unit_next = (source->unit_next + 1) % source->units_count;
+			}
+		}
+		const MockAccessUnit *unit = &source->units[source->unit_next];
+		source->unit_next = (source->unit_next + 1) % source->units_count;
+		*frame = source->file_buf + unit->offset;
+		*frame_size = unit->size;
+		return;
+	}
+
+	size_t size = idr ? size_hint * IDR_SIZE_FACTOR : size_hint;
+	if(size < 6)
+		size = 6;
+	if(size > source->synthetic_buf_size)
+		size = source->synthetic_buf_size;
+	uint8_t *buf = source->synthetic_buf;
+	buf[0] = 0;
+	buf[1] = 0;
+	buf[2] = 0;
+	buf[3] = 1;
+	buf[4] = idr ? 0x65 : 0x41;
+	*frame = buf;
+	*frame_size = size;
+}
+
+// ---------------- StreamConnection ----------------
+
+typedef struct mock_stream_t
+{
+	MockHost *host;
+	MockTakion takion;
+	MockSource source;
+	ChiakiFecCache fec_cache;
+	uint8_t *frame_buf;
+
+	bool bang_sent;
+	bool streaming;
+	bool idr_requested;
+	uint64_t streaminfo_next_us;
+	uint64_t frame_next_us;
+	uint64_t frame_interval_us;
+	size_t frame_size;
+	size_t unit_size_max;
+	unsigned int width;
+	unsigned int height;
+	ChiakiSeqNum16 frame_index;
+	ChiakiSeqNum16 packet_index;
+} MockStream;
+
+static unsigned int launch_spec_uint(const char *json, const char *key, unsigned int fallback)
+{
+	const char *cur = strstr(json, key);
+	if(!cur)
+		return fallback;
+	cur += strlen(key);
+	unsigned long v = strtoul(cur, NULL, 10);
+	return v ? (unsigned int)v : fallback;
+}
+
+static void mock_stream_end_session(MockStream *stream)
+{
+	mock_takion_reset(&stream->takion);
+	stream->bang_sent = false;
+	stream->streaming = false;
+}
+
+static void mock_stream_handle_big(MockStream *stream, const char *session_key, const char *launch_spec_b64,
+		const uint8_t *ecdh_pub_key, size_t ecdh_pub_key_size, const uint8_t *ecdh_sig, size_t ecdh_sig_size)
+{
+	MockHost *host = stream->host;
+	chiaki_mutex_lock(&host->state_mutex);
+	bool valid = host->session_valid;
+	ChiakiRPCrypt rpcrypt = host->rpcrypt;
+	ChiakiTarget target = host->target;
+	bool session_key_match = strcmp(session_key, host->session_id) == 0;
+	chiaki_mutex_unlock(&host->state_mutex);
+	if(!valid)
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection received big without a session request before");
+		return;
+	}
+	if(!session_key_match)
+		CHIAKI_LOGW(host->log, "Mock StreamConnection received big with unknown session key %s", session_key);
+
+	// launch spec is the json xored with the rpcrypt key stream for counter 0
+	uint8_t launch_spec[0x1000];
+	size_t launch_spec_size = sizeof(launch_spec) - 1;
+	if(chiaki_base64_decode(launch_spec_b64, strlen(launch_spec_b64), launch_spec, &launch_spec_size) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection failed to decode launch spec");
+		return;
+	}
+	uint8_t key_stream[sizeof(launch_spec)];
+	memset(key_stream, 0, launch_spec_size);
+	chiaki_rpcrypt_encrypt(&rpcrypt, 0, key_stream, key_stream, launch_spec_size);
+	for(size_t i=0; i<launch_spec_size; i++)
+		launch_spec[i] ^= key_stream[i];
+	launch_spec[launch_spec_size] = '\0';
+	const char *json = (const char *)launch_spec;
+
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	size_t handshake_key_size = sizeof(handshake_key);
+	const char *handshake_key_b64 = strstr(json, "\"handshakeKey\":\"");
+	const char *handshake_key_end = handshake_key_b64 ? strchr(handshake_key_b64 + 16, '"') : NULL;
+	if(!handshake_key_end
+			|| chiaki_base64_decode(handshake_key_b64 + 16, (size_t)(handshake_key_end - handshake_key_b64 - 16), handshake_key, &handshake_key_size) != CHIAKI_ERR_SUCCESS
+			|| handshake_key_size != sizeof(handshake_key))
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection found no handshake key in launch spec");
+		return;
+	}
+
+	unsigned int mtu = launch_spec_uint(json, "\"mtu\":", MTU_DEFAULT);
+	unsigned int max_fps = launch_spec_uint(json, "\"maxFps\":", 60);
+	unsigned int bitrate_kbps = launch_spec_uint(json, "\"bwKbpsSent\":", 10000);
+	stream->width = launch_spec_uint(json, "\"width\":", 1280);
+	stream->height = launch_spec_uint(json, "\"height\":", 720);
+
+	ChiakiECDH ecdh;
+	if(chiaki_ecdh_init(&ecdh) != CHIAKI_ERR_SUCCESS)
+		return;
+	uint8_t secret[CHIAKI_ECDH_SECRET_SIZE];
+	uint8_t local_pub_key[128];
+	ChiakiPBBuf local_pub_key_buf = { sizeof(local_pub_key), local_pub_key };
+	uint8_t local_sig[32];
+	ChiakiPBBuf local_sig_buf = { sizeof(local_sig), local_sig };
+	ChiakiErrorCode err = chiaki_ecdh_get_local_pub_key(&ecdh, local_pub_key, &local_pub_key_buf.size, handshake_key, local_sig, &local_sig_buf.size);
+	if(err == CHIAKI_ERR_SUCCESS)
+		err = chiaki_ecdh_derive_secret(&ecdh, secret, ecdh_pub_key, ecdh_pub_key_size, handshake_key, ecdh_sig, ecdh_sig_size);
+	chiaki_ecdh_fini(&ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection failed the ECDH exchange");
+		return;
+	}
+
+	uint8_t bang[0x200];
+	size_t bang_size;
+	if(!encode_bang(bang, sizeof(bang), &bang_size, chiaki_target_is_ps5(target) ? 12 : 9, &local_pub_key_buf, &local_sig_buf))
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection failed to encode bang");
+		return;
+	}
+	mock_takion_send_data(&stream->takion, 1, bang, bang_size);
+
+	// the client only checks MACs after it got the bang, so it is fine to start here
+	stream->takion.gkcrypt_local = chiaki_gkcrypt_new(host->log, 0, 3, handshake_key, secret);
+	if(!stream->takion.gkcrypt_local)
+	{
+		CHIAKI_LOGE(host->log, "Mock StreamConnection failed to init GKCrypt");
+		return;
+	}
+
+	unsigned int fps = host->settings.fps ? host->settings.fps : max_fps;
+	if(host->settings.bitrate_kbps)
+		bitrate_kbps = host->settings.bitrate_kbps;
+	stream->frame_interval_us = 1000000 / fps;
+	stream->frame_size = (size_t)bitrate_kbps * 1000 / 8 / fps;
+	if(mtu > PACKET_BUF_SIZE || mtu < UDP_PACKET_ADD + VIDEO_HEADER_SIZE + 0x10)
+		mtu = MTU_DEFAULT;
+	stream->unit_size_max = mtu - UDP_PACKET_ADD - VIDEO_HEADER_SIZE;
+	stream->frame_index = 0;
+	stream->idr_requested = true;
+	stream->bang_sent = true;
+	stream->streaming = false;
+	stream->streaminfo_next_us = chiaki_time_now_monotonic_us() + STREAMINFO_DELAY_US;
+
+	chiaki_mutex_lock(&host->state_mutex);
+	host->stats.sessions++;
+	chiaki_mutex_unlock(&host->state_mutex);
+	CHIAKI_LOGI(host->log, "Mock StreamConnection sent bang, streaming %ux%u at %u fps, %u kbps, mtu %u",
+			stream->width, stream->height, fps, bitrate_kbps, mtu);
+}
+
+static bool pb_encode_resolution(pb_ostream_t *ostream, const pb_field_t *field, void *const *arg)
+{
+	MockStream *stream = *arg;
+	ChiakiPBBuf header_buf = { stream->source.header_size, stream->source.header };
+	tkproto_ResolutionPayload resolution;
+	memset(&resolution, 0, sizeof(resolution));
+	resolution.width = stream->width;
+	resolution.height = stream->height;
+	resolution.video_header.arg = &header_buf;
+	resolution.video_header.funcs.encode = chiaki_pb_encode_buf;
+	if(!pb_encode_tag_for_field(ostream, field))
+		return false;
+	return pb_encode_submessage(ostream, tkproto_ResolutionPayload_fields, &resolution);
+}
+
+static void mock_stream_send_streaminfo(MockStream *stream)
+{
+	ChiakiAudioHeader audio_header = { 0 };
+	audio_header.channels = 2;
+	audio_header.bits = 16;
+	audio_header.rate = 48000;
+	audio_header.frame_size = 480;
+	uint8_t audio_header_buf[CHIAKI_AUDIO_HEADER_SIZE];
+	chiaki_audio_header_save(&audio_header, audio_header_buf);
+	ChiakiPBBuf audio_header_pb = { sizeof(audio_header_buf), audio_header_buf };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_STREAMINFO;
+	msg.has_stream_info_payload = true;
+	msg.stream_info_payload.resolution.arg = stream;
+	msg.stream_info_payload.resolution.funcs.encode = pb_encode_resolution;
+	msg.stream_info_payload.audio_header.arg = &audio_header_pb;
+	msg.stream_info_payload.audio_header.funcs.encode = chiaki_pb_encode_buf;
+
+	uint8_t buf[0x400];
+	pb_ostream_t ostream = pb_ostream_from_buffer(buf, sizeof(buf));
+	if(!pb_encode(&ostream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGE(stream->host->log, "Mock StreamConnection failed to encode streaminfo");
+		return;
+	}
+	mock_takion_send_data(&stream->takion, 9, buf, ostream.bytes_written);
+}
+
+static void mock_stream_handle_data(MockStream *stream, uint8_t *buf, size_t buf_size)
+{
+	MockHost *host = stream->host;
+	char session_key[CHIAKI_SESSION_ID_SIZE_MAX];
+	ChiakiPBDecodeBuf session_key_buf = { sizeof(session_key) - 1, 0, (uint8_t *)session_key };
+	char launch_spec[0x2000];
+	ChiakiPBDecodeBuf launch_spec_buf = { sizeof(launch_spec) - 1, 0, (uint8_t *)launch_spec };
+	uint8_t ecdh_pub_key[128];
+	ChiakiPBDecodeBuf ecdh_pub_key_buf = { sizeof(ecdh_pub_key), 0, ecdh_pub_key };
+	uint8_t ecdh_sig[32];
+	ChiakiPBDecodeBuf ecdh_sig_buf = { sizeof(ecdh_sig), 0, ecdh_sig };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.big_payload.session_key.arg = &session_key_buf;
+	msg.big_payload.session_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.launch_spec.arg = &launch_spec_buf;
+	msg.big_payload.launch_spec.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_pub_key.arg = &ecdh_pub_key_buf;
+	msg.big_payload.ecdh_pub_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_sig.arg = &ecdh_sig_buf;
+	msg.big_payload.ecdh_sig.funcs.decode = chiaki_pb_decode_buf;
+
+	pb_istream_t istream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&istream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGW(host->log, "Mock StreamConnection failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+			if(stream->bang_sent)
+				break;
+			session_key[session_key_buf.size] = '\0';
+			launch_spec[launch_spec_buf.size] = '\0';
+			mock_stream_handle_big(stream, session_key, launch_spec,
+					ecdh_pub_key, ecdh_pub_key_buf.size, ecdh_sig, ecdh_sig_buf.size);
+			break;
+		case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
+			if(!stream->bang_sent || stream->streaming)
+				break;
+			CHIAKI_LOGI(host->log, "Mock StreamConnection got streaminfo ack, starting video");
+			stream->streaming = true;
+			stream->frame_next_us = chiaki_time_now_monotonic_us();
+			break;
+		case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
+			CHIAKI_LOGI(host->log, "Mock StreamConnection got corrupt frame report %u to %u",
+					(unsigned int)msg.corrupt_payload.start, (unsigned int)msg.corrupt_payload.end);
+			stream->idr_requested = true;
+			chiaki_mutex_lock(&host->state_mutex);
+			host->stats.corrupt_reports++;
+			chiaki_mutex_unlock(&host->state_mutex);
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(host->log, "Mock StreamConnection disconnected by client");
+			mock_stream_end_session(stream);
+			break;
+		default:
+			break;
+	}
+}
+
+static void mock_stream_send_unit(MockStream *stream, unsigned int unit_index, unsigned int units_total, unsigned int units_fec, const uint8_t *data, size_t data_size)
+{
+	MockTakion *takion = &stream->takion;
+	uint8_t buf[PACKET_BUF_SIZE];
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.packet_index = stream->packet_index++;
+	packet.frame_index = stream->frame_index;
+	packet.unit_index = (ChiakiSeqNum16)unit_index;
+	packet.units_in_frame_total = (uint16_t)units_total;
+	packet.units_in_frame_fec = (uint16_t)units_fec;
+	packet.key_pos = mock_takion_advance_key_pos(takion, data_size);
+	size_t header_size;
+	if(chiaki_takion_v7_av_packet_format_header(buf, sizeof(buf), &header_size, &packet) != CHIAKI_ERR_SUCCESS
+			|| header_size + data_size > sizeof(buf))
+		return;
+
+	uint8_t *payload = buf + header_size;
+	memcpy(payload, data, data_size);
+	chiaki_gkcrypt_encrypt(takion->gkcrypt_local, packet.key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, payload, data_size);
+	mock_takion_send(takion, buf, header_size + data_size, packet.key_pos);
+}
+
+/**
+ * Split frame into source units with the 2 byte padding size in front, add fec units and send all of them.
+ */
+static void mock_stream_send_frame(MockStream *stream, const uint8_t *frame, size_t frame_size)
+{
+	MockHost *host = stream->host;
+	size_t payload_max = stream->unit_size_max - 2;
+	unsigned int fec_percent = host->settings.fec_percent;
+#define FEC_UNITS(k) (fec_percent ? ((k) * fec_percent + 99) / 100 : 0)
+
+	unsigned int k = (unsigned int)((frame_size + payload_max - 1) / payload_max);
+	bool truncated = false;
+	while(k > 1 && k + FEC_UNITS(k) > CHIAKI_FEC_UNITS_MAX)
+	{
+		k--;
+		truncated = true;
+	}
+	unsigned int m = FEC_UNITS(k);
+	if(m > CHIAKI_FEC_UNITS_MAX - k)
+		m = CHIAKI_FEC_UNITS_MAX - k;
+#undef FEC_UNITS
+	if(truncated)
+	{
+		CHIAKI_LOGW(host->log, "Mock frame of %llu bytes does not fit into %u units, truncating it",
+				(unsigned long long)frame_size, CHIAKI_FEC_UNITS_MAX);
+		frame_size = (size_t)k * payload_max;
+	}
+
+	size_t payload_size = (frame_size + k - 1) / k;
+	size_t unit_size = payload_size + 2;
+	for(unsigned int i=0; i<k; i++)
+	{
+		uint8_t *unit = stream->frame_buf + (size_t)i * unit_size;
+		size_t offset = (size_t)i * payload_size;
+		size_t n = frame_size - offset < payload_size ? frame_size - offset : payload_size;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(unit_size - 2 - n));
+		memcpy(unit + 2, frame + offset, n);
+		memset(unit + 2 + n, 0, unit_size - 2 - n);
+	}
+	if(chiaki_fec_encode_cached(&stream->fec_cache, stream->frame_buf, unit_size, unit_size, k, m) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(host->log, "Mock failed to compute fec units");
+		m = 0;
+	}
+
+	stream->frame_index++;
+	for(unsigned int i=0; i<k+m; i++)
+	{
+		uint8_t *unit = stream->frame_buf + (size_t)i * unit_size;
+		size_t data_size = i < k ? unit_size - ntohs(*((chiaki_unaligned_uint16_t *)unit)) : unit_size;
+		mock_stream_send_unit(stream, i, k + m, m, unit, data_size);
+	}
+
+	chiaki_mutex_lock(&host->state_mutex);
+	host->stats.frames++;
+	host->stats.frames_bytes += frame_size;
+	host->stats.packets += k + m;
+	host->stats.fec_units += m;
+	if(truncated)
+		host->stats.frames_truncated++;
+	chiaki_mutex_unlock(&host->state_mutex);
+}
+
+static void mock_stream_send_next_frame(MockStream *stream)
+{
+	const uint8_t *frame;
+	size_t frame_size;
+	mock_source_next_frame(&stream->source, stream->idr_requested, stream->frame_size, &frame, &frame_size);
+	stream->idr_requested = false;
+	if(frame_size < 2)
+		return;
+	mock_stream_send_frame(stream, frame, frame_size);
+}
+
+static void *stream_thread_func(void *user)
+{
+	MockStream *stream = user;
+	MockHost *host = stream->host;
+	mock_takion_init(&stream->takion, host, "StreamConnection", host->stream_sock);
+
+	uint8_t buf[RECV_BUF_SIZE];
+	while(true)
+	{
+		uint64_t now = chiaki_time_now_monotonic_us();
+		uint64_t timeout_ms = 1000;
+		if(stream->bang_sent)
+		{
+			uint64_t deadline = stream->streaming ? stream->frame_next_us : stream->streaminfo_next_us;
+			timeout_ms = deadline > now ? (deadline - now + 999) / 1000 : 0;
+		}
+
+		size_t size = sizeof(buf);
+		ChiakiErrorCode err = mock_takion_recv(&stream->takion, buf, &size, timeout_ms);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err == CHIAKI_ERR_SUCCESS && !host->settings.stall_stream)
+		{
+			// feedback and congestion packets from the client are ignored
+			uint8_t *data;
+			size_t data_size;
+			switch(mock_takion_handle(&stream->takion, buf, size, &data, &data_size))
+			{
+				case MOCK_TAKION_MESSAGE_INIT:
+					stream->bang_sent = false;
+					stream->streaming = false;
+					break;
+				case MOCK_TAKION_MESSAGE_DATA:
+					mock_stream_handle_data(stream, data, data_size);
+					break;
+				default:
+					break;
+			}
+		}
+
+		now = chiaki_time_now_monotonic_us();
+		if(stream->bang_sent && !stream->streaming && now >= stream->streaminfo_next_us)
+		{
+			mock_stream_send_streaminfo(stream);
+			stream->streaminfo_next_us = now + STREAMINFO_RESEND_US;
+		}
+		else if(stream->streaming && now >= stream->frame_next_us)
+		{
+			mock_stream_send_next_frame(stream);
+			stream->frame_next_us += stream->frame_interval_us;
+			if(stream->frame_next_us + stream->frame_interval_us < now)
+				stream->frame_next_us = now; // fell behind, don't burst to catch up
+		}
+	}
+
+	mock_stream_end_session(stream);
+	host_add_thread_cpu(host);
+	return NULL;
+}
+
+static ChiakiErrorCode mock_stream_init(MockStream *stream, MockHost *host)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->host = host;
+	ChiakiErrorCode err = mock_source_init(&stream->source, host->log, host->settings.h264_filename);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		mock_source_fini(&stream->source);
+		return err;
+	}
+	stream->frame_buf = malloc(FRAME_BUF_SIZE);
+	if(!stream->frame_buf)
+	{
+		mock_source_fini(&stream->source);
+		return CHIAKI_ERR_MEMORY;
+	}
+	chiaki_fec_cache_init(&stream->fec_cache, SIZE_MAX);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void mock_stream_fini(MockStream *stream)
+{
+	chiaki_fec_cache_fini(&stream->fec_cache);
+	free(stream->frame_buf);
+	mock_source_fini(&stream->source);
+}
+
+// ---------------- Host ----------------
+
+ChiakiErrorCode mock_host_start(MockHost *host, ChiakiLog *log, const MockHostSettings *settings)
+{
+	memset(host, 0, sizeof(*host));
+	host->log = log;
+	host->settings = *settings;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&host->state_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_stop_pipe_init(&host->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	host->stream = malloc(sizeof(MockStream));
+	if(!host->stream)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_stop_pipe;
+	}
+	err = mock_stream_init(host->stream, host);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stream_alloc;
+
+	host->ctrl_sock = socket_create_bound(SOCK_STREAM, SESSION_PORT);
+	host->senkusha_sock = socket_create_bound(SOCK_DGRAM, SENKUSHA_PORT);
+	host->stream_sock = socket_create_bound(SOCK_DGRAM, STREAM_CONNECTION_PORT);
+	if(CHIAKI_SOCKET_IS_INVALID(host->ctrl_sock) || CHIAKI_SOCKET_IS_INVALID(host->senkusha_sock) || CHIAKI_SOCKET_IS_INVALID(host->stream_sock))
+	{
+		CHIAKI_LOGE(log, "Mock failed to bind to ports %d to %d on 127.0.0.1", SESSION_PORT, SENKUSHA_PORT);
+		err = CHIAKI_ERR_NETWORK;
+		goto error_socks;
+	}
+
+	err = chiaki_thread_create(&host->ctrl_thread, ctrl_thread_func, host);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_socks;
+	chiaki_thread_set_name(&host->ctrl_thread, "Mock Ctrl");
+
+	err = chiaki_thread_create(&host->senkusha_thread, senkusha_thread_func, host);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ctrl_thread;
+	chiaki_thread_set_name(&host->senkusha_thread, "Mock Senkusha");
+
+	err = chiaki_thread_create(&host->stream_thread, stream_thread_func, host->stream);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_senkusha_thread;
+	chiaki_thread_set_name(&host->stream_thread, "Mock Stream");
+
+	CHIAKI_LOGI(log, "Mock %s host listening on 127.0.0.1", settings->ps5 ? "PS5" : "PS4");
+	return CHIAKI_ERR_SUCCESS;
+
+error_senkusha_thread:
+	chiaki_stop_pipe_stop(&host->stop_pipe);
+	chiaki_thread_join(&host->senkusha_thread, NULL);
+error_ctrl_thread:
+	chiaki_stop_pipe_stop(&host->stop_pipe);
+	chiaki_thread_join(&host->ctrl_thread, NULL);
+error_socks:
+	if(!CHIAKI_SOCKET_IS_INVALID(host->ctrl_sock))
+		CHIAKI_SOCKET_CLOSE(host->ctrl_sock);
+	if(!CHIAKI_SOCKET_IS_INVALID(host->senkusha_sock))
+		CHIAKI_SOCKET_CLOSE(host->senkusha_sock);
+	if(!CHIAKI_SOCKET_IS_INVALID(host->stream_sock))
+		CHIAKI_SOCKET_CLOSE(host->stream_sock);
+	mock_stream_fini(host->stream);
+error_stream_alloc:
+	free(host->stream);
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&host->stop_pipe);
+error_mutex:
+	chiaki_mutex_fini(&host->state_mutex);
+	return err;
+}
+
+void mock_host_stop(MockHost *host)
+{
+	chiaki_stop_pipe_stop(&host->stop_pipe);
+	chiaki_thread_join(&host->stream_thread, NULL);
+	chiaki_thread_join(&host->senkusha_thread, NULL);
+	chiaki_thread_join(&host->ctrl_thread, NULL);
+	CHIAKI_SOCKET_CLOSE(host->ctrl_sock);
+	CHIAKI_SOCKET_CLOSE(host->senkusha_sock);
+	CHIAKI_SOCKET_CLOSE(host->stream_sock);
+	mock_stream_fini(host->stream);
+	free(host->stream);
+	chiaki_stop_pipe_fini(&host->stop_pipe);
+	chiaki_mutex_fini(&host->state_mutex);
+}
+
+void mock_host_get_stats(MockHost *host, MockHostStats *stats)
+{
+	chiaki_mutex_lock(&host->state_mutex);
+	*stats = host->stats;
+	chiaki_mutex_unlock(&host->state_mutex);
+}
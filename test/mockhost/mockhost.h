@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_MOCKHOST_H
+#define CHIAKI_MOCKHOST_H
+
+#include <chiaki/session.h>
+#include <chiaki/rpcrypt.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/thread.h>
+#include <chiaki/log.h>
+#include <chiaki/sock.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MOCK_HOST_SESSION_ID_SIZE 32
+
+typedef struct mock_host_settings_t
+{
+	bool ps5;
+	unsigned int fps; // 0 to use the max fps requested in the launch spec
+	unsigned int bitrate_kbps; // 0 to use the bitrate requested in the launch spec
+	unsigned int fec_percent; // fec units per frame relative to the source units
+	const char *h264_filename; // annex b stream to send in a loop, NULL for a synthetic stream
+	bool stall_stream; // never answer the StreamConnection's Takion handshake
+	uint8_t morning[0x10]; // must be the same as in the client's connect info
+} MockHostSettings;
+
+typedef struct mock_host_stats_t
+{
+	uint64_t sessions;
+	uint64_t frames;
+	uint64_t frames_bytes;
+	uint64_t frames_truncated;
+	uint64_t packets;
+	uint64_t fec_units;
+	uint64_t corrupt_reports;
+	uint64_t cpu_us; // cpu time of the host threads, complete after mock_host_stop()
+} MockHostStats;
+
+struct mock_stream_t;
+
+typedef struct mock_host_t
+{
+	ChiakiLog *log;
+	MockHostSettings settings;
+
+	ChiakiStopPipe stop_pipe;
+	chiaki_socket_t ctrl_sock;
+	chiaki_socket_t senkusha_sock;
+	chiaki_socket_t stream_sock;
+	struct mock_stream_t *stream;
+	ChiakiThread ctrl_thread;
+	ChiakiThread senkusha_thread;
+	ChiakiThread stream_thread;
+
+	/**
+	 * Guards everything below, which is shared between the threads
+	 */
+	ChiakiMutex state_mutex;
+	bool session_valid;
+	ChiakiTarget target;
+	ChiakiRPCrypt rpcrypt;
+	char session_id[MOCK_HOST_SESSION_ID_SIZE + 1];
+	MockHostStats stats;
+} MockHost;
+
+/**
+ * Listen on the Remote Play ports of 127.0.0.1 and serve sessions until mock_host_stop() is called.
+ */
+ChiakiErrorCode mock_host_start(MockHost *host, ChiakiLog *log, const MockHostSettings *settings);
+void mock_host_stop(MockHost *host);
+void mock_host_get_stats(MockHost *host, MockHostStats *stats);
+
+#endif // CHIAKI_MOCKHOST_H
@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/netimpair.h>
+
+#include <string.h>
+
+#define PACKETS_COUNT 10000
+
+static ChiakiPacketBuf *packet_new(ChiakiPacketPool *pool, uint32_t index, size_t size)
+{
+	ChiakiPacketBuf *packet = chiaki_packet_pool_acquire(pool);
+	munit_assert_not_null(packet);
+	memcpy(packet->data, &index, sizeof(index));
+	packet->size = size;
+	return packet;
+}
+
+static uint32_t packet_index(ChiakiPacketBuf *packet)
+{
+	uint32_t index;
+	memcpy(&index, packet->data, sizeof(index));
+	return index;
+}
+
+static MunitResult test_net_impair_parse(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairConfig config;
+	ChiakiErrorCode err = chiaki_net_impair_config_parse(&config, "seed=42,loss=10,burst=4,dup=1,reorder=2,delay=20,jitter=5,rate=20000,bucket=3000,queue=50");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(config.seed, ==, 42);
+	munit_assert_double_equal(config.ge_r, 0.25, 6);
+	munit_assert_double_equal(config.ge_p / (config.ge_p + config.ge_r), 0.1, 6);
+	munit_assert_double_equal(config.loss_bad, 1.0, 6);
+	munit_assert_double_equal(config.duplicate, 0.01, 6);
+	munit_assert_double_equal(config.reorder, 0.02, 6);
+	munit_assert_uint32(config.reorder_delay_ms, >, 0);
+	munit_assert_uint32(config.delay_ms, ==, 20);
+	munit_assert_uint32(config.jitter_ms, ==, 5);
+	munit_assert_uint32(config.rate_kbps, ==, 20000);
+	munit_assert_uint32(config.burst_bytes, ==, 3000);
+	munit_assert_uint32(config.queue_ms, ==, 50);
+	munit_assert_true(chiaki_net_impair_config_active(&config));
+
+	err = chiaki_net_impair_config_parse(&config, "");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_false(chiaki_net_impair_config_active(&config));
+
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "loss"), ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "loss=1x"), ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "lots=1"), ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "loss=100"), ==, CHIAKI_ERR_INVALID_DATA);
+	return MUNIT_OK;
+}
+
+/**
+ * Push PACKETS_COUNT packets at interval_us and pop everything that is due in between.
+ *
+ * @param out receives the indices in delivery order
+ * @return number of delivered packets
+ */
+static size_t run_impair(const ChiakiNetImpairConfig *config, uint64_t interval_us, size_t packet_size, uint32_t *out, size_t out_size, ChiakiNetImpairStats *stats)
+{
+	ChiakiPacketPool pool;
+	munit_assert_int(chiaki_packet_pool_init(&pool, 64), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetImpair impair;
+	munit_assert_int(chiaki_net_impair_init(&impair, config, &pool), ==, CHIAKI_ERR_SUCCESS);
+
+	size_t delivered = 0;
+	uint64_t now = 1000000;
+	for(uint32_t i=0; i<PACKETS_COUNT || chiaki_net_impair_next_due_us(&impair) != UINT64_MAX; i++)
+	{
+		if(i < PACKETS_COUNT)
+			chiaki_net_impair_push(&impair, packet_new(&pool, i, packet_size), now);
+		ChiakiPacketBuf *packet;
+		while((packet = chiaki_net_impair_pop(&impair, now)))
+		{
+			munit_assert_size(delivered, <, out_size);
+			out[delivered++] = packet_index(packet);
+			chiaki_packet_pool_release(&pool, packet);
+		}
+		now += interval_us;
+	}
+
+	*stats = impair.stats;
+	chiaki_net_impair_fini(&impair);
+	chiaki_packet_pool_fini(&pool);
+	return delivered;
+}
+
+static MunitResult test_net_impair_passthrough(const MunitParameter params[], void *user)
+{
+	static uint32_t out[PACKETS_COUNT];
+	ChiakiNetImpairConfig config;
+	memset(&config, 0, sizeof(config));
+	ChiakiNetImpairStats stats;
+	size_t delivered = run_impair(&config, 100, 1000, out, PACKETS_COUNT, &stats);
+	munit_assert_size(delivered, ==, PACKETS_COUNT);
+	for(size_t i=0; i<delivered; i++)
+		munit_assert_uint32(out[i], ==, i);
+	munit_assert_uint64(stats.packets_out, ==, PACKETS_COUNT);
+	return MUNIT_OK;
+}
+
+static MunitResult test_net_impair_loss(const MunitParameter params[], void *user)
+{
+	static uint32_t out[PACKETS_COUNT];
+	static uint32_t out2[PACKETS_COUNT];
+	ChiakiNetImpairConfig config;
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "seed=1,loss=10,burst=5"), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetImpairStats stats;
+	size_t delivered = run_impair(&config, 100, 1000, out, PACKETS_COUNT, &stats);
+	munit_assert_uint64(stats.dropped_loss + delivered, ==, PACKETS_COUNT);
+	munit_assert_size(delivered, >, PACKETS_COUNT * 85 / 100);
+	munit_assert_size(delivered, <, PACKETS_COUNT * 95 / 100);
+
+	// losses come in bursts averaging 5 packets
+	size_t bursts = 0;
+	for(size_t i=1; i<delivered; i++)
+	{
+		munit_assert_uint32(out[i], >, out[i-1]);
+		if(out[i] != out[i-1] + 1)
+			bursts++;
+	}
+	double burst_avg = (double)stats.dropped_loss / (double)bursts;
+	munit_assert_double(burst_avg, >, 3.5);
+	munit_assert_double(burst_avg, <, 6.5);
+
+	// same seed, same result
+	ChiakiNetImpairStats stats2;
+	size_t delivered2 = run_impair(&config, 100, 1000, out2, PACKETS_COUNT, &stats2);
+	munit_assert_size(delivered2, ==, delivered);
+	munit_assert_memory_equal(delivered * sizeof(uint32_t), out, out2);
+	return MUNIT_OK;
+}
+
+static MunitResult test_net_impair_reorder_dup(const MunitParameter params[], void *user)
+{
+	static uint32_t out[PACKETS_COUNT * 2];
+	ChiakiNetImpairConfig config;
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "seed=2,dup=5,reorder=5,reorder_delay=1,delay=3"), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetImpairStats stats;
+	size_t delivered = run_impair(&config, 100, 1000, out, PACKETS_COUNT * 2, &stats);
+	munit_assert_size(delivered, ==, PACKETS_COUNT + stats.duplicated);
+	munit_assert_uint64(stats.duplicated, >, PACKETS_COUNT * 3 / 100);
+	munit_assert_uint64(stats.duplicated, <, PACKETS_COUNT * 7 / 100);
+
+	size_t late = 0;
+	uint32_t max = 0;
+	for(size_t i=0; i<delivered; i++)
+	{
+		if(out[i] < max)
+			late++;
+		else
+			max = out[i];
+	}
+	munit_assert_size(late, >, PACKETS_COUNT * 3 / 100);
+	munit_assert_uint64(stats.reordered, >, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_net_impair_rate(const MunitParameter params[], void *user)
+{
+	static uint32_t out[PACKETS_COUNT];
+	ChiakiNetImpairConfig config;
+
+	// 1000 bytes every 100us is 80 Mbit/s, limit to 60 without a queue limit: everything arrives in order, just later
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "rate=60000"), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetImpairStats stats;
+	size_t delivered = run_impair(&config, 100, 1000, out, PACKETS_COUNT, &stats);
+	munit_assert_size(delivered, ==, PACKETS_COUNT);
+	for(size_t i=0; i<delivered; i++)
+		munit_assert_uint32(out[i], ==, i);
+
+	// with a 10ms queue, about half is dropped
+	munit_assert_int(chiaki_net_impair_config_parse(&config, "rate=40000,queue=10"), ==, CHIAKI_ERR_SUCCESS);
+	delivered = run_impair(&config, 100, 1000, out, PACKETS_COUNT, &stats);
+	munit_assert_uint64(stats.dropped_queue + delivered, ==, PACKETS_COUNT);
+	munit_assert_size(delivered, >, PACKETS_COUNT * 45 / 100);
+	munit_assert_size(delivered, <, PACKETS_COUNT * 55 / 100);
+	return MUNIT_OK;
+}
+
+MunitTest tests_net_impair[] = {
+	{
+		"/parse",
+		test_net_impair_parse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/passthrough",
+		test_net_impair_passthrough,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_net_impair_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reorder_dup",
+		test_net_impair_reorder_dup,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/rate",
+		test_net_impair_rate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/packetpool.h>
+
+static MunitResult test_packet_pool(const MunitParameter params[], void *user)
+{
+	ChiakiPacketPool pool;
+	ChiakiErrorCode err = chiaki_packet_pool_init(&pool, 4);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_packet_pool_available(&pool), ==, 4);
+
+	ChiakiPacketBuf *bufs[6];
+	for(size_t i=0; i<4; i++)
+	{
+		bufs[i] = chiaki_packet_pool_acquire(&pool);
+		munit_assert_not_null(bufs[i]);
+		munit_assert(bufs[i]->pooled);
+		munit_assert_size(bufs[i]->size, ==, CHIAKI_PACKET_BUF_SIZE);
+		for(size_t j=0; j<i; j++)
+			munit_assert_ptr_not_equal(bufs[i], bufs[j]);
+	}
+	munit_assert_size(chiaki_packet_pool_available(&pool), ==, 0);
+	munit_assert_uint64(pool.exhausted_count, ==, 0);
+
+	// pool is empty now, so these are allocated separately
+	for(size_t i=4; i<6; i++)
+	{
+		bufs[i] = chiaki_packet_pool_acquire(&pool);
+		munit_assert_not_null(bufs[i]);
+		munit_assert(!bufs[i]->pooled);
+	}
+	munit_assert_uint64(pool.exhausted_count, ==, 2);
+
+	for(size_t i=0; i<6; i++)
+		chiaki_packet_pool_release(&pool, bufs[i]);
+	munit_assert_size(chiaki_packet_pool_available(&pool), ==, 4);
+
+	// released buffers are reused
+	ChiakiPacketBuf *buf = chiaki_packet_pool_acquire(&pool);
+	munit_assert(buf->pooled);
+	munit_assert_ptr_equal(buf, bufs[3]);
+	chiaki_packet_pool_release(&pool, buf);
+
+	chiaki_packet_pool_fini(&pool);
+	return MUNIT_OK;
+}
+
+MunitTest tests_packet_pool[] = {
+	{
+		"/packet_pool",
+		test_packet_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -171,6 +171,155 @@ static MunitResult test_reorder_queue_16(const MunitParameter params[], void *te
 	return MUNIT_OK;
 }
 
+static MunitResult test_reorder_queue_16_next_missing(const MunitParameter params[], void *test_user)
+{
+	ChiakiReorderQueue16 queue;
+	munit_assert_int(chiaki_reorder_queue_16_init(&queue, 16, 0), ==, CHIAKI_ERR_INVALID_DATA);
+	// more than one bitmap word and starting right before the wrap
+	ChiakiErrorCode err = chiaki_reorder_queue_16_init(&queue, 7, 0xfff0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_reorder_queue_16_size(&queue), ==, 128);
+
+	DropRecord drop_record = { 0 };
+	chiaki_reorder_queue_16_set_drop_cb(&queue, drop, &drop_record);
+
+	munit_assert_size(chiaki_reorder_queue_16_next_missing(&queue), ==, 0);
+
+	for(ChiakiSeqNum16 seq_num=0xfff1; seq_num!=0x60; seq_num++)
+		chiaki_reorder_queue_16_push(&queue, seq_num, (void *)1);
+	munit_assert_size(chiaki_reorder_queue_16_count(&queue), ==, 0x70);
+	munit_assert_size(chiaki_reorder_queue_16_next_missing(&queue), ==, 0);
+
+	chiaki_reorder_queue_16_push(&queue, 0xfff0, (void *)2);
+	munit_assert_size(chiaki_reorder_queue_16_next_missing(&queue), ==, 0x70);
+
+	// a gap in the second bitmap word
+	void *user = NULL;
+	ChiakiSeqNum16 seq_num = 0;
+	munit_assert_true(chiaki_reorder_queue_16_peek(&queue, 0x50, &seq_num, &user));
+	munit_assert_uint16(seq_num, ==, 0x40);
+	chiaki_reorder_queue_16_drop(&queue, 0x50);
+	munit_assert_uint64(drop_record.count[1], ==, 1);
+	munit_assert_uint64(drop_record.seq_num[1], ==, 0x40);
+	munit_assert_false(chiaki_reorder_queue_16_peek(&queue, 0x50, NULL, NULL));
+	munit_assert_size(chiaki_reorder_queue_16_next_missing(&queue), ==, 0x50);
+
+	// dropping the last one shrinks the queue
+	chiaki_reorder_queue_16_drop(&queue, 0x6f);
+	munit_assert_size(chiaki_reorder_queue_16_count(&queue), ==, 0x6f);
+
+	for(size_t i=0; i<0x50; i++)
+	{
+		munit_assert_true(chiaki_reorder_queue_16_pull(&queue, &seq_num, &user));
+		munit_assert_uint16(seq_num, ==, (ChiakiSeqNum16)(0xfff0 + i));
+	}
+	munit_assert_false(chiaki_reorder_queue_16_pull(&queue, &seq_num, &user));
+	munit_assert_size(chiaki_reorder_queue_16_next_missing(&queue), ==, 0);
+
+	memset(&drop_record, 0, sizeof(drop_record));
+	chiaki_reorder_queue_16_fini(&queue);
+	munit_assert_uint64(drop_record.count[1], ==, 0x1e);
+	munit_assert(!drop_record.failed);
+
+	return MUNIT_OK;
+}
+
+#define RANDOM_OPS 20000
+#define RANDOM_DROPS_MAX 64
+
+typedef struct drop_log_t
+{
+	uint64_t seq_nums[RANDOM_DROPS_MAX];
+	size_t count;
+} DropLog;
+
+static void drop_log(uint64_t seq_num, void *elem_user, void *cb_user)
+{
+	DropLog *log = cb_user;
+	munit_assert_size(log->count, <, RANDOM_DROPS_MAX);
+	munit_assert_uint64((uint64_t)(size_t)elem_user, ==, seq_num);
+	log->seq_nums[log->count++] = seq_num;
+}
+
+/**
+ * Feed the same random pushes and pulls into the specialized queue and ChiakiReorderQueue and expect the same results.
+ */
+static MunitResult test_reorder_queue_32_random(const MunitParameter params[], void *test_user)
+{
+	ChiakiSeqNum32 start = 0xffffff00;
+	ChiakiReorderQueue ref;
+	ChiakiErrorCode err = chiaki_reorder_queue_init_32(&ref, 7, start);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiReorderQueue32 queue;
+	err = chiaki_reorder_queue_32_init(&queue, 7, start);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	DropLog ref_drops = { 0 };
+	DropLog queue_drops = { 0 };
+	chiaki_reorder_queue_set_drop_cb(&ref, drop_log, &ref_drops);
+	chiaki_reorder_queue_32_set_drop_cb(&queue, drop_log, &queue_drops);
+
+	ChiakiSeqNum32 next = start;
+	for(size_t op=0; op<RANDOM_OPS; op++)
+	{
+		if(op == RANDOM_OPS / 2)
+		{
+			chiaki_reorder_queue_set_drop_strategy(&ref, CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN);
+			chiaki_reorder_queue_32_set_drop_strategy(&queue, CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN);
+		}
+
+		if(munit_rand_int_range(0, 3))
+		{
+			// mostly in order, sometimes late, duplicated or far ahead
+			ChiakiSeqNum32 seq_num = next + (ChiakiSeqNum32)munit_rand_int_range(-8, 8);
+			if(!munit_rand_int_range(0, 100))
+				seq_num += 200;
+			if(chiaki_seq_num_32_gt(seq_num, next))
+				next = seq_num;
+			next++;
+			chiaki_reorder_queue_push(&ref, seq_num, (void *)(size_t)seq_num);
+			chiaki_reorder_queue_32_push(&queue, seq_num, (void *)(size_t)seq_num);
+		}
+		else
+		{
+			uint64_t ref_seq_num;
+			void *ref_user;
+			bool ref_pulled = chiaki_reorder_queue_pull(&ref, &ref_seq_num, &ref_user);
+			ChiakiSeqNum32 seq_num;
+			void *user;
+			bool pulled = chiaki_reorder_queue_32_pull(&queue, &seq_num, &user);
+			munit_assert(pulled == ref_pulled);
+			if(pulled)
+			{
+				munit_assert_uint32(seq_num, ==, (ChiakiSeqNum32)ref_seq_num);
+				munit_assert_ptr_equal(user, ref_user);
+			}
+		}
+
+		munit_assert_uint64(chiaki_reorder_queue_32_count(&queue), ==, chiaki_reorder_queue_count(&ref));
+		munit_assert_size(queue_drops.count, ==, ref_drops.count);
+		munit_assert_memory_equal(queue_drops.count * sizeof(uint64_t), queue_drops.seq_nums, ref_drops.seq_nums);
+		ref_drops.count = queue_drops.count = 0;
+
+		size_t missing = chiaki_reorder_queue_32_count(&queue);
+		for(size_t i=0; i<chiaki_reorder_queue_32_count(&queue); i++)
+		{
+			if(!chiaki_reorder_queue_32_peek(&queue, i, NULL, NULL))
+			{
+				missing = i;
+				break;
+			}
+		}
+		munit_assert_size(chiaki_reorder_queue_32_next_missing(&queue), ==, missing);
+	}
+
+	chiaki_reorder_queue_set_drop_cb(&ref, NULL, NULL);
+	chiaki_reorder_queue_32_set_drop_cb(&queue, NULL, NULL);
+	chiaki_reorder_queue_fini(&ref);
+	chiaki_reorder_queue_32_fini(&queue);
+
+	return MUNIT_OK;
+}
 
 MunitTest tests_reorder_queue[] = {
 	{
@@ -181,5 +330,21 @@ MunitTest tests_reorder_queue[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/reorder_queue_16_next_missing",
+		test_reorder_queue_16_next_missing,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reorder_queue_32_random",
+		test_reorder_queue_32_random,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
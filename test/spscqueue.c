@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/spscqueue.h>
+
+static MunitResult test_spsc_queue_bounds(const MunitParameter params[], void *user)
+{
+	ChiakiSPSCQueue queue;
+	ChiakiErrorCode err = chiaki_spsc_queue_init(&queue, sizeof(uint32_t), 3);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(queue.count, ==, 4);
+
+	munit_assert_null(chiaki_spsc_queue_read_slot(&queue));
+	munit_assert_int(chiaki_spsc_queue_wait_readable(&queue, 1), ==, CHIAKI_ERR_TIMEOUT);
+
+	// fill, drain half and fill again to wrap around
+	uint32_t next_write = 0;
+	uint32_t next_read = 0;
+	for(size_t round=0; round<3; round++)
+	{
+		uint32_t *slot;
+		while((slot = chiaki_spsc_queue_write_slot(&queue)))
+		{
+			*slot = next_write++;
+			chiaki_spsc_queue_push(&queue);
+		}
+		munit_assert_size(chiaki_spsc_queue_depth(&queue), ==, 4);
+		munit_assert_int(chiaki_spsc_queue_wait_writable(&queue, 1), ==, CHIAKI_ERR_TIMEOUT);
+
+		for(size_t i=0; i<2; i++)
+		{
+			slot = chiaki_spsc_queue_read_slot(&queue);
+			munit_assert_not_null(slot);
+			munit_assert_uint32(*slot, ==, next_read++);
+			chiaki_spsc_queue_pop(&queue);
+		}
+		munit_assert_size(chiaki_spsc_queue_depth(&queue), ==, 2);
+	}
+
+	chiaki_spsc_queue_close(&queue);
+	munit_assert_int(chiaki_spsc_queue_wait_readable(&queue, 1000), ==, CHIAKI_ERR_CANCELED);
+	munit_assert_int(chiaki_spsc_queue_wait_writable(&queue, 1000), ==, CHIAKI_ERR_CANCELED);
+
+	chiaki_spsc_queue_fini(&queue);
+	return MUNIT_OK;
+}
+
+#define THREADED_ITEMS 100000
+
+static void *spsc_queue_producer_thread_func(void *user)
+{
+	ChiakiSPSCQueue *queue = user;
+	for(uint32_t i=0; i<THREADED_ITEMS; i++)
+	{
+		uint32_t *slot;
+		while(!(slot = chiaki_spsc_queue_write_slot(queue)))
+		{
+			if(chiaki_spsc_queue_wait_writable(queue, 1000) == CHIAKI_ERR_CANCELED)
+				return NULL;
+		}
+		*slot = i;
+		chiaki_spsc_queue_push(queue);
+	}
+	return NULL;
+}
+
+static MunitResult test_spsc_queue_threaded(const MunitParameter params[], void *user)
+{
+	ChiakiSPSCQueue queue;
+	ChiakiErrorCode err = chiaki_spsc_queue_init(&queue, sizeof(uint32_t), 16);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, spsc_queue_producer_thread_func, &queue);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// both sides regularly run into the full and the empty queue and have to be woken up,
+	// the consumer waits without a timeout, so a lost wakeup would hang here
+	for(uint32_t i=0; i<THREADED_ITEMS; i++)
+	{
+		uint32_t *slot;
+		while(!(slot = chiaki_spsc_queue_read_slot(&queue)))
+		{
+			err = chiaki_spsc_queue_wait_readable(&queue, UINT64_MAX);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+		munit_assert_uint32(*slot, ==, i);
+		chiaki_spsc_queue_pop(&queue);
+	}
+
+	chiaki_thread_join(&thread, NULL);
+	munit_assert_null(chiaki_spsc_queue_read_slot(&queue));
+	chiaki_spsc_queue_fini(&queue);
+	return MUNIT_OK;
+}
+
+static void *spsc_queue_wait_thread_func(void *user)
+{
+	ChiakiSPSCQueue *queue = user;
+	return (void *)(intptr_t)chiaki_spsc_queue_wait_readable(queue, UINT64_MAX);
+}
+
+static MunitResult test_spsc_queue_close_wakes(const MunitParameter params[], void *user)
+{
+	ChiakiSPSCQueue queue;
+	ChiakiErrorCode err = chiaki_spsc_queue_init(&queue, sizeof(uint32_t), 4);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, spsc_queue_wait_thread_func, &queue);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// give the thread a chance to actually block before closing
+	while(!chiaki_atomic_u32_load(&queue.consumer_waiting))
+		chiaki_thread_yield();
+	chiaki_spsc_queue_close(&queue);
+
+	void *ret;
+	chiaki_thread_join(&thread, &ret);
+	munit_assert_int((ChiakiErrorCode)(intptr_t)ret, ==, CHIAKI_ERR_CANCELED);
+	chiaki_spsc_queue_fini(&queue);
+	return MUNIT_OK;
+}
+
+MunitTest tests_spsc_queue[] = {
+	{
+		"/bounds",
+		test_spsc_queue_bounds,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/threaded",
+		test_spsc_queue_threaded,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/close_wakes",
+		test_spsc_queue_close_wakes,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
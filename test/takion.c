@@ -61,19 +61,19 @@ static MunitResult test_av_packet_parse_real_video(const MunitParameter params[]
 	return MUNIT_OK;
 }
 
-static void random_seqnums(ChiakiSeqNum32 *nums, size_t count)
+static void shuffled_seqnums(ChiakiSeqNum32 *nums, size_t count, ChiakiSeqNum32 first)
 {
 	for(size_t i=0; i<count; i++)
+		nums[i] = first + (ChiakiSeqNum32)i;
+	// packets from different threads may be pushed slightly out of order
+	for(size_t i=0; i+1<count; i++)
 	{
-		ChiakiSeqNum32 seqnum;
-		retry:
-		seqnum = munit_rand_uint32();
-		for(size_t j=0; j<i; j++)
+		if(munit_rand_int_range(0, 3) == 0)
 		{
-			if(nums[j] == seqnum)
-				goto retry;
+			ChiakiSeqNum32 tmp = nums[i];
+			nums[i] = nums[i+1];
+			nums[i+1] = tmp;
 		}
-		nums[i] = seqnum;
 	}
 }
 
@@ -90,9 +90,9 @@ static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, cons
 	for(size_t i=0; i<nums_expected_count; i++)
 	{
 		bool found = false;
-		for(size_t j=0; j<send_buffer->packets_count; j++)
+		for(size_t j=0; j<send_buffer->packets_size; j++)
 		{
-			if(send_buffer->packets[j].seq_num == nums_expected[i])
+			if(send_buffer->packets[j].used && send_buffer->packets[j].seq_num == nums_expected[i])
 			{
 				found = true;
 				break;
@@ -109,12 +109,12 @@ fail:
 	return false;
 }
 
-static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32 ack_num)
+static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32 ack_num, ChiakiSeqNum32 ack_num_last)
 {
-	// simulate ack of ack_num
+	// simulate ack of all seqnums from ack_num to ack_num_last
 	for(size_t i=0; i<*nums_count; i++)
 	{
-		if(nums[i] == ack_num || chiaki_seq_num_32_lt(nums[i], ack_num))
+		if(!chiaki_seq_num_32_lt(nums[i], ack_num) && !chiaki_seq_num_32_gt(nums[i], ack_num_last))
 		{
 			for(size_t j=i+1; j<*nums_count; j++)
 				nums[j-1] = nums[j];
@@ -124,42 +124,159 @@ static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32
 	}
 }
 
+static const uint8_t test_packet[8] = { 0 };
+
 static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
 {
 #define nums_count 0x30
+	// start close to the wrap around
+	ChiakiSeqNum32 first = 0xffffffff - (ChiakiSeqNum32)munit_rand_int_range(0, nums_count);
 	ChiakiTakionSendBuffer send_buffer;
-	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count);
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, NULL, first, nums_count);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	send_buffer.log = get_test_log();
 
-	ChiakiSeqNum32 nums_expected[nums_count + 1];
-	random_seqnums(nums_expected, nums_count + 1);
+	ChiakiSeqNum32 nums_expected[nums_count];
+	shuffled_seqnums(nums_expected, nums_count, first);
 
 	for(size_t i=0; i<nums_count; i++)
 	{
-		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], malloc(8), 8);
+		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], test_packet, sizeof(test_packet));
 		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	}
 
-	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], malloc(8), 8);
+	err = chiaki_takion_send_buffer_push(&send_buffer, first + nums_count, test_packet, sizeof(test_packet));
 	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+	err = chiaki_takion_send_buffer_push(&send_buffer, first + 1, test_packet, sizeof(test_packet));
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
 
 	size_t nums_count_cur = nums_count;
+	ChiakiSeqNum32 acked_seq_nums[nums_count];
 	while(nums_count_cur > 0)
 	{
-		ChiakiSeqNum32 ack_num = nums_expected[nums_count_cur - 1]
-				+ munit_rand_int_range(-1, 1) * munit_rand_int_range(1, 32);
-		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, NULL, NULL); // TODO: test acked seqnums params
-		seqnums_ack(nums_expected, &nums_count_cur, ack_num);
+		ChiakiSeqNum32 ack_num = first + (ChiakiSeqNum32)munit_rand_int_range(0, nums_count + 8);
+		size_t acked_count;
+		chiaki_takion_send_buffer_ack(&send_buffer, ack_num, NULL, 0, acked_seq_nums, &acked_count);
+		size_t nums_count_prev = nums_count_cur;
+		seqnums_ack(nums_expected, &nums_count_cur, first, ack_num);
+		munit_assert_size(acked_count, ==, nums_count_prev - nums_count_cur);
+		for(size_t i=0; i<acked_count; i++)
+			munit_assert_false(chiaki_seq_num_32_gt(acked_seq_nums[i], ack_num));
 		bool correct = check_send_buffer_contents(&send_buffer, nums_expected, nums_count_cur);
 		munit_assert(correct);
 	}
 
+	err = chiaki_takion_send_buffer_push(&send_buffer, first + 2, test_packet, sizeof(test_packet));
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	// acks never reach beyond what was pushed, so the next packets still fit
+	for(size_t i=0; i<nums_count; i++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, first + nums_count + (ChiakiSeqNum32)i, test_packet, sizeof(test_packet));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
 	chiaki_takion_send_buffer_fini(&send_buffer);
 	return MUNIT_OK;
 #undef nums_count
 }
 
+static MunitResult test_takion_send_buffer_gap_ack(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, NULL, 100, 16);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	for(ChiakiSeqNum32 seq_num=100; seq_num<110; seq_num++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, seq_num, test_packet, sizeof(test_packet));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	// 100 and 101 cumulatively, then 103-104 and 106
+	ChiakiTakionSendBufferGapAckBlock blocks[] = { { 2, 3 }, { 5, 5 } };
+	ChiakiSeqNum32 acked_seq_nums[16];
+	size_t acked_count;
+	chiaki_takion_send_buffer_ack(&send_buffer, 101, blocks, 2, acked_seq_nums, &acked_count);
+	static const ChiakiSeqNum32 acked_expected[] = { 100, 101, 103, 104, 106 };
+	munit_assert_size(acked_count, ==, 5);
+	munit_assert_memory_equal(sizeof(acked_expected), acked_seq_nums, acked_expected);
+	static const ChiakiSeqNum32 left_expected[] = { 102, 105, 107, 108, 109 };
+	munit_assert(check_send_buffer_contents(&send_buffer, left_expected, 5));
+	munit_assert_uint64(send_buffer.stats.packets_gap_acked, ==, 3);
+
+	// the same report twice more makes 102 and 105 due for a fast re-send, but not the ones after 106
+	for(size_t i=0; i<2; i++)
+	{
+		chiaki_takion_send_buffer_ack(&send_buffer, 101, blocks, 2, acked_seq_nums, &acked_count);
+		munit_assert_size(acked_count, ==, 0);
+	}
+	munit_assert_true(send_buffer.packets[102 - 100].fast_resend);
+	munit_assert_true(send_buffer.packets[105 - 100].fast_resend);
+	munit_assert_false(send_buffer.packets[107 - 100].fast_resend);
+
+	// a new packet reuses a slot of an acked one
+	err = chiaki_takion_send_buffer_push(&send_buffer, 117, test_packet, sizeof(test_packet));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_takion_send_buffer_push(&send_buffer, 118, test_packet, sizeof(test_packet));
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+
+	chiaki_takion_send_buffer_ack(&send_buffer, 108, NULL, 0, acked_seq_nums, &acked_count);
+	static const ChiakiSeqNum32 acked_expected_2[] = { 102, 105, 107, 108 };
+	munit_assert_size(acked_count, ==, 4);
+	munit_assert_memory_equal(sizeof(acked_expected_2), acked_seq_nums, acked_expected_2);
+	static const ChiakiSeqNum32 left_expected_2[] = { 109, 117 };
+	munit_assert(check_send_buffer_contents(&send_buffer, left_expected_2, 2));
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_takion_send_buffer_rto(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, NULL, 0, 16);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	// the rtt from before is only a start
+	chiaki_takion_send_buffer_set_rtt(&send_buffer, 40000);
+	munit_assert_uint64(send_buffer.rto_us, ==, 40000 + 4 * 20000);
+
+	// rto is bounded below, so it doesn't go off with every bit of jitter on a lan
+	chiaki_takion_send_buffer_set_rtt(&send_buffer, 500);
+	munit_assert_uint64(send_buffer.rto_us, ==, 10000);
+
+	chiaki_takion_send_buffer_push(&send_buffer, 0, test_packet, sizeof(test_packet));
+	send_buffer.packets[0].first_send_us -= 20000; // as if it was sent 20ms ago
+	chiaki_takion_send_buffer_ack(&send_buffer, 0, NULL, 0, NULL, NULL);
+	munit_assert_true(send_buffer.rtt_sampled);
+	munit_assert_uint64(send_buffer.srtt_us, >=, 20000);
+	munit_assert_uint64(send_buffer.rto_us, >=, send_buffer.srtt_us + 4 * send_buffer.rttvar_us);
+
+	// measured, so no more seeding
+	uint64_t srtt_us = send_buffer.srtt_us;
+	chiaki_takion_send_buffer_set_rtt(&send_buffer, 500);
+	munit_assert_uint64(send_buffer.srtt_us, ==, srtt_us);
+
+	// packets are copied into their slot, only oversized ones get their own allocation
+	uint8_t buf[CHIAKI_PACKET_BUF_SIZE + 1];
+	memset(buf, 0x42, sizeof(buf));
+	err = chiaki_takion_send_buffer_push(&send_buffer, 1, buf, 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_takion_send_buffer_push(&send_buffer, 2, buf, sizeof(buf));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	memset(buf, 0, sizeof(buf));
+	munit_assert_ptr_equal(send_buffer.packets[1].buf, send_buffer.bufs + CHIAKI_PACKET_BUF_SIZE);
+	munit_assert_uint8(send_buffer.packets[1].buf[7], ==, 0x42);
+	munit_assert_size(send_buffer.packets[2].buf_size, ==, sizeof(buf));
+	munit_assert_uint8(send_buffer.packets[2].buf[CHIAKI_PACKET_BUF_SIZE], ==, 0x42);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
 static MunitResult test_takion_format_congestion(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0x54, 0x65, 0x4c, 0x34, 0x5c, 0xac, 0x56, 0xb8, 0xea, 0xe6, 0x15, 0x2a, 0xde, 0x1c, 0xe2, 0xe8 };
@@ -220,6 +337,22 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/send_buffer_gap_ack",
+		test_takion_send_buffer_gap_ack,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/send_buffer_rto",
+		test_takion_send_buffer_rto,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/format_congestion",
 		test_takion_format_congestion,
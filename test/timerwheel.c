@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/timerwheel.h>
+
+#include <string.h>
+
+#define RANDOM_TIMERS_COUNT 512
+
+typedef struct random_test_t RandomTest;
+
+typedef struct random_timer_t
+{
+	ChiakiTimerWheelTimer timer;
+	RandomTest *test;
+	bool canceled;
+	unsigned int fired;
+} RandomTimer;
+
+struct random_test_t
+{
+	ChiakiTimerWheel wheel;
+	RandomTimer timers[RANDOM_TIMERS_COUNT];
+	uint64_t prev_now_us; // time of the previous advance
+	uint64_t now_us; // time of the current advance
+	uint64_t last_expires_us;
+};
+
+static void random_cb(void *user)
+{
+	RandomTimer *timer = user;
+	RandomTest *test = timer->test;
+	munit_assert_false(timer->canceled);
+	// fired by the first advance that reached it and in order
+	munit_assert_uint64(timer->timer.expires_us, <=, test->now_us);
+	munit_assert_uint64(timer->timer.expires_us, >, test->prev_now_us);
+	munit_assert_uint64(timer->timer.expires_us, >=, test->last_expires_us);
+	test->last_expires_us = timer->timer.expires_us;
+	timer->fired++;
+}
+
+static MunitResult test_random(const MunitParameter params[], void *user)
+{
+	static RandomTest test;
+	memset(&test, 0, sizeof(test));
+	uint64_t start_us = 1000000;
+	chiaki_timer_wheel_init(&test.wheel, start_us);
+	test.prev_now_us = test.now_us = start_us;
+
+	for(size_t i=0; i<RANDOM_TIMERS_COUNT; i++)
+	{
+		RandomTimer *timer = &test.timers[i];
+		timer->test = &test;
+		chiaki_timer_wheel_timer_init(&timer->timer, random_cb, timer);
+		// spread over all levels
+		uint64_t range = UINT64_C(1) << munit_rand_int_range(0, 30);
+		uint64_t due_us = start_us + 1 + ((uint64_t)munit_rand_uint32() % range);
+		chiaki_timer_wheel_schedule(&test.wheel, &timer->timer, due_us, 0, 0);
+		munit_assert_true(chiaki_timer_wheel_timer_scheduled(&timer->timer));
+	}
+	munit_assert_size(test.wheel.count, ==, RANDOM_TIMERS_COUNT);
+
+	size_t canceled = 0;
+	for(size_t i=0; i<RANDOM_TIMERS_COUNT; i++)
+	{
+		if(munit_rand_int_range(0, 3))
+			continue;
+		chiaki_timer_wheel_cancel(&test.wheel, &test.timers[i].timer);
+		test.timers[i].canceled = true;
+		canceled++;
+	}
+	munit_assert_size(test.wheel.count, ==, RANDOM_TIMERS_COUNT - canceled);
+
+	size_t fired = 0;
+	while(test.wheel.count)
+	{
+		uint64_t next_us = UINT64_MAX;
+		for(size_t i=0; i<RANDOM_TIMERS_COUNT; i++)
+		{
+			RandomTimer *timer = &test.timers[i];
+			if(!timer->canceled && !timer->fired && timer->timer.expires_us < next_us)
+				next_us = timer->timer.expires_us;
+		}
+		munit_assert_uint64(chiaki_timer_wheel_next_expiry(&test.wheel), ==, next_us);
+
+		test.prev_now_us = test.now_us;
+		test.now_us += UINT64_C(1) << munit_rand_int_range(0, 24);
+		fired += chiaki_timer_wheel_advance(&test.wheel, test.now_us);
+		munit_assert_uint64(test.wheel.now_us, ==, test.now_us);
+	}
+	munit_assert_size(fired, ==, RANDOM_TIMERS_COUNT - canceled);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&test.wheel), ==, UINT64_MAX);
+
+	for(size_t i=0; i<RANDOM_TIMERS_COUNT; i++)
+	{
+		RandomTimer *timer = &test.timers[i];
+		munit_assert_uint(timer->fired, ==, timer->canceled ? 0 : 1);
+		munit_assert_false(chiaki_timer_wheel_timer_scheduled(&timer->timer));
+	}
+	return MUNIT_OK;
+}
+
+static void count_cb(void *user)
+{
+	(*(unsigned int *)user)++;
+}
+
+static MunitResult test_periodic(const MunitParameter params[], void *user)
+{
+	ChiakiTimerWheel wheel;
+	chiaki_timer_wheel_init(&wheel, 0);
+	unsigned int fired = 0;
+	ChiakiTimerWheelTimer timer;
+	chiaki_timer_wheel_timer_init(&timer, count_cb, &fired);
+	chiaki_timer_wheel_schedule(&wheel, &timer, 500, 1000, 0);
+
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 499), ==, 0);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 500), ==, 1);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, 1500);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 2499), ==, 1);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 2500), ==, 1);
+	munit_assert_uint(fired, ==, 3);
+
+	// missed intervals are skipped
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 10000), ==, 1);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, 11000);
+
+	// rescheduling replaces the interval
+	chiaki_timer_wheel_schedule(&wheel, &timer, 10500, 0, 0);
+	munit_assert_size(wheel.count, ==, 1);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 20000), ==, 1);
+	munit_assert_size(wheel.count, ==, 0);
+	munit_assert_uint(fired, ==, 5);
+	return MUNIT_OK;
+}
+
+static MunitResult test_slack(const MunitParameter params[], void *user)
+{
+	ChiakiTimerWheel wheel;
+	chiaki_timer_wheel_init(&wheel, 0);
+	unsigned int fired = 0;
+	ChiakiTimerWheelTimer timers[3];
+	for(size_t i=0; i<3; i++)
+		chiaki_timer_wheel_timer_init(&timers[i], count_cb, &fired);
+
+	// overlapping slack coalesces, without slack the timer stays exact
+	chiaki_timer_wheel_schedule(&wheel, &timers[0], 1000, 0, 100);
+	chiaki_timer_wheel_schedule(&wheel, &timers[1], 1010, 0, 100);
+	chiaki_timer_wheel_schedule(&wheel, &timers[2], 1010, 0, 0);
+	munit_assert_uint64(timers[0].expires_us, ==, 1024);
+	munit_assert_uint64(timers[1].expires_us, ==, 1024);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, 1010);
+
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 1010), ==, 1);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, 1024);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 1023), ==, 0);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, 1024), ==, 2);
+	munit_assert_uint(fired, ==, 3);
+	return MUNIT_OK;
+}
+
+static MunitResult test_far(const MunitParameter params[], void *user)
+{
+	ChiakiTimerWheel wheel;
+	chiaki_timer_wheel_init(&wheel, 42);
+	unsigned int fired = 0;
+	ChiakiTimerWheelTimer timer;
+	chiaki_timer_wheel_timer_init(&timer, count_cb, &fired);
+
+	// beyond the last level, so it has to be put back a few times
+	uint64_t due_us = 42 + (UINT64_C(1) << 40) + 1234;
+	chiaki_timer_wheel_schedule(&wheel, &timer, due_us, 0, 0);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, due_us);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, due_us - 1), ==, 0);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, due_us);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, due_us), ==, 1);
+	munit_assert_uint(fired, ==, 1);
+
+	// in the past fires on the next advance
+	chiaki_timer_wheel_schedule(&wheel, &timer, 0, 0, 0);
+	munit_assert_uint64(chiaki_timer_wheel_next_expiry(&wheel), ==, 0);
+	munit_assert_size(chiaki_timer_wheel_advance(&wheel, due_us), ==, 1);
+	munit_assert_uint(fired, ==, 2);
+	return MUNIT_OK;
+}
+
+MunitTest tests_timer_wheel[] = {
+	{
+		"/random",
+		test_random,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/periodic",
+		test_periodic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/slack",
+		test_slack,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/far",
+		test_far,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/trace.h>
+#include <chiaki/thread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_FRAMES 100
+
+static void *trace_thread_func(void *user)
+{
+	// decode stages on a second thread, 3ms after the frame was flushed
+	for(int32_t i=0; i<THREAD_FRAMES; i++)
+	{
+		uint64_t flush_us = 1000000 + (uint64_t)i * 16667 + 2000;
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_DECODE_SUBMIT, i, flush_us + 1000);
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_DECODE_OUTPUT, i, flush_us + 3000 + (uint64_t)i * 10);
+	}
+	return NULL;
+}
+
+static void *trace_setup(const MunitParameter params[], void *user)
+{
+	munit_assert_true(chiaki_trace_clear());
+	munit_assert_int(chiaki_trace_enable(), ==, CHIAKI_ERR_SUCCESS);
+	return NULL;
+}
+
+static void trace_teardown(void *fixture)
+{
+	chiaki_trace_disable();
+	chiaki_trace_clear();
+}
+
+static MunitResult test_trace_threads(const MunitParameter params[], void *user)
+{
+	ChiakiThread thread;
+	munit_assert_int(chiaki_thread_create(&thread, trace_thread_func, NULL), ==, CHIAKI_ERR_SUCCESS);
+	for(int32_t i=0; i<THREAD_FRAMES; i++)
+	{
+		uint64_t first_us = 1000000 + (uint64_t)i * 16667;
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FIRST_UNIT, i, first_us);
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_LAST_UNIT, i, first_us + 1500);
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FLUSH, i, first_us + 2000);
+	}
+	chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FLUSH, -1, 0); // codec headers are not traced
+	chiaki_thread_join(&thread, NULL);
+
+	ChiakiTraceEvent *events;
+	size_t count;
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, THREAD_FRAMES * 5);
+	bool threads_seen[CHIAKI_TRACE_THREADS_MAX] = { 0 };
+	for(size_t i=0; i<count; i++)
+	{
+		if(i)
+			munit_assert_uint64(events[i].time_us, >=, events[i-1].time_us);
+		munit_assert_int32(events[i].frame_index, >=, 0);
+		munit_assert_uint16(events[i].thread, <, CHIAKI_TRACE_THREADS_MAX);
+		threads_seen[events[i].thread] = true;
+	}
+	size_t threads = 0;
+	for(size_t i=0; i<CHIAKI_TRACE_THREADS_MAX; i++)
+		threads += threads_seen[i];
+	munit_assert_size(threads, ==, 2);
+
+	ChiakiTraceSummary summary;
+	munit_assert_int(chiaki_trace_summarize(events, count, &summary), ==, CHIAKI_ERR_SUCCESS);
+	free(events);
+
+	munit_assert_uint64(summary.frames, ==, THREAD_FRAMES);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_FIRST_UNIT].count, ==, 0);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_FEC_START].count, ==, 0);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_LAST_UNIT].count, ==, THREAD_FRAMES);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_LAST_UNIT].p50_us, ==, 1500);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_FLUSH].max_us, ==, 500);
+	munit_assert_uint64(summary.stages[CHIAKI_TRACE_STAGE_DECODE_SUBMIT].p99_us, ==, 1000);
+
+	// decode output grows by 10us per frame: 2000, 2010, ..., 2990
+	const ChiakiTraceStageSummary *output = &summary.stages[CHIAKI_TRACE_STAGE_DECODE_OUTPUT];
+	munit_assert_uint64(output->count, ==, THREAD_FRAMES);
+	munit_assert_uint64(output->p50_us, ==, 2490);
+	munit_assert_uint64(output->p90_us, ==, 2890);
+	munit_assert_uint64(output->p99_us, ==, 2980);
+	munit_assert_uint64(output->max_us, ==, 2990);
+	munit_assert_uint64(summary.total.p50_us, ==, 5490);
+	munit_assert_uint64(summary.total.max_us, ==, 5990);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_trace_ring(const MunitParameter params[], void *user)
+{
+	// only the latest stamps of a thread are kept
+	for(int32_t i=0; i<CHIAKI_TRACE_RING_SIZE + 100; i++)
+		chiaki_trace_stamp_at(CHIAKI_TRACE_STAGE_FLUSH, i, 1000 + (uint64_t)i);
+
+	ChiakiTraceEvent *events;
+	size_t count;
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, CHIAKI_TRACE_RING_SIZE);
+	munit_assert_int32(events[0].frame_index, ==, 100);
+	munit_assert_int32(events[count - 1].frame_index, ==, CHIAKI_TRACE_RING_SIZE + 99);
+	free(events);
+
+	// only while disabled
+	munit_assert_false(chiaki_trace_clear());
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, CHIAKI_TRACE_RING_SIZE);
+	free(events);
+	chiaki_trace_disable();
+	munit_assert_true(chiaki_trace_clear());
+	munit_assert_int(chiaki_trace_enable(), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, 0);
+	munit_assert_null(events);
+
+	chiaki_trace_disable();
+	chiaki_trace_stamp(CHIAKI_TRACE_STAGE_FLUSH, 0);
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, 0);
+
+	munit_assert_int(chiaki_trace_enable(), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_trace_stamp(CHIAKI_TRACE_STAGE_FLUSH, 0);
+	munit_assert_int(chiaki_trace_snapshot(&events, &count), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(count, ==, 1);
+	free(events);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_trace_chrome_json(const MunitParameter params[], void *user)
+{
+	ChiakiTraceEvent events[] = {
+		{ 1000, 7, CHIAKI_TRACE_STAGE_FIRST_UNIT, 0 },
+		{ 1500, 7, CHIAKI_TRACE_STAGE_FLUSH, 0 },
+		{ 4000, 7, CHIAKI_TRACE_STAGE_DECODE_OUTPUT, 1 }
+	};
+
+	char filename[] = "chiaki_trace_test.json";
+	munit_assert_int(chiaki_trace_write_chrome_json(events, 3, filename), ==, CHIAKI_ERR_SUCCESS);
+
+	FILE *f = fopen(filename, "rb");
+	munit_assert_not_null(f);
+	char buf[4096];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	remove(filename);
+	buf[size] = '\0';
+
+	munit_assert_not_null(strstr(buf, "\"traceEvents\""));
+	munit_assert_not_null(strstr(buf, "\"name\":\"first unit\",\"ph\":\"i\""));
+	munit_assert_not_null(strstr(buf, "\"name\":\"decode output\",\"ph\":\"i\",\"s\":\"t\",\"ts\":3000,\"pid\":1,\"tid\":1"));
+	munit_assert_not_null(strstr(buf, "\"ph\":\"b\""));
+	munit_assert_not_null(strstr(buf, "\"ph\":\"e\""));
+	munit_assert_string_equal(buf + size - 4, "\n]}\n");
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_trace[] = {
+	{
+		"/threads",
+		test_trace_threads,
+		trace_setup,
+		trace_teardown,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/ring",
+		test_trace_ring,
+		trace_setup,
+		trace_teardown,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/chrome_json",
+		test_trace_chrome_json,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
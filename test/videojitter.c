@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videojitter.h>
+#include <chiaki/videoreceiver.h>
+#include <chiaki/session.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+#define FRAME_INTERVAL_US 16667
+#define RECEIVER_FRAMES_MAX 32
+#define RECEIVER_UNITS_SOURCE 2
+
+static MunitResult test_video_jitter_hold(const MunitParameter params[], void *user)
+{
+	ChiakiVideoJitter jitter;
+	chiaki_video_jitter_init(&jitter, 10000);
+
+	// perfectly steady frames and no reordering, nothing to hold
+	uint64_t now = 1000000;
+	for(size_t i=0; i<100; i++)
+	{
+		chiaki_video_jitter_frame_start(&jitter, now);
+		munit_assert_uint64(chiaki_video_jitter_hold_us(&jitter), ==, 0);
+		now += FRAME_INTERVAL_US;
+	}
+	munit_assert_uint64(chiaki_video_jitter_us(&jitter), ==, 0);
+
+	// one packet arrives 3ms late, hold a little longer than that from the next frame on
+	chiaki_video_jitter_late_packet(&jitter, 3000, false);
+	munit_assert_uint64(chiaki_video_jitter_hold_us(&jitter), ==, 0);
+	chiaki_video_jitter_frame_start(&jitter, now);
+	now += FRAME_INTERVAL_US;
+	uint64_t hold = chiaki_video_jitter_hold_us(&jitter);
+	munit_assert_uint64(hold, >=, 2900);
+	munit_assert_uint64(hold, <=, 3100);
+
+	// without any further reordering, holding stops again eventually
+	size_t frames = 0;
+	while(chiaki_video_jitter_hold_us(&jitter))
+	{
+		chiaki_video_jitter_frame_start(&jitter, now);
+		now += FRAME_INTERVAL_US;
+		frames++;
+		munit_assert_size(frames, <, 200);
+	}
+	munit_assert_size(frames, >, 50);
+
+	// very late packets are bounded by the maximum
+	chiaki_video_jitter_late_packet(&jitter, 50000, false);
+	chiaki_video_jitter_frame_start(&jitter, now);
+	munit_assert_uint64(chiaki_video_jitter_hold_us(&jitter), ==, 10000);
+
+	chiaki_video_jitter_frame_held(&jitter, 4000, true);
+	chiaki_video_jitter_frame_held(&jitter, 10000, false);
+	munit_assert_uint64(jitter.stats.packets_late, ==, 2);
+	munit_assert_uint64(jitter.stats.frames_held, ==, 2);
+	munit_assert_uint64(jitter.stats.frames_completed_while_held, ==, 1);
+	munit_assert_uint64(jitter.stats.hold_us_sum, ==, 14000);
+	munit_assert_uint64(jitter.stats.hold_us_max, ==, 10000);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_jitter_estimate(const MunitParameter params[], void *user)
+{
+	ChiakiVideoJitter jitter;
+	chiaki_video_jitter_init(&jitter, 100000);
+
+	// frames alternately arriving 2ms early and late make every interval deviate by 4ms from the one before
+	uint64_t now = 1000000;
+	for(size_t i=0; i<200; i++)
+	{
+		chiaki_video_jitter_frame_start(&jitter, now + ((i & 1) ? 2000 : 0));
+		now += FRAME_INTERVAL_US;
+	}
+	munit_assert_uint64(chiaki_video_jitter_us(&jitter), >=, 3900);
+	munit_assert_uint64(chiaki_video_jitter_us(&jitter), <=, 4000);
+
+	// the jitter is added on top of the lateness once holding is on
+	chiaki_video_jitter_late_packet(&jitter, 1000, false);
+	chiaki_video_jitter_frame_start(&jitter, now);
+	uint64_t hold = chiaki_video_jitter_hold_us(&jitter);
+	munit_assert_uint64(hold, >=, 1000 + 2 * 3900);
+
+	// disabled
+	chiaki_video_jitter_init(&jitter, 0);
+	chiaki_video_jitter_late_packet(&jitter, 1000, false);
+	chiaki_video_jitter_frame_start(&jitter, now);
+	munit_assert_uint64(chiaki_video_jitter_hold_us(&jitter), ==, 0);
+	return MUNIT_OK;
+}
+
+typedef struct receiver_test_t
+{
+	ChiakiSession session;
+	ChiakiVideoReceiver receiver;
+	int32_t frames[RECEIVER_FRAMES_MAX]; // indices of the frames handed to the sink, in order
+	bool frames_complete[RECEIVER_FRAMES_MAX];
+	size_t frames_count;
+	ChiakiSeqNum16 corrupt[RECEIVER_FRAMES_MAX][2]; // reported ranges
+	size_t corrupt_count;
+} ReceiverTest;
+
+static bool receiver_frame_cb(ChiakiVideoFrame *frame, void *user)
+{
+	ReceiverTest *test = user;
+	if(frame->frame_index < 0) // profile header
+		return true;
+	munit_assert_size(test->frames_count, <, RECEIVER_FRAMES_MAX);
+	test->frames[test->frames_count] = frame->frame_index;
+	// every source unit contributes 2 bytes: the frame index and its unit index
+	test->frames_complete[test->frames_count] = frame->buf_size == 2 * RECEIVER_UNITS_SOURCE;
+	test->frames_count++;
+	return true;
+}
+
+static void receiver_corrupt_frame_cb(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user)
+{
+	ReceiverTest *test = user;
+	munit_assert_size(test->corrupt_count, <, RECEIVER_FRAMES_MAX);
+	test->corrupt[test->corrupt_count][0] = start;
+	test->corrupt[test->corrupt_count][1] = end;
+	test->corrupt_count++;
+}
+
+static void receiver_test_init(ReceiverTest *test)
+{
+	memset(test, 0, sizeof(*test));
+	test->session.log = get_test_log();
+	// long enough for nothing to expire on its own while the test is running
+	test->session.connect_info.video_jitter_buffer_max_ms = 60000;
+	chiaki_session_set_video_frame_cb(&test->session, receiver_frame_cb, test);
+
+	ChiakiErrorCode err = chiaki_video_receiver_init(&test->receiver, &test->session, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	test->receiver.corrupt_frame_cb = receiver_corrupt_frame_cb;
+	test->receiver.corrupt_frame_cb_user = test;
+
+	ChiakiVideoProfile profile = { 0 };
+	profile.width = 1280;
+	profile.height = 720;
+	profile.header_sz = 4;
+	profile.header = calloc(1, profile.header_sz);
+	munit_assert_not_null(profile.header);
+	chiaki_video_receiver_stream_info(&test->receiver, &profile, 1);
+}
+
+static void receiver_send_unit(ReceiverTest *test, ChiakiSeqNum16 frame_index, ChiakiSeqNum16 unit_index)
+{
+	// 2 bytes of padding size extension, then the payload
+	uint8_t data[4] = { 0, 0, (uint8_t)frame_index, (uint8_t)unit_index };
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.frame_index = frame_index;
+	packet.unit_index = unit_index;
+	packet.units_in_frame_total = RECEIVER_UNITS_SOURCE + 1;
+	packet.units_in_frame_fec = 1;
+	packet.data = data;
+	packet.data_size = sizeof(data);
+	chiaki_video_receiver_av_packet(&test->receiver, &packet);
+}
+
+static void receiver_send_frame(ReceiverTest *test, ChiakiSeqNum16 frame_index)
+{
+	for(ChiakiSeqNum16 i=0; i<RECEIVER_UNITS_SOURCE; i++)
+		receiver_send_unit(test, frame_index, i);
+}
+
+static void receiver_assert_frame(ReceiverTest *test, size_t i, int32_t frame_index, bool complete)
+{
+	munit_assert_size(i, <, test->frames_count);
+	munit_assert_int32(test->frames[i], ==, frame_index);
+	munit_assert(test->frames_complete[i] == complete);
+}
+
+static void receiver_assert_corrupt(ReceiverTest *test, size_t i, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
+{
+	munit_assert_size(i, <, test->corrupt_count);
+	munit_assert_uint16(test->corrupt[i][0], ==, start);
+	munit_assert_uint16(test->corrupt[i][1], ==, end);
+}
+
+/**
+ * Lose the second unit of frame 3 until frame 4 has started, so the receiver starts holding frames.
+ */
+static void receiver_test_reorder(ReceiverTest *test)
+{
+	receiver_send_frame(test, 1);
+	receiver_send_frame(test, 2);
+	receiver_send_unit(test, 3, 0);
+	receiver_send_unit(test, 4, 0);
+	// no reordering seen yet, so 3 was handed on incomplete
+	munit_assert_size(test->frames_count, ==, 3);
+	receiver_assert_frame(test, 2, 3, false);
+	munit_assert_size(test->corrupt_count, ==, 1);
+	receiver_assert_corrupt(test, 0, 3, 3);
+	munit_assert_uint64(chiaki_video_receiver_deadline_us(&test->receiver), ==, UINT64_MAX);
+
+	receiver_send_unit(test, 3, 1);
+	munit_assert_uint64(test->receiver.jitter.stats.packets_late, ==, 1);
+	munit_assert_uint64(test->receiver.jitter.stats.packets_rescued, ==, 0);
+	// as if it had been much later, so holds don't expire on their own while the test is running
+	test->receiver.jitter.lateness_us = 30000000;
+	receiver_send_unit(test, 4, 1);
+	munit_assert_size(test->frames_count, ==, 4);
+	receiver_assert_frame(test, 3, 4, true);
+}
+
+static MunitResult test_video_receiver_hold(const MunitParameter params[], void *user)
+{
+	static ReceiverTest test;
+	receiver_test_init(&test);
+	receiver_test_reorder(&test);
+
+	// 5 is held back when 6 starts instead of being handed on incomplete
+	receiver_send_unit(&test, 5, 0);
+	receiver_send_unit(&test, 6, 0);
+	munit_assert_size(test.frames_count, ==, 4);
+	munit_assert_int32(test.receiver.frame_index_held, ==, 5);
+	munit_assert_int32(test.receiver.frame_index_cur, ==, 6);
+	munit_assert_uint64(chiaki_video_receiver_deadline_us(&test.receiver), >, chiaki_time_now_monotonic_us());
+
+	// the late unit completes it, 6 goes on in its own frame processor
+	receiver_send_unit(&test, 5, 1);
+	munit_assert_int32(test.receiver.frame_index_held, ==, -1);
+	munit_assert_uint64(chiaki_video_receiver_deadline_us(&test.receiver), ==, UINT64_MAX);
+	munit_assert_size(test.frames_count, ==, 5);
+	receiver_assert_frame(&test, 4, 5, true);
+	receiver_send_unit(&test, 6, 1);
+	munit_assert_size(test.frames_count, ==, 6);
+	receiver_assert_frame(&test, 5, 6, true);
+	munit_assert_size(test.corrupt_count, ==, 1);
+	munit_assert_uint64(test.receiver.jitter.stats.packets_rescued, ==, 1);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_held, ==, 1);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_completed_while_held, ==, 1);
+
+	// 7 is held, but 8 completes first, so 7 has to be handed on before it, incomplete
+	receiver_send_unit(&test, 7, 0);
+	receiver_send_unit(&test, 8, 0);
+	munit_assert_int32(test.receiver.frame_index_held, ==, 7);
+	receiver_send_unit(&test, 8, 1);
+	munit_assert_int32(test.receiver.frame_index_held, ==, -1);
+	munit_assert_size(test.frames_count, ==, 8);
+	receiver_assert_frame(&test, 6, 7, false);
+	receiver_assert_frame(&test, 7, 8, true);
+	munit_assert_size(test.corrupt_count, ==, 2);
+	receiver_assert_corrupt(&test, 1, 7, 7);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_held, ==, 2);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_completed_while_held, ==, 1);
+
+	// a frame lost entirely is reported once the next one starts
+	receiver_send_frame(&test, 10);
+	munit_assert_size(test.frames_count, ==, 9);
+	receiver_assert_frame(&test, 8, 10, true);
+	munit_assert_size(test.corrupt_count, ==, 3);
+	receiver_assert_corrupt(&test, 2, 9, 9);
+
+	chiaki_video_receiver_fini(&test.receiver);
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_receiver_expire(const MunitParameter params[], void *user)
+{
+	static ReceiverTest test;
+	receiver_test_init(&test);
+	receiver_test_reorder(&test);
+
+	receiver_send_unit(&test, 5, 0);
+	receiver_send_unit(&test, 6, 0);
+	munit_assert_int32(test.receiver.frame_index_held, ==, 5);
+	uint64_t deadline_us = chiaki_video_receiver_deadline_us(&test.receiver);
+	munit_assert_uint64(deadline_us, !=, UINT64_MAX);
+
+	// not due yet
+	chiaki_video_receiver_expire(&test.receiver);
+	munit_assert_int32(test.receiver.frame_index_held, ==, 5);
+	munit_assert_size(test.frames_count, ==, 4);
+
+	// no more packets until the deadline has passed, 5 is handed on incomplete without waiting for 6
+	test.receiver.held_deadline_us = chiaki_time_now_monotonic_us();
+	chiaki_video_receiver_expire(&test.receiver);
+	munit_assert_int32(test.receiver.frame_index_held, ==, -1);
+	munit_assert_uint64(chiaki_video_receiver_deadline_us(&test.receiver), ==, UINT64_MAX);
+	munit_assert_size(test.frames_count, ==, 5);
+	receiver_assert_frame(&test, 4, 5, false);
+	munit_assert_size(test.corrupt_count, ==, 2);
+	receiver_assert_corrupt(&test, 1, 5, 5);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_held, ==, 1);
+	munit_assert_uint64(test.receiver.jitter.stats.frames_completed_while_held, ==, 0);
+
+	// too late now
+	receiver_send_unit(&test, 5, 1);
+	munit_assert_size(test.frames_count, ==, 5);
+	munit_assert_uint64(test.receiver.jitter.stats.packets_rescued, ==, 0);
+	receiver_send_unit(&test, 6, 1);
+	munit_assert_size(test.frames_count, ==, 6);
+	receiver_assert_frame(&test, 5, 6, true);
+	munit_assert_size(test.corrupt_count, ==, 2);
+
+	chiaki_video_receiver_fini(&test.receiver);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_jitter[] = {
+	{
+		"/hold",
+		test_video_jitter_hold,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/estimate",
+		test_video_jitter_estimate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/receiver_hold",
+		test_video_receiver_hold,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/receiver_expire",
+		test_video_receiver_expire,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};